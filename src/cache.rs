@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+// small on-disk caches shared between runs
+//
+// entries are keyed by the identity of the file they describe, so a cached
+// value is reused only while the file is untouched. everything here is best
+// effort: a missing, unreadable or corrupt cache simply behaves as empty.
+
+use anyhow::{Context, Result};
+use serde::Serialize;
+use serde::de::DeserializeOwned;
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::UNIX_EPOCH;
+
+const CACHE_DIR_ENV: &str = "PAYLOAD_DUMPER_CACHE_DIR";
+const CACHE_DIR_NAME: &str = "payload_dumper";
+
+/// directory holding the caches, `None` when no suitable location exists
+///
+/// `PAYLOAD_DUMPER_CACHE_DIR` overrides the platform default
+/// (`$XDG_CACHE_HOME`, `~/.cache`, or `%LOCALAPPDATA%` on windows)
+pub fn cache_dir() -> Option<PathBuf> {
+    if let Some(dir) = std::env::var_os(CACHE_DIR_ENV).filter(|d| !d.is_empty()) {
+        return Some(PathBuf::from(dir));
+    }
+
+    let base = if cfg!(windows) {
+        std::env::var_os("LOCALAPPDATA").map(PathBuf::from)
+    } else {
+        std::env::var_os("XDG_CACHE_HOME")
+            .filter(|d| !d.is_empty())
+            .map(PathBuf::from)
+            .or_else(|| std::env::var_os("HOME").map(|h| PathBuf::from(h).join(".cache")))
+    };
+
+    base.map(|b| b.join(CACHE_DIR_NAME))
+}
+
+/// what makes a file "the same file" for caching purposes
+#[derive(Debug, Clone, PartialEq, Eq, Hash)]
+pub struct FileIdentity {
+    pub path: PathBuf,
+    pub size: u64,
+    pub mtime_ns: u128,
+    pub inode: u64,
+}
+
+impl FileIdentity {
+    pub fn of(path: &Path) -> Result<Self> {
+        let metadata =
+            fs::metadata(path).with_context(|| format!("Failed to stat {}", path.display()))?;
+
+        let mtime_ns = metadata
+            .modified()
+            .ok()
+            .and_then(|t| t.duration_since(UNIX_EPOCH).ok())
+            .map(|d| d.as_nanos())
+            .unwrap_or(0);
+
+        #[cfg(unix)]
+        let inode = {
+            use std::os::unix::fs::MetadataExt;
+            metadata.ino()
+        };
+        #[cfg(not(unix))]
+        let inode = 0;
+
+        Ok(Self {
+            path: fs::canonicalize(path).unwrap_or_else(|_| path.to_path_buf()),
+            size: metadata.len(),
+            mtime_ns,
+            inode,
+        })
+    }
+
+    /// stable string form used as the key in cache files
+    pub fn key(&self) -> String {
+        format!(
+            "{}|{}|{}|{}",
+            self.path.display(),
+            self.size,
+            self.mtime_ns,
+            self.inode
+        )
+    }
+}
+
+/// loads the cache file `name`, `None` if it does not exist or cannot be parsed
+pub fn load_json<T: DeserializeOwned>(name: &str) -> Option<T> {
+    serde_json::from_slice(&load_bytes(name)?).ok()
+}
+
+/// replaces the cache file `name` atomically
+pub fn store_json<T: Serialize>(name: &str, value: &T) -> Result<()> {
+    store_bytes(name, &serde_json::to_vec(value)?)
+}
+
+/// raw content of the cache file `name`, which may live in a subdirectory
+pub fn load_bytes(name: &str) -> Option<Vec<u8>> {
+    fs::read(cache_dir()?.join(name)).ok()
+}
+
+/// replaces the cache file `name` atomically, creating its directory
+pub fn store_bytes(name: &str, data: &[u8]) -> Result<()> {
+    let Some(dir) = cache_dir() else {
+        return Ok(());
+    };
+
+    let path = dir.join(name);
+    let parent = path.parent().unwrap_or(&dir);
+    fs::create_dir_all(parent)
+        .with_context(|| format!("Failed to create cache directory {}", parent.display()))?;
+
+    // concurrent stores from one process each need their own temporary file
+    static NEXT_TMP: AtomicU64 = AtomicU64::new(0);
+    let file_name = path.file_name().unwrap_or_default().to_string_lossy();
+    let tmp = parent.join(format!(
+        "{}.{}.{}.tmp",
+        file_name,
+        std::process::id(),
+        NEXT_TMP.fetch_add(1, Ordering::Relaxed)
+    ));
+
+    fs::write(&tmp, data).with_context(|| format!("Failed to write {}", tmp.display()))?;
+    fs::rename(&tmp, &path).with_context(|| format!("Failed to replace {}", path.display()))?;
+
+    Ok(())
+}
+
+/// keeps only the `keep` most recently written files of the cache
+/// subdirectory `subdir`
+pub fn prune(subdir: &str, keep: usize) {
+    let Some(dir) = cache_dir().map(|d| d.join(subdir)) else {
+        return;
+    };
+    let Ok(entries) = fs::read_dir(&dir) else {
+        return;
+    };
+
+    let mut files: Vec<(std::time::SystemTime, PathBuf)> = entries
+        .flatten()
+        .filter_map(|e| {
+            let modified = e.metadata().ok()?.modified().ok()?;
+            Some((modified, e.path()))
+        })
+        .collect();
+
+    if files.len() > keep {
+        files.sort_by(|a, b| b.0.cmp(&a.0));
+        for (_, path) in files.drain(keep..) {
+            let _ = fs::remove_file(path);
+        }
+    }
+}
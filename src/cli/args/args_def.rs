@@ -2,6 +2,7 @@
 // Copyright (c) 2025 rhythmcache
 // https://github.com/rhythmcache/payload-dumper-rust
 
+use crate::cli::payload::shard::ShardSpec;
 use clap::Parser;
 use std::path::PathBuf;
 
@@ -63,7 +64,7 @@ const VERSION_STRING: &str = concat!(
     "\n"
 );
 
-#[derive(Parser)]
+#[derive(Parser, Clone)]
 #[command(
     version = VERSION_STRING,
     about = "A fast and efficient Android OTA payload dumper"
@@ -85,7 +86,7 @@ pub struct Args {
         long,
         default_value = "output",
         value_name = "DIR",
-        help = "Directory to save extracted partitions"
+        help = "Directory to save extracted partitions, or - to stream them to stdout as a tar archive"
     )]
     pub out: PathBuf,
 
@@ -237,6 +238,316 @@ pub struct Args {
     )]
     pub no_verify: bool,
 
+    #[arg(
+        long,
+        help = "Check dm-verity hash trees the payload carries against the extracted data",
+        long_help = "Recompute the dm-verity hash tree of every extracted partition whose payload \
+                     writes the tree itself and compare it with the tree stored in the image, on all \
+                     cores. Trees the payload does not carry are generated from the image during \
+                     extraction, so there is nothing to check them against and they are skipped"
+    )]
+    pub verify_verity: bool,
+
+    #[arg(
+        long,
+        help = "Check extracted partitions against the verity FEC the payload carries",
+        long_help = "Recompute the Reed-Solomon error correction data of every extracted partition \
+                     whose payload writes the FEC itself and compare it with the FEC stored in the \
+                     image. Mismatching codewords point at corrupted blocks. FEC the payload does \
+                     not carry is generated from the image during extraction, so there is nothing \
+                     to check it against and it is skipped"
+    )]
+    pub verify_fec: bool,
+
+    #[arg(
+        long,
+        help = "Repair extracted partitions using the verity FEC the payload carries",
+        long_help = "Like --verify-fec, but correctable codewords are fixed in place: damaged data \
+                     blocks and parity are rewritten. Runs before hash verification so repaired \
+                     images are verified as well. Only FEC written by the payload can repair \
+                     anything, FEC generated during extraction is skipped"
+    )]
+    pub repair_fec: bool,
+
+    #[arg(
+        long,
+        help = "Skip verification of source images for differential OTA",
+        long_help = "Skip checking the old partition images against the hashes recorded in the payload \
+                     before applying differential operations. Verified hashes are cached per file \
+                     (path, size, modification time, inode) so unchanged images are not rehashed on \
+                     later runs. When an image does not match, the operations reading bad blocks are \
+                     reported and the partition is skipped",
+        hide = cfg!(not(feature = "diff_ota"))
+    )]
+    pub no_source_verify: bool,
+
+    #[arg(
+        long,
+        help = "Seed differential outputs with a clone of the source image",
+        long_help = "Start each differential partition from a copy of its source image and skip \
+                     SOURCE_COPY operations that leave blocks where they are, so only changed blocks \
+                     are written. On filesystems with reflink support (btrfs, xfs, bcachefs, apfs) the \
+                     copy shares extents with the source and takes no extra space or I/O",
+        hide = cfg!(not(feature = "diff_ota"))
+    )]
+    pub clone_source: bool,
+
+    #[arg(
+        long,
+        help = "Reuse identical blocks from images extracted earlier",
+        long_help = "Remember where the output of each full REPLACE operation was written, keyed by \
+                     the blob hash in the payload, and take it from that image on later runs instead \
+                     of downloading and decompressing the blob again. Consecutive builds of a device \
+                     share many such blobs. On filesystems with reflink support the blocks are shared \
+                     with the earlier image, otherwise they are copied. The index is kept in the cache \
+                     directory, images that were changed, moved or deleted are not used",
+        hide = cfg!(not(feature = "diff_ota"))
+    )]
+    pub blob_cache: bool,
+
+    #[arg(
+        long,
+        conflicts_with = "super_image",
+        help = "Keep images in the output directory that are already up to date",
+        long_help = "Check images left in the output directory by an earlier run against the size \
+                     and hash in the payload and skip the partitions that already match. Hashes are \
+                     cached per file (path, size, modification time, inode), and images verified after \
+                     extraction are remembered, so unchanged archives are not rehashed. Images that \
+                     differ are updated in place: every block is compared with what is on disk and \
+                     only changed blocks are written",
+        hide = cfg!(not(feature = "diff_ota"))
+    )]
+    pub skip_unchanged: bool,
+
+    #[arg(
+        long = "chain",
+        value_name = "PAYLOAD",
+        conflicts_with_all = &["list", "metadata"],
+        help = if cfg!(feature = "diff_ota") {
+            "Apply another incremental payload on top of the result (repeatable)"
+        } else {
+            "Apply another incremental payload on top of the result [requires diff_ota feature]"
+        },
+        long_help = "Apply further incremental payloads in order after the main one, each using \
+                     the images produced by the previous step as its source. Can be given multiple \
+                     times to go from build A to build D in one run. Intermediate images are kept in \
+                     hidden directories inside the output directory and removed once consumed, only \
+                     the final images are left in the output directory. Intermediate images are \
+                     seeded from their source as with --clone-source, so on reflink filesystems only \
+                     the blocks a step changes take new space; add --clone-source to do the same for \
+                     the final step",
+        hide = cfg!(not(feature = "diff_ota"))
+    )]
+    pub chain: Vec<PathBuf>,
+
+    #[arg(
+        long = "super",
+        conflicts_with_all = &["list", "chain"],
+        help = "Write dynamic partitions into a single super.img",
+        long_help = "Build super.img directly from the payload: the LP metadata is laid out from the \
+                     manifest's dynamic partition groups and every dynamic partition is written straight \
+                     into its extent inside the preallocated image, without separate partition images \
+                     or a later lpmake run. Partitions outside super are extracted as usual"
+    )]
+    pub super_image: bool,
+
+    #[arg(
+        long,
+        value_name = "BYTES",
+        requires = "super_image",
+        help = "Size of the super device (default: smallest size that fits)",
+        long_help = "Total size of super.img in bytes, usually the size of the super partition of the \
+                     target device. Must be a multiple of 1 MiB. Defaults to the smallest size that \
+                     holds the metadata and all dynamic partitions"
+    )]
+    pub super_size: Option<u64>,
+
+    #[arg(
+        long,
+        requires = "super_image",
+        help = "Also write super.img as an android sparse image",
+        long_help = "After building super.img, also write super.sparse.img in android sparse format \
+                     for fastboot. Zero blocks are skipped and repeated patterns stored as fill chunks"
+    )]
+    pub super_sparse: bool,
+
+    #[arg(
+        long,
+        conflicts_with_all = &["list", "super_image"],
+        help = "Write virtual A/B snapshot COW files instead of images",
+        long_help = "Turn every extracted dynamic partition into a libsnapshot COW file (<name>.cow) \
+                     as update_engine would write on a virtual A/B device: COPY and XOR ops from the \
+                     payload's merge operations, ZERO ops, and REPLACE ops for changed blocks, \
+                     compressed per the payload's vabc_compression_param on all cores. Blocks equal \
+                     to the source image are left out. The full image is removed once its COW is \
+                     written. Partitions outside super (boot, vbmeta, ...) are not snapshotted and \
+                     stay plain images"
+    )]
+    pub cow: bool,
+
+    #[arg(
+        long,
+        conflicts_with_all = &["list", "metadata", "cow", "skip_unchanged"],
+        help = "Write images as seekable zstd (<name>.img.zst)",
+        long_help = "Compress every extracted partition into the zstd seekable format: independent \
+                     frames plus a seek table, so the file decompresses with any zstd tool and stays \
+                     randomly accessible. Frames are compressed while the image is extracted, on cores \
+                     other partitions leave idle, and the full image is removed once it is verified \
+                     (sharded runs and --repair-fec compress it afterwards). ZSTD operations of a local \
+                     payload whose blob covers its extent exactly are stored as they are instead of \
+                     being compressed again"
+    )]
+    pub zstd_output: bool,
+
+    #[arg(
+        long,
+        value_name = "LEVEL",
+        default_value_t = 3,
+        value_parser = clap::value_parser!(i32).range(1..=22),
+        requires = "zstd_output",
+        help = "Compression level for --zstd-output"
+    )]
+    pub zstd_level: i32,
+
+    #[arg(
+        long,
+        value_name = "MB",
+        default_value_t = 2,
+        value_parser = clap::value_parser!(u64).range(1..=1024),
+        requires = "zstd_output",
+        help = "Decompressed size of each frame for --zstd-output",
+        long_help = "Size of the frames the image is cut into, in MiB. Smaller frames make random \
+                     access cheaper, larger ones compress slightly better"
+    )]
+    pub zstd_frame_size: u64,
+
+    #[arg(
+        long = "extract-file",
+        value_name = "PARTITION:PATH",
+        conflicts_with_all = &["list", "metadata", "chain", "super_image", "cow"],
+        help = "Extract a single file from an ext4/EROFS partition (repeatable)",
+        long_help = "Extract one file, e.g. system:/system/build.prop, without extracting the \
+                     partition it lives in. The filesystem is walked through blocks decoded on \
+                     demand from the payload, so only the superblock, the directories on the way \
+                     and the file's own blocks are read, a few MB even from a remote OTA. Files \
+                     are written to <out>/<partition>/<path>, or to stdout with -o -. Can be \
+                     given multiple times"
+    )]
+    pub extract_file: Vec<String>,
+
+    #[arg(
+        long,
+        conflicts_with_all = &["list", "metadata", "chain", "extract_file"],
+        help = "Treat PAYLOAD as a job list and extract many payloads in one process",
+        long_help = "Read jobs from the file given as PAYLOAD, one per line: INPUT OUTPUT_DIR \
+                     [PARTITIONS], where INPUT is a local file or URL and PARTITIONS an optional \
+                     comma-separated list. Empty lines and lines starting with # are ignored. All \
+                     jobs share one scheduler for --threads, --memory-budget, --disk-jobs and \
+                     --network-jobs and one pool of HTTP connections. The largest jobs start first \
+                     so a long one does not end up running alone at the end. Every other option \
+                     applies to all jobs"
+    )]
+    pub batch: bool,
+
+    #[arg(
+        long,
+        conflicts_with_all = &["batch", "list", "metadata", "chain", "extract_file"],
+        help = "Serve extraction jobs on the unix socket given as PAYLOAD",
+        long_help = "Run as a daemon listening on the unix socket given as PAYLOAD. Clients send \
+                     jobs as JSON lines ({\"input\": ..., \"output\": ..., \"images\": ..., \
+                     \"options\": [\"--no-verify\", ...]}) and get messages and partition progress \
+                     back as JSON lines, ending with a \"finished\" event. The runtime, HTTP \
+                     connections and the --threads, --memory-budget, --disk-jobs and --network-jobs \
+                     budgets are shared by all clients. The socket is only accessible to the user \
+                     running the daemon"
+    )]
+    pub daemon: bool,
+
+    #[arg(
+        long,
+        value_name = "COUNT",
+        default_value_t = 4,
+        requires = "batch",
+        help = "Number of payloads of a batch processed at the same time",
+        long_help = "Number of batch jobs that are opened and extracted at the same time. Their \
+                     partitions still share the global thread, memory, disk and network budgets"
+    )]
+    pub batch_jobs: usize,
+
+    #[arg(
+        long,
+        value_name = "MB",
+        help = "Memory budget of all partitions being extracted at the same time",
+        long_help = "Limit the estimated memory of the partitions being extracted at once, in MiB. \
+                     Each partition is estimated from its largest operation (output, data blob and \
+                     source data of differential operations). Partitions wait until they fit, one \
+                     larger than the whole budget runs alone. Unlimited by default"
+    )]
+    pub memory_budget: Option<u64>,
+
+    #[arg(
+        long,
+        value_name = "COUNT",
+        help = "Number of partitions written to disk at the same time (default: --threads)",
+        long_help = "Limit how many partitions are written at the same time, across all payloads of \
+                     a batch. Lower it for spinning disks or slow network storage. Defaults to the \
+                     thread count"
+    )]
+    pub disk_jobs: Option<usize>,
+
+    #[arg(
+        long,
+        value_name = "COUNT",
+        help = "Number of remote partitions streamed at the same time (default: --threads)",
+        long_help = "Limit how many partitions are read from remote payloads at the same time, \
+                     across all payloads of a batch. Lower it when the server throttles parallel \
+                     connections. Defaults to the thread count"
+    )]
+    pub network_jobs: Option<usize>,
+
+    #[arg(
+        long,
+        value_name = "INDEX/COUNT",
+        conflicts_with_all = &[
+            "list", "metadata", "chain", "super_image", "cow", "zstd_output",
+            "skip_unchanged", "extract_file"
+        ],
+        requires = "shard_run",
+        help = "Extract one share of the partitions as process INDEX of COUNT, e.g. 2/4",
+        long_help = "Spread the extraction over COUNT processes, on one machine or on several \
+                     sharing the output directory, this one being shard INDEX (from 1). Give every \
+                     process the same payload, partitions and options: each computes the same split \
+                     from the manifest, the largest partitions going first to the least loaded \
+                     shard, and verifies the partitions it extracted. A process leaves a marker in \
+                     <out>/.shards when done. Remove that directory after an interrupted run"
+    )]
+    pub shard: Option<ShardSpec>,
+
+    #[arg(
+        long,
+        value_name = "ID",
+        requires = "shard",
+        help = "Identifier of a sharded run, the same for all its processes",
+        long_help = "Name the run the --shard processes belong to, e.g. a timestamp or job ID. Every \
+                     process of a run gets the same ID and every new run a new one, so the markers \
+                     of an earlier or interrupted run never make a process believe the set is \
+                     complete"
+    )]
+    pub shard_run: Option<String>,
+
+    #[arg(
+        long,
+        requires = "shard",
+        help = "Also split large partitions into operation ranges across shards",
+        long_help = "Cut partitions larger than a fraction of a fair share into runs of operations \
+                     that different shards write into one shared image, so a single huge partition \
+                     does not leave the other processes idle. The shared images are created at their \
+                     final size by whichever process gets there first, the last process to finish \
+                     clears what no operation wrote, generates their hash tree and FEC and verifies \
+                     them"
+    )]
+    pub shard_operations: bool,
+
     #[arg(
         long,
         help = "Pre-download all required payload data before extraction (remote URLs only)",
@@ -256,4 +567,9 @@ pub struct Args {
                      messages. Errors and warnings will still be displayed."
     )]
     pub quiet: bool,
+
+    /// source images an earlier --chain step extracted and checked against
+    /// the hashes this step expects, they are not hashed again
+    #[arg(skip)]
+    pub verified_sources: Vec<String>,
 }
@@ -0,0 +1,218 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+use crate::cli::args::args_def::Args;
+use crate::cli::entry::run_payload;
+use crate::cli::payload::scheduler::Scheduler;
+use anyhow::{Context, Result, anyhow};
+use payload_dumper::utils::{format_elapsed_time, format_size};
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::time::Instant;
+use tokio::fs;
+use tokio::sync::Semaphore;
+
+/// one line of the job list
+struct BatchJob {
+    line: usize,
+    input: PathBuf,
+    out: PathBuf,
+    images: Option<String>,
+    /// payload size, used to start the largest jobs first
+    size: u64,
+}
+
+/// extracts every job listed in the file given as PAYLOAD for --batch
+///
+/// up to --batch-jobs payloads are open at the same time and all of their
+/// partitions go through the one `scheduler`, so the thread, memory, disk
+/// and network budgets hold for the whole batch. jobs are admitted largest
+/// first. every job runs with the options given on the command line, only
+/// the input, output directory and partition list come from the job list
+pub async fn run_batch(args: &Args, scheduler: &Arc<Scheduler>) -> Result<()> {
+    let list = fs::read_to_string(&args.payload_path)
+        .await
+        .with_context(|| format!("Failed to read job list {}", args.payload_path.display()))?;
+
+    let mut jobs = parse_jobs(&list)?;
+    if jobs.is_empty() {
+        return Err(anyhow!(
+            "No jobs in {}, expected lines of INPUT OUTPUT_DIR [PARTITIONS]",
+            args.payload_path.display()
+        ));
+    }
+
+    for job in &mut jobs {
+        job.size = payload_size(&job.input, args).await;
+    }
+    jobs.sort_by_key(|job| std::cmp::Reverse(job.size));
+
+    let total = jobs.len();
+    let start_time = Instant::now();
+    if !args.quiet {
+        println!(
+            "- Batch of {} jobs, {} at a time",
+            total,
+            args.batch_jobs.max(1)
+        );
+    }
+
+    // join_all polls every future once in order before waiting, so jobs
+    // queue on the (fair) semaphore largest first
+    let admission = Semaphore::new(args.batch_jobs.max(1));
+    let runs = jobs.iter().enumerate().map(|(index, job)| {
+        let admission = &admission;
+        async move {
+            let _permit = admission.acquire().await.unwrap();
+
+            if !args.quiet {
+                println!(
+                    "- [{}/{}] Starting {} ({})",
+                    index + 1,
+                    total,
+                    job.input.display(),
+                    format_size(job.size)
+                );
+            }
+
+            let job_start = Instant::now();
+            let result = run_payload(&job_args(args, job), scheduler).await;
+            let elapsed = format_elapsed_time(job_start.elapsed());
+
+            let ok = match &result {
+                Ok(failed) if failed.is_empty() => {
+                    if !args.quiet {
+                        println!(
+                            "- [{}/{}] ✓ {} -> {:?} (in {})",
+                            index + 1,
+                            total,
+                            job.input.display(),
+                            job.out,
+                            elapsed
+                        );
+                    }
+                    true
+                }
+                Ok(failed) => {
+                    eprintln!(
+                        "- [{}/{}] ✗ {}: failed partitions: {}",
+                        index + 1,
+                        total,
+                        job.input.display(),
+                        failed.join(", ")
+                    );
+                    false
+                }
+                Err(e) => {
+                    eprintln!(
+                        "- [{}/{}] ✗ {}: {}",
+                        index + 1,
+                        total,
+                        job.input.display(),
+                        e
+                    );
+                    false
+                }
+            };
+            (job, ok)
+        }
+    });
+
+    let results = futures::future::join_all(runs).await;
+    let failed: Vec<String> = results
+        .into_iter()
+        .filter(|(_, ok)| !ok)
+        .map(|(job, _)| format!("line {} ({})", job.line, job.input.display()))
+        .collect();
+
+    let elapsed_time = format_elapsed_time(start_time.elapsed());
+    if failed.is_empty() {
+        if !args.quiet {
+            println!("\n- Batch completed successfully in {}", elapsed_time);
+        }
+        Ok(())
+    } else {
+        Err(anyhow!(
+            "{} of {} batch jobs failed (in {}): {}",
+            failed.len(),
+            total,
+            elapsed_time,
+            failed.join(", ")
+        ))
+    }
+}
+
+fn parse_jobs(list: &str) -> Result<Vec<BatchJob>> {
+    let mut jobs = Vec::new();
+
+    for (index, line) in list.lines().enumerate() {
+        let line = line.trim();
+        if line.is_empty() || line.starts_with('#') {
+            continue;
+        }
+
+        let fields: Vec<&str> = line.split_whitespace().collect();
+        if !(2..=3).contains(&fields.len()) {
+            return Err(anyhow!(
+                "Job list line {}: expected INPUT OUTPUT_DIR [PARTITIONS], got '{}'",
+                index + 1,
+                line
+            ));
+        }
+
+        jobs.push(BatchJob {
+            line: index + 1,
+            input: PathBuf::from(fields[0]),
+            out: PathBuf::from(fields[1]),
+            images: fields.get(2).map(|s| s.to_string()),
+            size: 0,
+        });
+    }
+
+    Ok(jobs)
+}
+
+/// size of the payload behind `input`, 0 when it cannot be told
+async fn payload_size(input: &Path, args: &Args) -> u64 {
+    let input_str = input.to_string_lossy();
+
+    if input_str.starts_with("http://") || input_str.starts_with("https://") {
+        #[cfg(feature = "remote_zip")]
+        {
+            // the client is shared, so this connection is reused by the job
+            return payload_dumper::http::HttpReader::new(
+                input_str.to_string(),
+                args.user_agent.as_deref(),
+                args.cookies.as_deref(),
+                args.dns.as_deref(),
+            )
+            .await
+            .map(|reader| reader.content_length)
+            .unwrap_or(0);
+        }
+        #[cfg(not(feature = "remote_zip"))]
+        {
+            let _ = args;
+            return 0;
+        }
+    }
+
+    fs::metadata(input).await.map(|m| m.len()).unwrap_or(0)
+}
+
+/// command line options of one job
+///
+/// jobs print their own start and finish lines, the per-partition progress
+/// bars of several payloads would only garble each other
+fn job_args(args: &Args, job: &BatchJob) -> Args {
+    let mut job_args = args.clone();
+    job_args.batch = false;
+    job_args.payload_path = job.input.clone();
+    job_args.out = job.out.clone();
+    if let Some(images) = &job.images {
+        job_args.images = images.clone();
+    }
+    job_args.quiet = true;
+    job_args
+}
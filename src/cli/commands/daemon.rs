@@ -0,0 +1,231 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+use crate::cli::args::args_def::Args;
+use crate::cli::entry::{run_chain_with_ui, run_payload_with_ui};
+use crate::cli::payload::scheduler::Scheduler;
+use crate::cli::ui::ui_print::{UiEvent, UiOutput};
+use anyhow::{Context, Result, anyhow};
+use clap::Parser;
+use serde::{Deserialize, Serialize};
+use std::os::unix::fs::{FileTypeExt, PermissionsExt};
+use std::path::Path;
+use std::sync::Arc;
+use tokio::io::{AsyncBufReadExt, AsyncWriteExt, BufReader};
+use tokio::net::{UnixListener, UnixStream};
+use tokio::sync::mpsc;
+
+/// one extraction job, a single line of JSON
+///
+/// `options` are command line options as given to payload_dumper, for
+/// example `["--no-verify", "--clone-source"]`, `--chain` included. relative
+/// paths are relative to the daemon's working directory
+#[derive(Debug, Deserialize)]
+struct DaemonJob {
+    input: String,
+    output: String,
+    #[serde(default)]
+    images: Option<String>,
+    #[serde(default)]
+    options: Vec<String>,
+}
+
+/// what the daemon writes back, one JSON line each
+#[derive(Debug, Serialize)]
+#[serde(untagged)]
+enum DaemonReply {
+    Ui(UiEvent),
+    Finished(Finished),
+}
+
+#[derive(Debug, Serialize)]
+#[serde(tag = "event", rename = "finished")]
+struct Finished {
+    ok: bool,
+    failed: Vec<String>,
+    error: Option<String>,
+}
+
+/// serves extraction jobs on the unix socket given as PAYLOAD for --daemon
+///
+/// clients send one JSON job per line and get the job's messages and
+/// partition progress back as JSON lines, ending with a "finished" event.
+/// all jobs run in this process: the runtime, the HTTP connection pools,
+/// the DNS resolver and the scheduler budgets are shared by every client
+/// and stay warm between jobs. jobs of one connection run one after the
+/// other, connections run concurrently
+pub async fn run_daemon(args: &Args, scheduler: &Arc<Scheduler>) -> Result<()> {
+    let socket_path = args.payload_path.as_path();
+    let listener = bind(socket_path).await?;
+
+    if !args.quiet {
+        println!("- Listening on {}", socket_path.display());
+    }
+
+    // jobs are driven on this thread, the partitions they extract are still
+    // spawned onto the whole runtime
+    let local = tokio::task::LocalSet::new();
+    let result = local
+        .run_until(async {
+            loop {
+                tokio::select! {
+                    accepted = listener.accept() => {
+                        let (stream, _) = accepted.context("Failed to accept connection")?;
+                        let scheduler = Arc::clone(scheduler);
+                        let quiet = args.quiet;
+                        tokio::task::spawn_local(async move {
+                            if let Err(e) = serve(stream, &scheduler, quiet).await
+                                && !quiet
+                            {
+                                eprintln!("- Connection error: {}", e);
+                            }
+                        });
+                    }
+                    _ = tokio::signal::ctrl_c() => break anyhow::Ok(()),
+                }
+            }
+        })
+        .await;
+
+    let _ = std::fs::remove_file(socket_path);
+    result
+}
+
+/// binds `path`, replacing a socket left behind by a daemon that is gone
+async fn bind(path: &Path) -> Result<UnixListener> {
+    if let Ok(metadata) = std::fs::symlink_metadata(path) {
+        if !metadata.file_type().is_socket() {
+            return Err(anyhow!("{} exists and is not a socket", path.display()));
+        }
+        if UnixStream::connect(path).await.is_ok() {
+            return Err(anyhow!(
+                "A daemon is already listening on {}",
+                path.display()
+            ));
+        }
+        std::fs::remove_file(path)?;
+    }
+
+    let listener = UnixListener::bind(path)
+        .with_context(|| format!("Failed to listen on {}", path.display()))?;
+    // jobs read and write files as this user, nobody else may submit them
+    std::fs::set_permissions(path, std::fs::Permissions::from_mode(0o600))?;
+    Ok(listener)
+}
+
+async fn serve(stream: UnixStream, scheduler: &Arc<Scheduler>, quiet: bool) -> Result<()> {
+    let (reader, mut writer) = stream.into_split();
+    let mut lines = BufReader::new(reader).lines();
+
+    while let Some(line) = lines.next_line().await? {
+        if line.trim().is_empty() {
+            continue;
+        }
+
+        let args = match parse_job(&line) {
+            Ok(args) => args,
+            Err(e) => {
+                send(&mut writer, &finished(Err(e))).await?;
+                continue;
+            }
+        };
+
+        if !quiet {
+            println!(
+                "- Job {} -> {}",
+                args.payload_path.display(),
+                args.out.display()
+            );
+        }
+
+        let (events, mut received) = mpsc::unbounded_channel();
+        let job = async {
+            if args.chain.is_empty() {
+                run_payload_with_ui(&args, scheduler, UiOutput::with_events(events)).await
+            } else {
+                let new_ui = || UiOutput::with_events(events.clone());
+                run_chain_with_ui(&args, scheduler, &new_ui).await
+            }
+        };
+        tokio::pin!(job);
+
+        // a client that went away does not stop its job, the replies are
+        // simply dropped
+        let mut connected = true;
+        let result = loop {
+            tokio::select! {
+                result = &mut job => break result,
+                Some(event) = received.recv() => {
+                    connected = connected && forward(&mut writer, event).await;
+                }
+            }
+        };
+        while let Ok(event) = received.try_recv() {
+            connected = connected && forward(&mut writer, event).await;
+        }
+
+        if !connected {
+            return Ok(());
+        }
+        send(&mut writer, &finished(result)).await?;
+    }
+
+    Ok(())
+}
+
+/// command line of a job, checked by the same parser as a normal run
+fn parse_job(line: &str) -> Result<Args> {
+    let job: DaemonJob = serde_json::from_str(line).map_err(|e| anyhow!("Invalid job: {}", e))?;
+
+    let mut argv = vec![
+        "payload_dumper".to_string(),
+        job.input,
+        "--out".to_string(),
+        job.output,
+    ];
+    if let Some(images) = job.images {
+        argv.push("--images".to_string());
+        argv.push(images);
+    }
+    argv.extend(job.options);
+
+    let args = Args::try_parse_from(argv).map_err(|e| anyhow!("Invalid job: {}", e))?;
+
+    if args.daemon || args.batch {
+        return Err(anyhow!(
+            "Invalid job: --daemon and --batch cannot be used in a job"
+        ));
+    }
+    if args.out.to_string_lossy() == "-" {
+        return Err(anyhow!("Invalid job: output must be a directory"));
+    }
+    Ok(args)
+}
+
+fn finished(result: Result<Vec<String>>) -> DaemonReply {
+    DaemonReply::Finished(match result {
+        Ok(failed) => Finished {
+            ok: failed.is_empty(),
+            failed,
+            error: None,
+        },
+        Err(e) => Finished {
+            ok: false,
+            failed: Vec::new(),
+            error: Some(format!("{:#}", e)),
+        },
+    })
+}
+
+async fn send(writer: &mut tokio::net::unix::OwnedWriteHalf, reply: &DaemonReply) -> Result<()> {
+    let mut line = serde_json::to_vec(reply)?;
+    line.push(b'\n');
+    writer.write_all(&line).await?;
+    Ok(())
+}
+
+/// returns whether the client is still there
+async fn forward(writer: &mut tokio::net::unix::OwnedWriteHalf, event: UiEvent) -> bool {
+    send(writer, &DaemonReply::Ui(event)).await.is_ok()
+}
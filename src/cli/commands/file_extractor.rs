@@ -0,0 +1,165 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+use crate::cli::args::args_def::Args;
+use crate::cli::ui::ui_print::UiOutput;
+use anyhow::{Context, Result, anyhow};
+use payload_dumper::filesystem::read_file;
+use payload_dumper::payload::block_reader::PartitionBlockReader;
+use payload_dumper::payload::payload_dumper::AsyncPayloadRead;
+#[cfg(feature = "diff_ota")]
+use payload_dumper::payload::source_image::SourceImage;
+use payload_dumper::structs::DeltaArchiveManifest;
+use payload_dumper::utils::format_size;
+use std::path::{Component, Path, PathBuf};
+use std::sync::Arc;
+use tokio::fs;
+use tokio::io::AsyncWriteExt;
+
+/// pulls single files out of ext4/EROFS partitions for --extract-file
+///
+/// each request is `partition:/path/in/partition`. only the blocks the
+/// filesystem walk touches are decoded from the payload. files are written
+/// to `<out>/<partition>/<path>`, or to stdout when the output is "-"
+/// returns the requests that failed
+pub async fn extract_files(
+    manifest: &DeltaArchiveManifest,
+    data_offset: u64,
+    block_size: u64,
+    payload_reader: Arc<dyn AsyncPayloadRead>,
+    args: &Args,
+    ui: &UiOutput,
+) -> Result<Vec<String>> {
+    let is_stdout = args.out.to_string_lossy() == "-";
+    let mut failed = Vec::new();
+
+    // one block reader per partition, so files of the same partition share
+    // the decoded metadata blocks
+    let mut readers: Vec<(String, PartitionBlockReader<Arc<dyn AsyncPayloadRead>>)> = Vec::new();
+
+    for request in &args.extract_file {
+        let Some((partition_name, path)) = request.split_once(':') else {
+            ui.error(format!(
+                "Invalid --extract-file '{}', expected PARTITION:/PATH",
+                request
+            ));
+            failed.push(request.clone());
+            continue;
+        };
+
+        if !readers.iter().any(|(name, _)| name == partition_name) {
+            match open_partition(
+                manifest,
+                partition_name,
+                data_offset,
+                block_size,
+                &payload_reader,
+                args,
+            ) {
+                Ok(reader) => readers.push((partition_name.to_string(), reader)),
+                Err(e) => {
+                    ui.error(format!("{}: {}", request, e));
+                    failed.push(request.clone());
+                    continue;
+                }
+            }
+        }
+        let (_, reader) = readers
+            .iter()
+            .find(|(name, _)| name == partition_name)
+            .unwrap();
+
+        let pb = ui.create_spinner(format!("Reading {}", request));
+        let result = async {
+            let data = read_file(reader, path).await?;
+
+            if is_stdout {
+                let mut stdout = tokio::io::stdout();
+                stdout.write_all(&data).await?;
+                stdout.flush().await?;
+            } else {
+                let out_path = output_path(&args.out, partition_name, path)?;
+                if let Some(parent) = out_path.parent() {
+                    fs::create_dir_all(parent).await?;
+                }
+                fs::write(&out_path, &data)
+                    .await
+                    .with_context(|| format!("Failed to write {}", out_path.display()))?;
+            }
+            anyhow::Ok(data.len() as u64)
+        }
+        .await;
+
+        let message = match result {
+            Ok(size) => format!("✓ {} ({})", request, format_size(size)),
+            Err(e) => {
+                ui.error(format!("Failed to extract {}: {}", request, e));
+                failed.push(request.clone());
+                format!("✗ {} error", request)
+            }
+        };
+        if let Some(p) = &pb {
+            p.finish_with_message(message);
+        }
+    }
+
+    Ok(failed)
+}
+
+/// where `path` of `partition` is written under `out`. the in-image path
+/// is taken relative to the partition, components that would leave it
+/// (`..`, drive prefixes) are refused
+fn output_path(out: &Path, partition: &str, path: &str) -> Result<PathBuf> {
+    let mut target = out.to_path_buf();
+    let components = Path::new(partition).components();
+    for component in components.chain(Path::new(path).components()) {
+        match component {
+            Component::Normal(name) => target.push(name),
+            Component::RootDir | Component::CurDir => {}
+            Component::ParentDir | Component::Prefix(_) => {
+                return Err(anyhow!(
+                    "Refusing to write {}:{} outside {}",
+                    partition,
+                    path,
+                    out.display()
+                ));
+            }
+        }
+    }
+    Ok(target)
+}
+
+fn open_partition(
+    manifest: &DeltaArchiveManifest,
+    partition_name: &str,
+    data_offset: u64,
+    block_size: u64,
+    payload_reader: &Arc<dyn AsyncPayloadRead>,
+    args: &Args,
+) -> Result<PartitionBlockReader<Arc<dyn AsyncPayloadRead>>> {
+    let partition = manifest
+        .partitions
+        .iter()
+        .find(|p| p.partition_name == partition_name)
+        .ok_or_else(|| anyhow!("Partition {} not found in payload", partition_name))?;
+
+    let reader = PartitionBlockReader::new(
+        partition,
+        data_offset,
+        block_size,
+        Arc::clone(payload_reader),
+    )?;
+
+    // differential partitions are patched against the source image
+    #[cfg(feature = "diff_ota")]
+    if partition.old_partition_info.is_some() {
+        let source_path = args.source_dir.join(format!("{}.img", partition_name));
+        let source = SourceImage::open(&source_path)?;
+        return Ok(reader.with_source(Arc::new(source)));
+    }
+    #[cfg(not(feature = "diff_ota"))]
+    let _ = args;
+
+    Ok(reader)
+}
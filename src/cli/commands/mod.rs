@@ -1,2 +1,6 @@
+pub mod batch;
+#[cfg(unix)]
+pub mod daemon;
+pub mod file_extractor;
 pub mod list;
 pub mod metadata_saver;
@@ -2,29 +2,84 @@
 // Copyright (c) 2025 rhythmcache
 // https://github.com/rhythmcache/payload-dumper-rust
 
-use anyhow::Result;
+use anyhow::{Result, anyhow};
 use clap::Parser;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
 use std::time::Instant;
 use tokio::fs;
 
 use crate::cli::args::args_def::Args;
+use crate::cli::commands::batch::run_batch;
+#[cfg(unix)]
+use crate::cli::commands::daemon::run_daemon;
+use crate::cli::commands::file_extractor::extract_files;
 use crate::cli::commands::list::list_partitions;
 use crate::cli::commands::metadata_saver::handle_metadata_extraction;
+use crate::cli::payload::cow_builder::write_cow_files;
 use crate::cli::payload::extractor::extract_partitions;
-use crate::cli::payload::file_detector::{PayloadType, detect_payload_type};
+use crate::cli::payload::file_detector::PayloadType;
 use crate::cli::payload::partition_filter::filter_partitions;
-use crate::cli::payload::payload_loader::load_payload;
+use crate::cli::payload::payload_loader::open_payload;
 #[cfg(feature = "prefetch")]
 use crate::cli::payload::prefetch_extractor::extract_partitions_prefetch;
+use crate::cli::payload::scheduler::Scheduler;
+use crate::cli::payload::shard::{ShardPlan, finish_shard};
+use crate::cli::payload::super_builder::{finish_super_image, prepare_super_image};
+use crate::cli::payload::tar_output::{SpillDir, TarStream};
+use crate::cli::payload::zstd_output::{BlobFile, write_zstd_images};
 use crate::cli::ui::ui_print::UiOutput;
+#[cfg(feature = "diff_ota")]
+use crate::cli::verification::source_check::verify_source_images;
+#[cfg(feature = "diff_ota")]
+use crate::cli::verification::unchanged_check::{
+    find_unchanged_outputs, remember_verified_outputs,
+};
 use crate::cli::verification::validator::verify_extracted_partitions;
+use crate::cli::verification::verity_check::{verify_fec_data, verify_hash_trees};
+#[cfg(feature = "diff_ota")]
+use payload_dumper::payload::clone::clone_file;
 use payload_dumper::utils::{format_elapsed_time, format_size};
 
 pub async fn run() -> Result<()> {
     let args = Args::parse();
+    let scheduler = Scheduler::from_args(&args);
 
+    if args.daemon {
+        #[cfg(unix)]
+        return run_daemon(&args, &scheduler).await;
+        #[cfg(not(unix))]
+        return Err(anyhow!("Daemon mode needs unix domain sockets"));
+    }
+
+    if args.batch {
+        return run_batch(&args, &scheduler).await;
+    }
+
+    if !args.chain.is_empty() {
+        return run_chain(&args, &scheduler).await;
+    }
+
+    run_payload(&args, &scheduler).await.map(|_| ())
+}
+
+/// extracts a single payload as described by `args`
+/// partitions draw from the budgets of `scheduler`, which may be shared
+/// with other payloads extracted at the same time
+/// returns the partitions that failed extraction or hash verification
+pub async fn run_payload(args: &Args, scheduler: &Arc<Scheduler>) -> Result<Vec<String>> {
+    let is_stdout = args.out.to_string_lossy() == "-";
+    run_payload_with_ui(args, scheduler, UiOutput::new(args.quiet, is_stdout)).await
+}
+
+/// `run_payload` reporting through `ui`, which daemon jobs point at their
+/// client instead of the terminal
+pub async fn run_payload_with_ui(
+    args: &Args,
+    scheduler: &Arc<Scheduler>,
+    ui: UiOutput,
+) -> Result<Vec<String>> {
     let is_stdout = args.out.to_string_lossy() == "-";
-    let ui = UiOutput::new(args.quiet, is_stdout);
     let start_time = Instant::now();
     let main_pb = ui.create_spinner("Starting...");
 
@@ -44,23 +99,11 @@ pub async fn run() -> Result<()> {
         fs::create_dir_all(&args.out).await?;
     }
 
-    // Detect file type
-    ui.update_spinner(&main_pb, "Detecting file type...");
-
-    let payload_type = detect_payload_type(
-        &args.payload_path,
-        args.user_agent.as_deref(),
-        args.cookies.as_deref(),
-        args.dns.as_deref(),
-    )
-    .await?;
-
-    // Load payload
+    // Detect file type and load payload, unless the manifest is cached
     ui.update_spinner(&main_pb, "Parsing payload...");
 
-    let payload_info = load_payload(
+    let (payload_type, payload_info) = open_payload(
         &args.payload_path,
-        payload_type,
         args.user_agent.as_deref(),
         args.cookies.as_deref(),
         args.dns.as_deref(),
@@ -70,6 +113,25 @@ pub async fn run() -> Result<()> {
     let manifest = payload_info.manifest;
     let data_offset = payload_info.data_offset;
 
+    // ZSTD blobs of a local payload can be stored as they are with
+    // --zstd-output, a remote one would have to be downloaded again
+    let blob_file = match payload_type {
+        PayloadType::LocalBin => Some(BlobFile {
+            path: args.payload_path.clone(),
+            data_offset,
+        }),
+        #[cfg(feature = "local_zip")]
+        PayloadType::LocalZip => payload_info
+            .zip_info
+            .as_ref()
+            .filter(|zip| zip.compression_method == 0)
+            .map(|zip| BlobFile {
+                path: args.payload_path.clone(),
+                data_offset: zip.payload_data_offset + data_offset,
+            }),
+        _ => None,
+    };
+
     // Print security patch level
     if let Some(security_patch) = &manifest.security_patch_level {
         ui.pb_eprintln(format!("- Security Patch: {}", security_patch));
@@ -92,7 +154,7 @@ pub async fn run() -> Result<()> {
         {
             Ok(()) => {
                 ui.clear()?;
-                return Ok(());
+                return Ok(Vec::new());
             }
             Err(e) => {
                 ui.finish_spinner(main_pb, "Failed to save metadata");
@@ -121,32 +183,132 @@ pub async fn run() -> Result<()> {
                 ui.error(format!("Failed to save metadata: {}", e));
             }
             if is_stdout {
-                return Ok(());
+                return Ok(Vec::new());
             }
         }
 
         println!();
         list_partitions(&manifest);
-        return Ok(());
+        return Ok(Vec::new());
     }
 
     let block_size = manifest.block_size.unwrap_or(4096);
 
+    // single files are read through lazily decoded blocks, nothing else
+    // gets extracted
+    if !args.extract_file.is_empty() {
+        ui.update_spinner(&main_pb, "Extracting files...");
+        let failed = extract_files(
+            &manifest,
+            data_offset,
+            block_size as u64,
+            payload_info.reader,
+            args,
+            &ui,
+        )
+        .await?;
+
+        let elapsed_time = format_elapsed_time(start_time.elapsed());
+        if failed.is_empty() {
+            ui.finish_spinner(main_pb, format!("Files extracted in {}", elapsed_time));
+        } else {
+            ui.finish_spinner(
+                main_pb,
+                format!("{} files failed. (in {})", failed.len(), elapsed_time),
+            );
+        }
+        return Ok(failed);
+    }
+
+    // with -o - the images go to stdout as a tar archive: each one is
+    // extracted to a spill directory and streamed as soon as it is complete
+    let spill_dir = if is_stdout {
+        if args.super_image || args.cow || args.zstd_output || args.shard.is_some() {
+            return Err(anyhow!(
+                "--super, --cow, --zstd-output and --shard need an output directory"
+            ));
+        }
+        Some(SpillDir::create()?)
+    } else {
+        None
+    };
+    let spill_args;
+    let args = match &spill_dir {
+        Some(dir) => {
+            spill_args = Args {
+                out: dir.path().to_path_buf(),
+                ..args.clone()
+            };
+            &spill_args
+        }
+        None => args,
+    };
+
     // Filter partitions to extract
     let partitions_to_extract = filter_partitions(&manifest, &args.images);
 
     if partitions_to_extract.is_empty() {
         ui.finish_spinner(main_pb, "No partitions to extract");
         ui.clear()?;
-        return Ok(());
+        return Ok(Vec::new());
     }
 
+    // images an earlier run left in the output directory that already match
+    // need neither source images nor extraction
+    #[cfg(feature = "diff_ota")]
+    let partitions_to_extract = if args.skip_unchanged && !is_stdout {
+        let permit = scheduler
+            .acquire_workers(args.threads.unwrap_or_else(num_cpus::get))
+            .await;
+        let unchanged =
+            find_unchanged_outputs(&partitions_to_extract, permit.workers(), args, &ui).await?;
+        drop(permit);
+        let remaining: Vec<_> = partitions_to_extract
+            .into_iter()
+            .filter(|p| !unchanged.contains(&p.partition_name))
+            .collect();
+
+        if remaining.is_empty() {
+            ui.finish_spinner(main_pb, "All partitions are up to date");
+            ui.clear()?;
+            return Ok(Vec::new());
+        }
+        remaining
+    } else {
+        partitions_to_extract
+    };
+
+    // with --shard this process extracts its share of a run spread over
+    // several processes
+    let shard_plan = args.shard.map(|spec| {
+        ShardPlan::new(
+            &partitions_to_extract,
+            block_size as u64,
+            spec,
+            args.shard_run.as_deref().unwrap_or_default(),
+            args.shard_operations,
+        )
+    });
+    let partitions_to_extract = match &shard_plan {
+        Some(plan) => {
+            plan.prepare_outputs(args)?;
+            ui.println(format!(
+                "- Shard {}: {} partitions, parts of {} shared with other shards",
+                plan.spec,
+                plan.whole.len(),
+                plan.shares.len()
+            ));
+            plan.partitions()
+        }
+        None => partitions_to_extract,
+    };
+
     let thread_count = if args.no_parallel {
         1
     } else {
         args.threads
             .unwrap_or_else(num_cpus::get)
-            .min(partitions_to_extract.len())
+            .min(partitions_to_extract.len().max(1))
     };
 
     ui.println(format!("- Initialized {} thread(s)", thread_count));
@@ -155,13 +317,52 @@ pub async fn run() -> Result<()> {
         partitions_to_extract.len()
     ));
 
+    // Check source images of differential partitions up front, patching
+    // against a wrong image would only fail after all the work is done
+    #[cfg(feature = "diff_ota")]
+    let source_failures = verify_source_images(
+        &partitions_to_extract,
+        block_size as u64,
+        thread_count,
+        args,
+        &ui,
+    )
+    .await?;
+    #[cfg(not(feature = "diff_ota"))]
+    let source_failures: Vec<String> = Vec::new();
+
+    let partitions_to_extract: Vec<_> = partitions_to_extract
+        .into_iter()
+        .filter(|p| !source_failures.contains(&p.partition_name))
+        .collect();
+
+    // dynamic partitions are written in place into super.img with --super
+    let (partitions_to_extract, super_target) = prepare_super_image(
+        &manifest,
+        partitions_to_extract,
+        block_size as u64,
+        args,
+        &ui,
+    )
+    .await?;
+
     // Check for prefetch mode (remote URLs only)
     let is_remote = matches!(
         payload_type,
         PayloadType::RemoteZip | PayloadType::RemoteBin
     );
 
-    let failed_partitions = if args.prefetch && is_remote {
+    let tar_stream = spill_dir.as_ref().map(|dir| {
+        TarStream::start(
+            dir.path(),
+            &partitions_to_extract,
+            block_size as u64,
+            !args.no_verify,
+        )
+    });
+    let completed = tar_stream.as_ref().map(TarStream::sender);
+
+    let mut failed_partitions = if args.prefetch && is_remote {
         #[cfg(feature = "prefetch")]
         {
             ui.println("- Using prefetch mode for remote extraction");
@@ -171,31 +372,27 @@ pub async fn run() -> Result<()> {
 
             // Get payload offset (0 for .bin, non-zero for ZIP)
             let payload_offset = match payload_type {
-                PayloadType::RemoteZip => {
-                    // For ZIP files, we need to get the offset of payload.bin inside the ZIP
-                    use payload_dumper::zip::core_parser::ZipParser;
-                    let http_reader = payload_dumper::http::HttpReader::new(
-                        url.clone(),
-                        args.user_agent.as_deref(),
-                        args.cookies.as_deref(),
-                        args.dns.as_deref(),
-                    )
-                    .await?;
-                    let entry = ZipParser::find_payload_entry(&http_reader).await?;
-                    ZipParser::get_data_offset(&http_reader, &entry).await?
-                }
+                // where payload.bin sits was found (or cached) when the
+                // payload was opened, no need to walk the ZIP again
+                PayloadType::RemoteZip => payload_info
+                    .zip_info
+                    .as_ref()
+                    .map(|zip_info| zip_info.payload_data_offset)
+                    .ok_or_else(|| anyhow::anyhow!("Missing ZIP layout of remote payload"))?,
                 PayloadType::RemoteBin => 0, // Direct .bin file has no offset
                 _ => unreachable!(),
             };
 
             extract_partitions_prefetch(
-                &args,
+                args,
                 &partitions_to_extract,
                 data_offset,
                 block_size as u64,
                 url,
                 payload_offset,
-                thread_count,
+                scheduler,
+                super_target.as_ref(),
+                completed,
                 &ui,
             )
             .await?
@@ -218,19 +415,195 @@ pub async fn run() -> Result<()> {
         );
 
         extract_partitions(
-            &args,
+            args,
             &partitions_to_extract,
             data_offset,
             block_size as u64,
             payload_info.reader,
-            thread_count,
+            scheduler,
+            is_remote,
+            super_target.as_ref(),
+            blob_file.as_ref(),
+            completed,
             &ui,
         )
         .await?
     };
 
+    #[cfg(feature = "diff_ota")]
+    if args.blob_cache
+        && let Err(e) = crate::cli::payload::extractor::shared_blob_cache().save()
+    {
+        ui.error(format!("Failed to save blob index: {}", e));
+    }
+
+    // streamed images were checked against their hash on the way out, the
+    // spill directory is gone with them
+    if let Some(stream) = tar_stream {
+        for (name, reason) in stream.finish().await? {
+            ui.error(format!("{} not streamed: {}", name, reason));
+            failed_partitions.push(name);
+        }
+        failed_partitions.extend(source_failures);
+
+        let elapsed_time = format_elapsed_time(start_time.elapsed());
+        if failed_partitions.is_empty() {
+            ui.finish_spinner(
+                main_pb,
+                format!(
+                    "All partitions streamed successfully! (in {})",
+                    elapsed_time
+                ),
+            );
+        } else {
+            ui.finish_spinner(
+                main_pb,
+                format!(
+                    "Streamed with {} failed partitions. (in {})",
+                    failed_partitions.len(),
+                    elapsed_time
+                ),
+            );
+        }
+        return Ok(failed_partitions);
+    }
+
+    // the last shard of a run finishes the partitions split across shards
+    // and checks them with its own ones
+    let partitions_to_extract = match &shard_plan {
+        Some(plan) => {
+            let failed: Vec<String> = failed_partitions
+                .iter()
+                .chain(&source_failures)
+                .cloned()
+                .collect();
+            let completion =
+                finish_shard(plan, &failed, block_size as u64, args, scheduler, &ui).await?;
+            failed_partitions.extend(completion.failed);
+            plan.whole
+                .iter()
+                .chain(&completion.finished)
+                .cloned()
+                .collect()
+        }
+        None => partitions_to_extract,
+    };
+
+    // partitions inside super.img are checked by range, the other checks
+    // work on standalone images
+    let failed_super = match &super_target {
+        Some(target) => {
+            finish_super_image(
+                target,
+                &partitions_to_extract,
+                &failed_partitions,
+                block_size as u64,
+                args,
+                &ui,
+            )
+            .await?
+        }
+        None => Vec::new(),
+    };
+    let standalone: Vec<_> = partitions_to_extract
+        .iter()
+        .filter(|p| {
+            !super_target
+                .as_ref()
+                .is_some_and(|t| t.contains(&p.partition_name))
+        })
+        .cloned()
+        .collect();
+
+    // FEC repair rewrites damaged blocks, so it runs before the hash checks
+    let failed_fec = verify_fec_data(
+        &standalone,
+        &failed_partitions,
+        block_size as u64,
+        args,
+        scheduler,
+        &ui,
+    )
+    .await?;
+
     // Verify partitions
-    verify_extracted_partitions(&partitions_to_extract, &failed_partitions, &args, &ui).await?;
+    let failed_verifications =
+        verify_extracted_partitions(&standalone, &failed_partitions, args, &ui).await?;
+
+    // outputs of an image that failed its hash must not be cloned later on
+    #[cfg(feature = "diff_ota")]
+    if args.blob_cache && !failed_verifications.is_empty() {
+        let cache = crate::cli::payload::extractor::shared_blob_cache();
+        for name in &failed_verifications {
+            cache.forget_image(&args.out.join(format!("{}.img", name)));
+        }
+        if let Err(e) = cache.save() {
+            ui.error(format!("Failed to save blob index: {}", e));
+        }
+    }
+
+    #[cfg(feature = "diff_ota")]
+    if args.skip_unchanged && !args.no_verify && !is_stdout {
+        let failed: Vec<String> = failed_partitions
+            .iter()
+            .chain(&failed_verifications)
+            .cloned()
+            .collect();
+        remember_verified_outputs(&standalone, &failed, args, &ui);
+    }
+    let failed_trees = verify_hash_trees(
+        &standalone,
+        &failed_partitions,
+        block_size as u64,
+        args,
+        scheduler,
+        &ui,
+    )
+    .await?;
+
+    // COW files are built from verified images only
+    let failed_cow = {
+        let skip: Vec<String> = failed_partitions
+            .iter()
+            .chain(&failed_verifications)
+            .chain(&failed_trees)
+            .chain(&failed_fec)
+            .cloned()
+            .collect();
+        write_cow_files(
+            &manifest,
+            &standalone,
+            &skip,
+            block_size as u64,
+            args,
+            scheduler,
+            &ui,
+        )
+        .await?
+    };
+
+    // compressed images as well
+    let failed_zstd = {
+        let skip: Vec<String> = failed_partitions
+            .iter()
+            .chain(&failed_verifications)
+            .chain(&failed_trees)
+            .chain(&failed_fec)
+            .cloned()
+            .collect();
+        write_zstd_images(
+            &standalone,
+            &skip,
+            block_size as u64,
+            blob_file,
+            args,
+            scheduler,
+            &ui,
+        )
+        .await?
+    };
+
+    failed_partitions.extend(source_failures);
 
     // Print completion summary
     let elapsed_time = format_elapsed_time(start_time.elapsed());
@@ -264,5 +637,177 @@ pub async fn run() -> Result<()> {
         ));
     }
 
+    failed_partitions.extend(failed_verifications);
+    failed_partitions.extend(failed_trees);
+    failed_partitions.extend(failed_fec);
+    failed_partitions.extend(failed_super);
+    failed_partitions.extend(failed_cow);
+    failed_partitions.extend(failed_zstd);
+    Ok(failed_partitions)
+}
+
+/// applies the main payload and then every `--chain` payload in order
+///
+/// each step uses the previous step's images as its source directory.
+/// intermediate images live in hidden directories inside the output
+/// directory and are removed as soon as the next step has consumed them,
+/// only the last step writes to the output directory itself
+async fn run_chain(args: &Args, scheduler: &Arc<Scheduler>) -> Result<()> {
+    let is_stdout = args.out.to_string_lossy() == "-";
+    run_chain_with_ui(args, scheduler, &|| UiOutput::new(args.quiet, is_stdout))
+        .await
+        .map(|_| ())
+}
+
+/// `run_chain` reporting every step through a UI made by `new_ui`
+/// returns the partitions that failed in the last step
+pub async fn run_chain_with_ui(
+    args: &Args,
+    scheduler: &Arc<Scheduler>,
+    new_ui: &dyn Fn() -> UiOutput,
+) -> Result<Vec<String>> {
+    let payloads: Vec<PathBuf> = std::iter::once(args.payload_path.clone())
+        .chain(args.chain.iter().cloned())
+        .collect();
+    let steps = payloads.len();
+
+    fs::create_dir_all(&args.out).await?;
+
+    let mut previous_dir: Option<PathBuf> = None;
+    let mut verified = Vec::new();
+
+    for (step, payload_path) in payloads.into_iter().enumerate() {
+        let is_last = step + 1 == steps;
+        let step_out = if is_last {
+            args.out.clone()
+        } else {
+            args.out.join(format!(".chain-step-{}", step + 1))
+        };
+
+        let ui = new_ui();
+        ui.println(format!(
+            "- Chain step {}/{}: {}",
+            step + 1,
+            steps,
+            payload_path.display()
+        ));
+
+        let mut step_args = args.clone();
+        step_args.payload_path = payload_path;
+        step_args.out = step_out.clone();
+        if let Some(dir) = &previous_dir {
+            step_args.source_dir = dir.clone();
+            // the previous step already checked the images it extracted
+            // against the hashes this step expects as its source, the ones
+            // it carried over are still checked
+            if !args.no_verify {
+                step_args.verified_sources = std::mem::take(&mut verified);
+            }
+        }
+        // the next step reads this step's images as they are
+        step_args.zstd_output &= is_last;
+        // intermediate images start as clones of their source and only get
+        // the blocks that change written, unchanged and moved blocks keep
+        // sharing storage (reflink) back to the first source. the last step
+        // follows --clone-source
+        step_args.clone_source |= !is_last;
+
+        let result = run_payload_with_ui(&step_args, scheduler, ui).await;
+
+        // partitions this payload does not touch keep the image the step
+        // started from, the next step finds it next to the new ones
+        let result = match result {
+            Ok(failed) if failed.is_empty() && !is_last => {
+                carry_over_sources(&step_args.source_dir, &step_out)
+                    .await
+                    .map(|extracted| {
+                        verified = extracted;
+                        failed
+                    })
+            }
+            result => result,
+        };
+
+        // the intermediate images are not needed anymore once consumed
+        if let Some(dir) = previous_dir.take() {
+            let _ = fs::remove_dir_all(&dir).await;
+        }
+
+        let failed = match result {
+            Ok(failed) => failed,
+            Err(e) => {
+                if !is_last {
+                    let _ = fs::remove_dir_all(&step_out).await;
+                }
+                return Err(e);
+            }
+        };
+
+        if !failed.is_empty() && !is_last {
+            let _ = fs::remove_dir_all(&step_out).await;
+            return Err(anyhow!(
+                "Chain step {} failed for partitions: {}",
+                step + 1,
+                failed.join(", ")
+            ));
+        }
+
+        if is_last {
+            return Ok(failed);
+        }
+        previous_dir = Some(step_out);
+    }
+
+    Ok(Vec::new())
+}
+
+/// links every image of `source_dir` that `step_out` lacks into `step_out`,
+/// or clones it where hard links are not possible
+/// returns the partitions whose image the step wrote itself
+async fn carry_over_sources(source_dir: &Path, step_out: &Path) -> Result<Vec<String>> {
+    let extracted = image_names(step_out).await?;
+
+    for name in image_names(source_dir).await? {
+        if extracted.contains(&name) {
+            continue;
+        }
+        // the source directory of a later step is removed once consumed,
+        // so no symlinks: they would dangle in the final output
+        let target = fs::canonicalize(source_dir.join(format!("{}.img", name))).await?;
+        let link = step_out.join(format!("{}.img", name));
+        if fs::hard_link(&target, &link).await.is_err() {
+            clone_image(target, link).await?;
+        }
+    }
+
+    Ok(extracted)
+}
+
+/// reflinks `src` to `dst` where the filesystem can, copies it otherwise
+async fn clone_image(src: PathBuf, dst: PathBuf) -> Result<()> {
+    #[cfg(feature = "diff_ota")]
+    tokio::task::spawn_blocking(move || clone_file(&src, &dst)).await??;
+    #[cfg(not(feature = "diff_ota"))]
+    fs::copy(&src, &dst).await?;
     Ok(())
 }
+
+/// partition names of the `.img` files in `dir`, none if it does not exist
+async fn image_names(dir: &Path) -> Result<Vec<String>> {
+    let mut entries = match fs::read_dir(dir).await {
+        Ok(entries) => entries,
+        Err(e) if e.kind() == std::io::ErrorKind::NotFound => return Ok(Vec::new()),
+        Err(e) => return Err(e.into()),
+    };
+
+    let mut names = Vec::new();
+    while let Some(entry) = entries.next_entry().await? {
+        let path = entry.path();
+        if path.extension().is_some_and(|ext| ext == "img")
+            && let Some(name) = path.file_stem()
+        {
+            names.push(name.to_string_lossy().into_owned());
+        }
+    }
+    Ok(names)
+}
@@ -0,0 +1,155 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+use crate::cli::args::args_def::Args;
+use crate::cli::payload::scheduler::Scheduler;
+use crate::cli::ui::ui_print::UiOutput;
+use anyhow::{Context, Result, anyhow};
+use payload_dumper::cow::{CowCompression, CowOptions, write_cow};
+use payload_dumper::structs::{DeltaArchiveManifest, PartitionUpdate};
+use payload_dumper::utils::format_size;
+
+/// turns the extracted images into virtual A/B COW files when --cow is given
+///
+/// `<name>.cow` replaces `<name>.img` for dynamic partitions, the only ones
+/// virtual A/B snapshots. other images and partitions listed in `skip`
+/// (failed extraction or verification) are left alone
+/// returns the partitions whose COW could not be written
+pub async fn write_cow_files(
+    manifest: &DeltaArchiveManifest,
+    partitions: &[PartitionUpdate],
+    skip: &[String],
+    block_size: u64,
+    args: &Args,
+    scheduler: &Scheduler,
+    ui: &UiOutput,
+) -> Result<Vec<String>> {
+    if !args.cow {
+        return Ok(Vec::new());
+    }
+
+    let dynamic = manifest.dynamic_partition_metadata.as_ref();
+    let param = dynamic
+        .and_then(|d| d.vabc_compression_param.clone())
+        .unwrap_or_default();
+    let compression = CowCompression::from_param(&param).unwrap_or_else(|| {
+        ui.error(format!(
+            "COW compression '{}' is not supported, writing uncompressed COW files",
+            param
+        ));
+        CowCompression::None
+    });
+    let threaded = dynamic
+        .and_then(|d| d.vabc_feature_set.as_ref())
+        .and_then(|f| f.threaded)
+        .unwrap_or(true);
+
+    let max_workers = if threaded { num_cpus::get() } else { 1 };
+
+    ui.println(format!(
+        "- Writing COW files ({:?} compression)...",
+        compression
+    ));
+
+    let snapshotted: Vec<&String> = dynamic
+        .map(|d| {
+            d.groups
+                .iter()
+                .flat_map(|g| g.partition_names.iter())
+                .collect()
+        })
+        .unwrap_or_default();
+
+    let mut failed = Vec::new();
+
+    // one partition at a time, each one on the cores idle in the scheduler
+    for partition in partitions
+        .iter()
+        .filter(|p| snapshotted.contains(&&p.partition_name) && !skip.contains(&p.partition_name))
+    {
+        let name = partition.partition_name.clone();
+        let image_path = args.out.join(format!("{}.img", name));
+        let cow_path = args.out.join(format!("{}.cow", name));
+        let source_path = args.source_dir.join(format!("{}.img", name));
+        let has_source = partition.old_partition_info.is_some() && source_path.exists();
+
+        let pb = ui.create_spinner(format!("Writing COW for {}", name));
+        let task_partition = partition.clone();
+        let permit = scheduler.acquire_workers(max_workers).await;
+        let task_options = CowOptions {
+            compression,
+            workers: permit.workers(),
+            ..Default::default()
+        };
+
+        let result = tokio::task::spawn_blocking(move || {
+            let new_image = std::fs::File::open(&image_path)
+                .with_context(|| format!("Failed to open {}", image_path.display()))?;
+            let source = if has_source {
+                Some(std::fs::File::open(&source_path)?)
+            } else {
+                None
+            };
+            let output = std::fs::OpenOptions::new()
+                .read(true)
+                .write(true)
+                .create(true)
+                .truncate(true)
+                .open(&cow_path)
+                .with_context(|| format!("Failed to create {}", cow_path.display()))?;
+
+            let stats = write_cow(
+                &task_partition,
+                &new_image,
+                source.as_ref(),
+                &output,
+                block_size,
+                &task_options,
+            )?;
+
+            // the COW is what was asked for, the full image was only a means
+            std::fs::remove_file(&image_path)?;
+            anyhow::Ok(stats)
+        })
+        .await
+        .map_err(|e| anyhow!("COW task failed: {}", e))
+        .and_then(|r| r);
+        drop(permit);
+
+        let message = match result {
+            Ok(stats) => {
+                if let Some(estimate) = partition.estimate_cow_size
+                    && stats.size > estimate
+                {
+                    ui.error(format!(
+                        "COW of {} is {}, larger than the {} the payload estimates",
+                        name,
+                        format_size(stats.size),
+                        format_size(estimate)
+                    ));
+                }
+                format!(
+                    "✓ {}.cow {} ({} copy, {} xor, {} replace, {} zero)",
+                    name,
+                    format_size(stats.size),
+                    stats.copy_ops,
+                    stats.xor_ops,
+                    stats.replace_ops,
+                    stats.zero_ops
+                )
+            }
+            Err(e) => {
+                ui.error(format!("Failed to write COW for {}: {}", name, e));
+                failed.push(name.clone());
+                format!("✗ {} COW error", name)
+            }
+        };
+
+        if let Some(p) = &pb {
+            p.finish_with_message(message);
+        }
+    }
+
+    Ok(failed)
+}
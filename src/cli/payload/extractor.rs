@@ -3,15 +3,24 @@
 // https://github.com/rhythmcache/payload-dumper-rust
 
 use crate::cli::args::args_def::Args;
+use crate::cli::payload::scheduler::{Scheduler, partition_size};
+use crate::cli::payload::super_builder::SuperTarget;
+use crate::cli::payload::zstd_output::{BlobFile, seekable_output, streams_zstd};
 use crate::cli::ui::cli_reporter::CliExtractionReporter;
 use crate::cli::ui::ui_print::UiOutput;
 use anyhow::Result;
-use payload_dumper::payload::payload_dumper::{AsyncPayloadRead, dump_partition};
+#[cfg(feature = "diff_ota")]
+use payload_dumper::payload::blob_cache::BlobCache;
+use payload_dumper::payload::payload_dumper::{
+    AsyncPayloadRead, DumpOptions, dump_partition_with_options,
+};
 use payload_dumper::structs::PartitionUpdate;
+use std::path::PathBuf;
 use std::sync::Arc;
-use tokio::sync::Semaphore;
+use tokio::sync::mpsc::UnboundedSender;
 
 /// extracts partitions using parallel or sequential processing
+/// every partition waits for its share of the `scheduler` budgets first
 /// returns a list of failed partition names
 pub async fn extract_partitions(
     args: &Args,
@@ -19,7 +28,11 @@ pub async fn extract_partitions(
     data_offset: u64,
     block_size: u64,
     payload_reader: Arc<dyn AsyncPayloadRead>,
-    thread_count: usize,
+    scheduler: &Arc<Scheduler>,
+    remote: bool,
+    super_target: Option<&SuperTarget>,
+    blob_file: Option<&BlobFile>,
+    completed: Option<&UnboundedSender<String>>,
     ui: &UiOutput,
 ) -> Result<Vec<String>> {
     if args.no_parallel {
@@ -29,6 +42,11 @@ pub async fn extract_partitions(
             data_offset,
             block_size,
             payload_reader,
+            scheduler,
+            remote,
+            super_target,
+            blob_file,
+            completed,
             ui,
         )
         .await
@@ -39,13 +57,81 @@ pub async fn extract_partitions(
             data_offset,
             block_size,
             payload_reader,
-            thread_count,
+            scheduler,
+            remote,
+            super_target,
+            blob_file,
+            completed,
             ui,
         )
         .await
     }
 }
 
+/// partitions in the order they should start: the largest ones first, so
+/// the long tail is not left to a single core at the end
+pub fn largest_first(partitions: &[PartitionUpdate]) -> Vec<&PartitionUpdate> {
+    let mut ordered: Vec<&PartitionUpdate> = partitions.iter().collect();
+    ordered.sort_by_key(|p| std::cmp::Reverse(partition_size(p)));
+    ordered
+}
+
+/// blob index for --blob-cache, loaded once per process and shared by
+/// every job
+#[cfg(feature = "diff_ota")]
+pub fn shared_blob_cache() -> &'static Arc<BlobCache> {
+    static BLOB_CACHE: std::sync::OnceLock<Arc<BlobCache>> = std::sync::OnceLock::new();
+    BLOB_CACHE.get_or_init(|| Arc::new(BlobCache::load()))
+}
+
+/// extraction settings taken from the command line
+pub fn dump_options(args: &Args, scheduler: &Scheduler) -> DumpOptions {
+    DumpOptions {
+        source_dir: Some(args.source_dir.clone()),
+        clone_source: args.clone_source,
+        preallocated: false,
+        rewrite_changed: args.skip_unchanged,
+        #[cfg(feature = "diff_ota")]
+        blob_cache: args.blob_cache.then(|| Arc::clone(shared_blob_cache())),
+        cpu_budget: Some(scheduler.cpu_budget()),
+        #[cfg(feature = "diff_ota")]
+        puff_budget: Some(scheduler.puff_budget()),
+        // set per partition by `partition_output` for --zstd-output
+        seekable_zstd: None,
+    }
+}
+
+/// output file and settings of one partition, dynamic partitions are
+/// written in place into the super image when one is being built
+///
+/// `blob_file` is the local payload ZSTD blobs of --zstd-output are taken
+/// from
+pub fn partition_output(
+    args: &Args,
+    scheduler: &Scheduler,
+    super_target: Option<&SuperTarget>,
+    blob_file: Option<&BlobFile>,
+    partition_name: &str,
+) -> (PathBuf, DumpOptions) {
+    let mut options = dump_options(args, scheduler);
+
+    match super_target {
+        Some(target) if target.contains(partition_name) => {
+            options.preallocated = true;
+            (target.path.clone(), options)
+        }
+        _ => {
+            // sharded runs create the images up front, split ones are
+            // written by several processes
+            options.preallocated = args.shard.is_some();
+            if streams_zstd(args) {
+                options.seekable_zstd = Some(seekable_output(args, partition_name, blob_file));
+            }
+            (args.out.join(format!("{}.img", partition_name)), options)
+        }
+    }
+}
+
 /// sequential extraction
 async fn extract_sequential(
     args: &Args,
@@ -53,80 +139,117 @@ async fn extract_sequential(
     data_offset: u64,
     block_size: u64,
     payload_reader: Arc<dyn AsyncPayloadRead>,
+    scheduler: &Arc<Scheduler>,
+    remote: bool,
+    super_target: Option<&SuperTarget>,
+    blob_file: Option<&BlobFile>,
+    completed: Option<&UnboundedSender<String>>,
     ui: &UiOutput,
 ) -> Result<Vec<String>> {
     let mut failed_partitions = Vec::new();
 
     for partition in partitions {
+        // other payloads of a batch draw from the same budgets
+        let _permit = scheduler.acquire(partition, block_size, remote).await;
+
         // Create progress through UI layer - no indicatif imports needed!
         let progress = ui.create_extraction_progress(&partition.partition_name);
         let reporter = CliExtractionReporter::new(progress);
-        let output_path = args.out.join(format!("{}.img", &partition.partition_name));
+        let (output_path, options) = partition_output(
+            args,
+            scheduler,
+            super_target,
+            blob_file,
+            &partition.partition_name,
+        );
 
-        if let Err(e) = dump_partition(
+        match dump_partition_with_options(
             partition,
             data_offset,
             block_size,
             output_path,
             &payload_reader,
             &reporter,
-            Some(args.source_dir.clone()),
+            &options,
         )
         .await
         {
-            ui.error(format!(
-                "Failed to process partition {}: {}",
-                partition.partition_name, e
-            ));
-            failed_partitions.push(partition.partition_name.clone());
+            Ok(()) => {
+                if let Some(completed) = completed {
+                    let _ = completed.send(partition.partition_name.clone());
+                }
+            }
+            Err(e) => {
+                ui.error(format!(
+                    "Failed to process partition {}: {}",
+                    partition.partition_name, e
+                ));
+                failed_partitions.push(partition.partition_name.clone());
+            }
         }
     }
 
     Ok(failed_partitions)
 }
 
-/// parallel extraction with thread limiting
+/// parallel extraction limited by the scheduler
+///
+/// permits are taken here, before spawning, so partitions start strictly
+/// largest first
 async fn extract_parallel(
     args: &Args,
     partitions: &[PartitionUpdate],
     data_offset: u64,
     block_size: u64,
     payload_reader: Arc<dyn AsyncPayloadRead>,
-    thread_count: usize,
+    scheduler: &Arc<Scheduler>,
+    remote: bool,
+    super_target: Option<&SuperTarget>,
+    blob_file: Option<&BlobFile>,
+    completed: Option<&UnboundedSender<String>>,
     ui: &UiOutput,
 ) -> Result<Vec<String>> {
-    let semaphore = Arc::new(Semaphore::new(thread_count));
     let mut tasks = Vec::new();
-    let out_dir = args.out.clone();
-    let source_dir = args.source_dir.clone();
 
-    for partition in partitions {
+    for partition in largest_first(partitions) {
+        let permit = scheduler.acquire(partition, block_size, remote).await;
+
         let partition = partition.clone();
         let payload_reader = Arc::clone(&payload_reader);
-        let out_dir = out_dir.clone();
-        let source_dir = source_dir.clone();
-        let semaphore = Arc::clone(&semaphore);
+        let (output_path, options) = partition_output(
+            args,
+            scheduler,
+            super_target,
+            blob_file,
+            &partition.partition_name,
+        );
         let progress = ui.create_extraction_progress(&partition.partition_name);
+        let completed = completed.cloned();
 
         let task = tokio::spawn(async move {
-            let _permit = semaphore.acquire().await.unwrap();
+            let _permit = permit;
 
             let partition_name = partition.partition_name.clone();
-            let output_path = out_dir.join(format!("{}.img", partition_name));
             let reporter = CliExtractionReporter::new(progress);
 
-            match dump_partition(
+            match dump_partition_with_options(
                 &partition,
                 data_offset,
                 block_size,
                 output_path,
                 &payload_reader,
                 &reporter,
-                Some(source_dir),
+                &options,
             )
             .await
             {
-                Ok(()) => Ok(()),
+                Ok(()) => {
+                    // streamed while the other partitions are still running
+                    if let Some(completed) = completed {
+                        let _ = completed.send(partition_name);
+                    }
+                    Ok(())
+                }
                 Err(e) => Err((partition_name, e)),
             }
         });
@@ -1,6 +1,12 @@
+pub mod cow_builder;
 pub mod extractor;
 pub mod file_detector;
 pub mod partition_filter;
 pub mod payload_loader;
 #[cfg(feature = "prefetch")]
 pub mod prefetch_extractor;
+pub mod scheduler;
+pub mod shard;
+pub mod super_builder;
+pub mod tar_output;
+pub mod zstd_output;
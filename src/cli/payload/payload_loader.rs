@@ -3,16 +3,23 @@
 // https://github.com/rhythmcache/payload-dumper-rust
 
 #![allow(unused)]
-use crate::cli::payload::file_detector::PayloadType;
+use crate::cli::payload::file_detector::{PayloadType, detect_payload_type};
 use crate::cli::ui::ui_print::UiOutput;
 use anyhow::Result;
 use anyhow::anyhow;
+#[cfg(feature = "remote_zip")]
+use payload_dumper::http::HttpReader;
+#[cfg(feature = "local_zip")]
+use payload_dumper::payload::manifest_cache::{self, CachedPayload, PayloadIdentity};
 use payload_dumper::payload::payload_dumper::AsyncPayloadRead;
 use payload_dumper::payload::payload_parser::parse_local_payload;
 #[cfg(feature = "local_zip")]
 use payload_dumper::payload::payload_parser::parse_local_zip_payload;
 #[cfg(feature = "remote_zip")]
-use payload_dumper::payload::payload_parser::{parse_remote_bin_payload, parse_remote_payload};
+use payload_dumper::payload::payload_parser::{
+    parse_remote_bin_payload, parse_remote_bin_payload_from, parse_remote_payload,
+    parse_remote_payload_from,
+};
 use payload_dumper::readers::local_reader::LocalAsyncPayloadReader;
 #[cfg(feature = "local_zip")]
 use payload_dumper::readers::local_zip_reader::LocalAsyncZipPayloadReader;
@@ -23,6 +30,8 @@ use payload_dumper::readers::remote_zip_reader::RemoteAsyncZipPayloadReader;
 use payload_dumper::structs::{DeltaArchiveManifest, SourceInfo, ZipDetails};
 
 use payload_dumper::utils::format_size;
+#[cfg(feature = "remote_zip")]
+use payload_dumper::utils::{FileType, detect_file};
 #[cfg(any(feature = "local_zip", feature = "remote_zip"))]
 use payload_dumper::zip::core_parser::ZipMetadataInfo;
 use std::path::Path;
@@ -33,6 +42,34 @@ pub struct PayloadInfo {
     pub data_offset: u64,
     pub reader: Arc<dyn AsyncPayloadRead>,
     pub source_info: Option<SourceInfo>,
+    /// where payload.bin sits when it is inside a ZIP
+    #[cfg(feature = "local_zip")]
+    pub zip_info: Option<ZipMetadataInfo>,
+}
+
+fn source_type(payload_type: PayloadType) -> &'static str {
+    match payload_type {
+        PayloadType::LocalBin => "local_bin",
+        PayloadType::LocalZip => "local_zip",
+        PayloadType::RemoteBin => "remote_bin",
+        PayloadType::RemoteZip => "remote_zip",
+    }
+}
+
+fn bin_source_info(source_type: &str, path_or_url: &str, size: Option<u64>) -> SourceInfo {
+    let file_name = Path::new(path_or_url)
+        .file_name()
+        .map(|s| s.to_string_lossy().to_string())
+        .unwrap_or_else(|| path_or_url.to_string());
+
+    SourceInfo {
+        source_type: source_type.to_string(),
+        file_name,
+        file_path_or_url: path_or_url.to_string(),
+        archive_size: size,
+        archive_size_readable: size.map(format_size),
+        zip_details: None,
+    }
 }
 
 #[cfg(any(feature = "local_zip", feature = "remote_zip"))]
@@ -85,6 +122,8 @@ pub async fn load_payload(
     ui: &UiOutput,
 ) -> Result<PayloadInfo> {
     let payload_path_str = payload_path.to_string_lossy().to_string();
+    #[cfg(feature = "local_zip")]
+    let mut payload_zip_info = None;
 
     let (manifest, data_offset, source_info) = match payload_type {
         PayloadType::RemoteZip => {
@@ -100,6 +139,7 @@ pub async fn load_payload(
                 ));
                 let source_info =
                     create_zip_source_info("remote_zip", &payload_path_str, &zip_info);
+                payload_zip_info = Some(zip_info);
                 (manifest, data_offset, Some(source_info))
             }
             #[cfg(not(feature = "remote_zip"))]
@@ -118,19 +158,8 @@ pub async fn load_payload(
                     "- Remote .bin size: {}",
                     format_size(content_length)
                 ));
-                let file_name = Path::new(&payload_path_str)
-                    .file_name()
-                    .map(|s| s.to_string_lossy().to_string())
-                    .unwrap_or_else(|| payload_path_str.clone());
-
-                let source_info = SourceInfo {
-                    source_type: "remote_bin".to_string(),
-                    file_name,
-                    file_path_or_url: payload_path_str.clone(),
-                    archive_size: Some(content_length),
-                    archive_size_readable: Some(format_size(content_length)),
-                    zip_details: None,
-                };
+                let source_info =
+                    bin_source_info("remote_bin", &payload_path_str, Some(content_length));
                 (manifest, data_offset, Some(source_info))
             }
             #[cfg(not(feature = "remote_zip"))]
@@ -144,6 +173,7 @@ pub async fn load_payload(
                 let (manifest, data_offset, zip_info) =
                     parse_local_zip_payload(payload_path.to_path_buf()).await?;
                 let source_info = create_zip_source_info("local_zip", &payload_path_str, &zip_info);
+                payload_zip_info = Some(zip_info);
                 (manifest, data_offset, Some(source_info))
             }
             #[cfg(not(feature = "local_zip"))]
@@ -157,19 +187,7 @@ pub async fn load_payload(
                 .await
                 .map(|m| m.len())
                 .ok();
-            let file_name = payload_path
-                .file_name()
-                .map(|s| s.to_string_lossy().to_string())
-                .unwrap_or_else(|| payload_path_str.clone());
-
-            let source_info = SourceInfo {
-                source_type: "local_bin".to_string(),
-                file_name,
-                file_path_or_url: payload_path_str.clone(),
-                archive_size: file_size,
-                archive_size_readable: file_size.map(format_size),
-                zip_details: None,
-            };
+            let source_info = bin_source_info("local_bin", &payload_path_str, file_size);
             (manifest, data_offset, Some(source_info))
         }
     };
@@ -234,5 +252,269 @@ pub async fn load_payload(
         data_offset,
         reader,
         source_info,
+        #[cfg(feature = "local_zip")]
+        zip_info: payload_zip_info,
     })
 }
+
+/// detects and loads the payload, going through the manifest cache
+///
+/// on a hit the type detection, the ZIP directory walk and the manifest
+/// read are all skipped, a remote payload costs a single HEAD request. on a
+/// miss that same connection loads it. the cache is best effort, any problem
+/// with it falls back to parsing
+pub async fn open_payload(
+    payload_path: &Path,
+    user_agent: Option<&str>,
+    cookies: Option<&str>,
+    dns: Option<&str>,
+    ui: &UiOutput,
+) -> Result<(PayloadType, PayloadInfo)> {
+    #[cfg(feature = "local_zip")]
+    let lookup = cached_payload(payload_path, user_agent, cookies, dns).await;
+    #[cfg(feature = "local_zip")]
+    if let Some(loaded) = lookup.loaded {
+        ui.println("- Using cached manifest");
+        return Ok(loaded);
+    }
+
+    #[cfg(feature = "remote_zip")]
+    let loaded = match lookup.http_reader {
+        Some(http_reader) => {
+            let url = payload_path.to_string_lossy();
+            Some(load_remote_payload(&url, http_reader, ui).await?)
+        }
+        None => None,
+    };
+    #[cfg(not(feature = "remote_zip"))]
+    let loaded = None;
+
+    let (payload_type, payload_info) = match loaded {
+        Some(loaded) => loaded,
+        None => {
+            let payload_type = detect_payload_type(payload_path, user_agent, cookies, dns).await?;
+            let payload_info =
+                load_payload(payload_path, payload_type, user_agent, cookies, dns, ui).await?;
+            (payload_type, payload_info)
+        }
+    };
+
+    #[cfg(feature = "local_zip")]
+    if let Some(identity) = lookup.identity {
+        let cached = CachedPayload {
+            manifest: payload_info.manifest.clone(),
+            data_offset: payload_info.data_offset,
+            archive_size: payload_info
+                .source_info
+                .as_ref()
+                .and_then(|info| info.archive_size)
+                .unwrap_or(0),
+            zip_info: payload_info.zip_info.clone(),
+        };
+        // a read-only cache directory only costs the speedup
+        let _ = manifest_cache::store(&identity, &cached);
+    }
+
+    Ok((payload_type, payload_info))
+}
+
+/// what the manifest cache knows about a payload
+#[cfg(feature = "local_zip")]
+#[derive(Default)]
+struct CacheLookup {
+    identity: Option<PayloadIdentity>,
+    /// the payload ready to use, on a hit
+    loaded: Option<(PayloadType, PayloadInfo)>,
+    /// connection opened to identify a remote payload, on a miss
+    #[cfg(feature = "remote_zip")]
+    http_reader: Option<HttpReader>,
+}
+
+/// identity of the payload and, on a cache hit, the payload ready to use
+#[cfg(feature = "local_zip")]
+async fn cached_payload(
+    payload_path: &Path,
+    user_agent: Option<&str>,
+    cookies: Option<&str>,
+    dns: Option<&str>,
+) -> CacheLookup {
+    let payload_path_str = payload_path.to_string_lossy().to_string();
+
+    if payload_path_str.starts_with("http://") || payload_path_str.starts_with("https://") {
+        #[cfg(feature = "remote_zip")]
+        {
+            let Ok(http_reader) =
+                HttpReader::new(payload_path_str.clone(), user_agent, cookies, dns).await
+            else {
+                return CacheLookup::default();
+            };
+            let Some(identity) = PayloadIdentity::remote(&http_reader) else {
+                return CacheLookup {
+                    http_reader: Some(http_reader),
+                    ..Default::default()
+                };
+            };
+            let Some(cached) = manifest_cache::load(&identity) else {
+                return CacheLookup {
+                    identity: Some(identity),
+                    http_reader: Some(http_reader),
+                    ..Default::default()
+                };
+            };
+
+            // the HEAD request made for the identity is reused by the reader
+            let (payload_type, reader): (PayloadType, Arc<dyn AsyncPayloadRead>) =
+                match &cached.zip_info {
+                    Some(zip_info) => (
+                        PayloadType::RemoteZip,
+                        Arc::new(RemoteAsyncZipPayloadReader::from_http_reader(
+                            http_reader,
+                            zip_info.payload_data_offset,
+                            zip_info.uncompressed_size,
+                        )),
+                    ),
+                    None => (
+                        PayloadType::RemoteBin,
+                        Arc::new(RemoteAsyncBinPayloadReader::from_http_reader(http_reader)),
+                    ),
+                };
+            let info = cached_info(&payload_path_str, payload_type, cached, reader);
+            return CacheLookup {
+                identity: Some(identity),
+                loaded: Some((payload_type, info)),
+                ..Default::default()
+            };
+        }
+        #[cfg(not(feature = "remote_zip"))]
+        return CacheLookup::default();
+    }
+
+    let Ok(identity) = PayloadIdentity::local(payload_path) else {
+        return CacheLookup::default();
+    };
+    let Some(cached) = manifest_cache::load(&identity) else {
+        return CacheLookup {
+            identity: Some(identity),
+            ..Default::default()
+        };
+    };
+
+    let opened: Result<(PayloadType, Arc<dyn AsyncPayloadRead>)> = match &cached.zip_info {
+        Some(zip_info) => LocalAsyncZipPayloadReader::with_payload_offset(
+            payload_path.to_path_buf(),
+            zip_info.payload_data_offset,
+        )
+        .await
+        .map(|r| {
+            (
+                PayloadType::LocalZip,
+                Arc::new(r) as Arc<dyn AsyncPayloadRead>,
+            )
+        }),
+        None => LocalAsyncPayloadReader::new(payload_path.to_path_buf())
+            .await
+            .map(|r| {
+                (
+                    PayloadType::LocalBin,
+                    Arc::new(r) as Arc<dyn AsyncPayloadRead>,
+                )
+            }),
+    };
+
+    let loaded = opened.ok().map(|(payload_type, reader)| {
+        let info = cached_info(&payload_path_str, payload_type, cached, reader);
+        (payload_type, info)
+    });
+    CacheLookup {
+        identity: Some(identity),
+        loaded,
+        ..Default::default()
+    }
+}
+
+/// detects and loads a remote payload over `http_reader`, the connection
+/// the manifest cache lookup already opened
+#[cfg(feature = "remote_zip")]
+async fn load_remote_payload(
+    url: &str,
+    http_reader: HttpReader,
+    ui: &UiOutput,
+) -> Result<(PayloadType, PayloadInfo)> {
+    let mut magic = [0u8; 4];
+    http_reader
+        .read_at(0, &mut magic)
+        .await
+        .map_err(|e| anyhow!("Failed to read magic bytes from remote file: {}", e))?;
+    let file_type = detect_file(&magic)
+        .map_err(|e| anyhow!("Unable to detect remote file type for {}: {}", url, e))?;
+
+    match file_type {
+        FileType::Zip => {
+            ui.println("- Connecting to remote ZIP archive...");
+            let (manifest, data_offset, zip_info) = parse_remote_payload_from(&http_reader).await?;
+            ui.pb_eprintln(format!(
+                "- Remote ZIP size: {}",
+                format_size(zip_info.archive_size)
+            ));
+            let source_info = create_zip_source_info("remote_zip", url, &zip_info);
+            let reader = RemoteAsyncZipPayloadReader::from_http_reader(
+                http_reader,
+                zip_info.payload_data_offset,
+                zip_info.uncompressed_size,
+            );
+            Ok((
+                PayloadType::RemoteZip,
+                PayloadInfo {
+                    manifest,
+                    data_offset,
+                    reader: Arc::new(reader),
+                    source_info: Some(source_info),
+                    zip_info: Some(zip_info),
+                },
+            ))
+        }
+        FileType::Bin => {
+            ui.println("- Connecting to remote .bin file...");
+            let (manifest, data_offset, content_length) =
+                parse_remote_bin_payload_from(&http_reader).await?;
+            ui.pb_eprintln(format!(
+                "- Remote .bin size: {}",
+                format_size(content_length)
+            ));
+            let source_info = bin_source_info("remote_bin", url, Some(content_length));
+            let reader = RemoteAsyncBinPayloadReader::from_http_reader(http_reader);
+            Ok((
+                PayloadType::RemoteBin,
+                PayloadInfo {
+                    manifest,
+                    data_offset,
+                    reader: Arc::new(reader),
+                    source_info: Some(source_info),
+                    zip_info: None,
+                },
+            ))
+        }
+    }
+}
+
+#[cfg(feature = "local_zip")]
+fn cached_info(
+    path_or_url: &str,
+    payload_type: PayloadType,
+    cached: CachedPayload,
+    reader: Arc<dyn AsyncPayloadRead>,
+) -> PayloadInfo {
+    let source_type = source_type(payload_type);
+    let source_info = match &cached.zip_info {
+        Some(zip_info) => create_zip_source_info(source_type, path_or_url, zip_info),
+        None => bin_source_info(source_type, path_or_url, Some(cached.archive_size)),
+    };
+
+    PayloadInfo {
+        manifest: cached.manifest,
+        data_offset: cached.data_offset,
+        reader,
+        source_info: Some(source_info),
+        zip_info: cached.zip_info,
+    }
+}
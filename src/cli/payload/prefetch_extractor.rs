@@ -3,17 +3,20 @@
 // https://github.com/rhythmcache/payload-dumper-rust
 
 use crate::cli::args::args_def::Args;
+use crate::cli::payload::extractor::{largest_first, partition_output};
+use crate::cli::payload::scheduler::Scheduler;
+use crate::cli::payload::super_builder::SuperTarget;
 use crate::cli::ui::cli_reporter::{CliDownloadReporter, CliExtractionReporter};
 use crate::cli::ui::ui_print::UiOutput;
 use anyhow::Result;
 use payload_dumper::http::HttpReader;
 use payload_dumper::prefetch::{
-    ExtractionPaths, PartitionExtractionConfig, prefetch_and_dump_partition,
+    ExtractionPaths, PartitionExtractionConfig, prefetch_and_dump_partition_with_options,
 };
 use payload_dumper::structs::PartitionUpdate;
 use std::sync::Arc;
 use tempfile::TempDir;
-use tokio::sync::Semaphore;
+use tokio::sync::mpsc::UnboundedSender;
 
 /// extract partitions using prefetch mode (download then extract)
 pub async fn extract_partitions_prefetch(
@@ -23,7 +26,9 @@ pub async fn extract_partitions_prefetch(
     block_size: u64,
     url: String,
     payload_offset: u64,
-    thread_count: usize,
+    scheduler: &Arc<Scheduler>,
+    super_target: Option<&SuperTarget>,
+    completed: Option<&UnboundedSender<String>>,
     ui: &UiOutput,
 ) -> Result<Vec<String>> {
     let config = PartitionExtractionConfig {
@@ -33,9 +38,29 @@ pub async fn extract_partitions_prefetch(
     };
 
     if args.no_parallel {
-        extract_prefetch_sequential(args, partitions, &config, url, ui).await
+        extract_prefetch_sequential(
+            args,
+            partitions,
+            &config,
+            url,
+            scheduler,
+            super_target,
+            completed,
+            ui,
+        )
+        .await
     } else {
-        extract_prefetch_parallel(args, partitions, &config, url, thread_count, ui).await
+        extract_prefetch_parallel(
+            args,
+            partitions,
+            &config,
+            url,
+            scheduler,
+            super_target,
+            completed,
+            ui,
+        )
+        .await
     }
 }
 
@@ -45,6 +70,9 @@ async fn extract_prefetch_sequential(
     partitions: &[PartitionUpdate],
     config: &PartitionExtractionConfig,
     url: String,
+    scheduler: &Arc<Scheduler>,
+    super_target: Option<&SuperTarget>,
+    completed: Option<&UnboundedSender<String>>,
     ui: &UiOutput,
 ) -> Result<Vec<String>> {
     let mut failed_partitions = Vec::new();
@@ -59,10 +87,14 @@ async fn extract_prefetch_sequential(
     .await?;
 
     for partition in partitions {
+        let _permit = scheduler.acquire(partition, config.block_size, true).await;
+
         let partition_name = &partition.partition_name;
+        let (output_path, options) =
+            partition_output(args, scheduler, super_target, None, partition_name);
         let paths = ExtractionPaths {
             temp_path: temp_dir.path().join(format!("{}.prefetch", partition_name)),
-            output_path: args.out.join(format!("{}.img", partition_name)),
+            output_path,
         };
         let download_progress = ui.create_download_progress("");
         let extraction_progress = ui.create_extraction_progress(partition_name);
@@ -70,35 +102,44 @@ async fn extract_prefetch_sequential(
         let download_reporter = CliDownloadReporter::new(download_progress);
         let extraction_reporter = CliExtractionReporter::new(extraction_progress);
 
-        if let Err(e) = prefetch_and_dump_partition(
+        match prefetch_and_dump_partition_with_options(
             partition,
             config,
             &http_reader,
             paths,
             &download_reporter,
             &extraction_reporter,
-            Some(args.source_dir.clone()),
+            &options,
         )
         .await
         {
-            ui.error(format!(
-                "Failed to prefetch/extract partition {}: {}",
-                partition_name, e
-            ));
-            failed_partitions.push(partition_name.clone());
+            Ok(()) => {
+                if let Some(completed) = completed {
+                    let _ = completed.send(partition_name.clone());
+                }
+            }
+            Err(e) => {
+                ui.error(format!(
+                    "Failed to prefetch/extract partition {}: {}",
+                    partition_name, e
+                ));
+                failed_partitions.push(partition_name.clone());
+            }
         }
     }
 
     Ok(failed_partitions)
 }
 
-/// parallel prefetch extraction with thread limiting
+/// parallel prefetch extraction limited by the scheduler, largest first
 async fn extract_prefetch_parallel(
     args: &Args,
     partitions: &[PartitionUpdate],
     config: &PartitionExtractionConfig,
     url: String,
-    thread_count: usize,
+    scheduler: &Arc<Scheduler>,
+    super_target: Option<&SuperTarget>,
+    completed: Option<&UnboundedSender<String>>,
     ui: &UiOutput,
 ) -> Result<Vec<String>> {
     let temp_dir = TempDir::new()?;
@@ -114,47 +155,52 @@ async fn extract_prefetch_parallel(
         .await?,
     );
 
-    let semaphore = Arc::new(Semaphore::new(thread_count));
     let mut tasks = Vec::new();
-    let out_dir = args.out.clone();
-    let source_dir = args.source_dir.clone();
     let config = config.clone();
 
-    for partition in partitions {
+    for partition in largest_first(partitions) {
+        let permit = scheduler.acquire(partition, config.block_size, true).await;
+
         let partition = partition.clone();
         let partition_name = partition.partition_name.clone();
         let http_reader = Arc::clone(&http_reader);
-        let semaphore = Arc::clone(&semaphore);
         let temp_dir_path = temp_dir_path.clone();
-        let out_dir = out_dir.clone();
-        let source_dir = source_dir.clone();
+        let (output_path, options) =
+            partition_output(args, scheduler, super_target, None, &partition_name);
         let config = config.clone();
         let download_progress = ui.create_download_progress("");
         let extraction_progress = ui.create_extraction_progress(&partition_name);
+        let completed = completed.cloned();
 
         let task = tokio::spawn(async move {
-            let _permit = semaphore.acquire().await.unwrap();
+            let _permit = permit;
 
             let paths = ExtractionPaths {
                 temp_path: temp_dir_path.join(format!("{}.prefetch", partition_name)),
-                output_path: out_dir.join(format!("{}.img", partition_name)),
+                output_path,
             };
 
             let download_reporter = CliDownloadReporter::new(download_progress);
             let extraction_reporter = CliExtractionReporter::new(extraction_progress);
 
-            match prefetch_and_dump_partition(
+            match prefetch_and_dump_partition_with_options(
                 &partition,
                 &config,
                 &http_reader,
                 paths,
                 &download_reporter,
                 &extraction_reporter,
-                Some(source_dir),
+                &options,
             )
             .await
             {
-                Ok(()) => Ok(()),
+                Ok(()) => {
+                    // streamed while the other partitions are still running
+                    if let Some(completed) = completed {
+                        let _ = completed.send(partition_name);
+                    }
+                    Ok(())
+                }
                 Err(e) => Err((partition_name, e)),
             }
         });
@@ -0,0 +1,226 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+use crate::cli::args::args_def::Args;
+#[cfg(feature = "diff_ota")]
+use payload_dumper::payload::diff_pipeline::{
+    DEFAULT_PREFETCH_BUDGET, DEFAULT_PUFF_MEMORY_BUDGET, PuffdiffBudget,
+};
+use payload_dumper::payload::payload_dumper::take_idle_workers;
+use payload_dumper::structs::{PartitionUpdate, install_operation};
+use payload_dumper::utils::is_diff_operation;
+use std::sync::Arc;
+use tokio::sync::{OwnedSemaphorePermit, Semaphore};
+
+// stream and copy buffers every partition task holds on top of its largest
+// operation
+const TASK_BASE_MEMORY: u64 = 4 * 1024 * 1024;
+const MEMORY_UNIT: u64 = 1024 * 1024;
+
+/// process-wide budgets every partition task draws from
+///
+/// a single extraction and a whole batch of payloads go through the same
+/// scheduler, so concurrent payloads share the cores, memory, disks and
+/// connections instead of each sizing itself to the whole machine. permits
+/// are always taken in the same order (network, memory, disk, cpu) so tasks
+/// waiting on several budgets cannot deadlock, and tokio semaphores are
+/// fair, so tasks queued first (largest first) run first
+pub struct Scheduler {
+    cpu: Arc<Semaphore>,
+    /// in MiB, none when memory is not limited
+    memory: Option<(Arc<Semaphore>, u32)>,
+    disk: Arc<Semaphore>,
+    network: Arc<Semaphore>,
+    /// PUFFDIFF operations of every partition, kept out of `memory`
+    #[cfg(feature = "diff_ota")]
+    puff: PuffdiffBudget,
+}
+
+/// cores held by a parallel step outside partition extraction
+pub struct WorkerPermit {
+    permit: OwnedSemaphorePermit,
+}
+
+impl WorkerPermit {
+    /// threads the step may run on
+    pub fn workers(&self) -> usize {
+        self.permit.num_permits()
+    }
+}
+
+/// permits held while one partition is being extracted
+pub struct TaskPermit {
+    _network: Option<OwnedSemaphorePermit>,
+    _memory: Option<OwnedSemaphorePermit>,
+    _disk: OwnedSemaphorePermit,
+    _cpu: OwnedSemaphorePermit,
+}
+
+impl Scheduler {
+    /// # Arguments
+    /// * `threads` -> partitions processed at the same time
+    /// * `memory_mb` -> memory budget of all running partitions, if any. a
+    ///   quarter of it at most goes to the PUFFDIFF operations
+    /// * `disk_jobs` -> partitions written at the same time
+    /// * `network_jobs` -> remote partitions streamed at the same time
+    pub fn new(
+        threads: usize,
+        memory_mb: Option<u64>,
+        disk_jobs: usize,
+        network_jobs: usize,
+    ) -> Arc<Self> {
+        #[cfg(feature = "diff_ota")]
+        let puff_mb = match memory_mb {
+            Some(mb) => (DEFAULT_PUFF_MEMORY_BUDGET / MEMORY_UNIT).min(mb / 4),
+            None => DEFAULT_PUFF_MEMORY_BUDGET / MEMORY_UNIT,
+        };
+        #[cfg(not(feature = "diff_ota"))]
+        let puff_mb = 0;
+
+        let memory = memory_mb.map(|mb| {
+            let units = (mb - puff_mb)
+                .clamp(1, Semaphore::MAX_PERMITS as u64)
+                .min(u32::MAX as u64) as u32;
+            (Arc::new(Semaphore::new(units as usize)), units)
+        });
+
+        Arc::new(Self {
+            cpu: Arc::new(Semaphore::new(threads.max(1))),
+            memory,
+            disk: Arc::new(Semaphore::new(disk_jobs.max(1))),
+            network: Arc::new(Semaphore::new(network_jobs.max(1))),
+            #[cfg(feature = "diff_ota")]
+            puff: PuffdiffBudget::new(puff_mb.max(1) * MEMORY_UNIT),
+        })
+    }
+
+    /// scheduler sized from the command line
+    pub fn from_args(args: &Args) -> Arc<Self> {
+        let threads = if args.no_parallel {
+            1
+        } else {
+            args.threads.unwrap_or_else(num_cpus::get)
+        };
+
+        Self::new(
+            threads,
+            args.memory_budget,
+            args.disk_jobs.unwrap_or(threads),
+            args.network_jobs.unwrap_or(threads),
+        )
+    }
+
+    /// waits until `partition` fits every budget
+    ///
+    /// partitions estimated above the whole memory budget take all of it,
+    /// so they still run, just alone
+    pub async fn acquire(
+        &self,
+        partition: &PartitionUpdate,
+        block_size: u64,
+        remote: bool,
+    ) -> TaskPermit {
+        let network = if remote {
+            Some(self.network.clone().acquire_owned().await.unwrap())
+        } else {
+            None
+        };
+
+        let memory = match &self.memory {
+            Some((semaphore, total)) => {
+                let units = estimate_memory(partition, block_size)
+                    .div_ceil(MEMORY_UNIT)
+                    .clamp(1, *total as u64) as u32;
+                Some(semaphore.clone().acquire_many_owned(units).await.unwrap())
+            }
+            None => None,
+        };
+
+        let disk = self.disk.clone().acquire_owned().await.unwrap();
+        let cpu = self.cpu.clone().acquire_owned().await.unwrap();
+
+        TaskPermit {
+            _network: network,
+            _memory: memory,
+            _disk: disk,
+            _cpu: cpu,
+        }
+    }
+
+    /// the cpu budget, extraction adds its idle cores to parallel steps
+    pub fn cpu_budget(&self) -> Arc<Semaphore> {
+        Arc::clone(&self.cpu)
+    }
+
+    /// the memory PUFFDIFF operations of all partitions share
+    #[cfg(feature = "diff_ota")]
+    pub fn puff_budget(&self) -> PuffdiffBudget {
+        self.puff.clone()
+    }
+
+    /// waits for a core for a parallel step outside partition extraction
+    /// (verity checks, COW and zstd encoding) and takes whichever others
+    /// are idle then, up to `max` in all
+    pub async fn acquire_workers(&self, max: usize) -> WorkerPermit {
+        let mut permit = self.cpu.clone().acquire_owned().await.unwrap();
+        if let Some(extra) = take_idle_workers(&self.cpu, max.saturating_sub(1)) {
+            permit.merge(extra);
+        }
+        WorkerPermit { permit }
+    }
+}
+
+/// rough peak memory of extracting `partition`: its largest operation's
+/// output and blob (source data too for differential ones) plus buffers,
+/// and the patch prefetcher of differential partitions. PUFFDIFF operations
+/// draw from their own budget, shared by every partition
+pub fn estimate_memory(partition: &PartitionUpdate, block_size: u64) -> u64 {
+    let largest = partition
+        .operations
+        .iter()
+        .filter(|op| {
+            !matches!(
+                op.r#type(),
+                install_operation::Type::Zero | install_operation::Type::Discard
+            )
+        })
+        .map(|op| {
+            let blocks = |extents: &[payload_dumper::structs::Extent]| -> u64 {
+                extents.iter().map(|e| e.num_blocks.unwrap_or(0)).sum()
+            };
+            let mut bytes = blocks(&op.dst_extents) * block_size + op.data_length.unwrap_or(0);
+            if is_diff_operation(op.r#type()) {
+                bytes += blocks(&op.src_extents) * block_size;
+            }
+            bytes
+        })
+        .max()
+        .unwrap_or(0);
+
+    #[cfg(feature = "diff_ota")]
+    let pipelines = {
+        if partition
+            .operations
+            .iter()
+            .any(|op| is_diff_operation(op.r#type()))
+        {
+            DEFAULT_PREFETCH_BUDGET
+        } else {
+            0
+        }
+    };
+    #[cfg(not(feature = "diff_ota"))]
+    let pipelines = 0;
+
+    largest + pipelines + TASK_BASE_MEMORY
+}
+
+/// size the partition will have once extracted
+pub fn partition_size(partition: &PartitionUpdate) -> u64 {
+    partition
+        .new_partition_info
+        .as_ref()
+        .and_then(|info| info.size)
+        .unwrap_or(0)
+}
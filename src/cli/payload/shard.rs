@@ -0,0 +1,500 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+// extraction shared by cooperating processes
+//
+// every process of a `--shard i/n` run computes the same plan from the
+// manifest: partitions, and with --shard-operations runs of operations of
+// the largest ones, are weighed by the bytes they write and handed out
+// largest first to the least loaded shard. a partition split across shards
+// is written by all of them into one shared image at its final size, each
+// applying its own operations. processes leave a marker in
+// <out>/.shards/<run>/ when done, the one completing the set clears what no
+// operation wrote, generates the hash tree and FEC of the split images and
+// verifies them. <run> includes the --shard-run ID, markers of an earlier
+// run never count towards a new one.
+
+use crate::cli::args::args_def::Args;
+use crate::cli::payload::scheduler::{Scheduler, partition_size};
+use crate::cli::ui::ui_print::UiOutput;
+use anyhow::{Context, Result, anyhow};
+use payload_dumper::payload::payload_dumper::finish_split_image;
+use payload_dumper::structs::{InstallOperation, PartitionUpdate, install_operation};
+use serde::{Deserialize, Serialize};
+use sha2::{Digest, Sha256};
+use std::fmt;
+use std::ops::Range;
+use std::path::{Path, PathBuf};
+use std::str::FromStr;
+use std::time::Duration;
+
+const SHARD_DIR: &str = ".shards";
+const FINALIZE_LOCK: &str = "finalize";
+// shards finishing together may not see each other's marker on a network
+// filesystem right away, the marker directory is listed again after this
+const MARKER_SETTLE: Duration = Duration::from_secs(2);
+// split partitions are cut into chunks of about 1/4 of a fair share, finer
+// chunks balance better but have more processes writing each image
+const CHUNKS_PER_SHARD: u64 = 4;
+
+/// one process of a sharded run, `index` counts from 1
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct ShardSpec {
+    pub index: usize,
+    pub count: usize,
+}
+
+impl FromStr for ShardSpec {
+    type Err = String;
+
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        let (index, count) = s
+            .split_once('/')
+            .ok_or_else(|| "expected INDEX/COUNT, e.g. 1/4".to_string())?;
+        let index: usize = index
+            .trim()
+            .parse()
+            .map_err(|_| format!("invalid shard index '{}'", index))?;
+        let count: usize = count
+            .trim()
+            .parse()
+            .map_err(|_| format!("invalid shard count '{}'", count))?;
+
+        if count == 0 || index == 0 || index > count {
+            return Err(format!(
+                "shard index must be between 1 and the shard count, got {}/{}",
+                index, count
+            ));
+        }
+        Ok(Self { index, count })
+    }
+}
+
+impl fmt::Display for ShardSpec {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "{}/{}", self.index, self.count)
+    }
+}
+
+/// a partition, or a run of its operations, extracted by one shard
+struct Unit {
+    partition: usize,
+    operations: Range<usize>,
+    chunk: usize,
+    weight: u64,
+}
+
+/// what this process extracts of a sharded run
+pub struct ShardPlan {
+    pub spec: ShardSpec,
+    /// the same for every process given the same run ID, payload and
+    /// partitions
+    run_id: String,
+    /// partitions extracted by this shard alone
+    pub whole: Vec<PartitionUpdate>,
+    /// partitions split across shards, as in the manifest
+    pub split: Vec<PartitionUpdate>,
+    /// this shard's operations of the split partitions, without hash tree
+    /// and FEC, those are generated once all shards are done
+    pub shares: Vec<PartitionUpdate>,
+}
+
+impl ShardPlan {
+    /// `run` is the --shard-run ID shared by the processes of this run
+    pub fn new(
+        partitions: &[PartitionUpdate],
+        block_size: u64,
+        spec: ShardSpec,
+        run: &str,
+        split_operations: bool,
+    ) -> Self {
+        let weights: Vec<Vec<u64>> = partitions
+            .iter()
+            .map(|p| {
+                p.operations
+                    .iter()
+                    .map(|op| operation_weight(op, block_size))
+                    .collect()
+            })
+            .collect();
+        let total: u64 = weights.iter().flatten().sum();
+        let target = (total / (spec.count as u64 * CHUNKS_PER_SHARD)).max(1);
+
+        let mut units = Vec::new();
+        for (partition, ops) in weights.iter().enumerate() {
+            let weight: u64 = ops.iter().sum();
+            if !split_operations || spec.count == 1 || weight <= target {
+                units.push(Unit {
+                    partition,
+                    operations: 0..ops.len(),
+                    chunk: 0,
+                    weight,
+                });
+                continue;
+            }
+
+            // cut at operation boundaries, in manifest order
+            let (mut start, mut acc, mut chunk) = (0, 0, 0);
+            for (i, w) in ops.iter().enumerate() {
+                acc += w;
+                if acc >= target || i + 1 == ops.len() {
+                    units.push(Unit {
+                        partition,
+                        operations: start..i + 1,
+                        chunk,
+                        weight: acc,
+                    });
+                    (start, acc, chunk) = (i + 1, 0, chunk + 1);
+                }
+            }
+        }
+
+        // largest first onto the least loaded shard, ties broken by name and
+        // position so every process ends up with the same plan
+        units.sort_by(|a, b| {
+            b.weight
+                .cmp(&a.weight)
+                .then_with(|| {
+                    partitions[a.partition]
+                        .partition_name
+                        .cmp(&partitions[b.partition].partition_name)
+                })
+                .then(a.chunk.cmp(&b.chunk))
+        });
+        let mut load = vec![0u64; spec.count];
+        let mut owners: Vec<Vec<(usize, Range<usize>)>> = vec![Vec::new(); partitions.len()];
+        for unit in &units {
+            let shard = (0..spec.count).min_by_key(|&s| (load[s], s)).unwrap();
+            load[shard] += unit.weight;
+            owners[unit.partition].push((shard, unit.operations.clone()));
+        }
+
+        let own = spec.index - 1;
+        let mut plan = Self {
+            spec,
+            run_id: run_id(partitions, spec, run, split_operations),
+            whole: Vec::new(),
+            split: Vec::new(),
+            shares: Vec::new(),
+        };
+
+        for (partition, mut owned) in partitions.iter().zip(owners) {
+            if owned.iter().all(|(shard, _)| *shard == owned[0].0) {
+                if owned.first().is_some_and(|(shard, _)| *shard == own) {
+                    plan.whole.push(partition.clone());
+                }
+                continue;
+            }
+
+            plan.split.push(partition.clone());
+            owned.retain(|(shard, _)| *shard == own);
+            if owned.is_empty() {
+                continue;
+            }
+            owned.sort_by_key(|(_, ops)| ops.start);
+
+            let mut share = partition.clone();
+            share.operations = owned
+                .iter()
+                .flat_map(|(_, ops)| partition.operations[ops.clone()].iter().cloned())
+                .collect();
+            share.hash_tree_extent = None;
+            share.fec_extent = None;
+            plan.shares.push(share);
+        }
+
+        plan
+    }
+
+    /// partitions to hand to the extractor
+    pub fn partitions(&self) -> Vec<PartitionUpdate> {
+        self.whole.iter().chain(&self.shares).cloned().collect()
+    }
+
+    fn marker_dir(&self, args: &Args) -> PathBuf {
+        args.out.join(SHARD_DIR).join(&self.run_id)
+    }
+
+    /// creates the images of this shard, extraction then writes into them
+    /// in place
+    ///
+    /// whole partitions get a fresh empty image. the images of split ones
+    /// may already be written to by other shards, they are only created or
+    /// brought to size, old data in them is cleared when they are finished
+    pub fn prepare_outputs(&self, args: &Args) -> Result<()> {
+        for partition in &self.whole {
+            let path = args.out.join(format!("{}.img", partition.partition_name));
+            let file = std::fs::OpenOptions::new()
+                .write(true)
+                .create(true)
+                .truncate(true)
+                .open(&path)
+                .with_context(|| format!("Failed to create {}", path.display()))?;
+            file.set_len(partition_size(partition))?;
+        }
+
+        for partition in &self.shares {
+            let path = args.out.join(format!("{}.img", partition.partition_name));
+            let file = std::fs::OpenOptions::new()
+                .write(true)
+                .create(true)
+                .truncate(false)
+                .open(&path)
+                .with_context(|| format!("Failed to create {}", path.display()))?;
+            let size = partition_size(partition);
+            if file.metadata()?.len() != size {
+                file.set_len(size)?;
+            }
+        }
+
+        // the marker of an earlier attempt of this shard does not count
+        if !self.split.is_empty() {
+            let dir = self.marker_dir(args);
+            let _ = std::fs::remove_file(dir.join(marker_name(self.spec.index)));
+            let _ = std::fs::remove_file(dir.join(FINALIZE_LOCK));
+        }
+        Ok(())
+    }
+}
+
+/// written by a shard once its extraction is over
+#[derive(Serialize, Deserialize)]
+struct ShardMarker {
+    shard: usize,
+    /// split partitions whose share failed in this shard
+    failed: Vec<String>,
+}
+
+/// what is left for this process once its share is extracted
+#[derive(Default)]
+pub struct ShardCompletion {
+    /// split partitions finished here, to be verified along with its own
+    pub finished: Vec<PartitionUpdate>,
+    /// split partitions that failed in other shards or could not be finished
+    pub failed: Vec<String>,
+}
+
+/// leaves the completion marker of this shard, and finishes the split
+/// partitions when it is the last one
+///
+/// `failed` holds the partitions this shard failed to extract
+pub async fn finish_shard(
+    plan: &ShardPlan,
+    failed: &[String],
+    block_size: u64,
+    args: &Args,
+    scheduler: &Scheduler,
+    ui: &UiOutput,
+) -> Result<ShardCompletion> {
+    if plan.split.is_empty() {
+        return Ok(ShardCompletion::default());
+    }
+
+    let dir = plan.marker_dir(args);
+    tokio::fs::create_dir_all(&dir)
+        .await
+        .with_context(|| format!("Failed to create {}", dir.display()))?;
+
+    // renamed into place so no process reads a partial marker
+    let marker = ShardMarker {
+        shard: plan.spec.index,
+        failed: plan
+            .split
+            .iter()
+            .map(|p| &p.partition_name)
+            .filter(|name| failed.contains(name))
+            .cloned()
+            .collect(),
+    };
+    let path = dir.join(marker_name(plan.spec.index));
+    let tmp_path = path.with_extension("tmp");
+    tokio::fs::write(&tmp_path, serde_json::to_vec(&marker)?).await?;
+    tokio::fs::rename(&tmp_path, &path).await?;
+
+    let mut markers = read_markers(&dir, plan.spec.count).await?;
+    if markers.len() < plan.spec.count {
+        tokio::time::sleep(MARKER_SETTLE).await;
+        markers = read_markers(&dir, plan.spec.count).await?;
+    }
+    if markers.len() < plan.spec.count {
+        report_unfinished(plan, &markers, ui);
+        return Ok(ShardCompletion::default());
+    }
+
+    // several shards may see the set complete at once, one of them wins
+    let lock = dir.join(FINALIZE_LOCK);
+    match std::fs::OpenOptions::new()
+        .write(true)
+        .create_new(true)
+        .open(&lock)
+    {
+        Ok(_) => {}
+        Err(e) if e.kind() == std::io::ErrorKind::AlreadyExists => {
+            ui.println(format!(
+                "- Shard {} done, another shard finishes the {} split partitions",
+                plan.spec,
+                plan.split.len()
+            ));
+            return Ok(ShardCompletion::default());
+        }
+        Err(e) => return Err(e.into()),
+    }
+
+    // the lock is taken on the server, the listing is current from here on
+    let markers = read_markers(&dir, plan.spec.count).await?;
+    if markers.len() < plan.spec.count {
+        let _ = std::fs::remove_file(&lock);
+        report_unfinished(plan, &markers, ui);
+        return Ok(ShardCompletion::default());
+    }
+
+    ui.println(format!(
+        "- All {} shards done, finishing {} split partitions...",
+        plan.spec.count,
+        plan.split.len()
+    ));
+
+    let mut completion = ShardCompletion::default();
+    for partition in &plan.split {
+        let name = partition.partition_name.clone();
+        if markers.iter().any(|m| m.failed.contains(&name)) {
+            // reported by the shard it failed in as well
+            if !failed.contains(&name) {
+                ui.error(format!("{} failed in another shard", name));
+                completion.failed.push(name);
+            }
+            continue;
+        }
+
+        let pb = ui.create_spinner(format!("Finishing {}", name));
+        let image_path = args.out.join(format!("{}.img", name));
+        let image = partition.clone();
+        let permit = scheduler.acquire_workers(num_cpus::get()).await;
+        let workers = permit.workers();
+        let result = tokio::task::spawn_blocking(move || {
+            let file = std::fs::OpenOptions::new()
+                .read(true)
+                .write(true)
+                .open(&image_path)?;
+            finish_split_image(&file, &image, block_size, workers)
+        })
+        .await
+        .map_err(|e| anyhow!("Finishing task failed: {}", e))
+        .and_then(|r| r);
+        drop(permit);
+
+        let message = match result {
+            Ok(warnings) => {
+                for warning in warnings {
+                    ui.error(format!("{}: {}", name, warning));
+                }
+                completion.finished.push(partition.clone());
+                format!("✓ {} finished", name)
+            }
+            Err(e) => {
+                ui.error(format!("Failed to finish {}: {}", name, e));
+                completion.failed.push(name.clone());
+                format!("✗ {} failed", name)
+            }
+        };
+        if let Some(p) = &pb {
+            p.finish_with_message(message);
+        }
+    }
+
+    // the run is over, a new one starts from scratch
+    let _ = tokio::fs::remove_dir_all(&dir).await;
+    let _ = tokio::fs::remove_dir(args.out.join(SHARD_DIR)).await;
+
+    Ok(completion)
+}
+
+/// bytes an operation writes, ZERO and DISCARD cost next to nothing
+fn operation_weight(op: &InstallOperation, block_size: u64) -> u64 {
+    match op.r#type() {
+        install_operation::Type::Zero | install_operation::Type::Discard => 0,
+        _ => op
+            .dst_extents
+            .iter()
+            .map(|e| e.num_blocks.unwrap_or(0) * block_size)
+            .sum(),
+    }
+}
+
+/// names the run after its partitions and how it is split, so shards of
+/// different runs sharing an output directory do not mix
+fn run_id(
+    partitions: &[PartitionUpdate],
+    spec: ShardSpec,
+    run: &str,
+    split_operations: bool,
+) -> String {
+    let mut hasher = Sha256::new();
+    hasher.update(run.as_bytes());
+    hasher.update([0]);
+    for partition in partitions {
+        hasher.update(partition.partition_name.as_bytes());
+        hasher.update([0]);
+        if let Some(hash) = partition
+            .new_partition_info
+            .as_ref()
+            .and_then(|info| info.hash.as_deref())
+        {
+            hasher.update(hash);
+        }
+        hasher.update(partition_size(partition).to_le_bytes());
+    }
+    hasher.update((spec.count as u64).to_le_bytes());
+    hasher.update([u8::from(split_operations)]);
+    hex::encode(&hasher.finalize()[..8])
+}
+
+fn marker_name(index: usize) -> String {
+    format!("{}.json", index)
+}
+
+/// markers of the shards done so far
+///
+/// the directory is listed rather than every marker looked up, NFS clients
+/// answer lookups of a name from a cached "not found" for a while
+async fn read_markers(dir: &Path, count: usize) -> Result<Vec<ShardMarker>> {
+    let mut entries = tokio::fs::read_dir(dir)
+        .await
+        .with_context(|| format!("Failed to list {}", dir.display()))?;
+
+    let mut markers = Vec::new();
+    while let Some(entry) = entries.next_entry().await? {
+        let name = entry.file_name();
+        let Some(index) = name
+            .to_str()
+            .and_then(|name| name.strip_suffix(".json"))
+            .and_then(|index| index.parse::<usize>().ok())
+            .filter(|index| (1..=count).contains(index))
+        else {
+            continue;
+        };
+        let data = tokio::fs::read(entry.path()).await?;
+        markers.push(
+            serde_json::from_slice::<ShardMarker>(&data)
+                .map_err(|e| anyhow!("Invalid marker of shard {}: {}", index, e))?,
+        );
+    }
+    Ok(markers)
+}
+
+/// tells which shards the split partitions still wait for
+fn report_unfinished(plan: &ShardPlan, markers: &[ShardMarker], ui: &UiOutput) {
+    let missing: Vec<String> = (1..=plan.spec.count)
+        .filter(|index| !markers.iter().any(|m| m.shard == *index))
+        .map(|index| index.to_string())
+        .collect();
+    ui.println(format!(
+        "- Shard {} done, {} split partitions not finalized yet: waiting for shard(s) {}. \
+         The last of them finishes them; if none reports doing so, run one shard again \
+         with the same --shard-run",
+        plan.spec,
+        plan.split.len(),
+        missing.join(", ")
+    ));
+}
@@ -0,0 +1,172 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+use crate::cli::args::args_def::Args;
+use crate::cli::ui::ui_print::UiOutput;
+use anyhow::{Context, Result, anyhow};
+use payload_dumper::structs::{DeltaArchiveManifest, PartitionUpdate};
+use payload_dumper::super_image::{SuperConfig, SuperLayout, write_sparse_image};
+use payload_dumper::utils::{format_size, read_exact_at};
+use sha2::{Digest, Sha256};
+use std::path::PathBuf;
+
+const SUPER_IMAGE_NAME: &str = "super.img";
+const SUPER_SPARSE_NAME: &str = "super.sparse.img";
+const HASH_BUFFER_SIZE: usize = 1024 * 1024;
+
+/// super image the dynamic partitions are written into
+pub struct SuperTarget {
+    pub path: PathBuf,
+    pub layout: SuperLayout,
+}
+
+impl SuperTarget {
+    pub fn contains(&self, partition_name: &str) -> bool {
+        self.layout.partition(partition_name).is_some()
+    }
+}
+
+/// plans and creates super.img when --super is given
+///
+/// returns the partitions to extract, with dynamic ones relocated into the
+/// super image, and the super image itself
+pub async fn prepare_super_image(
+    manifest: &DeltaArchiveManifest,
+    partitions: Vec<PartitionUpdate>,
+    block_size: u64,
+    args: &Args,
+    ui: &UiOutput,
+) -> Result<(Vec<PartitionUpdate>, Option<SuperTarget>)> {
+    if !args.super_image {
+        return Ok((partitions, None));
+    }
+
+    let config = SuperConfig {
+        device_size: args.super_size,
+        ..Default::default()
+    };
+    let layout = SuperLayout::plan(manifest, &config)?;
+    let path = args.out.join(SUPER_IMAGE_NAME);
+
+    let file = std::fs::OpenOptions::new()
+        .read(true)
+        .write(true)
+        .create(true)
+        .truncate(true)
+        .open(&path)
+        .with_context(|| format!("Failed to create {}", path.display()))?;
+    layout.write_metadata(&file)?;
+
+    ui.println(format!(
+        "- Writing {} dynamic partitions into {} ({})",
+        layout.partitions.len(),
+        SUPER_IMAGE_NAME,
+        format_size(layout.device_size)
+    ));
+
+    let target = SuperTarget { path, layout };
+    let partitions = partitions
+        .iter()
+        .map(|p| {
+            if target.contains(&p.partition_name) {
+                target.layout.relocate(p, block_size)
+            } else {
+                Ok(p.clone())
+            }
+        })
+        .collect::<Result<Vec<_>>>()?;
+
+    Ok((partitions, Some(target)))
+}
+
+/// checks the partitions written into the super image and writes the
+/// sparse image when asked to
+/// returns the partitions whose data does not match their expected hash
+pub async fn finish_super_image(
+    target: &SuperTarget,
+    partitions: &[PartitionUpdate],
+    failed_extractions: &[String],
+    block_size: u64,
+    args: &Args,
+    ui: &UiOutput,
+) -> Result<Vec<String>> {
+    let mut failed = Vec::new();
+
+    if !args.no_verify {
+        ui.println("- Verifying partitions inside super.img...");
+
+        for partition in partitions.iter().filter(|p| {
+            target.contains(&p.partition_name) && !failed_extractions.contains(&p.partition_name)
+        }) {
+            let name = partition.partition_name.clone();
+            let Some(expected) = partition
+                .new_partition_info
+                .as_ref()
+                .and_then(|info| info.hash.clone())
+                .filter(|hash| !hash.is_empty())
+            else {
+                continue;
+            };
+            let placed = target.layout.partition(&name).cloned().unwrap();
+            let path = target.path.clone();
+
+            let pb = ui.create_spinner(format!("Verifying {} in super.img", name));
+            let result = tokio::task::spawn_blocking(move || {
+                let file = std::fs::File::open(&path)?;
+                let mut hasher = Sha256::new();
+                let mut buf = vec![0u8; HASH_BUFFER_SIZE];
+                let mut done = 0u64;
+
+                while done < placed.size {
+                    let len = (placed.size - done).min(buf.len() as u64) as usize;
+                    read_exact_at(&file, &mut buf[..len], placed.offset + done)?;
+                    hasher.update(&buf[..len]);
+                    done += len as u64;
+                }
+                anyhow::Ok(hasher.finalize().to_vec() == expected)
+            })
+            .await
+            .map_err(|e| anyhow!("Verification task failed: {}", e))
+            .and_then(|r| r);
+
+            let message = match result {
+                Ok(true) => format!("✓ {} verified", name),
+                Ok(false) => {
+                    failed.push(name.clone());
+                    format!("✗ {} mismatch", name)
+                }
+                Err(e) => {
+                    ui.error(format!("Error verifying {}: {}", name, e));
+                    failed.push(name.clone());
+                    format!("✗ {} error", name)
+                }
+            };
+            if let Some(p) = &pb {
+                p.finish_with_message(message);
+            }
+        }
+    }
+
+    if args.super_sparse {
+        let src_path = target.path.clone();
+        let dst_path = args.out.join(SUPER_SPARSE_NAME);
+        let size = target.layout.device_size;
+        let pb = ui.create_spinner(format!("Writing {}", SUPER_SPARSE_NAME));
+
+        tokio::task::spawn_blocking(move || {
+            let src = std::fs::File::open(&src_path)?;
+            let mut dst = std::fs::File::create(&dst_path)
+                .with_context(|| format!("Failed to create {}", dst_path.display()))?;
+            write_sparse_image(&src, size, &mut dst, block_size as u32)
+        })
+        .await
+        .map_err(|e| anyhow!("Sparse image task failed: {}", e))??;
+
+        if let Some(p) = &pb {
+            p.finish_with_message(format!("✓ {} written", SUPER_SPARSE_NAME));
+        }
+    }
+
+    Ok(failed)
+}
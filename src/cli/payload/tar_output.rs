@@ -0,0 +1,162 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+use anyhow::{Context, Result, anyhow};
+use payload_dumper::sparse_tar::{TarWriter, scan_data_regions};
+use payload_dumper::structs::PartitionUpdate;
+use std::collections::HashMap;
+use std::io::{BufWriter, Stdout};
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use tokio::sync::mpsc;
+use tokio::task::JoinHandle;
+
+const STDOUT_BUFFER_SIZE: usize = 4 * 1024 * 1024;
+
+/// directory the images of a `-o -` run are extracted to before being
+/// streamed, removed with everything in it when dropped
+///
+/// set TMPDIR to a tmpfs to keep them off the disk
+pub struct SpillDir {
+    path: PathBuf,
+}
+
+impl SpillDir {
+    pub fn create() -> Result<Self> {
+        // batch jobs of one process each get their own
+        static NEXT: AtomicU64 = AtomicU64::new(0);
+        let path = std::env::temp_dir().join(format!(
+            "payload_dumper-{}-{}",
+            std::process::id(),
+            NEXT.fetch_add(1, Ordering::Relaxed)
+        ));
+        std::fs::create_dir_all(&path)
+            .with_context(|| format!("Failed to create {}", path.display()))?;
+        Ok(Self { path })
+    }
+
+    pub fn path(&self) -> &Path {
+        &self.path
+    }
+}
+
+impl Drop for SpillDir {
+    fn drop(&mut self) {
+        let _ = std::fs::remove_dir_all(&self.path);
+    }
+}
+
+/// tar archive of the extracted images on stdout
+///
+/// partitions are sent to it as they finish extracting and written in that
+/// order, each one is checked against its hash first and removed from the
+/// spill directory once streamed
+pub struct TarStream {
+    completed: mpsc::UnboundedSender<String>,
+    task: JoinHandle<Result<Vec<(String, String)>>>,
+}
+
+impl TarStream {
+    pub fn start(
+        spill_dir: &Path,
+        partitions: &[PartitionUpdate],
+        block_size: u64,
+        verify: bool,
+    ) -> Self {
+        let (completed, mut received) = mpsc::unbounded_channel::<String>();
+        let spill_dir = spill_dir.to_path_buf();
+        let partitions: HashMap<String, PartitionUpdate> = partitions
+            .iter()
+            .map(|p| (p.partition_name.clone(), p.clone()))
+            .collect();
+
+        let task = tokio::spawn(async move {
+            let mut writer = TarWriter::new(BufWriter::with_capacity(
+                STDOUT_BUFFER_SIZE,
+                std::io::stdout(),
+            ));
+            let mut failed = Vec::new();
+
+            while let Some(name) = received.recv().await {
+                let Some(partition) = partitions.get(&name).cloned() else {
+                    continue;
+                };
+                let image_path = spill_dir.join(format!("{}.img", name));
+
+                let (returned, result) = tokio::task::spawn_blocking(move || {
+                    let result =
+                        stream_image(&mut writer, &partition, &image_path, block_size, verify);
+                    let _ = std::fs::remove_file(&image_path);
+                    (writer, result)
+                })
+                .await
+                .map_err(|e| anyhow!("Tar task failed: {}", e))?;
+                writer = returned;
+
+                if let Err(e) = result {
+                    // an entry that was started and not finished leaves the
+                    // archive unusable
+                    if e.downcast_ref::<std::io::Error>().is_some() {
+                        return Err(e.context("Failed to write to stdout"));
+                    }
+                    failed.push((name, format!("{:#}", e)));
+                }
+            }
+
+            tokio::task::spawn_blocking(move || writer.finish())
+                .await
+                .map_err(|e| anyhow!("Tar task failed: {}", e))??;
+            Ok(failed)
+        });
+
+        Self { completed, task }
+    }
+
+    /// hands over a partition whose image is complete
+    pub fn sender(&self) -> &mpsc::UnboundedSender<String> {
+        &self.completed
+    }
+
+    /// ends the archive once every image has been written
+    /// returns the partitions left out and why
+    pub async fn finish(self) -> Result<Vec<(String, String)>> {
+        drop(self.completed);
+        self.task
+            .await
+            .map_err(|e| anyhow!("Tar task failed: {}", e))?
+    }
+}
+
+fn stream_image(
+    writer: &mut TarWriter<BufWriter<Stdout>>,
+    partition: &PartitionUpdate,
+    image_path: &Path,
+    block_size: u64,
+    verify: bool,
+) -> Result<()> {
+    let name = &partition.partition_name;
+    let file = std::fs::File::open(image_path)
+        .map_err(|e| anyhow!("Failed to open {}: {}", image_path.display(), e))?;
+    let size = file
+        .metadata()
+        .map_err(|e| anyhow!("Failed to stat {}: {}", image_path.display(), e))?
+        .len();
+
+    // the archive cannot take an entry back, so the hash is checked
+    // before anything is written
+    let (regions, hash) = scan_data_regions(&file, size, block_size)
+        .map_err(|e| anyhow!("Failed to read {}: {}", image_path.display(), e))?;
+    if verify
+        && let Some(expected) = partition
+            .new_partition_info
+            .as_ref()
+            .and_then(|info| info.hash.as_deref())
+        && !expected.is_empty()
+        && expected != hash.as_slice()
+    {
+        return Err(anyhow!("hash mismatch, left out of the archive"));
+    }
+
+    writer.append_image(&format!("{}.img", name), &file, size, &regions)
+}
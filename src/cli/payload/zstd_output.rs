@@ -0,0 +1,213 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+use crate::cli::args::args_def::Args;
+use crate::cli::payload::scheduler::Scheduler;
+use crate::cli::ui::ui_print::UiOutput;
+use anyhow::{Context, Result, anyhow};
+use payload_dumper::seekable_zstd::{
+    PayloadBlobs, SeekableOptions, SeekableOutput, write_seekable,
+};
+use payload_dumper::structs::PartitionUpdate;
+use payload_dumper::utils::format_size;
+use std::path::PathBuf;
+
+/// a local payload file and the file offset of its data section, for
+/// storing ZSTD blobs as they are
+#[derive(Debug, Clone)]
+pub struct BlobFile {
+    pub path: PathBuf,
+    pub data_offset: u64,
+}
+
+/// whether --zstd-output images are compressed while they are extracted:
+/// not in sharded runs, whose images several processes write, nor with
+/// --repair-fec, which may still change them afterwards
+pub fn streams_zstd(args: &Args) -> bool {
+    args.zstd_output && args.shard.is_none() && !args.repair_fec
+}
+
+/// where extraction writes the seekable zstd copy of `partition_name`
+pub fn seekable_output(
+    args: &Args,
+    partition_name: &str,
+    blob_file: Option<&BlobFile>,
+) -> SeekableOutput {
+    SeekableOutput {
+        path: args.out.join(format!("{}.img.zst", partition_name)),
+        options: SeekableOptions {
+            frame_size: args.zstd_frame_size * 1024 * 1024,
+            level: args.zstd_level,
+            workers: args.threads.unwrap_or_else(num_cpus::get),
+        },
+        payload: blob_file.map(|b| (b.path.clone(), b.data_offset)),
+    }
+}
+
+/// turns the extracted images into seekable zstd files when --zstd-output
+/// is given
+///
+/// `<name>.img.zst` replaces `<name>.img`, partitions listed in `skip`
+/// (failed extraction or verification) are left alone. when the files were
+/// written during extraction ([`streams_zstd`]) the verified images are
+/// only removed
+/// returns the partitions whose compressed image could not be written
+pub async fn write_zstd_images(
+    partitions: &[PartitionUpdate],
+    skip: &[String],
+    block_size: u64,
+    blob_file: Option<BlobFile>,
+    args: &Args,
+    scheduler: &Scheduler,
+    ui: &UiOutput,
+) -> Result<Vec<String>> {
+    if !args.zstd_output {
+        return Ok(Vec::new());
+    }
+    if streams_zstd(args) {
+        return keep_streamed_images(partitions, skip, args, ui).await;
+    }
+
+    let max_workers = args.threads.unwrap_or_else(num_cpus::get);
+
+    ui.println(format!(
+        "- Compressing images (zstd level {}, {} MiB frames)...",
+        args.zstd_level, args.zstd_frame_size
+    ));
+
+    let mut failed = Vec::new();
+
+    // one partition at a time, each one on the cores idle in the scheduler
+    for partition in partitions
+        .iter()
+        .filter(|p| !skip.contains(&p.partition_name))
+    {
+        let name = partition.partition_name.clone();
+        let image_path = args.out.join(format!("{}.img", name));
+        let zst_path = args.out.join(format!("{}.img.zst", name));
+
+        let pb = ui.create_spinner(format!("Compressing {}", name));
+        let task_partition = partition.clone();
+        let permit = scheduler.acquire_workers(max_workers).await;
+        let task_options = SeekableOptions {
+            frame_size: args.zstd_frame_size * 1024 * 1024,
+            level: args.zstd_level,
+            workers: permit.workers(),
+        };
+        let task_blob_file = blob_file.clone();
+
+        let result = tokio::task::spawn_blocking(move || {
+            let image = std::fs::File::open(&image_path)
+                .with_context(|| format!("Failed to open {}", image_path.display()))?;
+            let payload = match &task_blob_file {
+                Some(blob_file) => Some(std::fs::File::open(&blob_file.path)?),
+                None => None,
+            };
+            let blobs = payload
+                .as_ref()
+                .zip(task_blob_file.as_ref())
+                .map(|(file, blob_file)| PayloadBlobs {
+                    file,
+                    data_offset: blob_file.data_offset,
+                });
+            let output = std::fs::OpenOptions::new()
+                .read(true)
+                .write(true)
+                .create(true)
+                .truncate(true)
+                .open(&zst_path)
+                .with_context(|| format!("Failed to create {}", zst_path.display()))?;
+
+            let size = image.metadata()?.len();
+            let stats = write_seekable(
+                &task_partition,
+                &image,
+                &output,
+                block_size,
+                blobs.as_ref(),
+                &task_options,
+            )?;
+
+            // the compressed image is what was asked for
+            std::fs::remove_file(&image_path)?;
+            anyhow::Ok((size, stats))
+        })
+        .await
+        .map_err(|e| anyhow!("Compression task failed: {}", e))
+        .and_then(|r| r);
+        drop(permit);
+
+        let message = match result {
+            Ok((size, stats)) => format!(
+                "✓ {}.img.zst {} of {} ({} frames, {} reused)",
+                name,
+                format_size(stats.size),
+                format_size(size),
+                stats.frames,
+                stats.reused_frames
+            ),
+            Err(e) => {
+                ui.error(format!("Failed to compress {}: {}", name, e));
+                failed.push(name.clone());
+                format!("✗ {} compression error", name)
+            }
+        };
+
+        if let Some(p) = &pb {
+            p.finish_with_message(message);
+        }
+    }
+
+    Ok(failed)
+}
+
+/// keeps the `<name>.img.zst` written during extraction in place of each
+/// verified image, the ones of partitions in `skip` are removed
+async fn keep_streamed_images(
+    partitions: &[PartitionUpdate],
+    skip: &[String],
+    args: &Args,
+    ui: &UiOutput,
+) -> Result<Vec<String>> {
+    let mut failed = Vec::new();
+
+    for partition in partitions {
+        let name = &partition.partition_name;
+        let image_path = args.out.join(format!("{}.img", name));
+        let zst_path = args.out.join(format!("{}.img.zst", name));
+
+        if skip.contains(name) {
+            match tokio::fs::remove_file(&zst_path).await {
+                Ok(()) => {}
+                Err(e) if e.kind() == std::io::ErrorKind::NotFound => {}
+                Err(e) => ui.error(format!("Failed to remove {}: {}", zst_path.display(), e)),
+            }
+            continue;
+        }
+
+        let result = async {
+            let size = tokio::fs::metadata(&image_path).await?.len();
+            let compressed = tokio::fs::metadata(&zst_path).await?.len();
+            // the compressed image is what was asked for
+            tokio::fs::remove_file(&image_path).await?;
+            anyhow::Ok((size, compressed))
+        }
+        .await;
+
+        match result {
+            Ok((size, compressed)) => ui.println(format!(
+                "✓ {}.img.zst {} of {}",
+                name,
+                format_size(compressed),
+                format_size(size)
+            )),
+            Err(e) => {
+                ui.error(format!("Failed to keep {}.img.zst: {}", name, e));
+                failed.push(name.clone());
+            }
+        }
+    }
+
+    Ok(failed)
+}
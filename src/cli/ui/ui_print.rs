@@ -3,15 +3,30 @@
 // https://github.com/rhythmcache/payload-dumper-rust
 
 use indicatif::{MultiProgress, ProgressBar, ProgressStyle};
-use std::sync::Arc;
+use serde::Serialize;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use tokio::sync::mpsc::UnboundedSender;
 use tokio::time::Duration;
 
+/// what a UI shows, as sent to a daemon client instead of the terminal
+#[derive(Debug, Clone, Serialize)]
+#[serde(tag = "event", rename_all = "snake_case")]
+pub enum UiEvent {
+    Message { text: String },
+    Error { text: String },
+    Progress { name: String, percent: u64 },
+    Done { name: String, text: String },
+}
+
 /// main UI handler for CLI output
 /// respects quiet mode and stdout redirection
 pub struct UiOutput {
     quiet: bool,
     is_stdout: bool,
     multi_progress: Option<Arc<MultiProgress>>,
+    /// set for daemon jobs, everything goes here instead of the terminal
+    events: Option<UnboundedSender<UiEvent>>,
 }
 
 impl UiOutput {
@@ -26,12 +41,37 @@ impl UiOutput {
             quiet,
             is_stdout,
             multi_progress,
+            events: None,
+        }
+    }
+
+    /// UI of a daemon job, messages and progress are sent over `events`
+    pub fn with_events(events: UnboundedSender<UiEvent>) -> Self {
+        Self {
+            quiet: true,
+            is_stdout: false,
+            multi_progress: None,
+            events: Some(events),
+        }
+    }
+
+    /// forwards `msg` to the daemon client, if any
+    /// returns whether it was forwarded
+    fn send_message(&self, msg: &str) -> bool {
+        match &self.events {
+            Some(events) => {
+                let _ = events.send(UiEvent::Message {
+                    text: msg.to_string(),
+                });
+                true
+            }
+            None => false,
         }
     }
 
     /// print to stdout (respects quiet mode)
     pub fn println(&self, msg: impl AsRef<str>) {
-        if self.quiet {
+        if self.send_message(msg.as_ref()) || self.quiet {
             return;
         }
 
@@ -43,14 +83,14 @@ impl UiOutput {
     }
 
     pub fn println_final(&self, msg: impl AsRef<str>) {
-        if self.quiet {
+        if self.send_message(msg.as_ref()) || self.quiet {
             return;
         }
         println!("{}", msg.as_ref());
     }
 
     pub fn eprintln_final(&self, msg: impl AsRef<str>) {
-        if self.quiet {
+        if self.send_message(msg.as_ref()) || self.quiet {
             return;
         }
         if self.is_stdout {
@@ -62,19 +102,29 @@ impl UiOutput {
 
     /// print errors (ignores quiet mode)
     pub fn error(&self, msg: impl AsRef<str>) {
+        if let Some(events) = &self.events {
+            let _ = events.send(UiEvent::Error {
+                text: msg.as_ref().to_string(),
+            });
+            return;
+        }
         eprintln!("{}", msg.as_ref());
     }
 
     pub fn update_spinner(&self, pb: &Option<ProgressBar>, message: impl Into<String>) {
+        let message = message.into();
+        self.send_message(&message);
         if let Some(spinner) = pb {
-            spinner.set_message(message.into());
+            spinner.set_message(message);
         }
     }
 
     /// finish spinner with message
     pub fn finish_spinner(&self, pb: Option<ProgressBar>, message: impl Into<String>) {
+        let message = message.into();
+        self.send_message(&message);
         if let Some(spinner) = pb {
-            spinner.finish_with_message(message.into());
+            spinner.finish_with_message(message);
         }
     }
 
@@ -126,15 +176,33 @@ impl UiOutput {
         &self,
         partition_name: impl Into<String>,
     ) -> ExtractionProgress {
+        let partition_name = partition_name.into();
+        let events = self.progress_events(&partition_name);
         let pb = self.create_progress_bar_internal(100, partition_name);
-        ExtractionProgress { progress_bar: pb }
+        ExtractionProgress {
+            progress_bar: pb,
+            events,
+        }
     }
 
     /// create a progress bar wrapper for download progress
     #[cfg(feature = "prefetch")]
     pub fn create_download_progress(&self, message: impl Into<String>) -> DownloadProgress {
+        let message = message.into();
+        let events = self.progress_events(&message);
         let pb = self.create_progress_bar_internal(100, message);
-        DownloadProgress { progress_bar: pb }
+        DownloadProgress {
+            progress_bar: pb,
+            events,
+        }
+    }
+
+    fn progress_events(&self, name: &str) -> Option<ProgressEvents> {
+        self.events.clone().map(|events| ProgressEvents {
+            events,
+            name: Mutex::new(name.to_string()),
+            last_percent: AtomicU64::new(u64::MAX),
+        })
     }
 
     /// clear all progress bars
@@ -147,7 +215,7 @@ impl UiOutput {
 
     /// print through progress bar to stderr if stdout redirected
     pub fn pb_eprintln(&self, msg: impl AsRef<str>) {
-        if self.quiet {
+        if self.send_message(msg.as_ref()) || self.quiet {
             return;
         }
 
@@ -161,27 +229,69 @@ impl UiOutput {
     }
 }
 
+/// progress of one bar as daemon events
+/// only whole percent changes are sent, not every operation
+struct ProgressEvents {
+    events: UnboundedSender<UiEvent>,
+    name: Mutex<String>,
+    last_percent: AtomicU64,
+}
+
+impl ProgressEvents {
+    fn set_message(&self, message: &str) {
+        *self.name.lock().unwrap() = message.to_string();
+    }
+
+    fn set_position(&self, percent: u64) {
+        if self.last_percent.swap(percent, Ordering::Relaxed) != percent {
+            let _ = self.events.send(UiEvent::Progress {
+                name: self.name.lock().unwrap().clone(),
+                percent,
+            });
+        }
+    }
+
+    fn finish(&self, message: String) {
+        let _ = self.events.send(UiEvent::Done {
+            name: self.name.lock().unwrap().clone(),
+            text: message,
+        });
+    }
+}
+
 /// wrapper for extraction progress bar
 pub struct ExtractionProgress {
     progress_bar: Option<ProgressBar>,
+    events: Option<ProgressEvents>,
 }
 
 impl ExtractionProgress {
     pub fn set_message(&self, message: impl Into<String>) {
+        let message = message.into();
+        if let Some(events) = &self.events {
+            events.set_message(&message);
+        }
         if let Some(pb) = &self.progress_bar {
-            pb.set_message(message.into());
+            pb.set_message(message);
         }
     }
 
     pub fn set_position(&self, pos: u64) {
+        if let Some(events) = &self.events {
+            events.set_position(pos);
+        }
         if let Some(pb) = &self.progress_bar {
             pb.set_position(pos);
         }
     }
 
     pub fn finish_with_message(&self, message: impl Into<String>) {
+        let message = message.into();
+        if let Some(events) = &self.events {
+            events.finish(message.clone());
+        }
         if let Some(pb) = &self.progress_bar {
-            pb.finish_with_message(message.into());
+            pb.finish_with_message(message);
         }
     }
 }
@@ -190,25 +300,37 @@ impl ExtractionProgress {
 #[cfg(feature = "prefetch")]
 pub struct DownloadProgress {
     progress_bar: Option<ProgressBar>,
+    events: Option<ProgressEvents>,
 }
 
 #[cfg(feature = "prefetch")]
 impl DownloadProgress {
     pub fn set_message(&self, message: impl Into<String>) {
+        let message = message.into();
+        if let Some(events) = &self.events {
+            events.set_message(&message);
+        }
         if let Some(pb) = &self.progress_bar {
-            pb.set_message(message.into());
+            pb.set_message(message);
         }
     }
 
     pub fn set_position(&self, pos: u64) {
+        if let Some(events) = &self.events {
+            events.set_position(pos);
+        }
         if let Some(pb) = &self.progress_bar {
             pb.set_position(pos);
         }
     }
 
     pub fn finish_with_message(&self, message: impl Into<String>) {
+        let message = message.into();
+        if let Some(events) = &self.events {
+            events.finish(message.clone());
+        }
         if let Some(pb) = &self.progress_bar {
-            pb.finish_with_message(message.into());
+            pb.finish_with_message(message);
         }
     }
 }
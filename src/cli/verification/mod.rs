@@ -1,2 +1,7 @@
+#[cfg(feature = "diff_ota")]
+pub mod source_check;
+#[cfg(feature = "diff_ota")]
+pub mod unchanged_check;
 pub mod validator;
 pub mod verify;
+pub mod verity_check;
@@ -0,0 +1,180 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+use crate::cli::args::args_def::Args;
+use crate::cli::ui::ui_print::UiOutput;
+use anyhow::Result;
+use payload_dumper::payload::source_image::SourceImage;
+use payload_dumper::payload::source_verify::{
+    SourceHashIndex, SourceStatus, find_mismatched_operations, verify_source_image,
+};
+use payload_dumper::structs::PartitionUpdate;
+use payload_dumper::utils::{format_size, is_diff_operation};
+use std::sync::Arc;
+use tokio::sync::Semaphore;
+
+// how many bad operations are listed per partition before summarizing
+const MAX_REPORTED_OPERATIONS: usize = 8;
+
+/// checks the source images of all differential partitions before extraction
+/// returns the partitions whose source image is missing or does not match
+pub async fn verify_source_images(
+    partitions: &[PartitionUpdate],
+    block_size: u64,
+    thread_count: usize,
+    args: &Args,
+    ui: &UiOutput,
+) -> Result<Vec<String>> {
+    let diff_partitions: Vec<PartitionUpdate> = partitions
+        .iter()
+        .filter(|p| p.operations.iter().any(|op| is_diff_operation(op.r#type())))
+        .cloned()
+        .collect();
+
+    if diff_partitions.is_empty() {
+        return Ok(Vec::new());
+    }
+
+    if args.no_source_verify {
+        ui.println("- Skipping source image verification");
+        return Ok(Vec::new());
+    }
+
+    let diff_partitions: Vec<PartitionUpdate> = diff_partitions
+        .into_iter()
+        .filter(|p| !args.verified_sources.contains(&p.partition_name))
+        .collect();
+    if diff_partitions.is_empty() {
+        return Ok(Vec::new());
+    }
+
+    ui.println(format!(
+        "- Verifying {} source images...",
+        diff_partitions.len()
+    ));
+
+    let index = Arc::new(SourceHashIndex::load());
+    let semaphore = Arc::new(Semaphore::new(thread_count.max(1)));
+    let mut tasks = Vec::new();
+
+    for partition in diff_partitions {
+        let index = Arc::clone(&index);
+        let semaphore = Arc::clone(&semaphore);
+        let source_path = args
+            .source_dir
+            .join(format!("{}.img", partition.partition_name));
+        let pb = ui.create_spinner(format!("Queuing {}", partition.partition_name));
+
+        tasks.push(tokio::spawn(async move {
+            let _permit = semaphore.acquire_owned().await.unwrap();
+            let name = partition.partition_name.clone();
+
+            if let Some(p) = &pb {
+                p.set_message(format!("Hashing source {}", name));
+            }
+
+            let result = tokio::task::spawn_blocking(move || {
+                let source = SourceImage::open(&source_path)?;
+                let status = verify_source_image(&partition, &source, &index)?;
+                let mismatched = match status {
+                    SourceStatus::Mismatch | SourceStatus::TooSmall { .. } => {
+                        find_mismatched_operations(&partition, &source, block_size)?
+                    }
+                    _ => Vec::new(),
+                };
+                anyhow::Ok((status, mismatched))
+            })
+            .await
+            .map_err(|e| anyhow::anyhow!("Source verification task failed: {}", e))
+            .and_then(|r| r);
+
+            (name, pb, result)
+        }));
+    }
+
+    let mut failed = Vec::new();
+
+    for task in futures::future::join_all(tasks).await {
+        let (name, pb, result) = match task {
+            Ok(r) => r,
+            Err(e) => {
+                ui.error(format!("Task panicked: {}", e));
+                continue;
+            }
+        };
+
+        let (message, ok) = match result {
+            Ok((SourceStatus::Verified { cached: true }, _)) => {
+                (format!("✓ source {} verified (cached)", name), true)
+            }
+            Ok((SourceStatus::Verified { cached: false }, _)) => {
+                (format!("✓ source {} verified", name), true)
+            }
+            Ok((SourceStatus::NoHash, _)) => (format!("No source hash for {}", name), true),
+            Ok((status, mismatched)) => {
+                if let SourceStatus::TooSmall { expected, actual } = status {
+                    ui.error(format!(
+                        "Source image for {} is too small: expected {}, found {}",
+                        name,
+                        format_size(expected),
+                        format_size(actual)
+                    ));
+                }
+
+                if mismatched.is_empty() {
+                    ui.error(format!(
+                        "Source image for {} does not match the payload",
+                        name
+                    ));
+                } else {
+                    ui.error(format!(
+                        "Source image for {} does not match the payload, {} operations read bad blocks:",
+                        name,
+                        mismatched.len()
+                    ));
+                    for op in mismatched.iter().take(MAX_REPORTED_OPERATIONS) {
+                        let ranges: Vec<String> = op
+                            .src_extents
+                            .iter()
+                            .map(|e| {
+                                let start = e.start_block.unwrap_or(0);
+                                format!("{}..{}", start, start + e.num_blocks.unwrap_or(0))
+                            })
+                            .collect();
+                        ui.error(format!(
+                            "  operation {}: blocks {}",
+                            op.operation_index,
+                            ranges.join(", ")
+                        ));
+                    }
+                    if mismatched.len() > MAX_REPORTED_OPERATIONS {
+                        ui.error(format!(
+                            "  ... and {} more",
+                            mismatched.len() - MAX_REPORTED_OPERATIONS
+                        ));
+                    }
+                }
+
+                (format!("✗ source {} mismatch", name), false)
+            }
+            Err(e) => {
+                ui.error(format!("Error verifying source for {}: {}", name, e));
+                (format!("✗ source {} error", name), false)
+            }
+        };
+
+        if let Some(p) = &pb {
+            p.finish_with_message(message);
+        }
+        if !ok {
+            failed.push(name);
+        }
+    }
+
+    if let Err(e) = index.save() {
+        ui.error(format!("Failed to update source hash cache: {}", e));
+    }
+
+    Ok(failed)
+}
@@ -0,0 +1,126 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+use crate::cli::args::args_def::Args;
+use crate::cli::ui::ui_print::UiOutput;
+use anyhow::Result;
+use payload_dumper::payload::source_image::SourceImage;
+use payload_dumper::payload::source_verify::{SourceHashIndex, SourceStatus, verify_image};
+use payload_dumper::structs::PartitionUpdate;
+use std::sync::Arc;
+use tokio::sync::Semaphore;
+
+/// finds partitions whose image in the output directory already matches
+/// `new_partition_info`, for --skip-unchanged
+///
+/// image hashes are remembered per file identity in the same index as source
+/// images, so an archive that was verified once is not hashed again
+pub async fn find_unchanged_outputs(
+    partitions: &[PartitionUpdate],
+    thread_count: usize,
+    args: &Args,
+    ui: &UiOutput,
+) -> Result<Vec<String>> {
+    let index = Arc::new(SourceHashIndex::load());
+    let semaphore = Arc::new(Semaphore::new(thread_count.max(1)));
+    let mut tasks = Vec::new();
+
+    for partition in partitions {
+        let Some(info) = partition.new_partition_info.clone() else {
+            continue;
+        };
+        let out_path = args.out.join(format!("{}.img", partition.partition_name));
+
+        // a different size means the image has to be rewritten anyway
+        match tokio::fs::metadata(&out_path).await {
+            Ok(metadata) if Some(metadata.len()) == info.size => {}
+            _ => continue,
+        }
+
+        let index = Arc::clone(&index);
+        let semaphore = Arc::clone(&semaphore);
+        let name = partition.partition_name.clone();
+
+        tasks.push(tokio::spawn(async move {
+            let _permit = semaphore.acquire_owned().await.unwrap();
+            let result = tokio::task::spawn_blocking(move || {
+                let image = SourceImage::open(&out_path)?;
+                verify_image(&info, &image, &index)
+            })
+            .await
+            .map_err(|e| anyhow::anyhow!("Output check task failed: {}", e))
+            .and_then(|r| r);
+            (name, result)
+        }));
+    }
+
+    if tasks.is_empty() {
+        return Ok(Vec::new());
+    }
+
+    ui.println(format!(
+        "- Checking {} existing images for changes...",
+        tasks.len()
+    ));
+
+    let mut unchanged = Vec::new();
+    for task in futures::future::join_all(tasks).await {
+        match task {
+            Ok((name, Ok(SourceStatus::Verified { .. }))) => unchanged.push(name),
+            Ok((_, Ok(_))) => {}
+            Ok((name, Err(e))) => {
+                ui.error(format!("Error checking existing image {}: {}", name, e));
+            }
+            Err(e) => ui.error(format!("Task panicked: {}", e)),
+        }
+    }
+
+    if let Err(e) = index.save() {
+        ui.error(format!("Failed to update image hash cache: {}", e));
+    }
+
+    if !unchanged.is_empty() {
+        ui.println(format!(
+            "- Skipping {} unchanged partitions: {}",
+            unchanged.len(),
+            unchanged.join(", ")
+        ));
+    }
+
+    Ok(unchanged)
+}
+
+/// remembers the hashes of freshly verified images, so the next run with
+/// --skip-unchanged finds them unchanged without hashing
+pub fn remember_verified_outputs(
+    partitions: &[PartitionUpdate],
+    failed: &[String],
+    args: &Args,
+    ui: &UiOutput,
+) {
+    let index = SourceHashIndex::load();
+
+    for partition in partitions {
+        if failed.contains(&partition.partition_name) {
+            continue;
+        }
+        let Some(info) = &partition.new_partition_info else {
+            continue;
+        };
+        let (Some(size), Some(hash)) = (info.size, info.hash.as_deref()) else {
+            continue;
+        };
+        if hash.is_empty() {
+            continue;
+        }
+
+        let out_path = args.out.join(format!("{}.img", partition.partition_name));
+        // an image that cannot be identified is simply hashed next time
+        let _ = index.record(&out_path, size, hash);
+    }
+
+    if let Err(e) = index.save() {
+        ui.error(format!("Failed to update image hash cache: {}", e));
+    }
+}
@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+use crate::cli::args::args_def::Args;
+use crate::cli::payload::scheduler::Scheduler;
+use crate::cli::ui::ui_print::UiOutput;
+use anyhow::Result;
+use payload_dumper::fec::{FecConfig, verify_fec};
+use payload_dumper::structs::PartitionUpdate;
+use payload_dumper::verity::{HashTreeConfig, HashTreeStatus, verify_hash_tree};
+
+/// checks the dm-verity hash trees the payload wrote against the extracted
+/// data
+///
+/// trees the payload leaves to the device were generated from the image
+/// during extraction and cannot disagree with it, they are not checked
+/// returns a list of partition names whose tree does not match their data
+pub async fn verify_hash_trees(
+    partitions: &[PartitionUpdate],
+    failed_extractions: &[String],
+    block_size: u64,
+    args: &Args,
+    scheduler: &Scheduler,
+    ui: &UiOutput,
+) -> Result<Vec<String>> {
+    if !args.verify_verity {
+        return Ok(Vec::new());
+    }
+
+    ui.println("- Verifying dm-verity hash trees...");
+
+    let mut failed = Vec::new();
+    let mut generated = Vec::new();
+
+    // partitions are checked one after another, each check uses the cores
+    // idle in the scheduler at the time
+    for partition in partitions
+        .iter()
+        .filter(|p| !failed_extractions.contains(&p.partition_name))
+    {
+        let name = partition.partition_name.clone();
+        let config = match HashTreeConfig::from_partition(partition, block_size) {
+            Ok(Some(config)) if config.is_written_by_payload(partition) => config,
+            Ok(Some(_)) => {
+                generated.push(name);
+                continue;
+            }
+            Ok(None) => continue,
+            Err(e) => {
+                ui.error(format!("Hash tree of {} not checked: {}", name, e));
+                continue;
+            }
+        };
+
+        let pb = ui.create_spinner(format!("Verifying hash tree of {}", name));
+        let path = args.out.join(format!("{}.img", name));
+        let permit = scheduler.acquire_workers(num_cpus::get()).await;
+        let workers = permit.workers();
+
+        let result = tokio::task::spawn_blocking(move || {
+            let file = std::fs::File::open(&path)?;
+            verify_hash_tree(&file, &config, workers)
+        })
+        .await
+        .map_err(|e| anyhow::anyhow!("Hash tree task failed: {}", e))
+        .and_then(|r| r);
+        drop(permit);
+
+        let message = match result {
+            Ok(HashTreeStatus::Valid) => format!("✓ {} hash tree valid", name),
+            Ok(HashTreeStatus::Mismatch) => {
+                failed.push(name.clone());
+                format!("✗ {} hash tree mismatch", name)
+            }
+            Err(e) => {
+                ui.error(format!("Error verifying hash tree of {}: {}", name, e));
+                failed.push(name.clone());
+                format!("✗ {} hash tree error", name)
+            }
+        };
+
+        if let Some(p) = &pb {
+            p.finish_with_message(message);
+        }
+    }
+
+    if !generated.is_empty() {
+        ui.println(format!(
+            "- Hash trees of {} were generated during extraction, not checked",
+            generated.join(", ")
+        ));
+    }
+
+    if !failed.is_empty() {
+        ui.error(format!(
+            "Hash tree verification failed for {} partitions.",
+            failed.len()
+        ));
+    }
+
+    Ok(failed)
+}
+
+/// checks (and with --repair-fec repairs) extracted partitions against the
+/// FEC the payload wrote
+///
+/// FEC the payload leaves to the device was generated from the image during
+/// extraction and cannot disagree with it, it is not checked
+/// returns a list of partition names that are corrupted beyond repair
+pub async fn verify_fec_data(
+    partitions: &[PartitionUpdate],
+    failed_extractions: &[String],
+    block_size: u64,
+    args: &Args,
+    scheduler: &Scheduler,
+    ui: &UiOutput,
+) -> Result<Vec<String>> {
+    if !args.verify_fec && !args.repair_fec {
+        return Ok(Vec::new());
+    }
+
+    let repair = args.repair_fec;
+    ui.println(if repair {
+        "- Repairing partitions with verity FEC..."
+    } else {
+        "- Verifying verity FEC..."
+    });
+
+    let mut failed = Vec::new();
+    let mut generated = Vec::new();
+
+    for partition in partitions
+        .iter()
+        .filter(|p| !failed_extractions.contains(&p.partition_name))
+    {
+        let name = partition.partition_name.clone();
+        let config = match FecConfig::from_partition(partition, block_size) {
+            Ok(Some(config)) if config.is_written_by_payload(partition) => config,
+            Ok(Some(_)) => {
+                generated.push(name);
+                continue;
+            }
+            Ok(None) => continue,
+            Err(e) => {
+                ui.error(format!("FEC of {} not checked: {}", name, e));
+                continue;
+            }
+        };
+
+        let pb = ui.create_spinner(format!("Checking FEC of {}", name));
+        let path = args.out.join(format!("{}.img", name));
+        let permit = scheduler.acquire_workers(num_cpus::get()).await;
+        let workers = permit.workers();
+
+        let result = tokio::task::spawn_blocking(move || {
+            let file = std::fs::OpenOptions::new()
+                .read(true)
+                .write(repair)
+                .open(&path)?;
+            verify_fec(&file, &config, workers, repair)
+        })
+        .await
+        .map_err(|e| anyhow::anyhow!("FEC task failed: {}", e))
+        .and_then(|r| r);
+        drop(permit);
+
+        let message = match result {
+            Ok(report) if report.is_clean() => format!("✓ {} FEC valid", name),
+            Ok(report) if repair && report.uncorrectable_codewords == 0 => format!(
+                "✓ {} repaired, {} bytes in {} codewords",
+                name, report.corrected_bytes, report.corrupted_codewords
+            ),
+            Ok(report) => {
+                failed.push(name.clone());
+                if repair {
+                    format!(
+                        "✗ {} has {} uncorrectable codewords",
+                        name, report.uncorrectable_codewords
+                    )
+                } else {
+                    format!(
+                        "✗ {} FEC mismatch in {} codewords",
+                        name, report.corrupted_codewords
+                    )
+                }
+            }
+            Err(e) => {
+                ui.error(format!("Error checking FEC of {}: {}", name, e));
+                failed.push(name.clone());
+                format!("✗ {} FEC error", name)
+            }
+        };
+
+        if let Some(p) = &pb {
+            p.finish_with_message(message);
+        }
+    }
+
+    if !generated.is_empty() {
+        ui.println(format!(
+            "- FEC of {} was generated during extraction, not checked",
+            generated.join(", ")
+        ));
+    }
+
+    if !failed.is_empty() {
+        ui.error(format!("FEC check failed for {} partitions.", failed.len()));
+    }
+
+    Ok(failed)
+}
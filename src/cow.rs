@@ -0,0 +1,611 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+// virtual A/B snapshot COW files
+//
+// on a virtual A/B device update_engine does not write the new partition,
+// it writes a copy-on-write file (libsnapshot format v2) holding only what
+// differs from the old one: COPY ops for blocks that moved, XOR ops for
+// blocks that are cheap to express against an old block, ZERO ops and
+// REPLACE ops carrying compressed new data. the merge sequence tells
+// snapuserd in which order copy and xor blocks may be merged without
+// overwriting blocks later ones still read.
+//
+// ops are stored in clusters: `cluster_ops` operation slots (the last one a
+// CLUSTER op) followed by the data of those ops. block contents are read,
+// xored and compressed on worker threads, the writer emits the results in
+// order so the output is deterministic.
+
+use anyhow::{Context, Result, anyhow};
+use async_compression::Level;
+use async_compression::tokio::bufread::{BrotliEncoder, ZlibEncoder, ZstdEncoder};
+use std::collections::{BTreeMap, HashSet};
+use std::fs::File;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::mpsc;
+use tokio::io::AsyncReadExt;
+
+use crate::structs::{PartitionUpdate, cow_merge_operation};
+use crate::utils::{read_exact_at, write_all_at};
+
+const COW_MAGIC: u64 = 0x436f_7763_4f57_2121;
+const COW_VERSION_MAJOR: u16 = 2;
+const COW_VERSION_MINOR: u16 = 0;
+const HEADER_SIZE: u16 = 38;
+const OP_SIZE: usize = 20;
+const FOOTER_SIZE: u16 = OP_SIZE as u16 + 64;
+// scratch space snapuserd uses while merging, right after the header
+const BUFFER_SIZE: u64 = 2 * 1024 * 1024;
+
+pub const DEFAULT_CLUSTER_OPS: u32 = 200;
+
+const OP_COPY: u8 = 1;
+const OP_REPLACE: u8 = 2;
+const OP_ZERO: u8 = 3;
+const OP_CLUSTER: u8 = 5;
+const OP_XOR: u8 = 6;
+const OP_SEQUENCE: u8 = 7;
+const OP_FOOTER: u8 = 0xff;
+
+// blocks handed to a worker at once
+const BATCH_BLOCKS: u64 = 256;
+
+/// per-block compression of REPLACE and XOR data
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum CowCompression {
+    None,
+    Gz,
+    Brotli,
+    Zstd,
+}
+
+impl CowCompression {
+    /// parses `vabc_compression_param` ("lz4", "gz", "brotli,9", ...)
+    ///
+    /// `None` for algorithms that cannot be produced here
+    pub fn from_param(param: &str) -> Option<Self> {
+        let name = param.split(',').next().unwrap_or("").trim();
+        match name.to_ascii_lowercase().as_str() {
+            "" | "none" => Some(Self::None),
+            "gz" | "gzip" => Some(Self::Gz),
+            "brotli" => Some(Self::Brotli),
+            "zstd" => Some(Self::Zstd),
+            _ => None,
+        }
+    }
+
+    fn id(self) -> u8 {
+        match self {
+            Self::None => 0,
+            Self::Gz => 1,
+            Self::Brotli => 2,
+            Self::Zstd => 4,
+        }
+    }
+}
+
+/// COW generation settings
+#[derive(Debug, Clone)]
+pub struct CowOptions {
+    pub compression: CowCompression,
+    pub cluster_ops: u32,
+    pub workers: usize,
+}
+
+impl Default for CowOptions {
+    fn default() -> Self {
+        Self {
+            compression: CowCompression::None,
+            cluster_ops: DEFAULT_CLUSTER_OPS,
+            workers: num_cpus::get(),
+        }
+    }
+}
+
+/// what ended up in a COW file
+#[derive(Debug, Default)]
+pub struct CowStats {
+    pub copy_ops: u64,
+    pub xor_ops: u64,
+    pub zero_ops: u64,
+    pub replace_ops: u64,
+    pub size: u64,
+}
+
+/// writes the COW of `partition` to `output`
+///
+/// `new_image` is the extracted partition, `source_image` the old one it
+/// will be merged onto (absent for full payloads, every block is then
+/// written)
+pub fn write_cow(
+    partition: &PartitionUpdate,
+    new_image: &File,
+    source_image: Option<&File>,
+    output: &File,
+    block_size: u64,
+    options: &CowOptions,
+) -> Result<CowStats> {
+    let size = partition
+        .new_partition_info
+        .as_ref()
+        .and_then(|info| info.size)
+        .ok_or_else(|| anyhow!("Partition size is missing"))?;
+    let total_blocks = size / block_size;
+
+    let source_blocks = match (source_image, &partition.old_partition_info) {
+        (Some(_), Some(info)) => info.size.unwrap_or(0) / block_size,
+        (Some(file), None) => file.metadata()?.len() / block_size,
+        (None, _) => 0,
+    };
+
+    let plan = MergePlan::from_partition(partition, block_size, source_blocks)?;
+    if !plan.ordered.is_empty() && source_image.is_none() {
+        return Err(anyhow!("Merge operations need the source image"));
+    }
+
+    let mut writer = CowWriter::new(output, block_size, options.cluster_ops)?;
+    let mut stats = CowStats::default();
+
+    let sequence: Vec<u32> = plan.ordered.iter().map(|op| op.new_block as u32).collect();
+    writer.add_sequence(&sequence)?;
+
+    // copy ops need no data, xor ops are computed in the same pass as the
+    // remaining blocks so every block is read once
+    for op in plan.ordered.iter().filter(|op| op.kind == BlockKind::Copy) {
+        writer.add_op(OP_COPY, 0, op.new_block, op.source, &[])?;
+        stats.copy_ops += 1;
+    }
+
+    let mut jobs: Vec<BlockJob> = plan
+        .ordered
+        .iter()
+        .filter(|op| op.kind == BlockKind::Xor)
+        .cloned()
+        .collect();
+    jobs.extend(
+        (0..total_blocks)
+            .filter(|block| !plan.covered.contains(block))
+            .map(|block| BlockJob {
+                kind: BlockKind::Data,
+                new_block: block,
+                source: block,
+            }),
+    );
+
+    let ctx = JobContext {
+        new_image,
+        source_image,
+        source_blocks,
+        block_size,
+        compression: options.compression,
+    };
+
+    run_jobs(&ctx, &jobs, options.workers, |encoded| {
+        match encoded.op_type {
+            OP_XOR => stats.xor_ops += 1,
+            OP_ZERO => stats.zero_ops += 1,
+            _ => stats.replace_ops += 1,
+        }
+        writer.add_op(
+            encoded.op_type,
+            encoded.compression,
+            encoded.new_block,
+            encoded.source,
+            &encoded.data,
+        )
+    })?;
+
+    stats.size = writer.finish()?;
+    Ok(stats)
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum BlockKind {
+    Copy,
+    Xor,
+    // replace, zero, or nothing when the block did not change
+    Data,
+}
+
+/// one block of work; `source` is a block for copies and a byte offset for xor
+#[derive(Debug, Clone)]
+struct BlockJob {
+    kind: BlockKind,
+    new_block: u64,
+    source: u64,
+}
+
+/// copy and xor blocks in merge order, plus every block the merge ops cover
+struct MergePlan {
+    ordered: Vec<BlockJob>,
+    covered: HashSet<u64>,
+}
+
+impl MergePlan {
+    fn from_partition(
+        partition: &PartitionUpdate,
+        block_size: u64,
+        source_blocks: u64,
+    ) -> Result<Self> {
+        let mut ordered = Vec::new();
+        let mut covered = HashSet::new();
+
+        for merge in &partition.merge_operations {
+            let (Some(src), Some(dst)) = (&merge.src_extent, &merge.dst_extent) else {
+                continue;
+            };
+            let src_start = src.start_block.unwrap_or(0);
+            let dst_start = dst.start_block.unwrap_or(0);
+            let blocks = dst.num_blocks.unwrap_or(0);
+
+            let kind = match merge.r#type() {
+                cow_merge_operation::Type::CowCopy => BlockKind::Copy,
+                cow_merge_operation::Type::CowXor => BlockKind::Xor,
+                // new data either way, picked up by the block scan
+                cow_merge_operation::Type::CowReplace => continue,
+            };
+
+            // in-place copies leave nothing to merge
+            if kind == BlockKind::Copy && src_start == dst_start {
+                covered.extend(dst_start..dst_start + blocks);
+                continue;
+            }
+
+            if kind == BlockKind::Copy && src_start + blocks > source_blocks {
+                return Err(anyhow!(
+                    "Merge operation copies past the end of the source image"
+                ));
+            }
+            let src_offset = merge.src_offset.unwrap_or(0) as u64;
+
+            // an extent overlapping its own source must be merged from the
+            // end when it moves up, otherwise it would clobber unread blocks
+            let overlaps = src_start < dst_start + blocks && dst_start < src_start + blocks;
+            let descending = overlaps && dst_start > src_start;
+
+            let mut push = |i: u64| {
+                let source = match kind {
+                    BlockKind::Copy => src_start + i,
+                    _ => (src_start + i) * block_size + src_offset,
+                };
+                ordered.push(BlockJob {
+                    kind,
+                    new_block: dst_start + i,
+                    source,
+                });
+                covered.insert(dst_start + i);
+            };
+
+            if descending {
+                (0..blocks).rev().for_each(&mut push);
+            } else {
+                (0..blocks).for_each(&mut push);
+            }
+        }
+
+        Ok(Self { ordered, covered })
+    }
+}
+
+struct JobContext<'a> {
+    new_image: &'a File,
+    source_image: Option<&'a File>,
+    source_blocks: u64,
+    block_size: u64,
+    compression: CowCompression,
+}
+
+/// finished op with its (possibly compressed) data
+struct EncodedOp {
+    op_type: u8,
+    compression: u8,
+    new_block: u64,
+    source: u64,
+    data: Vec<u8>,
+}
+
+/// encodes `jobs` on `workers` threads and hands the ops to `emit` in job order
+fn run_jobs<F>(ctx: &JobContext, jobs: &[BlockJob], workers: usize, mut emit: F) -> Result<()>
+where
+    F: FnMut(EncodedOp) -> Result<()>,
+{
+    let batches: Vec<&[BlockJob]> = jobs.chunks(BATCH_BLOCKS as usize).collect();
+    if batches.is_empty() {
+        return Ok(());
+    }
+
+    let workers = workers.clamp(1, batches.len());
+    let next = AtomicUsize::new(0);
+    let (tx, rx) = mpsc::sync_channel::<(usize, Result<Vec<EncodedOp>>)>(workers * 2);
+
+    std::thread::scope(|scope| -> Result<()> {
+        // owned by this closure so an early return unblocks the workers
+        let rx = rx;
+
+        for _ in 0..workers {
+            let (tx, next, batches) = (tx.clone(), &next, &batches);
+            scope.spawn(move || {
+                loop {
+                    let index = next.fetch_add(1, Ordering::Relaxed);
+                    let Some(batch) = batches.get(index) else {
+                        return;
+                    };
+                    let result = encode_batch(ctx, batch);
+                    let failed = result.is_err();
+                    if tx.send((index, result)).is_err() || failed {
+                        return;
+                    }
+                }
+            });
+        }
+        drop(tx);
+
+        // batches finish out of order, emit them in order
+        let mut pending = BTreeMap::new();
+        let mut expected = 0usize;
+
+        for (index, result) in rx.iter() {
+            pending.insert(index, result?);
+            while let Some(ops) = pending.remove(&expected) {
+                for op in ops {
+                    emit(op)?;
+                }
+                expected += 1;
+            }
+        }
+
+        if expected != batches.len() {
+            return Err(anyhow!("COW worker stopped early"));
+        }
+        Ok(())
+    })
+}
+
+fn encode_batch(ctx: &JobContext, batch: &[BlockJob]) -> Result<Vec<EncodedOp>> {
+    let bs = ctx.block_size as usize;
+    let mut new_data = vec![0u8; bs];
+    let mut old_data = vec![0u8; bs];
+    let mut ops = Vec::with_capacity(batch.len());
+
+    for job in batch {
+        read_exact_at(ctx.new_image, &mut new_data, job.new_block * ctx.block_size)
+            .with_context(|| format!("Failed to read new block {}", job.new_block))?;
+
+        let op_type = match job.kind {
+            BlockKind::Xor => {
+                let source = ctx.source_image.expect("xor jobs need a source");
+                read_source(
+                    source,
+                    &mut old_data,
+                    job.source,
+                    ctx.source_blocks * ctx.block_size,
+                )?;
+                for (n, o) in new_data.iter_mut().zip(&old_data) {
+                    *n ^= o;
+                }
+                OP_XOR
+            }
+            BlockKind::Data => {
+                if let Some(source) = ctx.source_image
+                    && job.new_block < ctx.source_blocks
+                {
+                    read_exact_at(source, &mut old_data, job.new_block * ctx.block_size)?;
+                    // unchanged blocks are read straight from the base device
+                    if old_data == new_data {
+                        continue;
+                    }
+                }
+                if new_data.iter().all(|&b| b == 0) {
+                    ops.push(EncodedOp {
+                        op_type: OP_ZERO,
+                        compression: 0,
+                        new_block: job.new_block,
+                        source: 0,
+                        data: Vec::new(),
+                    });
+                    continue;
+                }
+                OP_REPLACE
+            }
+            BlockKind::Copy => unreachable!("copy ops carry no data"),
+        };
+
+        let (compression, data) = compress_block(&new_data, ctx.compression)?;
+        ops.push(EncodedOp {
+            op_type,
+            compression,
+            new_block: job.new_block,
+            source: job.source,
+            data,
+        });
+    }
+
+    Ok(ops)
+}
+
+/// reads a block at a byte offset of the source, past its end reads as zeros
+fn read_source(source: &File, buf: &mut [u8], offset: u64, source_size: u64) -> Result<()> {
+    buf.fill(0);
+    if offset >= source_size {
+        return Ok(());
+    }
+    let len = ((source_size - offset) as usize).min(buf.len());
+    read_exact_at(source, &mut buf[..len], offset)
+        .with_context(|| format!("Failed to read source at {}", offset))
+}
+
+/// compresses one block, keeping it raw when that is not smaller
+fn compress_block(block: &[u8], compression: CowCompression) -> Result<(u8, Vec<u8>)> {
+    if compression == CowCompression::None {
+        return Ok((0, block.to_vec()));
+    }
+
+    // the encoders are async but purely CPU bound over a slice
+    let compressed = futures::executor::block_on(async {
+        let mut out = Vec::with_capacity(block.len());
+        match compression {
+            CowCompression::Gz => {
+                ZlibEncoder::with_quality(block, Level::Default)
+                    .read_to_end(&mut out)
+                    .await
+            }
+            CowCompression::Brotli => {
+                BrotliEncoder::with_quality(block, Level::Default)
+                    .read_to_end(&mut out)
+                    .await
+            }
+            CowCompression::Zstd => {
+                ZstdEncoder::with_quality(block, Level::Default)
+                    .read_to_end(&mut out)
+                    .await
+            }
+            CowCompression::None => unreachable!(),
+        }
+        .map(|_| out)
+    })?;
+
+    if compressed.len() < block.len() {
+        Ok((compression.id(), compressed))
+    } else {
+        Ok((0, block.to_vec()))
+    }
+}
+
+/// sequential v2 writer, ops and data interleaved in clusters
+struct CowWriter<'a> {
+    file: &'a File,
+    cluster_ops: u64,
+    next_op_pos: u64,
+    next_data_pos: u64,
+    // ops and data bytes in the open cluster
+    cluster_used: u64,
+    cluster_data: u64,
+    num_ops: u64,
+}
+
+impl<'a> CowWriter<'a> {
+    fn new(file: &'a File, block_size: u64, cluster_ops: u32) -> Result<Self> {
+        if cluster_ops < 2 {
+            return Err(anyhow!("A cluster needs room for at least two ops"));
+        }
+
+        let mut header = Vec::with_capacity(HEADER_SIZE as usize);
+        header.extend_from_slice(&COW_MAGIC.to_le_bytes());
+        header.extend_from_slice(&COW_VERSION_MAJOR.to_le_bytes());
+        header.extend_from_slice(&COW_VERSION_MINOR.to_le_bytes());
+        header.extend_from_slice(&HEADER_SIZE.to_le_bytes());
+        header.extend_from_slice(&FOOTER_SIZE.to_le_bytes());
+        header.extend_from_slice(&(OP_SIZE as u16).to_le_bytes());
+        header.extend_from_slice(&(block_size as u32).to_le_bytes());
+        header.extend_from_slice(&0u32.to_le_bytes()); // num_merge_ops
+        header.extend_from_slice(&cluster_ops.to_le_bytes());
+        header.extend_from_slice(&BUFFER_SIZE.to_le_bytes());
+
+        file.set_len(0)?;
+        write_all_at(file, &header, 0).context("Failed to write COW header")?;
+
+        let first_op = HEADER_SIZE as u64 + BUFFER_SIZE;
+        let cluster_ops = cluster_ops as u64;
+
+        Ok(Self {
+            file,
+            cluster_ops,
+            next_op_pos: first_op,
+            next_data_pos: first_op + cluster_ops * OP_SIZE as u64,
+            cluster_used: 0,
+            cluster_data: 0,
+            num_ops: 0,
+        })
+    }
+
+    fn add_sequence(&mut self, blocks: &[u32]) -> Result<()> {
+        // data_length is 16 bits, long sequences take several ops
+        for chunk in blocks.chunks(u16::MAX as usize / 4) {
+            let data: Vec<u8> = chunk.iter().flat_map(|b| b.to_le_bytes()).collect();
+            self.add_op(OP_SEQUENCE, 0, 0, 0, &data)?;
+        }
+        Ok(())
+    }
+
+    fn add_op(
+        &mut self,
+        op_type: u8,
+        compression: u8,
+        new_block: u64,
+        source: u64,
+        data: &[u8],
+    ) -> Result<()> {
+        // the last slot of every cluster is reserved for the cluster op
+        if self.cluster_used == self.cluster_ops - 1 {
+            self.close_cluster()?;
+        }
+
+        // replace and sequence ops point at their own data
+        let source = if op_type == OP_REPLACE || op_type == OP_SEQUENCE {
+            self.next_data_pos
+        } else {
+            source
+        };
+        self.write_op(op_type, compression, new_block, source, data)?;
+
+        self.cluster_used += 1;
+        self.cluster_data += data.len() as u64;
+        self.next_op_pos += OP_SIZE as u64;
+        self.next_data_pos += data.len() as u64;
+        Ok(())
+    }
+
+    fn close_cluster(&mut self) -> Result<()> {
+        // the cluster op skips over the data written behind this cluster
+        let skip = self.cluster_data + (self.cluster_ops - 1 - self.cluster_used) * OP_SIZE as u64;
+        self.write_op(OP_CLUSTER, 0, 0, skip, &[])?;
+
+        self.next_op_pos += OP_SIZE as u64 + skip;
+        self.next_data_pos += self.cluster_ops * OP_SIZE as u64;
+        self.cluster_used = 0;
+        self.cluster_data = 0;
+        Ok(())
+    }
+
+    fn write_op(
+        &mut self,
+        op_type: u8,
+        compression: u8,
+        new_block: u64,
+        source: u64,
+        data: &[u8],
+    ) -> Result<()> {
+        let mut op = [0u8; OP_SIZE];
+        op[0] = op_type;
+        op[1] = compression;
+        op[2..4].copy_from_slice(&(data.len() as u16).to_le_bytes());
+        op[4..12].copy_from_slice(&new_block.to_le_bytes());
+        op[12..20].copy_from_slice(&source.to_le_bytes());
+
+        write_all_at(self.file, &op, self.next_op_pos)?;
+        if !data.is_empty() {
+            write_all_at(self.file, data, self.next_data_pos)?;
+        }
+        self.num_ops += 1;
+        Ok(())
+    }
+
+    /// closes the last cluster and writes the footer, returns the file size
+    fn finish(mut self) -> Result<u64> {
+        // the footer has to come after all data
+        if self.cluster_data > 0 {
+            self.close_cluster()?;
+        }
+
+        let mut footer = [0u8; FOOTER_SIZE as usize];
+        footer[0] = OP_FOOTER;
+        footer[4..12].copy_from_slice(&self.num_ops.to_le_bytes());
+        footer[12..20].copy_from_slice(&(self.num_ops * OP_SIZE as u64).to_le_bytes());
+
+        write_all_at(self.file, &footer, self.next_op_pos).context("Failed to write COW footer")?;
+        let size = self.next_op_pos + FOOTER_SIZE as u64;
+        self.file.set_len(size)?;
+        Ok(size)
+    }
+}
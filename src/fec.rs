@@ -0,0 +1,658 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+// android verity forward error correction
+//
+// the data covered by `fec_data_extent` (filesystem plus hash tree) is
+// protected by RS(255, 255 - roots) codewords over GF(2^8) (polynomial 0x11d,
+// first consecutive root 0, primitive element 1, as libfec). codewords are
+// interleaved across the whole image: with `rounds = ceil(blocks / (255 -
+// roots))`, data symbol d of round i comes from block `i + d * rounds`, byte
+// k of that block feeding codeword k. each round therefore yields one
+// codeword per byte of a block and stores `roots` parity bytes per codeword,
+// codeword-major.
+//
+// because symbol d of all codewords of a round is exactly one block, the
+// encoder runs the RS LFSR on whole blocks at once: every step is a
+// block-wide GF multiply-accumulate, done with SSSE3/NEON nibble table
+// lookups where available. rounds are independent and spread across threads.
+
+use anyhow::{Context, Result, anyhow};
+use once_cell::sync::Lazy;
+use std::sync::atomic::{AtomicU64, Ordering};
+
+use crate::payload::sink::PartitionSink;
+use crate::structs::{Extent, PartitionUpdate};
+
+const RS_N: usize = 255;
+const GF_POLY: u32 = 0x11d;
+
+/// FEC description of one partition, from its manifest entry
+#[derive(Debug, Clone)]
+pub struct FecConfig {
+    pub block_size: u64,
+    pub data_offset: u64,
+    pub data_size: u64,
+    pub fec_offset: u64,
+    pub fec_size: u64,
+    pub roots: usize,
+}
+
+impl FecConfig {
+    /// `None` when the partition has no FEC
+    pub fn from_partition(partition: &PartitionUpdate, block_size: u64) -> Result<Option<Self>> {
+        let (Some(data), Some(fec)) = (
+            partition.fec_data_extent.as_ref(),
+            partition.fec_extent.as_ref(),
+        ) else {
+            return Ok(None);
+        };
+
+        if fec.num_blocks.unwrap_or(0) == 0 {
+            return Ok(None);
+        }
+
+        let roots = partition.fec_roots.unwrap_or(2) as usize;
+        if roots == 0 || roots >= RS_N {
+            return Err(anyhow!("Invalid fec_roots {}", roots));
+        }
+
+        let config = Self {
+            block_size,
+            data_offset: extent_start(data, block_size),
+            data_size: extent_len(data, block_size),
+            fec_offset: extent_start(fec, block_size),
+            fec_size: extent_len(fec, block_size),
+            roots,
+        };
+
+        // the extent may be padded up to whole blocks, but never too small
+        let needed = config.rounds() * config.roots as u64 * block_size;
+        if needed > config.fec_size {
+            return Err(anyhow!(
+                "FEC extent of {} holds {} bytes, {} needed",
+                partition.partition_name,
+                config.fec_size,
+                needed
+            ));
+        }
+
+        Ok(Some(config))
+    }
+
+    fn data_symbols(&self) -> usize {
+        RS_N - self.roots
+    }
+
+    fn data_blocks(&self) -> u64 {
+        self.data_size / self.block_size
+    }
+
+    fn rounds(&self) -> u64 {
+        self.data_blocks().div_ceil(self.data_symbols() as u64)
+    }
+
+    /// whether any operation of the partition writes into the FEC extent
+    pub fn is_written_by_payload(&self, partition: &PartitionUpdate) -> bool {
+        let fec_end = self.fec_offset + self.fec_size;
+
+        partition
+            .operations
+            .iter()
+            .flat_map(|op| op.dst_extents.iter())
+            .any(|e| {
+                let start = extent_start(e, self.block_size);
+                let end = start + extent_len(e, self.block_size);
+                start < fec_end && self.fec_offset < end
+            })
+    }
+}
+
+/// result of checking (and possibly repairing) an image against its FEC
+#[derive(Debug, Default)]
+pub struct FecReport {
+    /// codewords whose data and parity disagreed
+    pub corrupted_codewords: u64,
+    /// bytes fixed in place (data and parity)
+    pub corrected_bytes: u64,
+    /// codewords with more errors than the code can correct
+    pub uncorrectable_codewords: u64,
+}
+
+impl FecReport {
+    pub fn is_clean(&self) -> bool {
+        self.corrupted_codewords == 0
+    }
+}
+
+/// computes the FEC of the image and writes it into the FEC extent
+pub fn generate_fec<S: PartitionSink + ?Sized>(
+    file: &S,
+    config: &FecConfig,
+    workers: usize,
+) -> Result<()> {
+    let encoder = Encoder::new(config.roots);
+
+    for_each_round(file, config, workers, |round, data| {
+        let parity = encoder.encode(data, config.block_size as usize);
+        file.write_at(&parity, round_fec_offset(config, round))
+            .with_context(|| format!("Failed to write FEC round {}", round))
+    })
+}
+
+/// checks the image against the FEC stored in it
+///
+/// with `repair`, correctable codewords are fixed in place: damaged data
+/// blocks and parity bytes are rewritten
+pub fn verify_fec<S: PartitionSink + ?Sized>(
+    file: &S,
+    config: &FecConfig,
+    workers: usize,
+    repair: bool,
+) -> Result<FecReport> {
+    let encoder = Encoder::new(config.roots);
+    let corrupted = AtomicU64::new(0);
+    let corrected = AtomicU64::new(0);
+    let uncorrectable = AtomicU64::new(0);
+    let block_size = config.block_size as usize;
+    let roots = config.roots;
+
+    for_each_round(file, config, workers, |round, data| {
+        let computed = encoder.encode(data, block_size);
+
+        let fec_offset = round_fec_offset(config, round);
+        let mut stored = vec![0u8; computed.len()];
+        file.read_at(&mut stored, fec_offset)
+            .with_context(|| format!("Failed to read FEC round {}", round))?;
+
+        if computed == stored {
+            return Ok(());
+        }
+
+        let mut dirty_blocks = vec![false; data.len()];
+        let mut parity_dirty = false;
+        let mut codeword = [0u8; RS_N];
+
+        for k in 0..block_size {
+            let parity = &mut stored[k * roots..(k + 1) * roots];
+            if parity == &computed[k * roots..(k + 1) * roots] {
+                continue;
+            }
+            corrupted.fetch_add(1, Ordering::Relaxed);
+
+            if !repair {
+                continue;
+            }
+
+            for (d, block) in data.iter().enumerate() {
+                codeword[d] = block[k];
+            }
+            codeword[data.len()..].copy_from_slice(parity);
+
+            // symbols past the end of the data are implicit zeros, a
+            // "correction" there means the codeword was miscorrected
+            let decoded = decode(&mut codeword, roots).filter(|fixed| {
+                fixed
+                    .iter()
+                    .all(|&pos| pos >= data.len() || block_offset(config, round, pos).is_some())
+            });
+
+            match decoded {
+                Some(fixed) => {
+                    corrected.fetch_add(fixed.len() as u64, Ordering::Relaxed);
+                    for pos in fixed {
+                        if pos < data.len() {
+                            dirty_blocks[pos] = true;
+                        } else {
+                            parity_dirty = true;
+                        }
+                    }
+                    for (d, block) in data.iter_mut().enumerate() {
+                        block[k] = codeword[d];
+                    }
+                    parity.copy_from_slice(&codeword[data.len()..]);
+                }
+                None => {
+                    uncorrectable.fetch_add(1, Ordering::Relaxed);
+                }
+            }
+        }
+
+        for (d, block) in data.iter().enumerate() {
+            if !dirty_blocks[d] {
+                continue;
+            }
+            let Some(offset) = block_offset(config, round, d) else {
+                continue;
+            };
+            file.write_at(block, offset)
+                .with_context(|| format!("Failed to write repaired block at {}", offset))?;
+        }
+        if parity_dirty {
+            file.write_at(&stored, fec_offset)
+                .with_context(|| format!("Failed to write repaired FEC round {}", round))?;
+        }
+
+        Ok(())
+    })?;
+
+    Ok(FecReport {
+        corrupted_codewords: corrupted.into_inner(),
+        corrected_bytes: corrected.into_inner(),
+        uncorrectable_codewords: uncorrectable.into_inner(),
+    })
+}
+
+fn round_fec_offset(config: &FecConfig, round: u64) -> u64 {
+    config.fec_offset + round * config.roots as u64 * config.block_size
+}
+
+/// image offset of data symbol `d` of `round`, `None` past the end of the data
+fn block_offset(config: &FecConfig, round: u64, d: usize) -> Option<u64> {
+    let block = round + d as u64 * config.rounds();
+    (block < config.data_blocks()).then(|| config.data_offset + block * config.block_size)
+}
+
+/// reads the data blocks of every round and hands them to `f`, rounds split
+/// across `workers` threads
+fn for_each_round<S, F>(file: &S, config: &FecConfig, workers: usize, f: F) -> Result<()>
+where
+    S: PartitionSink + ?Sized,
+    F: Fn(u64, &mut [Vec<u8>]) -> Result<()> + Sync,
+{
+    if config.block_size == 0 || config.data_size % config.block_size != 0 {
+        return Err(anyhow!("FEC data is not block aligned"));
+    }
+
+    let rounds = config.rounds();
+    if rounds == 0 {
+        return Ok(());
+    }
+
+    let workers = workers.clamp(1, rounds as usize) as u64;
+    let next = AtomicU64::new(0);
+
+    std::thread::scope(|scope| -> Result<()> {
+        let handles: Vec<_> = (0..workers)
+            .map(|_| {
+                let (f, next) = (&f, &next);
+                scope.spawn(move || -> Result<()> {
+                    let mut data =
+                        vec![vec![0u8; config.block_size as usize]; config.data_symbols()];
+
+                    loop {
+                        let round = next.fetch_add(1, Ordering::Relaxed);
+                        if round >= rounds {
+                            return Ok(());
+                        }
+
+                        for (d, block) in data.iter_mut().enumerate() {
+                            match block_offset(config, round, d) {
+                                Some(offset) => file.read_at(block, offset).with_context(|| {
+                                    format!("Failed to read FEC data at {}", offset)
+                                })?,
+                                None => block.fill(0),
+                            }
+                        }
+                        f(round, &mut data)?;
+                    }
+                })
+            })
+            .collect();
+
+        for handle in handles {
+            handle
+                .join()
+                .map_err(|_| anyhow!("FEC worker panicked"))??;
+        }
+        Ok(())
+    })
+}
+
+/// precomputed generator polynomial and multiplication tables
+struct Encoder {
+    roots: usize,
+    // generator coefficients, g[0] is the constant term
+    tables: Vec<MulTable>,
+}
+
+impl Encoder {
+    fn new(roots: usize) -> Self {
+        // g(x) = (x - a^0)(x - a^1)...(x - a^(roots-1))
+        let mut g = vec![1u8];
+        for i in 0..roots {
+            let root = GF.exp[i];
+            let mut next = vec![0u8; g.len() + 1];
+            for (j, &c) in g.iter().enumerate() {
+                next[j + 1] ^= c;
+                next[j] ^= GF.mul(c, root);
+            }
+            g = next;
+        }
+
+        Self {
+            roots,
+            tables: g[..roots].iter().map(|&c| MulTable::new(c)).collect(),
+        }
+    }
+
+    /// parity of all codewords of one round, codeword-major
+    ///
+    /// `data[d]` holds symbol d of every codeword
+    fn encode(&self, data: &[Vec<u8>], block_size: usize) -> Vec<u8> {
+        let n = self.roots;
+        let mut parity = vec![vec![0u8; block_size]; n];
+        let mut scratch = vec![0u8; block_size];
+        let mut head = 0usize;
+
+        for symbol in data {
+            // feedback = data ^ p[0], then p[r] = p[r + 1] ^ fb * g[n - 1 - r]
+            // and p[n - 1] = fb * g[0]; the register shifts by moving `head`
+            let mut feedback = std::mem::take(&mut parity[head]);
+            xor_slice(&mut feedback, symbol);
+
+            for r in 0..n - 1 {
+                let slot = (head + 1 + r) % n;
+                self.tables[n - 1 - r].mul(&mut parity[slot], &feedback, true);
+            }
+
+            self.tables[0].mul(&mut scratch, &feedback, false);
+            parity[head] = std::mem::replace(&mut scratch, feedback);
+            head = (head + 1) % n;
+        }
+
+        let mut out = vec![0u8; block_size * n];
+        for m in 0..n {
+            let lane = &parity[(head + m) % n];
+            for (k, &byte) in lane.iter().enumerate() {
+                out[k * n + m] = byte;
+            }
+        }
+        out
+    }
+}
+
+/// corrects `codeword` (data followed by parity) in place
+///
+/// returns the corrected positions, `None` if there are too many errors
+fn decode(codeword: &mut [u8; RS_N], roots: usize) -> Option<Vec<usize>> {
+    // syndromes S_j = r(a^j), symbol i carries x^(n - 1 - i)
+    let syndromes: Vec<u8> = (0..roots)
+        .map(|j| {
+            codeword
+                .iter()
+                .fold(0u8, |acc, &c| GF.mul(acc, GF.exp[j]) ^ c)
+        })
+        .collect();
+
+    if syndromes.iter().all(|&s| s == 0) {
+        return Some(Vec::new());
+    }
+
+    // berlekamp-massey
+    let mut lambda = vec![1u8];
+    let mut prev = vec![1u8];
+    let mut len = 0usize;
+    let mut shift = 1usize;
+    let mut prev_discrepancy = 1u8;
+
+    for step in 0..roots {
+        let mut discrepancy = syndromes[step];
+        for i in 1..=len.min(lambda.len() - 1) {
+            discrepancy ^= GF.mul(lambda[i], syndromes[step - i]);
+        }
+
+        if discrepancy == 0 {
+            shift += 1;
+            continue;
+        }
+
+        let scale = GF.div(discrepancy, prev_discrepancy);
+        let mut updated = lambda.clone();
+        if updated.len() < prev.len() + shift {
+            updated.resize(prev.len() + shift, 0);
+        }
+        for (i, &c) in prev.iter().enumerate() {
+            updated[i + shift] ^= GF.mul(scale, c);
+        }
+
+        if 2 * len <= step {
+            prev = std::mem::replace(&mut lambda, updated);
+            len = step + 1 - len;
+            prev_discrepancy = discrepancy;
+            shift = 1;
+        } else {
+            lambda = updated;
+            shift += 1;
+        }
+    }
+
+    while lambda.len() > 1 && lambda[lambda.len() - 1] == 0 {
+        lambda.pop();
+    }
+    let degree = lambda.len() - 1;
+    if degree == 0 || 2 * degree > roots {
+        return None;
+    }
+
+    // error evaluator omega = S(x) * lambda(x) mod x^roots
+    let mut omega = vec![0u8; roots];
+    for (i, &s) in syndromes.iter().enumerate() {
+        for (j, &l) in lambda.iter().enumerate() {
+            if i + j < roots {
+                omega[i + j] ^= GF.mul(s, l);
+            }
+        }
+    }
+
+    // chien search and forney, X = a^(n - 1 - pos)
+    let mut fixed = Vec::with_capacity(degree);
+    for pos in 0..RS_N {
+        let power = (RS_N - 1 - pos) % 255;
+        let x_inv = GF.exp[(255 - power) % 255];
+
+        if eval(&lambda, x_inv) != 0 {
+            continue;
+        }
+
+        let derivative: u8 = lambda
+            .iter()
+            .enumerate()
+            .skip(1)
+            .step_by(2)
+            .fold(0u8, |acc, (i, &c)| acc ^ GF.mul(c, GF.pow(x_inv, i - 1)));
+        if derivative == 0 {
+            return None;
+        }
+
+        let magnitude = GF.mul(GF.exp[power], GF.div(eval(&omega, x_inv), derivative));
+        codeword[pos] ^= magnitude;
+        fixed.push(pos);
+    }
+
+    (fixed.len() == degree).then_some(fixed)
+}
+
+fn eval(poly: &[u8], x: u8) -> u8 {
+    poly.iter().rev().fold(0u8, |acc, &c| GF.mul(acc, x) ^ c)
+}
+
+struct Gf {
+    exp: [u8; 512],
+    log: [u16; 256],
+}
+
+impl Gf {
+    fn mul(&self, a: u8, b: u8) -> u8 {
+        if a == 0 || b == 0 {
+            return 0;
+        }
+        self.exp[(self.log[a as usize] + self.log[b as usize]) as usize]
+    }
+
+    fn div(&self, a: u8, b: u8) -> u8 {
+        if a == 0 {
+            return 0;
+        }
+        self.exp[(self.log[a as usize] + 255 - self.log[b as usize]) as usize]
+    }
+
+    fn pow(&self, a: u8, n: usize) -> u8 {
+        if n == 0 {
+            return 1;
+        }
+        if a == 0 {
+            return 0;
+        }
+        self.exp[(self.log[a as usize] as usize * n) % 255]
+    }
+}
+
+static GF: Lazy<Gf> = Lazy::new(|| {
+    let mut exp = [0u8; 512];
+    let mut log = [0u16; 256];
+    let mut x = 1u32;
+
+    for i in 0..255 {
+        exp[i] = x as u8;
+        log[x as usize] = i as u16;
+        x <<= 1;
+        if x & 0x100 != 0 {
+            x ^= GF_POLY;
+        }
+    }
+    for i in 255..512 {
+        exp[i] = exp[i - 255];
+    }
+
+    Gf { exp, log }
+});
+
+/// multiplication by a constant, as full and nibble-split lookup tables
+struct MulTable {
+    full: [u8; 256],
+    lo: [u8; 16],
+    hi: [u8; 16],
+}
+
+impl MulTable {
+    fn new(c: u8) -> Self {
+        let mut full = [0u8; 256];
+        for (v, entry) in full.iter_mut().enumerate() {
+            *entry = GF.mul(c, v as u8);
+        }
+
+        let mut lo = [0u8; 16];
+        let mut hi = [0u8; 16];
+        for i in 0..16 {
+            lo[i] = full[i];
+            hi[i] = full[i << 4];
+        }
+
+        Self { full, lo, hi }
+    }
+
+    /// dst = c * src, or dst ^= c * src with `accumulate`
+    fn mul(&self, dst: &mut [u8], src: &[u8], accumulate: bool) {
+        let done = simd::mul(self, dst, src, accumulate);
+
+        for (d, &s) in dst[done..].iter_mut().zip(&src[done..]) {
+            let p = self.full[s as usize];
+            *d = if accumulate { *d ^ p } else { p };
+        }
+    }
+}
+
+fn xor_slice(dst: &mut [u8], src: &[u8]) {
+    for (d, &s) in dst.iter_mut().zip(src) {
+        *d ^= s;
+    }
+}
+
+// block-wide GF(2^8) multiply: c * v = lo[v & 0xf] ^ hi[v >> 4], with the
+// two 16-entry tables held in vector registers and looked up by byte shuffle
+mod simd {
+    use super::MulTable;
+
+    /// processes a prefix of whole vectors, returns how many bytes were done
+    #[cfg(target_arch = "x86_64")]
+    pub fn mul(table: &MulTable, dst: &mut [u8], src: &[u8], accumulate: bool) -> usize {
+        if std::arch::is_x86_feature_detected!("ssse3") {
+            // SAFETY: the required CPU feature was detected above
+            unsafe { mul_ssse3(table, dst, src, accumulate) }
+        } else {
+            0
+        }
+    }
+
+    #[cfg(target_arch = "x86_64")]
+    #[target_feature(enable = "ssse3")]
+    unsafe fn mul_ssse3(table: &MulTable, dst: &mut [u8], src: &[u8], accumulate: bool) -> usize {
+        use std::arch::x86_64::*;
+
+        let len = dst.len().min(src.len()) / 16 * 16;
+
+        // SAFETY: all accesses stay within the first `len` bytes of both slices
+        unsafe {
+            let lo = _mm_loadu_si128(table.lo.as_ptr() as *const __m128i);
+            let hi = _mm_loadu_si128(table.hi.as_ptr() as *const __m128i);
+            let mask = _mm_set1_epi8(0x0f);
+
+            for i in (0..len).step_by(16) {
+                let s = _mm_loadu_si128(src.as_ptr().add(i) as *const __m128i);
+                let l = _mm_and_si128(s, mask);
+                let h = _mm_and_si128(_mm_srli_epi64::<4>(s), mask);
+                let mut p = _mm_xor_si128(_mm_shuffle_epi8(lo, l), _mm_shuffle_epi8(hi, h));
+                if accumulate {
+                    let d = _mm_loadu_si128(dst.as_ptr().add(i) as *const __m128i);
+                    p = _mm_xor_si128(p, d);
+                }
+                _mm_storeu_si128(dst.as_mut_ptr().add(i) as *mut __m128i, p);
+            }
+        }
+
+        len
+    }
+
+    #[cfg(target_arch = "aarch64")]
+    pub fn mul(table: &MulTable, dst: &mut [u8], src: &[u8], accumulate: bool) -> usize {
+        use std::arch::aarch64::*;
+
+        let len = dst.len().min(src.len()) / 16 * 16;
+
+        // SAFETY: NEON is part of the aarch64 baseline, all accesses stay
+        // within the first `len` bytes of both slices
+        unsafe {
+            let lo = vld1q_u8(table.lo.as_ptr());
+            let hi = vld1q_u8(table.hi.as_ptr());
+            let mask = vdupq_n_u8(0x0f);
+
+            for i in (0..len).step_by(16) {
+                let s = vld1q_u8(src.as_ptr().add(i));
+                let l = vandq_u8(s, mask);
+                let h = vshrq_n_u8::<4>(s);
+                let mut p = veorq_u8(vqtbl1q_u8(lo, l), vqtbl1q_u8(hi, h));
+                if accumulate {
+                    p = veorq_u8(p, vld1q_u8(dst.as_ptr().add(i)));
+                }
+                vst1q_u8(dst.as_mut_ptr().add(i), p);
+            }
+        }
+
+        len
+    }
+
+    #[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+    pub fn mul(_: &MulTable, _: &mut [u8], _: &[u8], _: bool) -> usize {
+        0
+    }
+}
+
+fn extent_start(extent: &Extent, block_size: u64) -> u64 {
+    extent.start_block.unwrap_or(0) * block_size
+}
+
+fn extent_len(extent: &Extent, block_size: u64) -> u64 {
+    extent.num_blocks.unwrap_or(0) * block_size
+}
@@ -0,0 +1,709 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+// read-only EROFS walker
+//
+// inodes are addressed by nid (32 byte slots from meta_blkaddr), directories
+// are blocks of fixed-size dirents followed by their names. file data is
+// either flat (contiguous blocks, optionally with the tail packed right
+// after the inode), chunk based (a block address table per chunk) or
+// compressed: an index of logical clusters marks where each compressed
+// extent starts, the extent's physical cluster is read and decompressed.
+// LZ4 and zstd clusters are supported, the packed tail and fragment
+// features of newer mkfs.erofs versions are not.
+
+use anyhow::{Result, anyhow};
+use async_compression::tokio::bufread::ZstdDecoder;
+use async_trait::async_trait;
+use tokio::io::AsyncReadExt;
+
+use super::{BlockSource, Filesystem, NodeKind};
+
+pub const EROFS_SUPER_MAGIC: u32 = 0xE0F5_E1E2;
+
+const SUPERBLOCK_OFFSET: u64 = 1024;
+const INODE_SLOT_SIZE: u64 = 32;
+const DIRENT_SIZE: usize = 12;
+const NULL_ADDR: u32 = u32::MAX;
+// files handed back in one piece, everything bigger is refused
+const MAX_FILE_SIZE: u64 = 4 * 1024 * 1024 * 1024;
+
+const INCOMPAT_ZERO_PADDING: u32 = 0x1;
+
+const LAYOUT_FLAT_PLAIN: u8 = 0;
+const LAYOUT_COMPRESSED_FULL: u8 = 1;
+const LAYOUT_FLAT_INLINE: u8 = 2;
+const LAYOUT_COMPRESSED_COMPACT: u8 = 3;
+const LAYOUT_CHUNK_BASED: u8 = 4;
+
+const CHUNK_FORMAT_BLKBITS_MASK: u32 = 0x1f;
+const CHUNK_FORMAT_INDEXES: u32 = 0x20;
+
+const ADVISE_COMPACTED_2B: u16 = 0x1;
+const ADVISE_BIG_PCLUSTER_1: u16 = 0x2;
+const ADVISE_BIG_PCLUSTER_2: u16 = 0x4;
+const ADVISE_INLINE_PCLUSTER: u16 = 0x8;
+const ADVISE_INTERLACED_PCLUSTER: u16 = 0x10;
+const ADVISE_FRAGMENT_PCLUSTER: u16 = 0x20;
+const FRAGMENT_INODE_BIT: u8 = 0x80;
+
+// the first non-head lcluster of a big pcluster carries its block count
+const LI_D0_CBLKCNT: u16 = 1 << 11;
+
+const COMPRESSION_LZ4: u8 = 0;
+const COMPRESSION_ZSTD: u8 = 3;
+
+const S_IFMT: u16 = 0xF000;
+const S_IFREG: u16 = 0x8000;
+const S_IFDIR: u16 = 0x4000;
+const S_IFLNK: u16 = 0xA000;
+
+fn le16(buf: &[u8], offset: usize) -> u16 {
+    u16::from_le_bytes(buf[offset..offset + 2].try_into().unwrap())
+}
+
+fn le32(buf: &[u8], offset: usize) -> u32 {
+    u32::from_le_bytes(buf[offset..offset + 4].try_into().unwrap())
+}
+
+fn le64(buf: &[u8], offset: usize) -> u64 {
+    u64::from_le_bytes(buf[offset..offset + 8].try_into().unwrap())
+}
+
+/// the parts of an on-disk inode a read needs
+#[derive(Debug, Clone)]
+pub struct Inode {
+    pub nid: u64,
+    pub mode: u16,
+    pub size: u64,
+    layout: u8,
+    /// raw block address, chunk format or compressed block count by layout
+    raw: u32,
+    /// byte position right after the inode and its inline xattrs
+    end: u64,
+}
+
+/// kind of a logical cluster in a compressed file's index
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum LclusterType {
+    Plain,
+    Head1,
+    NonHead,
+    Head2,
+}
+
+impl LclusterType {
+    fn from_bits(bits: u16) -> Self {
+        match bits & 3 {
+            0 => Self::Plain,
+            1 => Self::Head1,
+            2 => Self::NonHead,
+            _ => Self::Head2,
+        }
+    }
+}
+
+/// one decoded logical cluster index entry
+#[derive(Debug, Clone, Copy)]
+struct Lcluster {
+    kind: LclusterType,
+    clusterofs: u64,
+    pblk: u64,
+    /// physical blocks of the big pcluster whose first non-head this is
+    compressed_blocks: Option<u64>,
+}
+
+/// decoded map header of a compressed inode
+struct ZMap {
+    compact: bool,
+    advise: u16,
+    algorithms: u8,
+    lcluster_bits: u32,
+    /// position of the first index entry
+    base: u64,
+    total: u64,
+}
+
+pub struct Erofs<'a> {
+    source: &'a dyn BlockSource,
+    block_bits: u32,
+    block_size: u64,
+    meta_blkaddr: u64,
+    incompat: u32,
+    root: Inode,
+}
+
+impl<'a> Erofs<'a> {
+    pub async fn open(source: &'a dyn BlockSource) -> Result<Self> {
+        let mut sb = [0u8; 128];
+        source.read_exact_at(SUPERBLOCK_OFFSET, &mut sb).await?;
+
+        if le32(&sb, 0) != EROFS_SUPER_MAGIC {
+            return Err(anyhow!("Not an EROFS filesystem"));
+        }
+
+        let block_bits = sb[12] as u32;
+        if !(9..=16).contains(&block_bits) {
+            return Err(anyhow!("Invalid EROFS block size (log {})", block_bits));
+        }
+
+        let mut fs = Self {
+            source,
+            block_bits,
+            block_size: 1 << block_bits,
+            meta_blkaddr: le32(&sb, 40) as u64,
+            incompat: le32(&sb, 80),
+            root: Inode {
+                nid: 0,
+                mode: 0,
+                size: 0,
+                layout: 0,
+                raw: 0,
+                end: 0,
+            },
+        };
+        fs.root = fs.inode(le16(&sb, 14) as u64).await?;
+        Ok(fs)
+    }
+
+    pub fn block_size(&self) -> u64 {
+        self.block_size
+    }
+
+    /// reads the inode at `nid`
+    pub async fn inode(&self, nid: u64) -> Result<Inode> {
+        let pos = self.meta_blkaddr * self.block_size + nid * INODE_SLOT_SIZE;
+        let mut raw = [0u8; 64];
+        self.source.read_exact_at(pos, &mut raw[..32]).await?;
+
+        let format = le16(&raw, 0);
+        let extended = format & 1 != 0;
+        let layout = ((format >> 1) & 7) as u8;
+        let xattr_count = le16(&raw, 2) as u64;
+
+        let (inode_size, size) = if extended {
+            self.source.read_exact_at(pos + 32, &mut raw[32..]).await?;
+            (64, le64(&raw, 8))
+        } else {
+            (32, le32(&raw, 8) as u64)
+        };
+
+        // inline xattrs: a 12 byte header and 4 byte slots, the header
+        // itself counting as the first slot
+        let xattr_size = if xattr_count == 0 {
+            0
+        } else {
+            12 + (xattr_count - 1) * 4
+        };
+
+        Ok(Inode {
+            nid,
+            mode: le16(&raw, 4),
+            size,
+            layout,
+            raw: le32(&raw, 16),
+            end: pos + inode_size + xattr_size,
+        })
+    }
+
+    /// whole content of `inode`
+    pub async fn read_inode(&self, inode: &Inode) -> Result<Vec<u8>> {
+        if inode.size > MAX_FILE_SIZE {
+            return Err(anyhow!(
+                "Inode {} is too large ({} bytes)",
+                inode.nid,
+                inode.size
+            ));
+        }
+
+        let mut data = vec![0u8; inode.size as usize];
+        if data.is_empty() {
+            return Ok(data);
+        }
+
+        match inode.layout {
+            LAYOUT_FLAT_PLAIN => {
+                self.source
+                    .read_exact_at(inode.raw as u64 * self.block_size, &mut data)
+                    .await?;
+            }
+            LAYOUT_FLAT_INLINE => {
+                // every block but the last is stored normally, the last one
+                // is packed right after the inode
+                let blocks = inode.size.div_ceil(self.block_size);
+                let head = ((blocks - 1) * self.block_size) as usize;
+                self.source
+                    .read_exact_at(inode.raw as u64 * self.block_size, &mut data[..head])
+                    .await?;
+                self.source
+                    .read_exact_at(inode.end, &mut data[head..])
+                    .await?;
+            }
+            LAYOUT_CHUNK_BASED => self.read_chunks(inode, &mut data).await?,
+            LAYOUT_COMPRESSED_FULL | LAYOUT_COMPRESSED_COMPACT => {
+                self.read_compressed(inode, &mut data).await?
+            }
+            other => {
+                return Err(anyhow!(
+                    "Inode {} has unknown data layout {}",
+                    inode.nid,
+                    other
+                ));
+            }
+        }
+
+        Ok(data)
+    }
+
+    async fn read_chunks(&self, inode: &Inode, data: &mut [u8]) -> Result<()> {
+        let chunk_bits = self.block_bits + (inode.raw & CHUNK_FORMAT_BLKBITS_MASK);
+        let chunk_size = 1u64 << chunk_bits;
+        let indexed = inode.raw & CHUNK_FORMAT_INDEXES != 0;
+        let unit = if indexed { 8 } else { 4 };
+
+        let chunks = inode.size.div_ceil(chunk_size) as usize;
+        let mut table = vec![0u8; chunks * unit];
+        self.source
+            .read_exact_at(inode.end.next_multiple_of(unit as u64), &mut table)
+            .await?;
+
+        for (i, entry) in table.chunks_exact(unit).enumerate() {
+            let blkaddr = if indexed {
+                if le16(entry, 2) != 0 {
+                    return Err(anyhow!(
+                        "Inode {} has chunks on an extra device, not supported",
+                        inode.nid
+                    ));
+                }
+                le32(entry, 4)
+            } else {
+                le32(entry, 0)
+            };
+
+            // unallocated chunks are holes
+            if blkaddr == NULL_ADDR {
+                continue;
+            }
+
+            let start = i as u64 * chunk_size;
+            let end = (start + chunk_size).min(inode.size);
+            self.source
+                .read_exact_at(
+                    blkaddr as u64 * self.block_size,
+                    &mut data[start as usize..end as usize],
+                )
+                .await?;
+        }
+
+        Ok(())
+    }
+
+    async fn read_compressed(&self, inode: &Inode, data: &mut [u8]) -> Result<()> {
+        let header_pos = inode.end.next_multiple_of(8);
+        let mut header = [0u8; 8];
+        self.source.read_exact_at(header_pos, &mut header).await?;
+
+        let advise = le16(&header, 4);
+        if header[7] & FRAGMENT_INODE_BIT != 0 || advise & ADVISE_FRAGMENT_PCLUSTER != 0 {
+            return Err(anyhow!(
+                "Inode {} uses EROFS fragments, not supported",
+                inode.nid
+            ));
+        }
+        if advise & ADVISE_INLINE_PCLUSTER != 0 {
+            return Err(anyhow!(
+                "Inode {} uses EROFS tail packing, not supported",
+                inode.nid
+            ));
+        }
+
+        let lcluster_bits = self.block_bits + (header[7] & 7) as u32;
+        let map = ZMap {
+            compact: inode.layout == LAYOUT_COMPRESSED_COMPACT,
+            advise,
+            algorithms: header[6],
+            lcluster_bits,
+            base: header_pos + 8,
+            total: inode.size.div_ceil(1 << lcluster_bits),
+        };
+
+        // every head lcluster starts an extent that runs to the next head
+        let mut heads = Vec::new();
+        for lcn in 0..map.total {
+            let lcluster = self.lcluster(&map, lcn).await?;
+            if lcluster.kind != LclusterType::NonHead {
+                heads.push((lcn, lcluster));
+            }
+        }
+
+        for (i, &(lcn, head)) in heads.iter().enumerate() {
+            let start = (lcn << lcluster_bits) | head.clusterofs;
+            let end = heads
+                .get(i + 1)
+                .map(|&(next, h)| (next << lcluster_bits) | h.clusterofs)
+                .unwrap_or(inode.size)
+                .min(inode.size);
+            if start >= end {
+                continue;
+            }
+
+            let blocks = self.pcluster_blocks(&map, lcn, head.kind).await?;
+            let mut raw = vec![0u8; (blocks * self.block_size) as usize];
+            self.source
+                .read_exact_at(head.pblk * self.block_size, &mut raw)
+                .await?;
+
+            let out = &mut data[start as usize..end as usize];
+            match head.kind {
+                LclusterType::Plain => self.copy_plain(&map, start, &raw, out)?,
+                LclusterType::Head1 => self.decompress(map.algorithms & 0xf, &raw, out).await?,
+                _ => self.decompress(map.algorithms >> 4, &raw, out).await?,
+            }
+        }
+
+        Ok(())
+    }
+
+    /// physical blocks of the pcluster whose head is at `lcn`
+    async fn pcluster_blocks(&self, map: &ZMap, lcn: u64, kind: LclusterType) -> Result<u64> {
+        let big = match kind {
+            LclusterType::Head1 => map.advise & ADVISE_BIG_PCLUSTER_1 != 0,
+            _ => map.advise & ADVISE_BIG_PCLUSTER_2 != 0,
+        };
+        if !big || lcn + 1 >= map.total {
+            return Ok(1);
+        }
+
+        let next = self.lcluster(map, lcn + 1).await?;
+        match (next.kind, next.compressed_blocks) {
+            (LclusterType::NonHead, Some(blocks)) if blocks > 0 => Ok(blocks),
+            (LclusterType::NonHead, _) => Err(anyhow!("Missing big pcluster size at {}", lcn)),
+            // a head right after a head carries no size: the pcluster is a
+            // single block, as in the kernel
+            _ => Ok(1),
+        }
+    }
+
+    /// index entry of logical cluster `lcn`
+    async fn lcluster(&self, map: &ZMap, lcn: u64) -> Result<Lcluster> {
+        if map.compact {
+            return self.compact_lcluster(map, lcn).await;
+        }
+
+        let mut entry = [0u8; 8];
+        self.source
+            .read_exact_at(map.base + lcn * 8, &mut entry)
+            .await?;
+
+        let kind = LclusterType::from_bits(le16(&entry, 0));
+        if kind == LclusterType::NonHead {
+            let delta0 = le16(&entry, 4);
+            return Ok(Lcluster {
+                kind,
+                clusterofs: 1 << map.lcluster_bits,
+                pblk: 0,
+                compressed_blocks: (delta0 & LI_D0_CBLKCNT != 0)
+                    .then_some((delta0 & !LI_D0_CBLKCNT) as u64),
+            });
+        }
+
+        Ok(Lcluster {
+            kind,
+            clusterofs: le16(&entry, 2) as u64,
+            pblk: le32(&entry, 4) as u64,
+            compressed_blocks: None,
+        })
+    }
+
+    /// entry `lcn` of a compacted index
+    ///
+    /// entries are bit-packed in packs (2 entries in 8 bytes or 16 in 32
+    /// bytes) that end with the block address of the pack's first pcluster;
+    /// a head's own block address is found by counting the pclusters before
+    /// it in the pack
+    async fn compact_lcluster(&self, map: &ZMap, lcn: u64) -> Result<Lcluster> {
+        if lcn >= map.total {
+            return Err(anyhow!("Logical cluster {} out of range", lcn));
+        }
+
+        // 4 byte entries up to 32 byte alignment, then 2 byte entries in
+        // multiples of 16 when enabled, then 4 byte entries again
+        let initial_4b = ((32 - map.base % 32) / 4) & 7;
+        let compacted_2b = if map.advise & ADVISE_COMPACTED_2B != 0 && initial_4b < map.total {
+            (map.total - initial_4b) / 16 * 16
+        } else {
+            0
+        };
+
+        let mut pos = map.base;
+        let mut index = lcn;
+        let amortized_shift = if index < initial_4b {
+            2
+        } else {
+            pos += initial_4b * 4;
+            index -= initial_4b;
+            if index < compacted_2b {
+                1
+            } else {
+                pos += compacted_2b * 2;
+                index -= compacted_2b;
+                2
+            }
+        };
+        pos += index << amortized_shift;
+
+        let count: u64 = if amortized_shift == 2 { 2 } else { 16 };
+        let pack_size = count << amortized_shift;
+        let encode_bits = ((pack_size - 4) * 8 / count) as usize;
+        let lo_bits = map.lcluster_bits.max(12);
+        let lo_mask = (1u32 << lo_bits) - 1;
+
+        let pack_pos = pos - pos % pack_size;
+        let mut pack = vec![0u8; pack_size as usize];
+        self.source.read_exact_at(pack_pos, &mut pack).await?;
+
+        let decode = |i: i64| -> (u32, LclusterType) {
+            let bit = encode_bits * i as usize;
+            let v = le32(&pack, bit / 8) >> (bit & 7);
+            (v & lo_mask, LclusterType::from_bits((v >> lo_bits) as u16))
+        };
+
+        let mut i = ((pos - pack_pos) >> amortized_shift) as i64;
+        let (lo, kind) = decode(i);
+        let big = map.advise & ADVISE_BIG_PCLUSTER_1 != 0;
+
+        if kind == LclusterType::NonHead {
+            return Ok(Lcluster {
+                kind,
+                clusterofs: 1 << map.lcluster_bits,
+                pblk: 0,
+                compressed_blocks: (big && lo & LI_D0_CBLKCNT as u32 != 0)
+                    .then_some((lo & !(LI_D0_CBLKCNT as u32)) as u64),
+            });
+        }
+
+        let mut blocks: i64 = if big { 0 } else { 1 };
+        while i > 0 {
+            i -= 1;
+            let (lo, kind) = decode(i);
+
+            if !big {
+                if kind == LclusterType::NonHead {
+                    i -= lo as i64;
+                }
+                if i >= 0 {
+                    blocks += 1;
+                }
+                continue;
+            }
+
+            if kind == LclusterType::NonHead {
+                if lo & LI_D0_CBLKCNT as u32 != 0 {
+                    i -= 1;
+                    blocks += (lo & !(LI_D0_CBLKCNT as u32)) as i64;
+                    continue;
+                }
+                if lo <= 1 {
+                    return Err(anyhow!("Corrupted compacted index at {}", lcn));
+                }
+                i -= lo as i64 - 2;
+                continue;
+            }
+            blocks += 1;
+        }
+
+        let pack_blkaddr = le32(&pack, pack_size as usize - 4) as i64;
+        Ok(Lcluster {
+            kind,
+            clusterofs: lo as u64,
+            pblk: (pack_blkaddr + blocks) as u64,
+            compressed_blocks: None,
+        })
+    }
+
+    /// uncompressed pcluster, interlaced ones start mid-block at the
+    /// extent's own in-block offset and wrap around
+    fn copy_plain(&self, map: &ZMap, start: u64, raw: &[u8], out: &mut [u8]) -> Result<()> {
+        if out.len() > raw.len() {
+            return Err(anyhow!("Uncompressed extent larger than its pcluster"));
+        }
+
+        if map.advise & ADVISE_INTERLACED_PCLUSTER == 0 {
+            out.copy_from_slice(&raw[..out.len()]);
+            return Ok(());
+        }
+
+        let right = (self.block_size - start % self.block_size) as usize;
+        let from = raw.len() - right;
+        let first = right.min(out.len());
+        out[..first].copy_from_slice(&raw[from..from + first]);
+        let rest = out.len() - first;
+        out[first..].copy_from_slice(&raw[..rest]);
+        Ok(())
+    }
+
+    async fn decompress(&self, algorithm: u8, raw: &[u8], out: &mut [u8]) -> Result<()> {
+        // with zero padding the compressed stream ends at the end of the
+        // pcluster and is preceded by zeros
+        let input = if self.incompat & INCOMPAT_ZERO_PADDING != 0 {
+            let skip = raw.iter().position(|&b| b != 0).unwrap_or(raw.len());
+            &raw[skip..]
+        } else {
+            raw
+        };
+
+        match algorithm {
+            COMPRESSION_LZ4 => lz4_decompress(input, out),
+            COMPRESSION_ZSTD => {
+                let mut decoder = ZstdDecoder::new(input);
+                let mut filled = 0;
+                while filled < out.len() {
+                    let n = decoder.read(&mut out[filled..]).await?;
+                    if n == 0 {
+                        return Err(anyhow!("zstd cluster ends early"));
+                    }
+                    filled += n;
+                }
+                Ok(())
+            }
+            other => Err(anyhow!(
+                "EROFS compression algorithm {} is not supported",
+                other
+            )),
+        }
+    }
+
+    /// nid of entry `name` in directory `dir`
+    pub async fn find_entry(&self, dir: &Inode, name: &[u8]) -> Result<Option<u64>> {
+        let data = self.read_inode(dir).await?;
+
+        for block in data.chunks(self.block_size as usize) {
+            if block.len() < DIRENT_SIZE {
+                break;
+            }
+
+            // the first name starts right after the last dirent
+            let count = le16(block, 8) as usize / DIRENT_SIZE;
+            if count == 0 || count * DIRENT_SIZE > block.len() {
+                return Err(anyhow!("Corrupted directory block in inode {}", dir.nid));
+            }
+
+            for i in 0..count {
+                let entry = &block[i * DIRENT_SIZE..];
+                let name_start = le16(entry, 8) as usize;
+                let name_end = if i + 1 < count {
+                    le16(entry, DIRENT_SIZE + 8) as usize
+                } else {
+                    block.len()
+                };
+                if name_start > name_end || name_end > block.len() {
+                    return Err(anyhow!("Corrupted directory block in inode {}", dir.nid));
+                }
+
+                // the last name of a block may be followed by zero padding
+                let mut entry_name = &block[name_start..name_end];
+                if i + 1 == count
+                    && let Some(nul) = entry_name.iter().position(|&b| b == 0)
+                {
+                    entry_name = &entry_name[..nul];
+                }
+
+                if entry_name == name {
+                    return Ok(Some(le64(entry, 0)));
+                }
+            }
+        }
+
+        Ok(None)
+    }
+}
+
+/// decodes an LZ4 block into `out`, stopping as soon as it is full
+///
+/// EROFS clusters hold plain LZ4 blocks (no frame) that may decode to more
+/// than the extent needs, so decoding stops at the output size
+fn lz4_decompress(input: &[u8], out: &mut [u8]) -> Result<()> {
+    let truncated = || anyhow!("LZ4 cluster is truncated");
+    let mut ip = 0usize;
+    let mut op = 0usize;
+
+    let read_length = |ip: &mut usize, mut length: usize| -> Result<usize> {
+        loop {
+            let b = *input.get(*ip).ok_or_else(truncated)?;
+            *ip += 1;
+            length += b as usize;
+            if b != 255 {
+                return Ok(length);
+            }
+        }
+    };
+
+    while op < out.len() {
+        let token = *input.get(ip).ok_or_else(truncated)?;
+        ip += 1;
+
+        let mut literals = (token >> 4) as usize;
+        if literals == 15 {
+            literals = read_length(&mut ip, literals)?;
+        }
+        let literals = literals.min(out.len() - op);
+        let src = input.get(ip..ip + literals).ok_or_else(truncated)?;
+        out[op..op + literals].copy_from_slice(src);
+        ip += literals;
+        op += literals;
+
+        if op == out.len() {
+            break;
+        }
+
+        let offset = le16(input.get(ip..ip + 2).ok_or_else(truncated)?, 0) as usize;
+        ip += 2;
+        if offset == 0 || offset > op {
+            return Err(anyhow!("Invalid LZ4 match offset {}", offset));
+        }
+
+        let mut length = (token & 15) as usize;
+        if length == 15 {
+            length = read_length(&mut ip, length)?;
+        }
+        let length = (length + 4).min(out.len() - op);
+
+        // matches may overlap their own output, copy forward byte by byte
+        for k in 0..length {
+            out[op + k] = out[op + k - offset];
+        }
+        op += length;
+    }
+
+    Ok(())
+}
+
+#[async_trait]
+impl Filesystem for Erofs<'_> {
+    type Node = Inode;
+
+    fn root(&self) -> Inode {
+        self.root.clone()
+    }
+
+    fn kind(&self, node: &Inode) -> NodeKind {
+        match node.mode & S_IFMT {
+            S_IFREG => NodeKind::File,
+            S_IFDIR => NodeKind::Directory,
+            S_IFLNK => NodeKind::Symlink,
+            _ => NodeKind::Other,
+        }
+    }
+
+    async fn lookup(&self, dir: &Inode, name: &[u8]) -> Result<Option<Inode>> {
+        match self.find_entry(dir, name).await? {
+            Some(nid) => Ok(Some(self.inode(nid).await?)),
+            None => Ok(None),
+        }
+    }
+
+    async fn read(&self, node: &Inode) -> Result<Vec<u8>> {
+        self.read_inode(node).await
+    }
+}
@@ -0,0 +1,451 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+// read-only ext4 (and ext2/3) walker
+//
+// superblock -> group descriptor -> inode table entry -> extent tree (or the
+// old indirect block map) -> data. only the blocks on that path are read,
+// the block and inode bitmaps and the journal are never looked at. htree
+// directories are scanned linearly, their index blocks look like empty
+// entries to a linear scan.
+
+use anyhow::{Result, anyhow};
+use async_trait::async_trait;
+
+use super::{BlockSource, Filesystem, NodeKind};
+
+pub const EXT4_SUPER_MAGIC: u16 = 0xEF53;
+
+const SUPERBLOCK_OFFSET: u64 = 1024;
+const ROOT_INODE: u32 = 2;
+const EXTENT_MAGIC: u16 = 0xF30A;
+// bytes of i_block, the extent tree root / block map / inline data
+const INODE_BLOCK_SIZE: usize = 60;
+const DIRECT_BLOCKS: usize = 12;
+// inode bytes read, enough for the in-inode xattrs of any real filesystem
+const MAX_INODE_SIZE: u64 = 1024;
+const XATTR_MAGIC: u32 = 0xEA02_0000;
+const XATTR_INDEX_SYSTEM: u8 = 7;
+const MAX_EXTENT_DEPTH: u16 = 5;
+// files handed back in one piece, everything bigger is refused
+const MAX_FILE_SIZE: u64 = 4 * 1024 * 1024 * 1024;
+
+const INCOMPAT_FILETYPE: u32 = 0x2;
+const INCOMPAT_META_BG: u32 = 0x10;
+const INCOMPAT_64BIT: u32 = 0x80;
+
+const EXTENTS_FL: u32 = 0x80000;
+const INLINE_DATA_FL: u32 = 0x1000_0000;
+const ENCRYPT_FL: u32 = 0x800;
+
+const S_IFMT: u16 = 0xF000;
+const S_IFREG: u16 = 0x8000;
+const S_IFDIR: u16 = 0x4000;
+const S_IFLNK: u16 = 0xA000;
+
+fn le16(buf: &[u8], offset: usize) -> u16 {
+    u16::from_le_bytes(buf[offset..offset + 2].try_into().unwrap())
+}
+
+fn le32(buf: &[u8], offset: usize) -> u32 {
+    u32::from_le_bytes(buf[offset..offset + 4].try_into().unwrap())
+}
+
+/// the parts of an on-disk inode a read needs
+#[derive(Debug, Clone)]
+pub struct Inode {
+    pub ino: u32,
+    pub mode: u16,
+    pub flags: u32,
+    pub size: u64,
+    block: [u8; INODE_BLOCK_SIZE],
+    /// rest of the inline data beyond i_block
+    inline_tail: Vec<u8>,
+}
+
+pub struct Ext4<'a> {
+    source: &'a dyn BlockSource,
+    block_size: u64,
+    first_data_block: u64,
+    inodes_per_group: u32,
+    inode_size: u64,
+    desc_size: u64,
+    incompat: u32,
+    root: Inode,
+}
+
+impl<'a> Ext4<'a> {
+    pub async fn open(source: &'a dyn BlockSource) -> Result<Self> {
+        let mut sb = [0u8; 1024];
+        source.read_exact_at(SUPERBLOCK_OFFSET, &mut sb).await?;
+
+        if le16(&sb, 56) != EXT4_SUPER_MAGIC {
+            return Err(anyhow!("Not an ext4 filesystem"));
+        }
+
+        let log_block_size = le32(&sb, 24);
+        if log_block_size > 6 {
+            return Err(anyhow!("Invalid ext4 block size (log {})", log_block_size));
+        }
+        let block_size = 1024u64 << log_block_size;
+
+        let incompat = le32(&sb, 96);
+        if incompat & INCOMPAT_META_BG != 0 {
+            return Err(anyhow!("ext4 meta_bg layout is not supported"));
+        }
+
+        // revision 0 filesystems have fixed 128 byte inodes
+        let inode_size = if le32(&sb, 76) == 0 {
+            128
+        } else {
+            le16(&sb, 88) as u64
+        };
+        let desc_size = if incompat & INCOMPAT_64BIT != 0 {
+            (le16(&sb, 254) as u64).max(32)
+        } else {
+            32
+        };
+
+        let inodes_per_group = le32(&sb, 40);
+        if inodes_per_group == 0 || inode_size < 128 {
+            return Err(anyhow!("Corrupted ext4 superblock"));
+        }
+
+        let mut fs = Self {
+            source,
+            block_size,
+            first_data_block: le32(&sb, 20) as u64,
+            inodes_per_group,
+            inode_size,
+            desc_size,
+            incompat,
+            root: Inode {
+                ino: 0,
+                mode: 0,
+                flags: 0,
+                size: 0,
+                block: [0; INODE_BLOCK_SIZE],
+                inline_tail: Vec::new(),
+            },
+        };
+        fs.root = fs.inode(ROOT_INODE).await?;
+        Ok(fs)
+    }
+
+    pub fn block_size(&self) -> u64 {
+        self.block_size
+    }
+
+    /// reads inode `ino` from its group's inode table
+    pub async fn inode(&self, ino: u32) -> Result<Inode> {
+        if ino == 0 {
+            return Err(anyhow!("Invalid inode number 0"));
+        }
+
+        let group = ((ino - 1) / self.inodes_per_group) as u64;
+        let index = ((ino - 1) % self.inodes_per_group) as u64;
+
+        // the descriptor table starts in the block after the superblock
+        let desc_offset = (self.first_data_block + 1) * self.block_size + group * self.desc_size;
+        let mut desc = vec![0u8; self.desc_size as usize];
+        self.source.read_exact_at(desc_offset, &mut desc).await?;
+
+        let mut inode_table = le32(&desc, 8) as u64;
+        if self.desc_size >= 64 {
+            inode_table |= (le32(&desc, 0x28) as u64) << 32;
+        }
+
+        let mut raw = vec![0u8; self.inode_size.min(MAX_INODE_SIZE) as usize];
+        self.source
+            .read_exact_at(
+                inode_table * self.block_size + index * self.inode_size,
+                &mut raw,
+            )
+            .await?;
+
+        let mode = le16(&raw, 0);
+        let size = le32(&raw, 4) as u64 | (le32(&raw, 0x6C) as u64) << 32;
+        let flags = le32(&raw, 0x20);
+        let mut block = [0u8; INODE_BLOCK_SIZE];
+        block.copy_from_slice(&raw[0x28..0x28 + INODE_BLOCK_SIZE]);
+
+        let inline_tail = if flags & INLINE_DATA_FL != 0 {
+            inline_data_xattr(&raw).unwrap_or_default()
+        } else {
+            Vec::new()
+        };
+
+        Ok(Inode {
+            ino,
+            mode,
+            flags,
+            size,
+            block,
+            inline_tail,
+        })
+    }
+
+    /// whole content of `inode`, holes and unwritten extents read as zeros
+    pub async fn read_inode(&self, inode: &Inode) -> Result<Vec<u8>> {
+        if inode.flags & ENCRYPT_FL != 0 {
+            return Err(anyhow!("Inode {} is encrypted", inode.ino));
+        }
+        if inode.size > MAX_FILE_SIZE {
+            return Err(anyhow!(
+                "Inode {} is too large ({} bytes)",
+                inode.ino,
+                inode.size
+            ));
+        }
+
+        let size = inode.size as usize;
+
+        // fast symlinks live in i_block itself, inline data continues in
+        // the system.data xattr
+        let is_fast_symlink = inode.mode & S_IFMT == S_IFLNK && size < INODE_BLOCK_SIZE;
+        if is_fast_symlink || inode.flags & INLINE_DATA_FL != 0 {
+            let mut data = inode.block.to_vec();
+            data.extend_from_slice(&inode.inline_tail);
+            if size > data.len() {
+                return Err(anyhow!("Inline data of inode {} is truncated", inode.ino));
+            }
+            data.truncate(size);
+            return Ok(data);
+        }
+
+        let runs = if inode.flags & EXTENTS_FL != 0 {
+            self.extent_runs(inode).await?
+        } else {
+            self.block_map_runs(inode).await?
+        };
+
+        let mut data = vec![0u8; size];
+        for run in runs {
+            let start = run.logical * self.block_size;
+            if start >= inode.size {
+                continue;
+            }
+            let end = ((run.logical + run.len) * self.block_size).min(inode.size);
+            self.source
+                .read_exact_at(
+                    run.physical * self.block_size,
+                    &mut data[start as usize..end as usize],
+                )
+                .await?;
+        }
+
+        Ok(data)
+    }
+
+    /// mapped blocks of an extent-based inode
+    async fn extent_runs(&self, inode: &Inode) -> Result<Vec<Run>> {
+        let mut runs = Vec::new();
+        let mut nodes = vec![(inode.block.to_vec(), MAX_EXTENT_DEPTH + 1)];
+
+        while let Some((node, parent_depth)) = nodes.pop() {
+            if le16(&node, 0) != EXTENT_MAGIC {
+                return Err(anyhow!("Bad extent header in inode {}", inode.ino));
+            }
+
+            let entries = le16(&node, 2) as usize;
+            let depth = le16(&node, 6);
+            // every level has to be strictly below its parent, so a corrupted
+            // tree cannot loop
+            if depth >= parent_depth || 12 + entries * 12 > node.len() {
+                return Err(anyhow!("Corrupted extent tree in inode {}", inode.ino));
+            }
+
+            for i in 0..entries {
+                let entry = &node[12 + i * 12..24 + i * 12];
+
+                if depth == 0 {
+                    let raw_len = le16(entry, 4);
+                    // lengths above 32768 mark unwritten extents, which read
+                    // back as zeros
+                    if raw_len > 32768 {
+                        continue;
+                    }
+                    runs.push(Run {
+                        logical: le32(entry, 0) as u64,
+                        len: raw_len as u64,
+                        physical: (le16(entry, 6) as u64) << 32 | le32(entry, 8) as u64,
+                    });
+                } else {
+                    let leaf = (le16(entry, 8) as u64) << 32 | le32(entry, 4) as u64;
+                    let mut child = vec![0u8; self.block_size as usize];
+                    self.source
+                        .read_exact_at(leaf * self.block_size, &mut child)
+                        .await?;
+                    nodes.push((child, depth));
+                }
+            }
+        }
+
+        Ok(runs)
+    }
+
+    /// mapped blocks of an inode using direct and indirect block pointers
+    async fn block_map_runs(&self, inode: &Inode) -> Result<Vec<Run>> {
+        let per_block = self.block_size / 4;
+        let blocks = inode.size.div_ceil(self.block_size);
+        let mut runs: Vec<Run> = Vec::new();
+
+        // (pointer, indirection level, first logical block it maps)
+        let mut pending: Vec<(u32, u32, u64)> = Vec::new();
+        let mut first = 0u64;
+        for i in 0..15usize {
+            let level = i.saturating_sub(DIRECT_BLOCKS - 1) as u32;
+            pending.push((le32(&inode.block, i * 4), level, first));
+            first += per_block.pow(level);
+        }
+        pending.reverse();
+
+        while let Some((ptr, level, logical)) = pending.pop() {
+            if ptr == 0 || logical >= blocks {
+                continue;
+            }
+
+            if level == 0 {
+                match runs.last_mut() {
+                    Some(last)
+                        if last.logical + last.len == logical
+                            && last.physical + last.len == ptr as u64 =>
+                    {
+                        last.len += 1
+                    }
+                    _ => runs.push(Run {
+                        logical,
+                        len: 1,
+                        physical: ptr as u64,
+                    }),
+                }
+                continue;
+            }
+
+            let mut table = vec![0u8; self.block_size as usize];
+            self.source
+                .read_exact_at(ptr as u64 * self.block_size, &mut table)
+                .await?;
+
+            let span = per_block.pow(level - 1);
+            for i in (0..per_block).rev() {
+                pending.push((le32(&table, i as usize * 4), level - 1, logical + i * span));
+            }
+        }
+
+        Ok(runs)
+    }
+
+    /// inode number of entry `name` in directory `dir`
+    pub async fn find_entry(&self, dir: &Inode, name: &[u8]) -> Result<Option<u32>> {
+        if dir.flags & INLINE_DATA_FL != 0 {
+            // inline directories start with the parent's inode number and
+            // have no "." or ".." entries
+            match name {
+                b"." => return Ok(Some(dir.ino)),
+                b".." => return Ok(Some(le32(&dir.block, 0))),
+                _ => {
+                    return Ok(self
+                        .scan_entries(&dir.block[4..], name)
+                        .or_else(|| self.scan_entries(&dir.inline_tail, name)));
+                }
+            }
+        }
+
+        let data = self.read_inode(dir).await?;
+        Ok(self.scan_entries(&data, name))
+    }
+
+    fn scan_entries(&self, data: &[u8], name: &[u8]) -> Option<u32> {
+        let mut pos = 0usize;
+
+        while pos + 8 <= data.len() {
+            let ino = le32(data, pos);
+            let mut rec_len = le16(data, pos + 4) as usize;
+            // 64k blocks store a full-block record length as 0 or 65535
+            if self.block_size >= 65536 && (rec_len == 0 || rec_len == 65535) {
+                rec_len = self.block_size as usize;
+            }
+            let name_len = if self.incompat & INCOMPAT_FILETYPE != 0 {
+                data[pos + 6] as usize
+            } else {
+                le16(data, pos + 6) as usize
+            };
+
+            if rec_len < 8 || pos + rec_len > data.len() || 8 + name_len > rec_len {
+                break;
+            }
+            if ino != 0 && &data[pos + 8..pos + 8 + name_len] == name {
+                return Some(ino);
+            }
+            pos += rec_len;
+        }
+
+        None
+    }
+}
+
+/// value of the in-inode `system.data` xattr, where inline data that does
+/// not fit i_block continues
+fn inline_data_xattr(raw: &[u8]) -> Option<Vec<u8>> {
+    let extra_size = le16(raw.get(..130)?, 128) as usize;
+    let start = 128 + extra_size;
+    if le32(raw.get(..start + 4)?, start) != XATTR_MAGIC {
+        return None;
+    }
+
+    // value offsets count from the first entry
+    let entries = start + 4;
+    let mut pos = entries;
+    while pos + 16 <= raw.len() && le32(raw, pos) != 0 {
+        let name_len = raw[pos] as usize;
+        let name = raw.get(pos + 16..pos + 16 + name_len)?;
+
+        if raw[pos + 1] == XATTR_INDEX_SYSTEM && name == b"data" {
+            let offset = entries + le16(raw, pos + 2) as usize;
+            let size = le32(raw, pos + 8) as usize;
+            return raw.get(offset..offset + size).map(|v| v.to_vec());
+        }
+        pos += (16 + name_len + 3) & !3;
+    }
+
+    None
+}
+
+/// `len` logical blocks from `logical` stored at `physical`
+#[derive(Debug, Clone, Copy)]
+struct Run {
+    logical: u64,
+    len: u64,
+    physical: u64,
+}
+
+#[async_trait]
+impl Filesystem for Ext4<'_> {
+    type Node = Inode;
+
+    fn root(&self) -> Inode {
+        self.root.clone()
+    }
+
+    fn kind(&self, node: &Inode) -> NodeKind {
+        match node.mode & S_IFMT {
+            S_IFREG => NodeKind::File,
+            S_IFDIR => NodeKind::Directory,
+            S_IFLNK => NodeKind::Symlink,
+            _ => NodeKind::Other,
+        }
+    }
+
+    async fn lookup(&self, dir: &Inode, name: &[u8]) -> Result<Option<Inode>> {
+        match self.find_entry(dir, name).await? {
+            Some(ino) => Ok(Some(self.inode(ino).await?)),
+            None => Ok(None),
+        }
+    }
+
+    async fn read(&self, node: &Inode) -> Result<Vec<u8>> {
+        self.read_inode(node).await
+    }
+}
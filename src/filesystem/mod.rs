@@ -0,0 +1,164 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+// read-only access to files inside ext4 and EROFS partition images
+//
+// everything goes through a `BlockSource`, so only the superblock, the
+// inodes and directories on the way to a file and the file's own blocks are
+// ever read. backed by a `PartitionBlockReader` this pulls a single file out
+// of a payload without extracting the partition it lives in.
+
+pub mod erofs;
+pub mod ext4;
+
+use anyhow::{Result, anyhow};
+use async_trait::async_trait;
+use std::collections::VecDeque;
+
+use crate::payload::block_reader::PartitionBlockReader;
+use crate::payload::payload_dumper::AsyncPayloadRead;
+
+// symlinks followed while resolving one path, as in linux (MAXSYMLINKS)
+const MAX_SYMLINKS: usize = 40;
+
+/// random access to the bytes of a partition image
+#[async_trait]
+pub trait BlockSource: Send + Sync {
+    /// reads exactly `buf.len()` bytes at `offset`
+    async fn read_exact_at(&self, offset: u64, buf: &mut [u8]) -> Result<()>;
+
+    /// size of the image in bytes
+    fn size(&self) -> u64;
+}
+
+#[async_trait]
+impl<P: AsyncPayloadRead> BlockSource for PartitionBlockReader<P> {
+    async fn read_exact_at(&self, offset: u64, buf: &mut [u8]) -> Result<()> {
+        PartitionBlockReader::read_exact_at(self, offset, buf).await
+    }
+
+    fn size(&self) -> u64 {
+        PartitionBlockReader::size(self)
+    }
+}
+
+/// filesystems `read_file` knows how to walk
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum FsKind {
+    Ext4,
+    Erofs,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum NodeKind {
+    File,
+    Directory,
+    Symlink,
+    Other,
+}
+
+/// the little a path walk needs from a filesystem
+#[async_trait]
+pub trait Filesystem: Send + Sync {
+    type Node: Clone + Send + Sync;
+
+    fn root(&self) -> Self::Node;
+
+    fn kind(&self, node: &Self::Node) -> NodeKind;
+
+    /// entry `name` of directory `dir`
+    async fn lookup(&self, dir: &Self::Node, name: &[u8]) -> Result<Option<Self::Node>>;
+
+    /// whole content of a file, or the target of a symlink
+    async fn read(&self, node: &Self::Node) -> Result<Vec<u8>>;
+}
+
+/// tells ext4 and EROFS apart by their superblock magic
+pub async fn detect(source: &dyn BlockSource) -> Result<Option<FsKind>> {
+    if source.size() < 2048 {
+        return Ok(None);
+    }
+
+    let mut sb = [0u8; 1024];
+    source.read_exact_at(1024, &mut sb).await?;
+
+    if u32::from_le_bytes(sb[0..4].try_into().unwrap()) == erofs::EROFS_SUPER_MAGIC {
+        return Ok(Some(FsKind::Erofs));
+    }
+    if u16::from_le_bytes(sb[56..58].try_into().unwrap()) == ext4::EXT4_SUPER_MAGIC {
+        return Ok(Some(FsKind::Ext4));
+    }
+    Ok(None)
+}
+
+/// reads the file at `path` (absolute, symlinks are followed) from the
+/// ext4 or EROFS image behind `source`
+pub async fn read_file(source: &dyn BlockSource, path: &str) -> Result<Vec<u8>> {
+    match detect(source).await? {
+        Some(FsKind::Ext4) => {
+            let fs = ext4::Ext4::open(source).await?;
+            read_path(&fs, path).await
+        }
+        Some(FsKind::Erofs) => {
+            let fs = erofs::Erofs::open(source).await?;
+            read_path(&fs, path).await
+        }
+        None => Err(anyhow!("Image is neither ext4 nor EROFS")),
+    }
+}
+
+/// resolves `path` from the root and reads the file it names
+pub async fn read_path<F: Filesystem>(fs: &F, path: &str) -> Result<Vec<u8>> {
+    let node = resolve(fs, path).await?;
+
+    match fs.kind(&node) {
+        NodeKind::File => fs.read(&node).await,
+        NodeKind::Directory => Err(anyhow!("{} is a directory", path)),
+        _ => Err(anyhow!("{} is not a regular file", path)),
+    }
+}
+
+async fn resolve<F: Filesystem>(fs: &F, path: &str) -> Result<F::Node> {
+    let mut remaining: VecDeque<Vec<u8>> = components(path.as_bytes()).collect();
+    let mut node = fs.root();
+    let mut symlinks = 0usize;
+
+    while let Some(name) = remaining.pop_front() {
+        if fs.kind(&node) != NodeKind::Directory {
+            return Err(anyhow!("{}: not a directory on the way", path));
+        }
+
+        let child = fs
+            .lookup(&node, &name)
+            .await?
+            .ok_or_else(|| anyhow!("{}: no such file or directory", path))?;
+
+        // the last component is followed too, the caller wants the content
+        if fs.kind(&child) == NodeKind::Symlink {
+            symlinks += 1;
+            if symlinks > MAX_SYMLINKS {
+                return Err(anyhow!("{}: too many levels of symbolic links", path));
+            }
+
+            let target = fs.read(&child).await?;
+            if target.first() == Some(&b'/') {
+                node = fs.root();
+            }
+            for component in components(&target).rev() {
+                remaining.push_front(component);
+            }
+            continue;
+        }
+
+        node = child;
+    }
+
+    Ok(node)
+}
+
+fn components(path: &[u8]) -> impl DoubleEndedIterator<Item = Vec<u8>> + '_ {
+    path.split(|&b| b == b'/')
+        .filter(|c| !c.is_empty() && *c != b".")
+        .map(|c| c.to_vec())
+}
@@ -69,11 +69,41 @@ async fn get_or_init_dns_resolver(
     Ok(GLOBAL_DNS_RESOLVER.get_or_init(|| resolver.clone()).clone())
 }
 
-/// HTTP client
+type ClientKey = (Option<String>, Option<String>, Option<String>);
+
+/// HTTP client, shared by every reader with the same settings
+///
+/// clones of a reqwest client share its connection pool, so payloads read
+/// from the same host in one process (a batch, several readers of one
+/// payload) reuse warm connections instead of handshaking again
 async fn create_http_client(
     user_agent: Option<&str>,
     cookies: Option<&str>,
     dns: Option<&str>,
+) -> Result<Client> {
+    static CLIENTS: std::sync::OnceLock<std::sync::Mutex<ahash::AHashMap<ClientKey, Client>>> =
+        std::sync::OnceLock::new();
+
+    let key: ClientKey = (
+        user_agent.map(str::to_string),
+        cookies.map(str::to_string),
+        dns.map(str::to_string),
+    );
+    let clients = CLIENTS.get_or_init(Default::default);
+
+    if let Some(client) = clients.lock().unwrap().get(&key) {
+        return Ok(client.clone());
+    }
+
+    let client = build_http_client(user_agent, cookies, dns).await?;
+    // another task may have built one meanwhile, keep the first
+    Ok(clients.lock().unwrap().entry(key).or_insert(client).clone())
+}
+
+async fn build_http_client(
+    user_agent: Option<&str>,
+    cookies: Option<&str>,
+    dns: Option<&str>,
 ) -> Result<Client> {
     static INIT_CRYPTO: Once = Once::new();
     INIT_CRYPTO.call_once(|| {
@@ -161,6 +191,9 @@ pub struct HttpReader {
     pub client: Client,
     pub url: String,
     pub content_length: u64,
+    /// ETag, or Last-Modified when the server sends no ETag, of the
+    /// resource, used to tell whether cached data about it is still valid
+    pub validator: Option<String>,
 }
 
 impl HttpReader {
@@ -206,10 +239,26 @@ impl HttpReader {
                         return Err(anyhow!("File size is 0"));
                     }
 
+                    // weak etags (W/) still change with the content, good enough
+                    // for caching metadata about it
+                    let header_str = |name| {
+                        response
+                            .headers()
+                            .get(name)
+                            .and_then(|v| v.to_str().ok())
+                            .map(str::to_string)
+                    };
+                    let validator = header_str(header::ETAG)
+                        .map(|etag| format!("etag:{}", etag))
+                        .or_else(|| {
+                            header_str(header::LAST_MODIFIED).map(|lm| format!("modified:{}", lm))
+                        });
+
                     return Ok(Self {
                         client,
                         url,
                         content_length,
+                        validator,
                     });
                 }
                 Err(e) => {
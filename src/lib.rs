@@ -2,7 +2,11 @@
 // Copyright (c) 2025 rhythmcache
 // https://github.com/rhythmcache/payload-dumper-rust
 
+pub mod cache;
 pub mod constants;
+pub mod cow;
+pub mod fec;
+pub mod filesystem;
 #[cfg(feature = "remote_zip")]
 pub mod http;
 pub mod metadata;
@@ -10,7 +14,11 @@ pub mod payload;
 #[cfg(feature = "prefetch")]
 pub mod prefetch;
 pub mod readers;
+pub mod seekable_zstd;
+pub mod sparse_tar;
 pub mod structs;
+pub mod super_image;
 pub mod utils;
+pub mod verity;
 #[cfg(any(feature = "local_zip", feature = "remote_zip"))]
 pub mod zip;
@@ -0,0 +1,218 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+// content-addressed reuse of decoded operation outputs across payloads
+//
+// consecutive builds of a device ship many REPLACE* blobs with identical
+// `data_sha256_hash`. decoding is deterministic, so a blob seen before has
+// the same output as last time. instead of keeping a second copy of that
+// output, the index remembers where it already lives: an extent of an image
+// extracted earlier. a hit is cloned from there (a reflink on filesystems
+// that share extents), so neither the download nor the decode happens.
+// images are tracked by file identity, an entry pointing into an image that
+// was modified, moved or deleted is simply a miss.
+
+use anyhow::Result;
+use serde::{Deserialize, Serialize};
+use std::collections::HashMap;
+use std::path::{Path, PathBuf};
+use std::sync::Mutex;
+use std::sync::atomic::{AtomicBool, Ordering};
+
+use crate::cache::{self, FileIdentity};
+use crate::structs::{InstallOperation, install_operation};
+
+const BLOB_INDEX_FILE: &str = "blob_index.json";
+// about 100 bytes of JSON each, the index stays in the tens of MB
+const MAX_BLOBS: usize = 500_000;
+
+/// an operation output that can be shared between payloads
+#[derive(Debug, Clone)]
+pub struct BlobKey {
+    key: String,
+    /// where the output goes in the partition
+    pub dst_offset: u64,
+    pub length: u64,
+}
+
+impl BlobKey {
+    /// `None` for operations whose output is not a pure function of their
+    /// blob: diff operations (they depend on the source), ops without a
+    /// blob hash and ops scattered over several extents
+    pub fn of(op: &InstallOperation, block_size: u64) -> Option<Self> {
+        let kind = match op.r#type() {
+            install_operation::Type::Replace => "replace",
+            install_operation::Type::ReplaceXz => "xz",
+            install_operation::Type::ReplaceBz => "bz",
+            install_operation::Type::Zstd => "zstd",
+            _ => return None,
+        };
+        let hash = op.data_sha256_hash.as_ref()?;
+        let [extent] = op.dst_extents.as_slice() else {
+            return None;
+        };
+
+        Some(Self {
+            key: format!("{}:{}", kind, hex::encode(hash)),
+            dst_offset: extent.start_block.unwrap_or(0) * block_size,
+            length: extent.num_blocks.unwrap_or(0) * block_size,
+        })
+    }
+}
+
+/// where a blob's output can be copied from
+#[derive(Debug, Clone)]
+pub struct BlobSource {
+    pub image: PathBuf,
+    pub offset: u64,
+}
+
+#[derive(Debug, Default, Serialize, Deserialize)]
+struct BlobIndex {
+    next_image: u32,
+    images: HashMap<u32, ImageRecord>,
+    blobs: HashMap<String, BlobLocation>,
+}
+
+#[derive(Debug, Serialize, Deserialize)]
+struct ImageRecord {
+    path: PathBuf,
+    identity: String,
+}
+
+#[derive(Debug, Clone, Copy, Serialize, Deserialize)]
+struct BlobLocation {
+    image: u32,
+    offset: u64,
+    length: u64,
+}
+
+/// persistent map from blob hash to an extent of a previously extracted
+/// image
+///
+/// safe to share between concurrent partition tasks
+#[derive(Debug)]
+pub struct BlobCache {
+    index: Mutex<BlobIndex>,
+    dirty: AtomicBool,
+}
+
+impl BlobCache {
+    pub fn load() -> Self {
+        Self {
+            index: Mutex::new(cache::load_json(BLOB_INDEX_FILE).unwrap_or_default()),
+            dirty: AtomicBool::new(false),
+        }
+    }
+
+    /// location of an unchanged earlier output of `key`
+    pub fn lookup(&self, key: &BlobKey) -> Option<BlobSource> {
+        let (path, identity, offset) = {
+            let index = self.index.lock().unwrap();
+            let location = index.blobs.get(&key.key)?;
+            if location.length != key.length {
+                return None;
+            }
+            let image = index.images.get(&location.image)?;
+            (image.path.clone(), image.identity.clone(), location.offset)
+        };
+
+        // checked on every hit, the image may be rewritten at any time
+        if FileIdentity::of(&path).ok()?.key() != identity {
+            return None;
+        }
+
+        Some(BlobSource {
+            image: path,
+            offset,
+        })
+    }
+
+    /// drops everything pointing into `path`, called before it is
+    /// overwritten
+    pub fn forget_image(&self, path: &Path) {
+        let path = path.canonicalize().unwrap_or_else(|_| path.to_path_buf());
+        let mut index = self.index.lock().unwrap();
+
+        let stale: Vec<u32> = index
+            .images
+            .iter()
+            .filter(|(_, image)| image.path == path)
+            .map(|(&id, _)| id)
+            .collect();
+        if stale.is_empty() {
+            return;
+        }
+
+        for id in &stale {
+            index.images.remove(id);
+        }
+        index
+            .blobs
+            .retain(|_, location| !stale.contains(&location.image));
+        self.dirty.store(true, Ordering::Relaxed);
+    }
+
+    /// remembers the finished image at `path` as the home of `written`
+    pub fn record_image(&self, path: &Path, written: &[BlobKey]) -> Result<()> {
+        if written.is_empty() {
+            return Ok(());
+        }
+        self.forget_image(path);
+
+        let identity = FileIdentity::of(path)?;
+        let mut index = self.index.lock().unwrap();
+
+        let id = index.next_image;
+        index.next_image = index.next_image.wrapping_add(1);
+        index.images.insert(
+            id,
+            ImageRecord {
+                path: identity.path.clone(),
+                identity: identity.key(),
+            },
+        );
+        for blob in written {
+            index.blobs.insert(
+                blob.key.clone(),
+                BlobLocation {
+                    image: id,
+                    offset: blob.dst_offset,
+                    length: blob.length,
+                },
+            );
+        }
+
+        // oldest images go first once the index grows too large
+        while index.blobs.len() > MAX_BLOBS {
+            let Some(&oldest) = index.images.keys().min() else {
+                break;
+            };
+            index.images.remove(&oldest);
+            index.blobs.retain(|_, location| location.image != oldest);
+        }
+
+        self.dirty.store(true, Ordering::Relaxed);
+        Ok(())
+    }
+
+    /// writes the index back if anything changed
+    pub fn save(&self) -> Result<()> {
+        if !self.dirty.swap(false, Ordering::Relaxed) {
+            return Ok(());
+        }
+
+        let mut index = self.index.lock().unwrap();
+
+        // images whose blobs all moved to newer images are not needed
+        let referenced: std::collections::HashSet<u32> = index
+            .blobs
+            .values()
+            .map(|location| location.image)
+            .collect();
+        index.images.retain(|id, _| referenced.contains(id));
+
+        cache::store_json(BLOB_INDEX_FILE, &*index)
+    }
+}
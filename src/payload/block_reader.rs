@@ -0,0 +1,514 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+use ahash::AHashMap;
+use anyhow::{Context, Result, anyhow};
+use async_compression::tokio::bufread::{BzDecoder, XzDecoder, ZstdDecoder};
+use std::sync::{Arc, Mutex};
+use tokio::io::{AsyncRead, AsyncReadExt};
+
+use crate::payload::payload_dumper::{AsyncPayloadRead, PayloadReader};
+use crate::structs::{InstallOperation, PartitionUpdate, install_operation};
+use crate::utils::run_blocking;
+
+#[cfg(feature = "diff_ota")]
+use crate::payload::diff::{
+    DiffContext, DiffOperationParams, extent_ranges, process_diff_operation, read_patch_data,
+};
+#[cfg(feature = "diff_ota")]
+use crate::payload::payload_dumper::NoOpReporter;
+#[cfg(feature = "diff_ota")]
+use crate::payload::source_image::SourceImage;
+#[cfg(feature = "diff_ota")]
+use crate::utils::read_exact_at;
+
+/// bytes of decoded operation output kept for later reads
+pub const DEFAULT_BLOCK_CACHE_BUDGET: u64 = 64 * 1024 * 1024;
+
+const MAX_OPERATION_SIZE: u64 = 512 * 1024 * 1024; // 512 MB safety limit
+
+/// run of destination blocks written by one operation
+#[derive(Debug, Clone, Copy)]
+struct IndexEntry {
+    start_block: u64,
+    num_blocks: u64,
+    op_index: usize,
+    /// where this run starts in the operation's decoded output, in blocks
+    op_block: u64,
+}
+
+/// random access to the blocks of a partition without extracting it
+///
+/// the destination extents of every operation are indexed up front, a read
+/// decodes only the operations covering the requested range and keeps their
+/// output in a small LRU, so neighbouring reads (filesystem metadata, a
+/// single file) rarely touch the payload twice. blocks no operation writes,
+/// ZERO and DISCARD included, read back as zeros without any I/O
+///
+/// `read_at` takes `&self`, the payload reader is opened on first use and
+/// shared behind a lock
+pub struct PartitionBlockReader<P: AsyncPayloadRead> {
+    partition: PartitionUpdate,
+    data_offset: u64,
+    block_size: u64,
+    size: u64,
+    payload: P,
+    index: Vec<IndexEntry>,
+    reader: tokio::sync::Mutex<Option<Box<dyn PayloadReader>>>,
+    cache: Mutex<OpCache>,
+    #[cfg(feature = "diff_ota")]
+    source: Option<Arc<SourceImage>>,
+}
+
+impl<P: AsyncPayloadRead> PartitionBlockReader<P> {
+    /// builds the block index of `partition`
+    ///
+    /// # Arguments
+    /// * `partition` -> the partition metadata
+    /// * `data_offset` -> offset in payload file where data begins
+    /// * `block_size` -> block size from the manifest
+    /// * `payload` -> payload the operation data is read from
+    pub fn new(
+        partition: &PartitionUpdate,
+        data_offset: u64,
+        block_size: u64,
+        payload: P,
+    ) -> Result<Self> {
+        if block_size == 0 {
+            return Err(anyhow!("Block size must not be zero"));
+        }
+
+        let mut index = Vec::new();
+        let mut end_block = 0u64;
+
+        for (op_index, op) in partition.operations.iter().enumerate() {
+            let mut op_block = 0u64;
+            let skip = matches!(
+                op.r#type(),
+                install_operation::Type::Zero | install_operation::Type::Discard
+            );
+
+            for extent in &op.dst_extents {
+                let start_block = extent.start_block.unwrap_or(0);
+                let num_blocks = extent.num_blocks.unwrap_or(0);
+                if num_blocks == 0 {
+                    continue;
+                }
+
+                let extent_end = start_block
+                    .checked_add(num_blocks)
+                    .ok_or_else(|| anyhow!("Extent of operation {} overflows", op_index))?;
+                end_block = end_block.max(extent_end);
+
+                if !skip {
+                    index.push(IndexEntry {
+                        start_block,
+                        num_blocks,
+                        op_index,
+                        op_block,
+                    });
+                }
+                op_block += num_blocks;
+            }
+        }
+
+        index.sort_by_key(|e| e.start_block);
+        if let Some(pair) = index
+            .windows(2)
+            .find(|w| w[0].start_block + w[0].num_blocks > w[1].start_block)
+        {
+            return Err(anyhow!(
+                "Operations {} and {} write overlapping blocks of {}",
+                pair[0].op_index,
+                pair[1].op_index,
+                partition.partition_name
+            ));
+        }
+
+        let size = partition
+            .new_partition_info
+            .as_ref()
+            .and_then(|info| info.size)
+            .unwrap_or(end_block * block_size);
+
+        Ok(Self {
+            partition: partition.clone(),
+            data_offset,
+            block_size,
+            size,
+            payload,
+            index,
+            reader: tokio::sync::Mutex::new(None),
+            cache: Mutex::new(OpCache::new(DEFAULT_BLOCK_CACHE_BUDGET)),
+            #[cfg(feature = "diff_ota")]
+            source: None,
+        })
+    }
+
+    /// source image differential operations are applied against
+    #[cfg(feature = "diff_ota")]
+    pub fn with_source(mut self, source: Arc<SourceImage>) -> Self {
+        self.source = Some(source);
+        self
+    }
+
+    /// changes the byte budget of the decoded operation cache, 0 disables it
+    pub fn with_cache_budget(self, budget: u64) -> Self {
+        if let Ok(mut cache) = self.cache.lock() {
+            *cache = OpCache::new(budget);
+        }
+        self
+    }
+
+    pub fn partition(&self) -> &PartitionUpdate {
+        &self.partition
+    }
+
+    pub fn block_size(&self) -> u64 {
+        self.block_size
+    }
+
+    /// size of the partition image in bytes
+    pub fn size(&self) -> u64 {
+        self.size
+    }
+
+    /// reads up to `buf.len()` bytes at `offset`
+    ///
+    /// returns the number of bytes read, which is only short at the end of
+    /// the partition
+    pub async fn read_at(&self, offset: u64, buf: &mut [u8]) -> Result<usize> {
+        if offset >= self.size {
+            return Ok(0);
+        }
+
+        let len = (self.size - offset).min(buf.len() as u64) as usize;
+        let mut done = 0usize;
+
+        while done < len {
+            let pos = offset + done as u64;
+            let block = pos / self.block_size;
+            let in_block = pos % self.block_size;
+            let remaining = len - done;
+
+            // last run starting at or before this block
+            let idx = self.index.partition_point(|e| e.start_block <= block);
+            let covering = idx
+                .checked_sub(1)
+                .map(|i| self.index[i])
+                .filter(|e| block < e.start_block + e.num_blocks);
+
+            let Some(entry) = covering else {
+                // unwritten up to the next run
+                let gap_end = self
+                    .index
+                    .get(idx)
+                    .map(|e| e.start_block * self.block_size)
+                    .unwrap_or(u64::MAX);
+                let n = (gap_end - pos).min(remaining as u64) as usize;
+                buf[done..done + n].fill(0);
+                done += n;
+                continue;
+            };
+
+            let data = self.decoded(entry.op_index).await?;
+            let start = ((entry.op_block + block - entry.start_block) * self.block_size + in_block)
+                as usize;
+            let run_end = ((entry.op_block + entry.num_blocks) * self.block_size) as usize;
+            let n = (run_end - start).min(remaining);
+            buf[done..done + n].copy_from_slice(&data[start..start + n]);
+            done += n;
+        }
+
+        Ok(len)
+    }
+
+    /// reads exactly `buf.len()` bytes at `offset`
+    pub async fn read_exact_at(&self, offset: u64, buf: &mut [u8]) -> Result<()> {
+        let n = self.read_at(offset, buf).await?;
+        if n != buf.len() {
+            return Err(anyhow!(
+                "Read of {} bytes at {} is beyond the end of {} ({} bytes)",
+                buf.len(),
+                offset,
+                self.partition.partition_name,
+                self.size
+            ));
+        }
+        Ok(())
+    }
+
+    /// decoded output of one operation, the dst extents concatenated
+    async fn decoded(&self, op_index: usize) -> Result<Arc<[u8]>> {
+        let cached = self.cache.lock().ok().and_then(|mut c| c.get(op_index));
+        if let Some(data) = cached {
+            return Ok(data);
+        }
+
+        let op = &self.partition.operations[op_index];
+        let data: Arc<[u8]> = self
+            .decode_operation(op_index, op)
+            .await
+            .with_context(|| {
+                format!(
+                    "Failed to decode operation {} of {}",
+                    op_index, self.partition.partition_name
+                )
+            })?
+            .into();
+
+        if let Ok(mut cache) = self.cache.lock() {
+            cache.insert(op_index, Arc::clone(&data));
+        }
+        Ok(data)
+    }
+
+    async fn decode_operation(&self, op_index: usize, op: &InstallOperation) -> Result<Vec<u8>> {
+        let expected = op
+            .dst_extents
+            .iter()
+            .map(|e| e.num_blocks.unwrap_or(0) * self.block_size)
+            .sum::<u64>();
+
+        if expected > MAX_OPERATION_SIZE {
+            return Err(anyhow!(
+                "Operation output of {} bytes exceeds safety limit",
+                expected
+            ));
+        }
+
+        let mut data = match op.r#type() {
+            op_type @ (install_operation::Type::Replace
+            | install_operation::Type::ReplaceXz
+            | install_operation::Type::ReplaceBz
+            | install_operation::Type::Zstd) => {
+                let offset = self.data_offset + op.data_offset.unwrap_or(0);
+                let length = op.data_length.unwrap_or(0);
+
+                if length > MAX_OPERATION_SIZE {
+                    return Err(anyhow!(
+                        "Operation data of {} bytes exceeds safety limit",
+                        length
+                    ));
+                }
+
+                // only the read holds the shared reader, the blob is decoded
+                // after it is released so other reads of the payload go on
+                let mut blob = {
+                    let mut guard = self.reader.lock().await;
+                    if guard.is_none() {
+                        *guard = Some(self.payload.open_reader().await?);
+                    }
+                    let reader = guard.as_mut().unwrap();
+                    let mut stream = reader.read_range(offset, length).await?;
+
+                    let mut blob = Vec::with_capacity(length as usize);
+                    stream
+                        .read_to_end(&mut blob)
+                        .await
+                        .with_context(|| format!("Failed to read {:?} data", op_type))?;
+                    blob
+                };
+
+                if op_type == install_operation::Type::Replace {
+                    blob.truncate(expected as usize);
+                    blob
+                } else {
+                    run_blocking(|| {
+                        futures::executor::block_on(async {
+                            let mut stream: std::pin::Pin<Box<dyn AsyncRead + Send + '_>> =
+                                match op_type {
+                                    install_operation::Type::ReplaceXz => {
+                                        Box::pin(XzDecoder::new(&blob[..]))
+                                    }
+                                    install_operation::Type::ReplaceBz => {
+                                        Box::pin(BzDecoder::new(&blob[..]))
+                                    }
+                                    _ => Box::pin(ZstdDecoder::new(&blob[..])),
+                                };
+
+                            let mut data = Vec::with_capacity(expected as usize);
+                            (&mut stream)
+                                .take(expected)
+                                .read_to_end(&mut data)
+                                .await
+                                .with_context(|| format!("Failed to decode {:?} data", op_type))?;
+                            Ok::<_, anyhow::Error>(data)
+                        })
+                    })?
+                }
+            }
+            #[cfg(feature = "diff_ota")]
+            install_operation::Type::SourceCopy
+            | install_operation::Type::SourceBsdiff
+            | install_operation::Type::BrotliBsdiff
+            | install_operation::Type::Lz4diffBsdiff
+            | install_operation::Type::Lz4diffPuffdiff
+            | install_operation::Type::Puffdiff
+            | install_operation::Type::Zucchini => self.decode_diff(op_index, op).await?,
+            other => {
+                return Err(anyhow!("Operation type {:?} cannot be read lazily", other));
+            }
+        };
+
+        // short replace blobs leave the tail of their extents zeroed, as in
+        // a full extraction
+        data.resize(expected as usize, 0);
+        Ok(data)
+    }
+
+    /// applies a differential operation against the source image
+    ///
+    /// SOURCE_COPY is served from the source directly, patches go through
+    /// the regular diff path into a sparse scratch file whose dst extents are
+    /// then read back
+    #[cfg(feature = "diff_ota")]
+    async fn decode_diff(&self, op_index: usize, op: &InstallOperation) -> Result<Vec<u8>> {
+        let source = self.source.as_deref().ok_or_else(|| {
+            anyhow!(
+                "Operation {} is a differential OTA operation but no source image was provided",
+                op_index
+            )
+        })?;
+
+        if op.r#type() == install_operation::Type::SourceCopy {
+            return run_blocking(|| {
+                source
+                    .read_extents(&op.src_extents, self.block_size)
+                    .map(|data| data.to_vec())
+            });
+        }
+
+        let patch_data = {
+            let mut guard = self.reader.lock().await;
+            if guard.is_none() {
+                *guard = Some(self.payload.open_reader().await?);
+            }
+            read_patch_data(guard.as_mut().unwrap().as_mut(), op, self.data_offset).await?
+        };
+
+        let scratch = ScratchFile::create()?;
+        let diff_ctx = DiffContext::new(
+            source
+                .path()
+                .parent()
+                .map(|p| p.to_path_buf())
+                .unwrap_or_default(),
+            self.block_size,
+        );
+
+        process_diff_operation(DiffOperationParams {
+            operation_index: op_index,
+            op,
+            ctx: &diff_ctx,
+            partition_name: &self.partition.partition_name,
+            source,
+            sink: &scratch.file,
+            patch_data: &patch_data,
+            reporter: &NoOpReporter,
+        })
+        .await?;
+
+        run_blocking(|| {
+            let ranges = extent_ranges(&op.dst_extents, self.block_size)?;
+            let mut data = vec![0u8; ranges.iter().map(|r| r.1).sum::<u64>() as usize];
+            let mut pos = 0usize;
+            for (offset, length) in ranges {
+                let length = length as usize;
+                read_exact_at(&scratch.file, &mut data[pos..pos + length], offset)?;
+                pos += length;
+            }
+            Ok(data)
+        })
+    }
+}
+
+/// temporary file removed again when dropped
+#[cfg(feature = "diff_ota")]
+struct ScratchFile {
+    file: std::fs::File,
+    path: std::path::PathBuf,
+}
+
+#[cfg(feature = "diff_ota")]
+impl ScratchFile {
+    fn create() -> Result<Self> {
+        use std::sync::atomic::{AtomicU64, Ordering};
+        static NEXT: AtomicU64 = AtomicU64::new(0);
+
+        let path = std::env::temp_dir().join(format!(
+            "payload-dumper-{}-{}.blocks",
+            std::process::id(),
+            NEXT.fetch_add(1, Ordering::Relaxed)
+        ));
+        let file = std::fs::OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create_new(true)
+            .open(&path)
+            .with_context(|| format!("Failed to create {}", path.display()))?;
+
+        Ok(Self { file, path })
+    }
+}
+
+#[cfg(feature = "diff_ota")]
+impl Drop for ScratchFile {
+    fn drop(&mut self) {
+        let _ = std::fs::remove_file(&self.path);
+    }
+}
+
+/// byte-budgeted LRU of decoded operation output, keyed by operation index
+struct OpCache {
+    budget: u64,
+    used: u64,
+    tick: u64,
+    entries: AHashMap<usize, (Arc<[u8]>, u64)>,
+}
+
+impl OpCache {
+    fn new(budget: u64) -> Self {
+        Self {
+            budget,
+            used: 0,
+            tick: 0,
+            entries: AHashMap::new(),
+        }
+    }
+
+    fn get(&mut self, op_index: usize) -> Option<Arc<[u8]>> {
+        self.tick += 1;
+        let (data, last_used) = self.entries.get_mut(&op_index)?;
+        *last_used = self.tick;
+        Some(Arc::clone(data))
+    }
+
+    fn insert(&mut self, op_index: usize, data: Arc<[u8]>) {
+        let size = data.len() as u64;
+        if size > self.budget {
+            return;
+        }
+
+        while self.used + size > self.budget {
+            let Some(oldest) = self
+                .entries
+                .iter()
+                .min_by_key(|(_, (_, last_used))| *last_used)
+                .map(|(key, _)| *key)
+            else {
+                break;
+            };
+            if let Some((evicted, _)) = self.entries.remove(&oldest) {
+                self.used -= evicted.len() as u64;
+            }
+        }
+
+        self.tick += 1;
+        if let Some((previous, _)) = self.entries.insert(op_index, (data, self.tick)) {
+            self.used -= previous.len() as u64;
+        }
+        self.used += size;
+    }
+}
@@ -0,0 +1,186 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+// streaming applier for SOURCE_BSDIFF / BROTLI_BSDIFF patches
+//
+// supports the Android `BSDF2` container (per stream none/bzip2/brotli) and
+// the legacy `BSDIFF40` format (bzip2 everywhere). the control, diff and
+// extra streams are decoded incrementally and the new data is pushed into
+// the destination extents through a small bounded buffer, so the output of an
+// operation is never materialized in memory.
+
+use anyhow::{Context, Result, anyhow};
+use async_compression::tokio::bufread::{BrotliDecoder, BzDecoder};
+use std::pin::Pin;
+use tokio::io::{AsyncRead, AsyncReadExt};
+
+use crate::payload::diff::ExtentWriter;
+
+const BSDIFF40_MAGIC: &[u8; 8] = b"BSDIFF40";
+const BSDF2_MAGIC: &[u8; 5] = b"BSDF2";
+const HEADER_SIZE: usize = 32;
+
+// bytes of diff/extra data decoded per step
+const CHUNK_SIZE: usize = 64 * 1024;
+
+#[derive(Debug, Clone, Copy)]
+enum StreamCompression {
+    None,
+    Bz2,
+    Brotli,
+}
+
+impl StreamCompression {
+    fn from_byte(value: u8) -> Result<Self> {
+        match value {
+            0 => Ok(Self::None),
+            1 => Ok(Self::Bz2),
+            2 => Ok(Self::Brotli),
+            other => Err(anyhow!("Unknown BSDF2 compression type {}", other)),
+        }
+    }
+
+    fn decoder<'a>(self, data: &'a [u8]) -> Pin<Box<dyn AsyncRead + Send + 'a>> {
+        match self {
+            Self::None => Box::pin(data),
+            Self::Bz2 => Box::pin(BzDecoder::new(data)),
+            Self::Brotli => Box::pin(BrotliDecoder::new(data)),
+        }
+    }
+}
+
+/// bsdiff stores signed 64-bit integers as little-endian sign-magnitude
+fn offtin(buf: &[u8]) -> i64 {
+    let mut bytes = [0u8; 8];
+    bytes.copy_from_slice(&buf[..8]);
+    let magnitude = (u64::from_le_bytes(bytes) & !(1u64 << 63)) as i64;
+
+    if buf[7] & 0x80 != 0 {
+        -magnitude
+    } else {
+        magnitude
+    }
+}
+
+fn checked_len(value: i64, what: &str) -> Result<usize> {
+    usize::try_from(value).map_err(|_| anyhow!("Corrupt patch: invalid {} {}", what, value))
+}
+
+/// applies a bsdiff patch against `old`, streaming the result into `out`
+/// returns the number of bytes produced
+pub async fn apply_patch(old: &[u8], patch: &[u8], out: &mut ExtentWriter<'_>) -> Result<u64> {
+    if patch.len() < HEADER_SIZE {
+        return Err(anyhow!("Patch too small ({} bytes)", patch.len()));
+    }
+
+    let compression = if patch.starts_with(BSDIFF40_MAGIC) {
+        [StreamCompression::Bz2; 3]
+    } else if patch.starts_with(BSDF2_MAGIC) {
+        [
+            StreamCompression::from_byte(patch[5])?,
+            StreamCompression::from_byte(patch[6])?,
+            StreamCompression::from_byte(patch[7])?,
+        ]
+    } else {
+        return Err(anyhow!("Unrecognized bsdiff patch magic"));
+    };
+
+    let ctrl_len = checked_len(offtin(&patch[8..16]), "control length")?;
+    let diff_len = checked_len(offtin(&patch[16..24]), "diff length")?;
+    let new_size = checked_len(offtin(&patch[24..32]), "new size")? as u64;
+
+    let ctrl_end = HEADER_SIZE
+        .checked_add(ctrl_len)
+        .filter(|&end| end <= patch.len())
+        .ok_or_else(|| anyhow!("Corrupt patch: control stream out of bounds"))?;
+    let diff_end = ctrl_end
+        .checked_add(diff_len)
+        .filter(|&end| end <= patch.len())
+        .ok_or_else(|| anyhow!("Corrupt patch: diff stream out of bounds"))?;
+
+    let mut ctrl = compression[0].decoder(&patch[HEADER_SIZE..ctrl_end]);
+    let mut diff = compression[1].decoder(&patch[ctrl_end..diff_end]);
+    let mut extra = compression[2].decoder(&patch[diff_end..]);
+
+    let mut ctrl_buf = [0u8; 24];
+    let mut chunk = vec![0u8; CHUNK_SIZE];
+    let mut old_pos: i64 = 0;
+    let mut new_pos: u64 = 0;
+
+    while new_pos < new_size {
+        ctrl.read_exact(&mut ctrl_buf)
+            .await
+            .context("Corrupt patch: truncated control stream")?;
+
+        let add_len = checked_len(offtin(&ctrl_buf[0..8]), "diff block length")? as u64;
+        let copy_len = checked_len(offtin(&ctrl_buf[8..16]), "extra block length")? as u64;
+        let seek = offtin(&ctrl_buf[16..24]);
+
+        if new_pos + add_len > new_size {
+            return Err(anyhow!("Corrupt patch: diff block runs past new size"));
+        }
+
+        // diff block: new = diff + old, bytes outside the old image count as 0
+        let mut remaining = add_len;
+        while remaining > 0 {
+            let n = remaining.min(CHUNK_SIZE as u64) as usize;
+            let buf = &mut chunk[..n];
+            diff.read_exact(buf)
+                .await
+                .context("Corrupt patch: truncated diff stream")?;
+
+            add_old(buf, old, old_pos);
+            out.write(buf).await?;
+
+            old_pos = old_pos
+                .checked_add(n as i64)
+                .ok_or_else(|| anyhow!("Corrupt patch: old position overflow"))?;
+            new_pos += n as u64;
+            remaining -= n as u64;
+        }
+
+        if new_pos + copy_len > new_size {
+            return Err(anyhow!("Corrupt patch: extra block runs past new size"));
+        }
+
+        // extra block: copied verbatim
+        let mut remaining = copy_len;
+        while remaining > 0 {
+            let n = remaining.min(CHUNK_SIZE as u64) as usize;
+            let buf = &mut chunk[..n];
+            extra
+                .read_exact(buf)
+                .await
+                .context("Corrupt patch: truncated extra stream")?;
+
+            out.write(buf).await?;
+
+            new_pos += n as u64;
+            remaining -= n as u64;
+        }
+
+        old_pos = old_pos
+            .checked_add(seek)
+            .ok_or_else(|| anyhow!("Corrupt patch: old position overflow"))?;
+    }
+
+    Ok(new_pos)
+}
+
+/// adds the overlapping part of `old[old_pos..]` into `buf`
+fn add_old(buf: &mut [u8], old: &[u8], old_pos: i64) {
+    // i128 so positions near the ends of the i64 range cannot overflow
+    let old_pos = old_pos as i128;
+    let start = old_pos.max(0);
+    let end = (old_pos + buf.len() as i128).min(old.len() as i128);
+    if start >= end {
+        return;
+    }
+
+    let dst = &mut buf[(start - old_pos) as usize..(end - old_pos) as usize];
+    let src = &old[start as usize..end as usize];
+    for (d, s) in dst.iter_mut().zip(src) {
+        *d = d.wrapping_add(*s);
+    }
+}
@@ -0,0 +1,166 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+// seeding an output image from its source image
+//
+// for incrementals most destination blocks are identical to the source, so
+// starting from a copy of the source lets those blocks be skipped entirely.
+// on copy-on-write filesystems (btrfs, xfs, bcachefs, apfs) the copy is a
+// reflink and costs no data I/O at all.
+
+use anyhow::{Context, Result, anyhow};
+use std::path::Path;
+
+/// how the source image ended up in the output path
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum CloneMethod {
+    /// shares extents with the source (FICLONE)
+    Reflink,
+    /// regular copy, `copy_file_range` / `clonefile` where the platform has them
+    Copy,
+}
+
+/// replaces `dst` with a clone of `src`
+pub fn clone_file(src: &Path, dst: &Path) -> Result<CloneMethod> {
+    if let (Ok(a), Ok(b)) = (src.canonicalize(), dst.canonicalize())
+        && a == b
+    {
+        return Err(anyhow!(
+            "Source image {} is the output path, refusing to clone it onto itself",
+            src.display()
+        ));
+    }
+
+    #[cfg(target_os = "linux")]
+    if reflink(src, dst).is_ok() {
+        return Ok(CloneMethod::Reflink);
+    }
+
+    // std::fs::copy already goes through copy_file_range on linux and
+    // fclonefileat on macOS, so this is as cheap as the platform allows
+    std::fs::copy(src, dst).with_context(|| {
+        format!(
+            "Failed to copy source image {} to {}",
+            src.display(),
+            dst.display()
+        )
+    })?;
+
+    Ok(CloneMethod::Copy)
+}
+
+#[cfg(target_os = "linux")]
+fn reflink(src: &Path, dst: &Path) -> std::io::Result<()> {
+    use std::fs::File;
+    use std::os::fd::AsRawFd;
+
+    // _IOW(0x94, 9, int)
+    const FICLONE: u32 = 0x4004_9409;
+
+    let src_file = File::open(src)?;
+    let dst_file = File::create(dst)?;
+
+    // SAFETY: both descriptors are valid for the duration of the call
+    let ret = unsafe { libc::ioctl(dst_file.as_raw_fd(), FICLONE as _, src_file.as_raw_fd()) };
+    if ret == 0 {
+        Ok(())
+    } else {
+        Err(std::io::Error::last_os_error())
+    }
+}
+
+/// makes `len` bytes of `dst` at `dst_offset` a copy of `src` at
+/// `src_offset`, sharing extents (FICLONERANGE) when the filesystem can
+///
+/// reflinks need block aligned offsets and both files on the same
+/// filesystem, anything else falls back to copying. file cursors are left
+/// alone
+pub fn clone_range(
+    src: &std::fs::File,
+    src_offset: u64,
+    dst: &std::fs::File,
+    dst_offset: u64,
+    len: u64,
+) -> Result<CloneMethod> {
+    #[cfg(target_os = "linux")]
+    if reflink_range(src, src_offset, dst, dst_offset, len).is_ok() {
+        return Ok(CloneMethod::Reflink);
+    }
+
+    let mut buf = vec![0u8; (len as usize).min(1024 * 1024)];
+    let mut done = 0u64;
+    while done < len {
+        let chunk = (len - done).min(buf.len() as u64) as usize;
+        crate::utils::read_exact_at(src, &mut buf[..chunk], src_offset + done)?;
+        crate::utils::write_all_at(dst, &buf[..chunk], dst_offset + done)?;
+        done += chunk as u64;
+    }
+
+    Ok(CloneMethod::Copy)
+}
+
+#[cfg(target_os = "linux")]
+fn reflink_range(
+    src: &std::fs::File,
+    src_offset: u64,
+    dst: &std::fs::File,
+    dst_offset: u64,
+    len: u64,
+) -> std::io::Result<()> {
+    use std::os::fd::AsRawFd;
+
+    #[repr(C)]
+    struct FileCloneRange {
+        src_fd: i64,
+        src_offset: u64,
+        src_length: u64,
+        dest_offset: u64,
+    }
+
+    // _IOW(0x94, 13, struct file_clone_range)
+    const FICLONERANGE: u32 = 0x4020_940d;
+
+    let range = FileCloneRange {
+        src_fd: src.as_raw_fd() as i64,
+        src_offset,
+        src_length: len,
+        dest_offset: dst_offset,
+    };
+
+    // SAFETY: both descriptors are valid and `range` outlives the call
+    let ret = unsafe { libc::ioctl(dst.as_raw_fd(), FICLONERANGE as _, &range) };
+    if ret == 0 {
+        Ok(())
+    } else {
+        Err(std::io::Error::last_os_error())
+    }
+}
+
+/// deallocates `len` bytes at `offset` so they read back as zeros
+///
+/// returns false when the filesystem cannot punch holes, the caller then has
+/// to write the zeros itself
+pub fn punch_hole(file: &std::fs::File, offset: u64, len: u64) -> bool {
+    #[cfg(target_os = "linux")]
+    {
+        use std::os::fd::AsRawFd;
+
+        // SAFETY: plain syscall on a valid descriptor
+        let ret = unsafe {
+            libc::fallocate(
+                file.as_raw_fd(),
+                libc::FALLOC_FL_PUNCH_HOLE | libc::FALLOC_FL_KEEP_SIZE,
+                offset as libc::off_t,
+                len as libc::off_t,
+            )
+        };
+        ret == 0
+    }
+
+    #[cfg(not(target_os = "linux"))]
+    {
+        let _ = (file, offset, len);
+        false
+    }
+}
@@ -2,14 +2,20 @@
 // Copyright (c) 2025 rhythmcache
 
 use anyhow::{Context, Result, anyhow};
+use async_compression::tokio::bufread::BrotliDecoder;
 use std::path::PathBuf;
-use tokio::fs::File;
-use tokio::io::{AsyncReadExt, AsyncSeekExt, AsyncWriteExt};
+use tokio::io::AsyncReadExt;
 
+use crate::payload::clone::clone_range;
 use crate::payload::payload_dumper::{PayloadReader, ProgressReporter};
+use crate::payload::sink::PartitionSink;
+use crate::payload::source_image::{SourceData, SourceImage};
+use crate::payload::{bspatch, zucchini};
 use crate::structs::{Extent, InstallOperation, install_operation};
+use crate::utils::run_blocking;
 
 const MAX_OPERATION_SIZE: usize = 512 * 1024 * 1024; // 512 MB safety limit
+const DST_WRITE_BUFFER_SIZE: usize = 1024 * 1024; // 1 MB staging for streamed output
 
 pub struct DiffContext {
     pub source_dir: PathBuf,
@@ -23,11 +29,11 @@ impl DiffContext {
             block_size,
         }
     }
-    async fn read_source_extents(
+    async fn read_source_extents<'s>(
         &self,
-        source_file: &mut File,
+        source: &'s SourceImage,
         extents: &[Extent],
-    ) -> Result<Vec<u8>> {
+    ) -> Result<SourceData<'s>> {
         let total_size: u64 = extents
             .iter()
             .map(|e| e.num_blocks.unwrap_or(0) * self.block_size)
@@ -40,103 +46,304 @@ impl DiffContext {
             ));
         }
 
-        let mut data = Vec::with_capacity(total_size as usize);
+        // contiguous extents come back as a borrowed slice of the mapping,
+        // only scattered ones are gathered (and pread when mapping failed)
+        run_blocking(|| source.read_extents(extents, self.block_size))
+    }
 
-        for (i, extent) in extents.iter().enumerate() {
-            let start_block = extent.start_block.unwrap_or(0);
-            let num_blocks = extent.num_blocks.unwrap_or(0);
+    fn write_dst_extents(
+        &self,
+        sink: &dyn PartitionSink,
+        extents: &[Extent],
+        data: &[u8],
+    ) -> Result<()> {
+        run_blocking(|| write_extents_at(sink, extents, self.block_size, data))
+    }
+}
 
-            if num_blocks == 0 {
-                continue;
-            }
+/// SOURCE_COPY that writes every block back to where it came from
+///
+/// such operations are no-ops when the output already holds the source image
+pub fn is_identity_copy(op: &InstallOperation) -> bool {
+    if op.r#type() != install_operation::Type::SourceCopy {
+        return false;
+    }
 
-            let offset = start_block
-                .checked_mul(self.block_size)
-                .ok_or_else(|| anyhow!("Offset overflow in extent {}", i))?;
+    let non_empty = |extents: &[Extent]| -> Vec<(u64, u64)> {
+        extents
+            .iter()
+            .filter(|e| e.num_blocks.unwrap_or(0) > 0)
+            .map(|e| (e.start_block.unwrap_or(0), e.num_blocks.unwrap_or(0)))
+            .collect()
+    };
 
-            let length = num_blocks
-                .checked_mul(self.block_size)
-                .ok_or_else(|| anyhow!("Length overflow in extent {}", i))?;
+    non_empty(&op.src_extents) == non_empty(&op.dst_extents)
+}
 
-            source_file
-                .seek(std::io::SeekFrom::Start(offset))
-                .await
-                .context(format!("Failed to seek to extent {} offset {}", i, offset))?;
+/// absolute payload range of the patch blob carried by a diff operation
+pub fn patch_range(op: &InstallOperation, data_offset: u64) -> Option<(u64, u64)> {
+    match op.data_length {
+        Some(length) if length > 0 => Some((data_offset + op.data_offset.unwrap_or(0), length)),
+        _ => None,
+    }
+}
 
-            let current_len = data.len();
-            data.resize(current_len + length as usize, 0);
+/// reads the whole patch blob of a diff operation from the payload
+pub async fn read_patch_data(
+    payload_reader: &mut dyn PayloadReader,
+    op: &InstallOperation,
+    data_offset: u64,
+) -> Result<Vec<u8>> {
+    let Some((patch_offset, patch_length)) = patch_range(op, data_offset) else {
+        return Ok(Vec::new());
+    };
+
+    if patch_length > MAX_OPERATION_SIZE as u64 {
+        return Err(anyhow!("Patch size {} exceeds safety limit", patch_length));
+    }
 
-            source_file
-                .read_exact(&mut data[current_len..])
-                .await
-                .context(format!("Failed to read extent {} ({} bytes)", i, length))?;
+    let mut patch_stream = payload_reader
+        .read_range(patch_offset, patch_length)
+        .await
+        .context("Failed to read patch data")?;
+
+    let mut patch_data = Vec::with_capacity(patch_length as usize);
+    patch_stream
+        .read_to_end(&mut patch_data)
+        .await
+        .context("Failed to read patch stream")?;
+
+    if patch_data.len() as u64 != patch_length {
+        return Err(anyhow!(
+            "Patch data truncated: expected {} bytes, got {} bytes",
+            patch_length,
+            patch_data.len()
+        ));
+    }
+
+    Ok(patch_data)
+}
+
+/// byte ranges (offset, length) covered by `extents`
+pub fn extent_ranges(extents: &[Extent], block_size: u64) -> Result<Vec<(u64, u64)>> {
+    let mut ranges = Vec::with_capacity(extents.len());
+
+    for (i, extent) in extents.iter().enumerate() {
+        let num_blocks = extent.num_blocks.unwrap_or(0);
+        if num_blocks == 0 {
+            continue;
         }
 
-        Ok(data)
+        let offset = extent
+            .start_block
+            .unwrap_or(0)
+            .checked_mul(block_size)
+            .ok_or_else(|| anyhow!("Offset overflow in extent {}", i))?;
+        let length = num_blocks
+            .checked_mul(block_size)
+            .ok_or_else(|| anyhow!("Length overflow in extent {}", i))?;
+
+        ranges.push((offset, length));
     }
 
-    async fn write_dst_extents(
-        &self,
-        out_file: &mut File,
-        extents: &[Extent],
-        data: &[u8],
-    ) -> Result<()> {
-        let expected_size: u64 = extents
-            .iter()
-            .map(|e| e.num_blocks.unwrap_or(0) * self.block_size)
-            .sum();
+    Ok(ranges)
+}
 
-        if data.len() != expected_size as usize {
-            return Err(anyhow!(
-                "Data size mismatch: expected {} bytes, got {} bytes",
-                expected_size,
-                data.len()
-            ));
+/// carries out a SOURCE_COPY by cloning its blocks from the source image
+/// file into `out`, so on reflink filesystems they keep sharing storage with
+/// the source instead of being written again
+///
+/// blocking, run it on a blocking thread
+pub fn clone_source_copy(
+    op: &InstallOperation,
+    source: &SourceImage,
+    out: &std::fs::File,
+    block_size: u64,
+) -> Result<()> {
+    let src = extent_ranges(&op.src_extents, block_size)?;
+    let dst = extent_ranges(&op.dst_extents, block_size)?;
+
+    let total = |ranges: &[(u64, u64)]| ranges.iter().map(|r| r.1).sum::<u64>();
+    if total(&src) != total(&dst) {
+        return Err(anyhow!(
+            "SOURCE_COPY covers {} source bytes but {} destination bytes",
+            total(&src),
+            total(&dst)
+        ));
+    }
+    if let Some(&(offset, length)) = src
+        .iter()
+        .find(|r| r.0.checked_add(r.1).is_none_or(|end| end > source.size()))
+    {
+        return Err(anyhow!(
+            "Source extent at {} ({} bytes) is beyond the end of {}",
+            offset,
+            length,
+            source.path().display()
+        ));
+    }
+
+    // walk both extent lists at once, cloning the overlap of each pair
+    let (mut s, mut d) = (0, 0);
+    let (mut s_done, mut d_done) = (0u64, 0u64);
+    while s < src.len() && d < dst.len() {
+        let (src_offset, src_length) = src[s];
+        let (dst_offset, dst_length) = dst[d];
+        let length = (src_length - s_done).min(dst_length - d_done);
+
+        clone_range(
+            source.file(),
+            src_offset + s_done,
+            out,
+            dst_offset + d_done,
+            length,
+        )?;
+
+        s_done += length;
+        d_done += length;
+        if s_done == src_length {
+            s += 1;
+            s_done = 0;
         }
+        if d_done == dst_length {
+            d += 1;
+            d_done = 0;
+        }
+    }
 
-        let mut data_offset = 0usize;
+    Ok(())
+}
 
-        for (i, extent) in extents.iter().enumerate() {
-            let start_block = extent.start_block.unwrap_or(0);
-            let num_blocks = extent.num_blocks.unwrap_or(0);
+/// writes `data` across `extents` with positional writes
+///
+/// several operations with disjoint destination extents may write through
+/// the same sink concurrently
+pub fn write_extents_at<S: PartitionSink + ?Sized>(
+    sink: &S,
+    extents: &[Extent],
+    block_size: u64,
+    data: &[u8],
+) -> Result<()> {
+    let ranges = extent_ranges(extents, block_size)?;
+    let expected: u64 = ranges.iter().map(|r| r.1).sum();
+
+    if data.len() as u64 != expected {
+        return Err(anyhow!(
+            "Data size mismatch: expected {} bytes, got {} bytes",
+            expected,
+            data.len()
+        ));
+    }
 
-            if num_blocks == 0 {
-                continue;
-            }
+    let mut pos = 0usize;
+    for (offset, length) in ranges {
+        let length = length as usize;
+        sink.write_at(&data[pos..pos + length], offset)
+            .with_context(|| format!("Failed to write {} bytes at offset {}", length, offset))?;
+        pos += length;
+    }
 
-            let offset = start_block
-                .checked_mul(self.block_size)
-                .ok_or_else(|| anyhow!("Offset overflow in dst extent {}", i))?;
+    Ok(())
+}
 
-            let length = (num_blocks * self.block_size) as usize;
+/// sequential writer over the destination extents of one operation
+///
+/// patch appliers that produce their output as a stream push it through this
+/// writer; bytes are staged in a bounded buffer and flushed per extent, so
+/// the full operation output never has to be held in memory
+pub struct ExtentWriter<'a> {
+    sink: &'a dyn PartitionSink,
+    // (byte offset, byte length) of every non-empty destination extent
+    ranges: Vec<(u64, u64)>,
+    current: usize,
+    filled: u64,
+    pending: Vec<u8>,
+    pending_offset: u64,
+    written: u64,
+}
+
+impl<'a> ExtentWriter<'a> {
+    pub fn new(sink: &'a dyn PartitionSink, extents: &[Extent], block_size: u64) -> Result<Self> {
+        let ranges = extent_ranges(extents, block_size)?;
+        let expected: u64 = ranges.iter().map(|r| r.1).sum();
+
+        Ok(Self {
+            sink,
+            ranges,
+            current: 0,
+            filled: 0,
+            pending: Vec::with_capacity(DST_WRITE_BUFFER_SIZE.min(expected as usize)),
+            pending_offset: 0,
+            written: 0,
+        })
+    }
 
-            if data_offset + length > data.len() {
+    pub async fn write(&mut self, mut data: &[u8]) -> Result<()> {
+        while !data.is_empty() {
+            let Some(&(offset, length)) = self.ranges.get(self.current) else {
                 return Err(anyhow!(
-                    "Insufficient data for extent {}: need {} bytes, have {} remaining",
-                    i,
-                    length,
-                    data.len() - data_offset
+                    "Patched data exceeds destination extents ({} bytes)",
+                    self.written
                 ));
+            };
+
+            if self.pending.is_empty() {
+                self.pending_offset = offset + self.filled;
             }
 
-            out_file
-                .seek(std::io::SeekFrom::Start(offset))
-                .await
-                .context(format!(
-                    "Failed to seek to dst extent {} offset {}",
-                    i, offset
-                ))?;
+            let room = (length - self.filled) as usize;
+            let space = DST_WRITE_BUFFER_SIZE - self.pending.len();
+            let take = room.min(space).min(data.len());
+
+            self.pending.extend_from_slice(&data[..take]);
+            self.filled += take as u64;
+            self.written += take as u64;
+            data = &data[take..];
+
+            if self.filled == length {
+                self.flush().await?;
+                self.current += 1;
+                self.filled = 0;
+            } else if self.pending.len() == DST_WRITE_BUFFER_SIZE {
+                self.flush().await?;
+            }
+        }
 
-            out_file
-                .write_all(&data[data_offset..data_offset + length])
-                .await
-                .context(format!("Failed to write extent {} ({} bytes)", i, length))?;
+        Ok(())
+    }
 
-            data_offset += length;
+    async fn flush(&mut self) -> Result<()> {
+        if self.pending.is_empty() {
+            return Ok(());
         }
 
+        run_blocking(|| self.sink.write_at(&self.pending, self.pending_offset)).context(
+            format!(
+                "Failed to write {} bytes at dst offset {}",
+                self.pending.len(),
+                self.pending_offset
+            ),
+        )?;
+
+        self.pending.clear();
         Ok(())
     }
+
+    /// flushes what is left and checks the destination extents were filled
+    pub async fn finish(mut self) -> Result<u64> {
+        self.flush().await?;
+
+        let expected: u64 = self.ranges.iter().map(|r| r.1).sum();
+        if self.written != expected {
+            return Err(anyhow!(
+                "Patched data size mismatch: expected {} bytes, got {} bytes",
+                expected,
+                self.written
+            ));
+        }
+
+        Ok(self.written)
+    }
 }
 
 pub struct DiffOperationParams<'a> {
@@ -144,10 +351,10 @@ pub struct DiffOperationParams<'a> {
     pub op: &'a InstallOperation,
     pub ctx: &'a DiffContext,
     pub partition_name: &'a str,
-    pub source_file: &'a mut File,
-    pub out_file: &'a mut File,
-    pub payload_reader: &'a mut dyn PayloadReader,
-    pub data_offset: u64,
+    pub source: &'a SourceImage,
+    pub sink: &'a dyn PartitionSink,
+    /// patch blob for this operation (empty for SOURCE_COPY), see `read_patch_data`
+    pub patch_data: &'a [u8],
     pub reporter: &'a dyn ProgressReporter,
 }
 
@@ -157,115 +364,49 @@ pub async fn process_diff_operation(params: DiffOperationParams<'_>) -> Result<(
         operation_index,
         op,
         ctx,
-        partition_name,
-        source_file,
-        out_file,
-        payload_reader,
-        data_offset,
-        reporter,
+        partition_name: _,
+        source,
+        sink,
+        patch_data,
+        reporter: _,
     } = params;
 
     match op.r#type() {
         install_operation::Type::SourceCopy => {
             let source_data = ctx
-                .read_source_extents(source_file, &op.src_extents)
+                .read_source_extents(source, &op.src_extents)
                 .await
                 .context("Failed to read source extents for SOURCE_COPY")?;
 
-            ctx.write_dst_extents(out_file, &op.dst_extents, &source_data)
-                .await
+            ctx.write_dst_extents(sink, &op.dst_extents, &source_data)
                 .context("Failed to write destination extents for SOURCE_COPY")?;
         }
 
-        install_operation::Type::SourceBsdiff => {
+        op_type @ (install_operation::Type::SourceBsdiff
+        | install_operation::Type::BrotliBsdiff) => {
             let source_data = ctx
-                .read_source_extents(source_file, &op.src_extents)
+                .read_source_extents(source, &op.src_extents)
                 .await
-                .context("Failed to read source extents for SOURCE_BSDIFF")?;
-
-            let patch_offset = data_offset + op.data_offset.unwrap_or(0);
-            let patch_length = op.data_length.unwrap_or(0);
-
-            if patch_length > MAX_OPERATION_SIZE as u64 {
-                return Err(anyhow!("Patch size {} exceeds safety limit", patch_length));
-            }
-
-            let mut patch_stream = payload_reader
-                .read_range(patch_offset, patch_length)
-                .await
-                .context("Failed to read patch data")?;
-
-            let mut patch_data = Vec::with_capacity(patch_length as usize);
-            patch_stream
-                .read_to_end(&mut patch_data)
-                .await
-                .context("Failed to read patch stream")?;
-
-            let mut patched_data = Vec::new();
-            bsdiff_android::patch_bsdf2(&source_data, &patch_data, &mut patched_data)
-                .map_err(|e| anyhow!("BSDF2 patch failed: {}", e))?;
-
-            let expected_size: u64 = op
-                .dst_extents
-                .iter()
-                .map(|e| e.num_blocks.unwrap_or(0) * ctx.block_size)
-                .sum();
-
-            if patched_data.len() != expected_size as usize {
-                return Err(anyhow!(
-                    "Patched data size mismatch: expected {} bytes, got {} bytes",
-                    expected_size,
-                    patched_data.len()
-                ));
-            }
-
-            ctx.write_dst_extents(out_file, &op.dst_extents, &patched_data)
-                .await
-                .context("Failed to write patched data")?;
-        }
-
-        install_operation::Type::BrotliBsdiff => {
-            let source_data = ctx
-                .read_source_extents(source_file, &op.src_extents)
-                .await
-                .context("Failed to read source extents for BROTLI_BSDIFF")?;
-
-            let patch_offset = data_offset + op.data_offset.unwrap_or(0);
-            let patch_length = op.data_length.unwrap_or(0);
-
-            if patch_length > MAX_OPERATION_SIZE as u64 {
-                return Err(anyhow!("Patch size {} exceeds safety limit", patch_length));
-            }
-
-            let mut patch_stream = payload_reader
-                .read_range(patch_offset, patch_length)
-                .await
-                .context("Failed to read patch data")?;
-
-            let mut patch_data = Vec::with_capacity(patch_length as usize);
-            patch_stream
-                .read_to_end(&mut patch_data)
-                .await
-                .context("Failed to read patch stream")?;
-            let mut patched_data = Vec::new();
-            bsdiff_android::patch_bsdf2(&source_data, &patch_data, &mut patched_data)
-                .map_err(|e| anyhow!("BSDF2 patch failed: {}", e))?;
-
-            let expected_size: u64 = op
-                .dst_extents
-                .iter()
-                .map(|e| e.num_blocks.unwrap_or(0) * ctx.block_size)
-                .sum();
-
-            if patched_data.len() != expected_size as usize {
-                return Err(anyhow!(
-                    "Patched data size mismatch: expected {} bytes, got {} bytes",
-                    expected_size,
-                    patched_data.len()
-                ));
-            }
+                .context(format!(
+                    "Failed to read source extents for {}",
+                    op_type.as_str_name()
+                ))?;
 
-            ctx.write_dst_extents(out_file, &op.dst_extents, &patched_data)
+            // the patch is decoded incrementally and written straight into the
+            // dst extents, only the source and the compressed patch stay resident.
+            // decoding is cpu bound like the other patch formats, so it is
+            // driven off the async workers as well
+            let mut writer = ExtentWriter::new(sink, &op.dst_extents, ctx.block_size)?;
+            run_blocking(|| {
+                futures::executor::block_on(bspatch::apply_patch(
+                    &source_data,
+                    patch_data,
+                    &mut writer,
+                ))
+            })
+            .context("BSDF2 patch failed")?;
+            writer
+                .finish()
                 .await
                 .context("Failed to write patched data")?;
         }
@@ -273,32 +414,11 @@ pub async fn process_diff_operation(params: DiffOperationParams<'_>) -> Result<(
         op_type @ (install_operation::Type::Lz4diffBsdiff
         | install_operation::Type::Lz4diffPuffdiff) => {
             let source_data = ctx
-                .read_source_extents(source_file, &op.src_extents)
+                .read_source_extents(source, &op.src_extents)
                 .await
                 .context("Failed to read source extents for LZ4DIFF operation")?;
 
-            let patch_offset = data_offset + op.data_offset.unwrap_or(0);
-            let patch_length = op.data_length.unwrap_or(0);
-
-            if patch_length > MAX_OPERATION_SIZE as u64 {
-                return Err(anyhow!(
-                    "LZ4DIFF patch size {} exceeds safety limit",
-                    patch_length
-                ));
-            }
-
-            let mut patch_stream = payload_reader
-                .read_range(patch_offset, patch_length)
-                .await
-                .context("Failed to read LZ4DIFF patch data")?;
-
-            let mut patch_data = Vec::with_capacity(patch_length as usize);
-            patch_stream
-                .read_to_end(&mut patch_data)
-                .await
-                .context("Failed to read LZ4DIFF patch stream")?;
-
-            let patched_data = lz4diff::lz4_patch(&source_data, &patch_data)
+            let patched_data = run_blocking(|| lz4diff::lz4_patch(&source_data[..], patch_data))
                 .map_err(|e| anyhow!("{:?} patch failed: {}", op_type, e))?;
 
             let expected_size: u64 = op
@@ -315,36 +435,17 @@ pub async fn process_diff_operation(params: DiffOperationParams<'_>) -> Result<(
                 ));
             }
 
-            ctx.write_dst_extents(out_file, &op.dst_extents, &patched_data)
-                .await
+            ctx.write_dst_extents(sink, &op.dst_extents, &patched_data)
                 .context("Failed to write LZ4DIFF-patched data")?;
         }
 
         install_operation::Type::Puffdiff => {
             let source_data = ctx
-                .read_source_extents(source_file, &op.src_extents)
+                .read_source_extents(source, &op.src_extents)
                 .await
                 .context("Failed to read source extents for PUFFDIFF")?;
 
-            let patch_offset = data_offset + op.data_offset.unwrap_or(0);
-            let patch_length = op.data_length.unwrap_or(0);
-
-            if patch_length > MAX_OPERATION_SIZE as u64 {
-                return Err(anyhow!("Patch size {} exceeds safety limit", patch_length));
-            }
-
-            let mut patch_stream = payload_reader
-                .read_range(patch_offset, patch_length)
-                .await
-                .context("Failed to read patch data")?;
-
-            let mut patch_data = Vec::with_capacity(patch_length as usize);
-            patch_stream
-                .read_to_end(&mut patch_data)
-                .await
-                .context("Failed to read patch stream")?;
-
-            let patched_data = puffdiff::puffpatch(&source_data, &patch_data)
+            let patched_data = run_blocking(|| puffdiff::puffpatch(&source_data[..], patch_data))
                 .map_err(|e| anyhow!("PUFFDIFF patch failed: {}", e))?;
 
             let expected_size: u64 = op
@@ -361,18 +462,49 @@ pub async fn process_diff_operation(params: DiffOperationParams<'_>) -> Result<(
                 ));
             }
 
-            ctx.write_dst_extents(out_file, &op.dst_extents, &patched_data)
-                .await
+            ctx.write_dst_extents(sink, &op.dst_extents, &patched_data)
                 .context("Failed to write PUFFDIFF data")?;
         }
 
         install_operation::Type::Zucchini => {
-            reporter.on_warning(
-                partition_name,
-                operation_index,
-                "ZUCCHINI operations not supported yet".to_string(),
-            );
-            return Err(anyhow!("ZUCCHINI operation not supported"));
+            let source_data = ctx
+                .read_source_extents(source, &op.src_extents)
+                .await
+                .context("Failed to read source extents for ZUCCHINI")?;
+
+            // the blob is either a bare zucchini patch or a brotli-compressed
+            // one, decoded off the async workers and only up to the size limit
+            let decompressed;
+            let patch = if patch_data.starts_with(b"Zucc") {
+                patch_data
+            } else {
+                decompressed = run_blocking(|| {
+                    futures::executor::block_on(async {
+                        let mut buf = Vec::new();
+                        BrotliDecoder::new(patch_data)
+                            .take(MAX_OPERATION_SIZE as u64 + 1)
+                            .read_to_end(&mut buf)
+                            .await?;
+                        Ok::<_, std::io::Error>(buf)
+                    })
+                })
+                .context("Failed to decompress ZUCCHINI patch")?;
+                if decompressed.len() > MAX_OPERATION_SIZE {
+                    return Err(anyhow!(
+                        "Decompressed ZUCCHINI patch exceeds {} bytes",
+                        MAX_OPERATION_SIZE
+                    ));
+                }
+                &decompressed[..]
+            };
+
+            let patched_data = run_blocking(|| zucchini::apply_patch(&source_data[..], patch))
+                .with_context(|| {
+                    format!("ZUCCHINI patch of operation {} failed", operation_index)
+                })?;
+
+            ctx.write_dst_extents(sink, &op.dst_extents, &patched_data)
+                .context("Failed to write ZUCCHINI data")?;
         }
 
         _ => {
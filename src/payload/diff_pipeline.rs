@@ -0,0 +1,342 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+use anyhow::{Context, Result, anyhow};
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, Ordering};
+use tokio::sync::{OwnedSemaphorePermit, Semaphore, mpsc};
+use tokio::task::{JoinHandle, JoinSet};
+
+use crate::payload::diff::{
+    extent_ranges, is_identity_copy, patch_range, read_patch_data, write_extents_at,
+};
+use crate::payload::payload_dumper::PayloadReader;
+use crate::payload::sink::PartitionSink;
+use crate::payload::source_image::SourceImage;
+use crate::structs::InstallOperation;
+use crate::utils::is_diff_operation;
+
+/// how many diff operations may be fetched ahead of the one being patched
+pub const DEFAULT_PREFETCH_DEPTH: usize = 16;
+/// upper bound for patch bytes held by fetched-but-not-yet-applied operations
+pub const DEFAULT_PREFETCH_BUDGET: u64 = 128 * 1024 * 1024;
+
+/// upper bound for memory held by PUFFDIFF operations running concurrently
+pub const DEFAULT_PUFF_MEMORY_BUDGET: u64 = 1024 * 1024 * 1024;
+
+// budget is tracked in KiB so large budgets fit in semaphore permits
+const BUDGET_UNIT: u64 = 1024;
+// puffing inflates every deflate stream of source and target, plus the
+// patched output itself; a rough multiple of the raw extent sizes
+const PUFF_MEMORY_FACTOR: u64 = 3;
+
+/// a diff operation whose inputs are ready to be patched
+pub struct PrefetchedPatch {
+    pub operation_index: usize,
+    pub data: Vec<u8>,
+    // returned to the budget once the patch has been applied and dropped
+    _permit: Option<OwnedSemaphorePermit>,
+}
+
+impl PrefetchedPatch {
+    /// wraps a patch that was read directly, outside of any prefetch budget
+    pub fn new(operation_index: usize, data: Vec<u8>) -> Self {
+        Self {
+            operation_index,
+            data,
+            _permit: None,
+        }
+    }
+}
+
+struct PrefetchJob {
+    operation_index: usize,
+    op: InstallOperation,
+}
+
+/// background stage that runs ahead of `process_diff_operation`
+///
+/// while the current operation is being patched, the next diff operations of
+/// the partition get their patch blobs read from the payload (hiding network
+/// latency for remote payloads) and their source extents queued for kernel
+/// readahead. fetched patches are handed out strictly in operation order.
+pub struct DiffPrefetcher {
+    rx: mpsc::Receiver<Result<PrefetchedPatch>>,
+    task: JoinHandle<()>,
+}
+
+impl DiffPrefetcher {
+    /// starts prefetching every diff operation in `operations`
+    ///
+    /// `reader` must be a dedicated reader; the caller keeps its own for
+    /// full operations. at most `depth` operations and `budget` bytes of patch
+    /// data are held ahead of the consumer. with `skip_identity_copies` the
+    /// identity SOURCE_COPY operations are left out, the consumer must not ask
+    /// for them either.
+    pub fn spawn(
+        operations: &[InstallOperation],
+        data_offset: u64,
+        block_size: u64,
+        mut reader: Box<dyn PayloadReader>,
+        source: Arc<SourceImage>,
+        depth: usize,
+        budget: u64,
+        skip_identity_copies: bool,
+    ) -> Self {
+        let jobs: Vec<PrefetchJob> = operations
+            .iter()
+            .enumerate()
+            .filter(|(_, op)| is_diff_operation(op.r#type()))
+            .filter(|(_, op)| !(skip_identity_copies && is_identity_copy(op)))
+            .map(|(operation_index, op)| PrefetchJob {
+                operation_index,
+                op: op.clone(),
+            })
+            .collect();
+
+        let (tx, rx) = mpsc::channel(depth.max(1));
+        let total_units = budget.div_ceil(BUDGET_UNIT).clamp(1, u32::MAX as u64) as u32;
+        let budget = Arc::new(Semaphore::new(total_units as usize));
+
+        let task = tokio::spawn(async move {
+            for job in jobs {
+                // a single patch bigger than the whole budget still gets through,
+                // it just has the pipeline to itself
+                let units = patch_range(&job.op, data_offset)
+                    .map(|(_, length)| length.div_ceil(BUDGET_UNIT))
+                    .unwrap_or(0)
+                    .min(total_units as u64) as u32;
+
+                let permit = if units > 0 {
+                    match Arc::clone(&budget).acquire_many_owned(units).await {
+                        Ok(permit) => Some(permit),
+                        Err(_) => return,
+                    }
+                } else {
+                    None
+                };
+
+                source.prefetch_extents(&job.op.src_extents, block_size);
+
+                let result = read_patch_data(&mut *reader, &job.op, data_offset)
+                    .await
+                    .map(|data| PrefetchedPatch {
+                        operation_index: job.operation_index,
+                        data,
+                        _permit: permit,
+                    });
+
+                let failed = result.is_err();
+                if tx.send(result).await.is_err() || failed {
+                    // consumer is gone or the payload read failed, either way stop
+                    return;
+                }
+            }
+        });
+
+        Self { rx, task }
+    }
+
+    /// waits for the prefetched inputs of `operation_index`
+    pub async fn next_for(&mut self, operation_index: usize) -> Result<PrefetchedPatch> {
+        let prefetched = self
+            .rx
+            .recv()
+            .await
+            .ok_or_else(|| anyhow!("Diff prefetch pipeline stopped unexpectedly"))??;
+
+        if prefetched.operation_index != operation_index {
+            return Err(anyhow!(
+                "Diff prefetch out of order: expected operation {}, got {}",
+                operation_index,
+                prefetched.operation_index
+            ));
+        }
+
+        Ok(prefetched)
+    }
+}
+
+impl Drop for DiffPrefetcher {
+    fn drop(&mut self) {
+        self.task.abort();
+    }
+}
+
+/// memory the PUFFDIFF operations of every pool sharing it may hold at once,
+/// one per process keeps partitions extracted together under a single cap
+#[derive(Debug, Clone)]
+pub struct PuffdiffBudget {
+    memory: Arc<Semaphore>,
+    units: u32,
+}
+
+impl PuffdiffBudget {
+    pub fn new(bytes: u64) -> Self {
+        let units = bytes.div_ceil(BUDGET_UNIT).clamp(1, u32::MAX as u64) as u32;
+        Self {
+            memory: Arc::new(Semaphore::new(units as usize)),
+            units,
+        }
+    }
+}
+
+impl Default for PuffdiffBudget {
+    fn default() -> Self {
+        Self::new(DEFAULT_PUFF_MEMORY_BUDGET)
+    }
+}
+
+/// runs PUFFDIFF operations of one partition concurrently on blocking threads
+///
+/// re-deflating puffed streams is CPU bound, so instead of patching them one
+/// by one on the extraction task each operation is handed to the blocking
+/// pool and the partition loop moves on. destination extents of operations in
+/// a partition never overlap, so finished operations write straight to their
+/// extents through the shared sink with positional writes. concurrency is
+/// bounded by an estimate of in-flight memory, drawn from a budget shared
+/// with the other pools, and by the cores: with a cpu budget one operation
+/// runs on the core the partition's task holds and more only on cores of the
+/// budget that are idle, without one on every core.
+pub struct PuffdiffPool {
+    out: Arc<dyn PartitionSink>,
+    source: Arc<SourceImage>,
+    block_size: u64,
+    slots: Arc<Semaphore>,
+    cpu_budget: Option<Arc<Semaphore>>,
+    budget: PuffdiffBudget,
+    /// set once the partition failed, queued operations do not start
+    cancelled: Arc<AtomicBool>,
+    tasks: JoinSet<Result<()>>,
+}
+
+impl PuffdiffPool {
+    pub fn new(
+        out: Arc<dyn PartitionSink>,
+        source: Arc<SourceImage>,
+        block_size: u64,
+        cpu_budget: Option<Arc<Semaphore>>,
+        budget: PuffdiffBudget,
+    ) -> Self {
+        Self {
+            out,
+            source,
+            block_size,
+            slots: Arc::new(Semaphore::new(match cpu_budget {
+                Some(_) => 1,
+                None => num_cpus::get(),
+            })),
+            cpu_budget,
+            budget,
+            cancelled: Arc::new(AtomicBool::new(false)),
+            tasks: JoinSet::new(),
+        }
+    }
+
+    /// queues a PUFFDIFF operation, waiting while the pool is saturated
+    ///
+    /// errors of operations that already finished are reported here so a bad
+    /// patch stops the partition early
+    pub async fn submit(
+        &mut self,
+        operation_index: usize,
+        op: &InstallOperation,
+        patch: PrefetchedPatch,
+    ) -> Result<()> {
+        while let Some(done) = self.tasks.try_join_next() {
+            done.map_err(|e| anyhow!("PUFFDIFF task failed: {}", e))??;
+        }
+
+        let src_bytes: u64 = extent_ranges(&op.src_extents, self.block_size)?
+            .iter()
+            .map(|r| r.1)
+            .sum();
+        let dst_bytes: u64 = extent_ranges(&op.dst_extents, self.block_size)?
+            .iter()
+            .map(|r| r.1)
+            .sum();
+        // an operation larger than the whole budget still runs, just alone
+        let units = ((src_bytes + dst_bytes) * PUFF_MEMORY_FACTOR)
+            .div_ceil(BUDGET_UNIT)
+            .clamp(1, self.budget.units as u64) as u32;
+
+        // never waits on the budget, the partitions holding it may be
+        // waiting for this one
+        let idle = match Arc::clone(&self.slots).try_acquire_owned() {
+            Ok(slot) => Some(slot),
+            Err(_) => self
+                .cpu_budget
+                .as_ref()
+                .and_then(|budget| Arc::clone(budget).try_acquire_owned().ok()),
+        };
+        let slot = match idle {
+            Some(slot) => slot,
+            None => Arc::clone(&self.slots)
+                .acquire_owned()
+                .await
+                .map_err(|_| anyhow!("PUFFDIFF pool closed"))?,
+        };
+        let memory = Arc::clone(&self.budget.memory)
+            .acquire_many_owned(units)
+            .await
+            .map_err(|_| anyhow!("PUFFDIFF pool closed"))?;
+
+        let out = Arc::clone(&self.out);
+        let source = Arc::clone(&self.source);
+        let block_size = self.block_size;
+        let op = op.clone();
+        let cancelled = Arc::clone(&self.cancelled);
+
+        self.tasks.spawn_blocking(move || {
+            let _permits = (slot, memory);
+            if cancelled.load(Ordering::Relaxed) {
+                return Ok(());
+            }
+
+            let source_data = source
+                .read_extents(&op.src_extents, block_size)
+                .context("Failed to read source extents for PUFFDIFF")?;
+            let patched_data = puffdiff::puffpatch(&source_data[..], &patch.data[..])
+                .map_err(|e| anyhow!("PUFFDIFF patch failed: {}", e))?;
+            drop(source_data);
+
+            write_extents_at(&*out, &op.dst_extents, block_size, &patched_data).with_context(|| {
+                format!(
+                    "Failed to write PUFFDIFF data for operation {}",
+                    operation_index
+                )
+            })
+        });
+
+        Ok(())
+    }
+
+    /// waits for every queued operation, returning the first failure
+    pub async fn finish(mut self) -> Result<()> {
+        let mut first_error = None;
+
+        while let Some(done) = self.tasks.join_next().await {
+            let result = done
+                .map_err(|e| anyhow!("PUFFDIFF task failed: {}", e))
+                .and_then(|r| r);
+            if let Err(e) = result
+                && first_error.is_none()
+            {
+                first_error = Some(e);
+            }
+        }
+
+        match first_error {
+            Some(e) => Err(e),
+            None => Ok(()),
+        }
+    }
+
+    /// keeps queued operations from starting and waits for the running ones,
+    /// nothing writes to the sink anymore once this returns
+    pub async fn cancel(mut self) {
+        self.cancelled.store(true, Ordering::Relaxed);
+        while self.tasks.join_next().await.is_some() {}
+    }
+}
@@ -0,0 +1,152 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+// decoded manifests remembered across runs
+//
+// `--list`, `--metadata` and an extraction of the same payload would each
+// walk the ZIP directory and read the manifest again, for a remote OTA a
+// handful of round trips before any work starts. entries are keyed by the
+// identity of the payload (path, size, mtime and inode of a local file, or
+// URL, ETag and length of a remote one), so a changed file is never served
+// from the cache.
+
+use anyhow::{Result, anyhow};
+use prost::Message;
+use serde::{Deserialize, Serialize};
+use sha2::{Digest, Sha256};
+use std::path::Path;
+
+use crate::cache::{self, FileIdentity};
+#[cfg(feature = "remote_zip")]
+use crate::http::HttpReader;
+use crate::structs::DeltaArchiveManifest;
+use crate::zip::core_parser::ZipMetadataInfo;
+
+const CACHE_SUBDIR: &str = "manifests";
+const ENTRY_MAGIC: &[u8; 4] = b"PDMC";
+// full OTAs carry small manifests, incremental ones up to tens of MB
+const MAX_ENTRIES: usize = 32;
+
+/// what identifies a payload for the manifest cache
+#[derive(Debug, Clone)]
+pub enum PayloadIdentity {
+    Local(FileIdentity),
+    Remote {
+        url: String,
+        validator: String,
+        content_length: u64,
+    },
+}
+
+impl PayloadIdentity {
+    pub fn local(path: &Path) -> Result<Self> {
+        Ok(Self::Local(FileIdentity::of(path)?))
+    }
+
+    /// `None` when the server sends neither ETag nor Last-Modified, there
+    /// is then no telling whether the resource changed
+    #[cfg(feature = "remote_zip")]
+    pub fn remote(reader: &HttpReader) -> Option<Self> {
+        Some(Self::Remote {
+            url: reader.url.clone(),
+            validator: reader.validator.clone()?,
+            content_length: reader.content_length,
+        })
+    }
+
+    fn key(&self) -> String {
+        match self {
+            Self::Local(identity) => format!("local|{}", identity.key()),
+            Self::Remote {
+                url,
+                validator,
+                content_length,
+            } => format!("remote|{}|{}|{}", url, validator, content_length),
+        }
+    }
+
+    fn file_name(&self) -> String {
+        let digest = Sha256::digest(self.key().as_bytes());
+        format!(
+            "{}/{}.bin",
+            CACHE_SUBDIR,
+            &hex::encode(digest.to_vec())[..32]
+        )
+    }
+}
+
+/// everything needed to start working on a payload without parsing it
+#[derive(Debug, Clone)]
+pub struct CachedPayload {
+    pub manifest: DeltaArchiveManifest,
+    pub data_offset: u64,
+    /// size of the file or resource, payload.bin or the ZIP around it
+    pub archive_size: u64,
+    /// set when the payload is inside a ZIP
+    pub zip_info: Option<ZipMetadataInfo>,
+}
+
+#[derive(Serialize, Deserialize)]
+struct EntryHeader {
+    key: String,
+    data_offset: u64,
+    archive_size: u64,
+    zip_info: Option<ZipMetadataInfo>,
+}
+
+/// cached payload for `identity`, `None` on a miss or a damaged entry
+pub fn load(identity: &PayloadIdentity) -> Option<CachedPayload> {
+    let data = cache::load_bytes(&identity.file_name())?;
+    let (header, manifest) = decode_entry(&data).ok()?;
+
+    // the file name is a truncated hash, the full key decides
+    if header.key != identity.key() {
+        return None;
+    }
+
+    Some(CachedPayload {
+        manifest,
+        data_offset: header.data_offset,
+        archive_size: header.archive_size,
+        zip_info: header.zip_info,
+    })
+}
+
+/// remembers `payload` for `identity`, dropping the oldest entries
+pub fn store(identity: &PayloadIdentity, payload: &CachedPayload) -> Result<()> {
+    let header = serde_json::to_vec(&EntryHeader {
+        key: identity.key(),
+        data_offset: payload.data_offset,
+        archive_size: payload.archive_size,
+        zip_info: payload.zip_info.clone(),
+    })?;
+    let manifest = payload.manifest.encode_to_vec();
+
+    let mut data = Vec::with_capacity(8 + header.len() + manifest.len());
+    data.extend_from_slice(ENTRY_MAGIC);
+    data.extend_from_slice(&(header.len() as u32).to_le_bytes());
+    data.extend_from_slice(&header);
+    data.extend_from_slice(&manifest);
+
+    cache::store_bytes(&identity.file_name(), &data)?;
+    cache::prune(CACHE_SUBDIR, MAX_ENTRIES);
+    Ok(())
+}
+
+// entry layout: magic, u32 LE header length, JSON header, manifest protobuf
+fn decode_entry(data: &[u8]) -> Result<(EntryHeader, DeltaArchiveManifest)> {
+    if data.len() < 8 || &data[..4] != ENTRY_MAGIC {
+        return Err(anyhow!("Not a manifest cache entry"));
+    }
+
+    let header_len = u32::from_le_bytes(data[4..8].try_into().unwrap()) as usize;
+    let header_end = 8usize
+        .checked_add(header_len)
+        .filter(|&end| end <= data.len())
+        .ok_or_else(|| anyhow!("Truncated manifest cache entry"))?;
+
+    let header: EntryHeader = serde_json::from_slice(&data[8..header_end])?;
+    let manifest = DeltaArchiveManifest::decode(&data[header_end..])?;
+    Ok((header, manifest))
+}
@@ -1,4 +1,22 @@
 #[cfg(feature = "diff_ota")]
+pub mod blob_cache;
+pub mod block_reader;
+#[cfg(feature = "diff_ota")]
+pub mod bspatch;
+#[cfg(feature = "diff_ota")]
+pub mod clone;
+#[cfg(feature = "diff_ota")]
 pub mod diff;
+#[cfg(feature = "diff_ota")]
+pub mod diff_pipeline;
+#[cfg(feature = "local_zip")]
+pub mod manifest_cache;
 pub mod payload_dumper;
 pub mod payload_parser;
+pub mod sink;
+#[cfg(feature = "diff_ota")]
+pub mod source_image;
+#[cfg(feature = "diff_ota")]
+pub mod source_verify;
+#[cfg(feature = "diff_ota")]
+pub mod zucchini;
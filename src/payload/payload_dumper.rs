@@ -3,26 +3,44 @@
 // https://github.com/rhythmcache/payload-dumper-rust
 
 #![allow(dead_code)]
-use anyhow::{Result, anyhow};
+use anyhow::{Context, Result, anyhow};
 use async_compression::tokio::bufread::{BzDecoder, XzDecoder, ZstdDecoder};
 use async_trait::async_trait;
-use std::path::PathBuf;
+use sha2::{Digest, Sha256};
+use std::path::{Path, PathBuf};
 use std::pin::Pin;
 use std::sync::Arc;
-use tokio::fs::File;
-use tokio::io::{AsyncRead, AsyncReadExt, AsyncSeekExt, AsyncWriteExt, BufReader};
+use tokio::io::{AsyncRead, AsyncReadExt, BufReader};
+use tokio::sync::{OwnedSemaphorePermit, Semaphore};
 
 pub use crate::structs::PartitionUpdate;
 use crate::structs::{InstallOperation, install_operation};
 
+use crate::fec::{FecConfig, generate_fec};
 #[cfg(feature = "diff_ota")]
-use crate::payload::diff::{DiffContext, DiffOperationParams, process_diff_operation};
-use crate::utils::is_diff_operation;
+use crate::payload::blob_cache::{BlobCache, BlobKey};
+#[cfg(feature = "diff_ota")]
+use crate::payload::clone::{CloneMethod, clone_file, clone_range};
+#[cfg(feature = "diff_ota")]
+use crate::payload::diff::{
+    DiffContext, DiffOperationParams, clone_source_copy, is_identity_copy, process_diff_operation,
+    read_patch_data,
+};
+#[cfg(feature = "diff_ota")]
+use crate::payload::diff_pipeline::{
+    DEFAULT_PREFETCH_BUDGET, DEFAULT_PREFETCH_DEPTH, DiffPrefetcher, PrefetchedPatch,
+    PuffdiffBudget, PuffdiffPool,
+};
+use crate::payload::sink::{FileSink, PartitionSink};
+#[cfg(feature = "diff_ota")]
+use crate::payload::source_image::SourceImage;
+use crate::seekable_zstd::{SeekableOptions, SeekableOutput, SeekableZstdSink};
+use crate::utils::{is_diff_operation, run_blocking};
+use crate::verity::{HashTreeConfig, write_hash_tree};
 
 // Increased buffer sizes for better throughput
 const BUFREADER_SIZE: usize = 256 * 1024; // 256 KB for decompression streams
 const COPY_BUFFER_SIZE: usize = 512 * 1024; // 512 KB for direct copy operations
-const ZERO_WRITE_CHUNK: usize = 2 * 1024 * 1024; // 2 MB chunks for zero writes
 
 /// progress reporting trait for partition extraction
 /// implement this to receive progress updates during extraction
@@ -85,66 +103,232 @@ impl AsyncPayloadRead for Arc<dyn AsyncPayloadRead> {
     }
 }
 
-/// custom copy function with reusable buffer
-async fn copy_with_buffer<R, W>(reader: &mut R, writer: &mut W, buf: &mut [u8]) -> Result<u64>
+/// passes an operation blob through, hashing it on the way when asked to
+///
+/// outputs are only remembered for reuse when their blob matches its
+/// `data_sha256_hash`, a corrupted download must not be cloned into later
+/// images
+struct BlobReader<R> {
+    inner: R,
+    hasher: Option<Sha256>,
+}
+
+impl<R> BlobReader<R> {
+    fn new(inner: R, hash: bool) -> Self {
+        Self {
+            inner,
+            hasher: hash.then(Sha256::new),
+        }
+    }
+
+    /// whether the bytes read so far hash to `expected`
+    fn matches(&self, expected: Option<&[u8]>) -> bool {
+        match (&self.hasher, expected) {
+            (Some(hasher), Some(expected)) => hasher.clone().finalize().as_slice() == expected,
+            _ => false,
+        }
+    }
+}
+
+impl<R: AsyncRead + Unpin> AsyncRead for BlobReader<R> {
+    fn poll_read(
+        mut self: Pin<&mut Self>,
+        cx: &mut std::task::Context<'_>,
+        buf: &mut tokio::io::ReadBuf<'_>,
+    ) -> std::task::Poll<std::io::Result<()>> {
+        let before = buf.filled().len();
+        let this = &mut *self;
+        let result = Pin::new(&mut this.inner).poll_read(cx, buf);
+        if let (std::task::Poll::Ready(Ok(())), Some(hasher)) = (&result, &mut this.hasher) {
+            hasher.update(&buf.filled()[before..]);
+        }
+        result
+    }
+}
+
+/// reads until `buf` is full or the reader ends, returns the bytes read
+async fn read_full<R>(reader: &mut R, buf: &mut [u8]) -> Result<usize>
 where
     R: AsyncRead + Unpin,
-    W: AsyncWriteExt + Unpin,
 {
-    let mut total = 0u64;
+    let mut filled = 0;
+    while filled < buf.len() {
+        let n = reader.read(&mut buf[filled..]).await?;
+        if n == 0 {
+            break;
+        }
+        filled += n;
+    }
+    Ok(filled)
+}
+
+/// copies `reader` to the sink at `offset`, returns the bytes copied
+///
+/// with `existing` the sink holds an earlier extraction: every chunk is
+/// compared with what is already there and only written when it differs
+async fn copy_to_output<R>(
+    reader: &mut R,
+    sink: &dyn PartitionSink,
+    offset: u64,
+    buf: &mut [u8],
+    mut existing: Option<&mut Vec<u8>>,
+) -> Result<u64>
+where
+    R: AsyncRead + Unpin,
+{
+    if let Some(existing) = existing.as_deref_mut() {
+        existing.resize(buf.len(), 0);
+    }
 
+    let mut total = 0u64;
     loop {
-        let n = reader.read(buf).await?;
+        let n = read_full(reader, buf).await?;
         if n == 0 {
             break;
         }
-        writer.write_all(&buf[..n]).await?;
+
+        let pos = offset + total;
+        run_blocking(|| -> std::io::Result<()> {
+            if let Some(existing) = existing.as_deref_mut() {
+                sink.read_at(&mut existing[..n], pos)?;
+                if existing[..n] == buf[..n] {
+                    return Ok(());
+                }
+            }
+            sink.write_at(&buf[..n], pos)
+        })?;
         total += n as u64;
     }
 
     Ok(total)
 }
 
-/// optimized zero handling using sparse files
-/// This avoids physically writing zeros - just seeks past the region
-/// The filesystem will automatically return zeros when reading these areas
-async fn handle_zero_region_sparse(
-    file: &mut File,
-    start_offset: u64,
-    total_bytes: u64,
+/// zeroes every block of the partition that no operation writes
+///
+/// a fresh output file reads back zeros there, a seeded or reused one (or a
+/// block device) would still hold old data, so clear it to keep all outputs
+/// byte-identical
+fn clear_unwritten_blocks(
+    sink: &dyn PartitionSink,
+    partition: &PartitionUpdate,
+    block_size: u64,
+    partition_size: u64,
 ) -> Result<()> {
-    // Just seek past the zero region - no actual I/O needed!
-    // The filesystem will treat this as a sparse region (holes)
-    // When read later, it automatically returns zeros
-    file.seek(std::io::SeekFrom::Start(start_offset + total_bytes))
-        .await?;
+    let mut written: Vec<(u64, u64)> = partition
+        .operations
+        .iter()
+        .flat_map(|op| op.dst_extents.iter())
+        .filter(|e| e.num_blocks.unwrap_or(0) > 0)
+        .map(|e| {
+            let start = e.start_block.unwrap_or(0) * block_size;
+            (start, start + e.num_blocks.unwrap_or(0) * block_size)
+        })
+        .collect();
+    written.sort_unstable();
+
+    let mut pos = 0u64;
+    for (start, end) in written {
+        if start > pos {
+            let end = start.min(partition_size);
+            sink.write_zeros(pos, end - pos)?;
+        }
+        pos = pos.max(end);
+        if pos >= partition_size {
+            return Ok(());
+        }
+    }
+
+    sink.write_zeros(pos, partition_size - pos)?;
     Ok(())
 }
 
-/// fallback >> dead_code >> write zeros in large chunks for filesystems that don't support sparse files
-/// (use this only if sparse file approach causes issues on your target filesystem)
-#[allow(dead_code)]
-async fn write_zeros_chunked(
-    file: &mut File,
-    start_offset: u64,
-    total_bytes: u64,
-    zero_chunk: &[u8],
-) -> Result<()> {
-    file.seek(std::io::SeekFrom::Start(start_offset)).await?;
+/// extraction settings beyond the partition and payload themselves
+#[derive(Debug, Clone, Default)]
+pub struct DumpOptions {
+    /// directory containing source images for differential OTA
+    pub source_dir: Option<PathBuf>,
+    /// seed the output with a clone (reflink where supported) of the source
+    /// image and skip SOURCE_COPY operations that leave blocks in place
+    pub clone_source: bool,
+    /// the output already exists at its final size and the partition's
+    /// extents point into it (e.g. a super image shared by several
+    /// partitions), open it in place instead of creating and resizing it
+    pub preallocated: bool,
+    /// an existing output holds an earlier extraction of this partition,
+    /// keep it and only write the blocks whose content differs
+    pub rewrite_changed: bool,
+    /// take REPLACE* outputs seen in earlier images from there instead of
+    /// downloading and decoding them, and remember the ones written here
+    #[cfg(feature = "diff_ota")]
+    pub blob_cache: Option<Arc<BlobCache>>,
+    /// cores shared with everything else being extracted, the partition's
+    /// task is taken to hold one of them. parallel steps (PUFFDIFF, hash
+    /// tree, FEC) only add cores that are idle, without a budget they use
+    /// every core
+    pub cpu_budget: Option<Arc<Semaphore>>,
+    /// memory PUFFDIFF operations may hold, shared with every partition given
+    /// the same budget, without one each partition gets its own
+    #[cfg(feature = "diff_ota")]
+    pub puff_budget: Option<PuffdiffBudget>,
+    /// also write a file output as seekable zstd, compressed while the
+    /// image is extracted (not used with `preallocated`)
+    pub seekable_zstd: Option<SeekableOutput>,
+}
 
-    let chunk_size = zero_chunk.len() as u64;
-    let full_chunks = total_bytes / chunk_size;
-    let remainder = (total_bytes % chunk_size) as usize;
+/// takes up to `max` permits of `budget` that are idle right now, without
+/// waiting for any
+pub fn take_idle_workers(budget: &Arc<Semaphore>, max: usize) -> Option<OwnedSemaphorePermit> {
+    let idle = budget.available_permits().min(max);
+    // other tasks may take some in between, settle for fewer then
+    (1..=idle)
+        .rev()
+        .find_map(|n| Arc::clone(budget).try_acquire_many_owned(n as u32).ok())
+}
 
-    for _ in 0..full_chunks {
-        file.write_all(zero_chunk).await?;
+/// threads, up to `max`, a parallel step of a partition may use: the core
+/// its task holds plus idle ones of the budget, kept in the returned permit
+/// until the step is done
+fn step_workers(options: &DumpOptions, max: usize) -> (usize, Option<OwnedSemaphorePermit>) {
+    match &options.cpu_budget {
+        Some(budget) => {
+            let extra = take_idle_workers(budget, max.saturating_sub(1));
+            (1 + extra.as_ref().map_or(0, |p| p.num_permits()), extra)
+        }
+        None => (max.max(1), None),
     }
+}
 
-    if remainder > 0 {
-        file.write_all(&zero_chunk[..remainder]).await?;
-    }
+/// blob reuse state of one partition
+#[cfg(feature = "diff_ota")]
+struct BlobReuse<'a> {
+    cache: &'a BlobCache,
+    /// positional handle on the output for cloning into it
+    out: std::fs::File,
+    /// outputs this partition now holds
+    written: Vec<BlobKey>,
+}
 
-    Ok(())
+#[cfg(feature = "diff_ota")]
+impl BlobReuse<'_> {
+    /// clones the earlier output of `key` into place
+    /// returns false on a miss, the operation is then decoded as usual
+    async fn try_reuse(&mut self, key: &BlobKey) -> bool {
+        let Some(source) = self.cache.lookup(key) else {
+            return false;
+        };
+        let Ok(out) = self.out.try_clone() else {
+            return false;
+        };
+
+        let (dst_offset, length) = (key.dst_offset, key.length);
+        let cloned = tokio::task::spawn_blocking(move || {
+            let src = std::fs::File::open(&source.image)?;
+            clone_range(&src, source.offset, &out, dst_offset, length)
+        })
+        .await;
+
+        matches!(cloned, Ok(Ok(_)))
+    }
 }
 
 /// context for processing operations -> groups related parameters
@@ -152,13 +336,29 @@ struct OperationContext<'a> {
     data_offset: u64,
     block_size: u64,
     payload_reader: &'a mut dyn PayloadReader,
-    out_file: &'a mut File,
+    sink: &'a dyn PartitionSink,
     copy_buffer: &'a mut [u8],
+    // set when rewriting an earlier extraction, holds the on-disk bytes
+    compare_buffer: Option<Vec<u8>>,
+    // blobs are hashed while read, set by an operation whose blob matched
+    hash_blobs: bool,
+    blob_intact: bool,
     #[cfg(feature = "diff_ota")]
     diff_ctx: Option<&'a DiffContext>,
     #[cfg(feature = "diff_ota")]
-    source_file: Option<&'a mut File>,
-    current_pos: u64, // Track current file position to avoid redundant seeks
+    source: Option<&'a SourceImage>,
+    #[cfg(feature = "diff_ota")]
+    prefetcher: Option<&'a mut DiffPrefetcher>,
+    #[cfg(feature = "diff_ota")]
+    puff_pool: Option<&'a mut PuffdiffPool>,
+    #[cfg(feature = "diff_ota")]
+    seeded: bool, // output already holds the source image
+    // positional handle on a seeded output, SOURCE_COPY blocks are cloned
+    // into it from the source
+    #[cfg(feature = "diff_ota")]
+    clone_out: Option<std::fs::File>,
+    #[cfg(feature = "diff_ota")]
+    blob_reuse: Option<BlobReuse<'a>>,
 }
 
 async fn process_operation_streaming(
@@ -170,39 +370,60 @@ async fn process_operation_streaming(
 ) -> Result<()> {
     let offset = ctx.data_offset + op.data_offset.unwrap_or(0);
     let length = op.data_length.unwrap_or(0);
+    let expected_hash = op.data_sha256_hash.as_deref();
+    ctx.blob_intact = false;
+
+    // a blob seen in an earlier image is cloned from there, without reading
+    // it from the payload at all
+    #[cfg(feature = "diff_ota")]
+    let blob_key = match &ctx.blob_reuse {
+        Some(_) => BlobKey::of(op, ctx.block_size),
+        None => None,
+    };
+    #[cfg(feature = "diff_ota")]
+    if let (Some(reuse), Some(key)) = (ctx.blob_reuse.as_mut(), &blob_key) {
+        if reuse.try_reuse(key).await {
+            reuse.written.push(key.clone());
+            return Ok(());
+        }
+    }
 
     match op.r#type() {
         install_operation::Type::Replace => {
-            let mut stream = ctx.payload_reader.read_range(offset, length).await?;
+            let mut stream = BlobReader::new(
+                ctx.payload_reader.read_range(offset, length).await?,
+                ctx.hash_blobs,
+            );
             let target_pos = op.dst_extents[0].start_block.unwrap_or(0) * ctx.block_size;
 
-            // Avoid redundant seek if already at correct position
-            if ctx.current_pos != target_pos {
-                ctx.out_file
-                    .seek(std::io::SeekFrom::Start(target_pos))
-                    .await?;
-                ctx.current_pos = target_pos;
-            }
-
-            let written = copy_with_buffer(&mut stream, ctx.out_file, ctx.copy_buffer).await?;
-            ctx.current_pos += written;
+            copy_to_output(
+                &mut stream,
+                ctx.sink,
+                target_pos,
+                ctx.copy_buffer,
+                ctx.compare_buffer.as_mut(),
+            )
+            .await?;
+            ctx.blob_intact = stream.matches(expected_hash);
         }
         install_operation::Type::ReplaceXz => {
-            let stream = ctx.payload_reader.read_range(offset, length).await?;
+            let stream = BlobReader::new(
+                ctx.payload_reader.read_range(offset, length).await?,
+                ctx.hash_blobs,
+            );
             let mut decoder = XzDecoder::new(BufReader::with_capacity(BUFREADER_SIZE, stream));
             let target_pos = op.dst_extents[0].start_block.unwrap_or(0) * ctx.block_size;
 
-            if ctx.current_pos != target_pos {
-                ctx.out_file
-                    .seek(std::io::SeekFrom::Start(target_pos))
-                    .await?;
-                ctx.current_pos = target_pos;
-            }
-
-            match copy_with_buffer(&mut decoder, ctx.out_file, ctx.copy_buffer).await {
-                Ok(written) => {
-                    ctx.current_pos += written;
-                }
+            match copy_to_output(
+                &mut decoder,
+                ctx.sink,
+                target_pos,
+                ctx.copy_buffer,
+                ctx.compare_buffer.as_mut(),
+            )
+            .await
+            {
+                Ok(_) => ctx.blob_intact = decoder.get_ref().get_ref().matches(expected_hash),
                 Err(e) => {
                     reporter.on_warning(
                         partition_name,
@@ -214,21 +435,23 @@ async fn process_operation_streaming(
             }
         }
         install_operation::Type::ReplaceBz => {
-            let stream = ctx.payload_reader.read_range(offset, length).await?;
+            let stream = BlobReader::new(
+                ctx.payload_reader.read_range(offset, length).await?,
+                ctx.hash_blobs,
+            );
             let mut decoder = BzDecoder::new(BufReader::with_capacity(BUFREADER_SIZE, stream));
             let target_pos = op.dst_extents[0].start_block.unwrap_or(0) * ctx.block_size;
 
-            if ctx.current_pos != target_pos {
-                ctx.out_file
-                    .seek(std::io::SeekFrom::Start(target_pos))
-                    .await?;
-                ctx.current_pos = target_pos;
-            }
-
-            match copy_with_buffer(&mut decoder, ctx.out_file, ctx.copy_buffer).await {
-                Ok(written) => {
-                    ctx.current_pos += written;
-                }
+            match copy_to_output(
+                &mut decoder,
+                ctx.sink,
+                target_pos,
+                ctx.copy_buffer,
+                ctx.compare_buffer.as_mut(),
+            )
+            .await
+            {
+                Ok(_) => ctx.blob_intact = decoder.get_ref().get_ref().matches(expected_hash),
                 Err(e) => {
                     reporter.on_warning(
                         partition_name,
@@ -240,7 +463,10 @@ async fn process_operation_streaming(
             }
         }
         install_operation::Type::Zstd => {
-            let stream = ctx.payload_reader.read_range(offset, length).await?;
+            let stream = BlobReader::new(
+                ctx.payload_reader.read_range(offset, length).await?,
+                ctx.hash_blobs,
+            );
             let mut decoder = ZstdDecoder::new(BufReader::with_capacity(BUFREADER_SIZE, stream));
 
             if op.dst_extents.len() != 1 {
@@ -254,17 +480,16 @@ async fn process_operation_streaming(
 
             let target_pos = op.dst_extents[0].start_block.unwrap_or(0) * ctx.block_size;
 
-            if ctx.current_pos != target_pos {
-                ctx.out_file
-                    .seek(std::io::SeekFrom::Start(target_pos))
-                    .await?;
-                ctx.current_pos = target_pos;
-            }
-
-            match copy_with_buffer(&mut decoder, ctx.out_file, ctx.copy_buffer).await {
-                Ok(written) => {
-                    ctx.current_pos += written;
-                }
+            match copy_to_output(
+                &mut decoder,
+                ctx.sink,
+                target_pos,
+                ctx.copy_buffer,
+                ctx.compare_buffer.as_mut(),
+            )
+            .await
+            {
+                Ok(_) => ctx.blob_intact = decoder.get_ref().get_ref().matches(expected_hash),
                 Err(e) => {
                     reporter.on_warning(
                         partition_name,
@@ -276,19 +501,16 @@ async fn process_operation_streaming(
             }
         }
         install_operation::Type::Zero => {
-            // zero handling using sparse files
-            // Instead of writing zeros, just seek past the region
-            // This turns multi GB zero operations into instant seeks
+            // a fresh output file leaves these as holes without any I/O,
+            // outputs holding old data (seeded, reused, block devices) are
+            // cleared by the sink
             for ext in &op.dst_extents {
                 let start_block = ext.start_block.unwrap_or(0);
                 let num_blocks = ext.num_blocks.unwrap_or(0);
                 let start_offset = start_block * ctx.block_size;
                 let total_bytes = num_blocks * ctx.block_size;
 
-                // Use sparse file optimization >> no actual I/O!
-                handle_zero_region_sparse(ctx.out_file, start_offset, total_bytes).await?;
-
-                ctx.current_pos = start_offset + total_bytes;
+                run_blocking(|| ctx.sink.write_zeros(start_offset, total_bytes))?;
             }
         }
         install_operation::Type::SourceCopy
@@ -300,24 +522,52 @@ async fn process_operation_streaming(
         | install_operation::Type::Zucchini => {
             #[cfg(feature = "diff_ota")]
             {
-                if let (Some(diff_ctx), Some(source_file)) =
-                    (ctx.diff_ctx, ctx.source_file.as_mut())
+                if ctx.seeded && is_identity_copy(op) {
+                    // blocks are already in place in the seeded output
+                    return Ok(());
+                }
+
+                // moved blocks keep sharing storage with the source too, so a
+                // seeded image only holds new data for blocks that changed
+                if op.r#type() == install_operation::Type::SourceCopy
+                    && let (Some(out), Some(source)) = (&ctx.clone_out, ctx.source)
                 {
+                    let block_size = ctx.block_size;
+                    run_blocking(|| clone_source_copy(op, source, out, block_size))
+                        .context("Failed to clone SOURCE_COPY blocks")?;
+                    return Ok(());
+                }
+
+                if let (Some(diff_ctx), Some(source)) = (ctx.diff_ctx, ctx.source) {
+                    // patch blobs normally arrive from the prefetch stage, which
+                    // has already been reading ahead while earlier ops patched
+                    let patch = match ctx.prefetcher.as_deref_mut() {
+                        Some(prefetcher) => prefetcher.next_for(operation_index).await?,
+                        None => PrefetchedPatch::new(
+                            operation_index,
+                            read_patch_data(ctx.payload_reader, op, ctx.data_offset).await?,
+                        ),
+                    };
+
+                    // CPU-heavy puffpatch runs in the background, the loop moves on
+                    if op.r#type() == install_operation::Type::Puffdiff
+                        && let Some(pool) = ctx.puff_pool.as_deref_mut()
+                    {
+                        pool.submit(operation_index, op, patch).await?;
+                        return Ok(());
+                    }
+
                     process_diff_operation(DiffOperationParams {
                         operation_index,
                         op,
                         ctx: diff_ctx,
                         partition_name,
-                        source_file,
-                        out_file: ctx.out_file,
-                        payload_reader: ctx.payload_reader,
-                        data_offset: ctx.data_offset,
+                        source,
+                        sink: ctx.sink,
+                        patch_data: &patch.data,
                         reporter,
                     })
                     .await?;
-
-                    // Update position after diff operation
-                    ctx.current_pos = ctx.out_file.stream_position().await?;
                 } else {
                     return Err(anyhow!(
                         "Operation {} is a differential OTA operation but source directory not provided. Use --source-dir option.",
@@ -342,11 +592,21 @@ async fn process_operation_streaming(
             return Ok(());
         }
     }
+
+    // only outputs that were written completely from an intact blob get here
+    #[cfg(feature = "diff_ota")]
+    if let (Some(reuse), Some(key), true) = (ctx.blob_reuse.as_mut(), blob_key, ctx.blob_intact) {
+        reuse.written.push(key);
+    }
     Ok(())
 }
 
 /// dump a partition to disk
 ///
+/// works on any tokio runtime. file I/O and patching block the calling
+/// worker, a multi-threaded runtime keeps its other tasks going meanwhile,
+/// a current-thread one waits for them
+///
 /// # Arguments
 /// * `partition` -> the partition metadata
 /// * `data_offset` -> offset in payload file where data begins
@@ -364,8 +624,183 @@ pub async fn dump_partition<P: AsyncPayloadRead>(
     reporter: &dyn ProgressReporter,
     source_dir: Option<PathBuf>,
 ) -> Result<()> {
+    let options = DumpOptions {
+        source_dir,
+        ..Default::default()
+    };
+
+    dump_partition_with_options(
+        partition,
+        data_offset,
+        block_size,
+        output_path,
+        payload_reader,
+        reporter,
+        &options,
+    )
+    .await
+}
+
+/// same as [`dump_partition`], with every extraction setting in `options`
+pub async fn dump_partition_with_options<P: AsyncPayloadRead>(
+    partition: &PartitionUpdate,
+    data_offset: u64,
+    block_size: u64,
+    output_path: PathBuf,
+    payload_reader: &P,
+    reporter: &dyn ProgressReporter,
+    options: &DumpOptions,
+) -> Result<()> {
+    extract_partition(
+        partition,
+        data_offset,
+        block_size,
+        Output::Path(&output_path),
+        payload_reader,
+        reporter,
+        options,
+    )
+    .await
+}
+
+/// extracts a partition into `sink` instead of a file
+///
+/// seeding from the source (`clone_source`), `rewrite_changed`,
+/// `blob_cache` and `seekable_zstd` work on image files and are not used
+/// here (wrap the sink in a [`SeekableZstdSink`] instead of the latter);
+/// with `preallocated` the sink is not given the image size
+pub async fn dump_partition_to_sink<P: AsyncPayloadRead>(
+    partition: &PartitionUpdate,
+    data_offset: u64,
+    block_size: u64,
+    sink: Arc<dyn PartitionSink>,
+    payload_reader: &P,
+    reporter: &dyn ProgressReporter,
+    options: &DumpOptions,
+) -> Result<()> {
+    extract_partition(
+        partition,
+        data_offset,
+        block_size,
+        Output::Sink(sink),
+        payload_reader,
+        reporter,
+        options,
+    )
+    .await
+}
+
+/// hash tree the payload leaves to the device, to be generated here
+///
+/// a tree that cannot be generated (e.g. an unsupported algorithm) is left
+/// out with a warning, the image is still written
+fn tree_to_generate(
+    partition: &PartitionUpdate,
+    block_size: u64,
+    warn: &mut dyn FnMut(String),
+) -> Option<HashTreeConfig> {
+    match HashTreeConfig::from_partition(partition, block_size) {
+        Ok(Some(config)) if !config.is_written_by_payload(partition) => Some(config),
+        Ok(_) => None,
+        Err(e) => {
+            warn(format!("Hash tree not generated: {}", e));
+            None
+        }
+    }
+}
+
+/// FEC the payload leaves to the device, to be generated here
+///
+/// FEC that cannot be generated (e.g. invalid roots) is left out with a
+/// warning, the image is still written
+fn fec_to_generate(
+    partition: &PartitionUpdate,
+    block_size: u64,
+    warn: &mut dyn FnMut(String),
+) -> Option<FecConfig> {
+    match FecConfig::from_partition(partition, block_size) {
+        Ok(Some(config)) if !config.is_written_by_payload(partition) => Some(config),
+        Ok(_) => None,
+        Err(e) => {
+            warn(format!("FEC not generated: {}", e));
+            None
+        }
+    }
+}
+
+/// completes an image whose operations were applied in parts by several
+/// writers into a shared preallocated file, e.g. cooperating processes
+///
+/// the parts must leave out the hash tree and FEC extents, they are
+/// generated here once all data is in place. the file may have been reused
+/// and hold old data, so every block no data-writing operation covers is
+/// cleared first, ZERO operations included
+///
+/// the hash tree and FEC are computed on `workers` threads
+/// returns warnings about verity data that could not be generated
+pub fn finish_split_image(
+    sink: &dyn PartitionSink,
+    partition: &PartitionUpdate,
+    block_size: u64,
+    workers: usize,
+) -> Result<Vec<String>> {
+    let mut warnings = Vec::new();
+    let size = partition
+        .new_partition_info
+        .as_ref()
+        .and_then(|info| info.size)
+        .ok_or_else(|| anyhow!("Partition size is missing"))?;
+
+    let mut data_ops = partition.clone();
+    data_ops.operations.retain(|op| {
+        !matches!(
+            op.r#type(),
+            install_operation::Type::Zero | install_operation::Type::Discard
+        )
+    });
+    clear_unwritten_blocks(sink, &data_ops, block_size, size)?;
+
+    if let Some(config) = tree_to_generate(partition, block_size, &mut |m| warnings.push(m)) {
+        write_hash_tree(sink, &config, workers).context(format!(
+            "Failed to generate hash tree for {}",
+            partition.partition_name
+        ))?;
+    }
+
+    if let Some(config) = fec_to_generate(partition, block_size, &mut |m| warnings.push(m)) {
+        generate_fec(sink, &config, workers).context(format!(
+            "Failed to generate FEC for {}",
+            partition.partition_name
+        ))?;
+    }
+
+    sink.flush()?;
+    Ok(warnings)
+}
+
+/// where [`extract_partition`] writes the image
+enum Output<'a> {
+    Path(&'a Path),
+    Sink(Arc<dyn PartitionSink>),
+}
+
+async fn extract_partition<P: AsyncPayloadRead>(
+    partition: &PartitionUpdate,
+    data_offset: u64,
+    block_size: u64,
+    output: Output<'_>,
+    payload_reader: &P,
+    reporter: &dyn ProgressReporter,
+    options: &DumpOptions,
+) -> Result<()> {
+    let source_dir = options.source_dir.clone();
     let partition_name = &partition.partition_name;
     let total_ops = partition.operations.len() as u64;
+    #[cfg(feature = "diff_ota")]
+    let output_path = match &output {
+        Output::Path(path) => Some(*path),
+        Output::Sink(_) => None,
+    };
 
     reporter.on_start(partition_name, total_ops);
 
@@ -376,7 +811,7 @@ pub async fn dump_partition<P: AsyncPayloadRead>(
         .any(|op| is_diff_operation(op.r#type()));
 
     #[cfg(feature = "diff_ota")]
-    let (diff_ctx, mut source_file_opt) = if has_diff_ops {
+    let (diff_ctx, source_image) = if has_diff_ops {
         if let Some(src_dir) = source_dir {
             let diff_ctx = DiffContext::new(src_dir, block_size);
             let source_img_path = diff_ctx.source_dir.join(format!("{}.img", partition_name));
@@ -388,8 +823,10 @@ pub async fn dump_partition<P: AsyncPayloadRead>(
                 ));
             }
 
-            let source_file = File::open(&source_img_path).await?;
-            (Some(diff_ctx), Some(source_file))
+            // opened once and shared read-only by every diff operation
+            let source_image =
+                Arc::new(SourceImage::open_for_output(&source_img_path, output_path)?);
+            (Some(diff_ctx), Some(source_image))
         } else {
             return Err(anyhow!(
                 "Partition '{}' contains differential operations but no source directory provided.",
@@ -408,11 +845,112 @@ pub async fn dump_partition<P: AsyncPayloadRead>(
         ));
     }
 
-    let mut out_file = File::create(&output_path).await?;
+    // seed the output with the source image so identity copies cost nothing
+    #[cfg(feature = "diff_ota")]
+    let seeded = match (&source_image, output_path) {
+        (Some(source), Some(output_path)) if options.clone_source && !options.preallocated => {
+            let src_path = source.path().to_path_buf();
+            let dst_path = output_path.to_path_buf();
+            let method =
+                tokio::task::spawn_blocking(move || clone_file(&src_path, &dst_path)).await??;
+            if method == CloneMethod::Copy {
+                reporter.on_warning(
+                    partition_name,
+                    0,
+                    "Reflink not supported, source image was copied instead".to_string(),
+                );
+            }
+            true
+        }
+        _ => false,
+    };
+    #[cfg(not(feature = "diff_ota"))]
+    let seeded = false;
+
+    // an earlier extraction is kept and only rewritten where it differs,
+    // clearing unwritten blocks relies on punching holes
+    #[cfg(feature = "diff_ota")]
+    let in_place = match output_path {
+        Some(path) if options.rewrite_changed && !seeded && !options.preallocated => {
+            tokio::fs::try_exists(path).await.unwrap_or(false)
+        }
+        _ => false,
+    };
+    #[cfg(not(feature = "diff_ota"))]
+    let in_place = false;
+
+    // blobs in the image about to be overwritten cannot be reused anymore
+    #[cfg(feature = "diff_ota")]
+    if let (Some(cache), Some(path)) = (&options.blob_cache, output_path) {
+        cache.forget_image(path);
+    }
+
+    let mut zstd_cores = None;
+    let sink: Arc<dyn PartitionSink> = match &output {
+        // opened readable as well, the hash tree and FEC are computed from it
+        Output::Path(path) => {
+            let reopen = seeded || in_place || options.preallocated;
+            let file = tokio::fs::OpenOptions::new()
+                .write(true)
+                .read(true)
+                .create(!reopen)
+                .truncate(!reopen)
+                .open(path)
+                .await?
+                .into_std()
+                .await;
+            // a shared preallocated image was created empty as well
+            let image = FileSink::from_file(file, !(seeded || in_place));
+            match &options.seekable_zstd {
+                Some(zstd) if !options.preallocated => {
+                    let output = tokio::fs::OpenOptions::new()
+                        .read(true)
+                        .write(true)
+                        .create(true)
+                        .truncate(true)
+                        .open(&zstd.path)
+                        .await
+                        .with_context(|| format!("Failed to create {}", zstd.path.display()))?
+                        .into_std()
+                        .await;
+                    let payload = match &zstd.payload {
+                        Some((path, data_offset)) => Some((
+                            tokio::fs::File::open(path).await?.into_std().await,
+                            *data_offset,
+                        )),
+                        None => None,
+                    };
+                    // frames are compressed alongside the extraction, on
+                    // cores that are idle when it starts
+                    let (workers, permit) = step_workers(options, zstd.options.workers);
+                    zstd_cores = permit;
+                    Arc::new(SeekableZstdSink::new(
+                        image,
+                        output,
+                        partition,
+                        block_size,
+                        payload,
+                        SeekableOptions {
+                            workers,
+                            ..zstd.options.clone()
+                        },
+                    ))
+                }
+                _ => Arc::new(image),
+            }
+        }
+        Output::Sink(sink) => Arc::clone(sink),
+    };
 
     if let Some(info) = &partition.new_partition_info {
         if let Some(size) = info.size {
-            out_file.set_len(size).await?;
+            // other partitions own the rest of a preallocated image
+            if !options.preallocated {
+                run_blocking(|| -> Result<()> {
+                    sink.set_size(size)?;
+                    clear_unwritten_blocks(&*sink, partition, block_size, size)
+                })?;
+            }
         } else {
             return Err(anyhow!("Partition size is missing"));
         }
@@ -420,37 +958,166 @@ pub async fn dump_partition<P: AsyncPayloadRead>(
 
     let mut reader = payload_reader.open_reader().await?;
 
+    // diff operations get a dedicated reader feeding the prefetch stage
+    #[cfg(feature = "diff_ota")]
+    let mut prefetcher = match &source_image {
+        Some(source) => Some(DiffPrefetcher::spawn(
+            &partition.operations,
+            data_offset,
+            block_size,
+            payload_reader.open_reader().await?,
+            Arc::clone(source),
+            DEFAULT_PREFETCH_DEPTH,
+            DEFAULT_PREFETCH_BUDGET,
+            seeded,
+        )),
+        None => None,
+    };
+
+    // PUFFDIFF operations are patched concurrently and write positionally
+    #[cfg(feature = "diff_ota")]
+    let mut puff_pool = match &source_image {
+        Some(source)
+            if partition
+                .operations
+                .iter()
+                .any(|op| op.r#type() == install_operation::Type::Puffdiff) =>
+        {
+            Some(PuffdiffPool::new(
+                Arc::clone(&sink),
+                Arc::clone(source),
+                block_size,
+                options.cpu_budget.clone(),
+                options.puff_budget.clone().unwrap_or_default(),
+            ))
+        }
+        _ => None,
+    };
+
+    // outputs inside a shared preallocated image are not tracked, other
+    // partitions keep writing to it and its identity changes
+    #[cfg(feature = "diff_ota")]
+    let blob_reuse = match (&options.blob_cache, output_path, sink.as_file()) {
+        (Some(cache), Some(_), Some(file)) if !options.preallocated => Some(BlobReuse {
+            cache,
+            out: file.try_clone()?,
+            written: Vec::new(),
+        }),
+        _ => None,
+    };
+
+    #[cfg(feature = "diff_ota")]
+    let clone_out = match sink.as_file() {
+        Some(file) if seeded => Some(file.try_clone()?),
+        _ => None,
+    };
+
     // Allocate reusable buffers once >> now with larger sizes
     let mut copy_buffer = vec![0u8; COPY_BUFFER_SIZE];
-    // zero_chunk no longer needed with sparse file optimization
-    // Keeping it commented for potential fallback
-    // let zero_chunk = vec![0u8; ZERO_WRITE_CHUNK];
 
     // Create context to group related parameters
     let mut ctx = OperationContext {
         data_offset,
         block_size,
         payload_reader: &mut *reader,
-        out_file: &mut out_file,
+        sink: &*sink,
         copy_buffer: &mut copy_buffer,
+        compare_buffer: in_place.then(Vec::new),
+        #[cfg(feature = "diff_ota")]
+        hash_blobs: blob_reuse.is_some(),
+        #[cfg(not(feature = "diff_ota"))]
+        hash_blobs: false,
+        blob_intact: false,
         #[cfg(feature = "diff_ota")]
         diff_ctx: diff_ctx.as_ref(),
         #[cfg(feature = "diff_ota")]
-        source_file: source_file_opt.as_mut(),
-        current_pos: 0, // Initialize position tracker
+        source: source_image.as_deref(),
+        #[cfg(feature = "diff_ota")]
+        prefetcher: prefetcher.as_mut(),
+        #[cfg(feature = "diff_ota")]
+        puff_pool: puff_pool.as_mut(),
+        #[cfg(feature = "diff_ota")]
+        seeded,
+        #[cfg(feature = "diff_ota")]
+        clone_out,
+        #[cfg(feature = "diff_ota")]
+        blob_reuse,
     };
 
+    let mut result = Ok(());
     for (i, op) in partition.operations.iter().enumerate() {
         // Check for cancellation before processing each operation
         if reporter.is_cancelled() {
-            return Err(anyhow!("Extraction cancelled by user"));
+            result = Err(anyhow!("Extraction cancelled by user"));
+            break;
         }
 
-        process_operation_streaming(i, op, &mut ctx, reporter, partition_name).await?;
+        result = process_operation_streaming(i, op, &mut ctx, reporter, partition_name).await;
+        if result.is_err() {
+            break;
+        }
         reporter.on_progress(partition_name, (i + 1) as u64, total_ops);
     }
 
-    out_file.flush().await?;
+    #[cfg(feature = "diff_ota")]
+    let blob_reuse = ctx.blob_reuse.take();
+
+    // PUFFDIFF operations still running write to the sink, they have to be
+    // done before the error is returned and the output is cleaned up
+    #[cfg(feature = "diff_ota")]
+    if let Some(pool) = puff_pool {
+        match result {
+            Ok(()) => pool.finish().await?,
+            Err(_) => pool.cancel().await,
+        }
+    }
+    result?;
+
+    // update_engine builds the verity tree on device, payloads normally leave
+    // its extent empty, regenerate it so the image matches its expected hash
+    if let Some(config) = tree_to_generate(partition, block_size, &mut |message| {
+        reporter.on_warning(partition_name, 0, message)
+    }) {
+        let image = Arc::clone(&sink);
+        let (workers, _extra) = step_workers(options, num_cpus::get());
+        tokio::task::spawn_blocking(move || write_hash_tree(&*image, &config, workers))
+            .await?
+            .context(format!(
+                "Failed to generate hash tree for {}",
+                partition_name
+            ))?;
+    }
+
+    // the FEC covers the hash tree as well, so it has to come after it
+    if let Some(config) = fec_to_generate(partition, block_size, &mut |message| {
+        reporter.on_warning(partition_name, 0, message)
+    }) {
+        let image = Arc::clone(&sink);
+        let (workers, _extra) = step_workers(options, num_cpus::get());
+        tokio::task::spawn_blocking(move || generate_fec(&*image, &config, workers))
+            .await?
+            .context(format!("Failed to generate FEC for {}", partition_name))?;
+    }
+
+    // the image is complete, sinks that encode a container do it now
+    let image = Arc::clone(&sink);
+    tokio::task::spawn_blocking(move || image.flush())
+        .await?
+        .context(format!("Failed to finish the image of {}", partition_name))?;
+    drop(zstd_cores);
+
+    // recorded last, the image identity includes its modification time
+    #[cfg(feature = "diff_ota")]
+    if let (Some(reuse), Some(output_path)) = (blob_reuse, output_path) {
+        run_blocking(|| reuse.out.sync_all())?;
+        if let Err(e) = reuse.cache.record_image(output_path, &reuse.written) {
+            reporter.on_warning(
+                partition_name,
+                0,
+                format!("Failed to record blobs for reuse: {}", e),
+            );
+        }
+    }
 
     reporter.on_complete(partition_name, total_ops);
 
@@ -72,9 +72,17 @@ pub async fn parse_remote_payload(
     dns: Option<&str>,
 ) -> Result<(DeltaArchiveManifest, u64, ZipMetadataInfo)> {
     let http_reader = HttpReader::new(url, user_agent, cookies, dns).await?;
-    let zip_info = ZipParser::get_zip_info(&http_reader).await?;
+    parse_remote_payload_from(&http_reader).await
+}
+
+/// like `parse_remote_payload`, over a connection that is already open
+#[cfg(feature = "remote_zip")]
+pub async fn parse_remote_payload_from(
+    http_reader: &HttpReader,
+) -> Result<(DeltaArchiveManifest, u64, ZipMetadataInfo)> {
+    let zip_info = ZipParser::get_zip_info(http_reader).await?;
     let payload_offset = zip_info.payload_data_offset;
-    ZipParser::verify_payload_magic(&http_reader, payload_offset).await?;
+    ZipParser::verify_payload_magic(http_reader, payload_offset).await?;
 
     let mut pos = payload_offset;
 
@@ -87,31 +95,31 @@ pub async fn parse_remote_payload(
 
     // read and validate magic
     let mut magic = [0u8; 4];
-    read_at(&http_reader, &mut pos, &mut magic).await?;
+    read_at(http_reader, &mut pos, &mut magic).await?;
     if &magic != PAYLOAD_MAGIC {
         return Err(anyhow!("Invalid payload file: magic 'CrAU' not found"));
     }
 
     // read and validate version
     let mut buf = [0u8; 8];
-    read_at(&http_reader, &mut pos, &mut buf).await?;
+    read_at(http_reader, &mut pos, &mut buf).await?;
     let version = u64::from_be_bytes(buf);
     if version != SUPPORTED_PAYLOAD_VERSION {
         return Err(anyhow!("Unsupported payload version: {}", version));
     }
 
     // read manifest size
-    read_at(&http_reader, &mut pos, &mut buf).await?;
+    read_at(http_reader, &mut pos, &mut buf).await?;
     let manifest_size = u64::from_be_bytes(buf);
 
     // read metadata signature size
     let mut buf4 = [0u8; 4];
-    read_at(&http_reader, &mut pos, &mut buf4).await?;
+    read_at(http_reader, &mut pos, &mut buf4).await?;
     let sig_size = u32::from_be_bytes(buf4);
 
     // read manifest
     let mut manifest_bytes = vec![0u8; manifest_size as usize];
-    read_at(&http_reader, &mut pos, &mut manifest_bytes).await?;
+    read_at(http_reader, &mut pos, &mut manifest_bytes).await?;
 
     // skip signature, advance position
     pos += sig_size as u64;
@@ -255,6 +263,14 @@ pub async fn parse_remote_bin_payload(
     dns: Option<&str>,
 ) -> Result<(DeltaArchiveManifest, u64, u64)> {
     let http_reader = HttpReader::new(url, user_agent, cookies, dns).await?;
+    parse_remote_bin_payload_from(&http_reader).await
+}
+
+/// like `parse_remote_bin_payload`, over a connection that is already open
+#[cfg(feature = "remote_zip")]
+pub async fn parse_remote_bin_payload_from(
+    http_reader: &HttpReader,
+) -> Result<(DeltaArchiveManifest, u64, u64)> {
     let content_length = http_reader.content_length;
 
     let mut pos = 0u64;
@@ -268,31 +284,31 @@ pub async fn parse_remote_bin_payload(
 
     // Read and validate magic
     let mut magic = [0u8; 4];
-    read_at(&http_reader, &mut pos, &mut magic).await?;
+    read_at(http_reader, &mut pos, &mut magic).await?;
     if &magic != PAYLOAD_MAGIC {
         return Err(anyhow!("Invalid payload file: magic 'CrAU' not found"));
     }
 
     // Read and validate version
     let mut buf = [0u8; 8];
-    read_at(&http_reader, &mut pos, &mut buf).await?;
+    read_at(http_reader, &mut pos, &mut buf).await?;
     let version = u64::from_be_bytes(buf);
     if version != SUPPORTED_PAYLOAD_VERSION {
         return Err(anyhow!("Unsupported payload version: {}", version));
     }
 
     // Read manifest size
-    read_at(&http_reader, &mut pos, &mut buf).await?;
+    read_at(http_reader, &mut pos, &mut buf).await?;
     let manifest_size = u64::from_be_bytes(buf);
 
     // Read metadata signature size
     let mut buf4 = [0u8; 4];
-    read_at(&http_reader, &mut pos, &mut buf4).await?;
+    read_at(http_reader, &mut pos, &mut buf4).await?;
     let sig_size = u32::from_be_bytes(buf4);
 
     // Read manifest
     let mut manifest_bytes = vec![0u8; manifest_size as usize];
-    read_at(&http_reader, &mut pos, &mut manifest_bytes).await?;
+    read_at(http_reader, &mut pos, &mut manifest_bytes).await?;
 
     // Skip signature
     pos += sig_size as u64;
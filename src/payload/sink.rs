@@ -0,0 +1,430 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+// destinations for extracted partition images
+//
+// operations write their output wherever their destination extents point,
+// in manifest order, and the hash tree, FEC and in-place rewrites read the
+// image back, so a sink is a positional store rather than a stream. every
+// method takes `&self`: PUFFDIFF operations and the hash tree / FEC workers
+// use one sink from several threads at once, on disjoint ranges.
+//
+// containers that have to be written front to back (android sparse images,
+// tar archives) stage the image in another sink and encode it on `flush`.
+
+use std::fs::File;
+use std::io::{self, Seek, SeekFrom, Write};
+use std::ops::Range;
+use std::path::Path;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex, RwLock};
+
+#[cfg(feature = "diff_ota")]
+use crate::payload::clone::punch_hole;
+use crate::sparse_tar::{TarWriter, scan_data_regions};
+use crate::super_image::write_sparse_image;
+use crate::utils::{read_exact_at, write_all_at};
+
+const ZERO_WRITE_CHUNK: usize = 2 * 1024 * 1024; // 2 MB chunks for zero writes
+
+/// where an extracted partition image goes
+///
+/// implement this to receive images without going through the filesystem
+pub trait PartitionSink: Send + Sync {
+    /// final size of the image, given before the first write when the
+    /// manifest records it
+    fn set_size(&self, size: u64) -> io::Result<()> {
+        let _ = size;
+        Ok(())
+    }
+
+    /// writes all of `buf` at `offset`
+    fn write_at(&self, buf: &[u8], offset: u64) -> io::Result<()>;
+
+    /// fills `buf` from `offset`, with data written earlier
+    fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<()>;
+
+    /// makes `length` bytes at `offset` read back as zeros
+    fn write_zeros(&self, offset: u64, length: u64) -> io::Result<()> {
+        write_zero_chunks(self, offset, length)
+    }
+
+    /// called once after the last write, the image is complete
+    fn flush(&self) -> io::Result<()> {
+        Ok(())
+    }
+
+    /// the file holding the image, blobs seen before are reflinked into it
+    fn as_file(&self) -> Option<&File> {
+        None
+    }
+}
+
+/// zero fill through plain writes, for sinks that cannot do better
+fn write_zero_chunks<S: PartitionSink + ?Sized>(
+    sink: &S,
+    mut offset: u64,
+    length: u64,
+) -> io::Result<()> {
+    if length == 0 {
+        return Ok(());
+    }
+
+    let end = offset + length;
+    let zero_chunk = vec![0u8; ZERO_WRITE_CHUNK.min(length as usize)];
+    while offset < end {
+        let n = (end - offset).min(zero_chunk.len() as u64) as usize;
+        sink.write_at(&zero_chunk[..n], offset)?;
+        offset += n as u64;
+    }
+    Ok(())
+}
+
+impl PartitionSink for File {
+    fn set_size(&self, size: u64) -> io::Result<()> {
+        self.set_len(size)
+    }
+
+    fn write_at(&self, buf: &[u8], offset: u64) -> io::Result<()> {
+        write_all_at(self, buf, offset)
+    }
+
+    fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<()> {
+        read_exact_at(self, buf, offset)
+    }
+
+    fn write_zeros(&self, offset: u64, length: u64) -> io::Result<()> {
+        #[cfg(feature = "diff_ota")]
+        if length == 0 || punch_hole(self, offset, length) {
+            return Ok(());
+        }
+        write_zero_chunks(self, offset, length)
+    }
+
+    fn as_file(&self) -> Option<&File> {
+        Some(self)
+    }
+}
+
+/// image file on a filesystem
+///
+/// a freshly created file reads back zeros wherever nothing was written, so
+/// ZERO operations cost nothing and the untouched ranges stay holes
+pub struct FileSink {
+    file: File,
+    zeroed: bool,
+}
+
+impl FileSink {
+    /// creates `path`, truncating whatever was there
+    pub fn create(path: &Path) -> io::Result<Self> {
+        let file = std::fs::OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .truncate(true)
+            .open(path)?;
+        Ok(Self::from_file(file, true))
+    }
+
+    /// opens the existing image at `path`, its contents are overwritten in
+    /// place and cleared where the new image has zeros
+    pub fn open(path: &Path) -> io::Result<Self> {
+        let file = std::fs::OpenOptions::new()
+            .read(true)
+            .write(true)
+            .open(path)?;
+        Ok(Self::from_file(file, false))
+    }
+
+    /// wraps a file opened for reading and writing
+    ///
+    /// `zeroed` when every byte not written yet reads back as zero (an empty
+    /// or freshly truncated file)
+    pub fn from_file(file: File, zeroed: bool) -> Self {
+        Self { file, zeroed }
+    }
+
+    pub fn file(&self) -> &File {
+        &self.file
+    }
+}
+
+impl PartitionSink for FileSink {
+    fn set_size(&self, size: u64) -> io::Result<()> {
+        self.file.set_len(size)
+    }
+
+    fn write_at(&self, buf: &[u8], offset: u64) -> io::Result<()> {
+        write_all_at(&self.file, buf, offset)
+    }
+
+    fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<()> {
+        read_exact_at(&self.file, buf, offset)
+    }
+
+    fn write_zeros(&self, offset: u64, length: u64) -> io::Result<()> {
+        if self.zeroed {
+            return Ok(());
+        }
+        self.file.write_zeros(offset, length)
+    }
+
+    fn as_file(&self) -> Option<&File> {
+        Some(&self.file)
+    }
+}
+
+/// image written straight onto a block device (or any fixed size file)
+///
+/// nothing is resized, the image only has to fit, and every byte of it is
+/// written since the device still holds whatever was there before
+pub struct BlockDeviceSink {
+    file: File,
+}
+
+impl BlockDeviceSink {
+    pub fn open(path: &Path) -> io::Result<Self> {
+        let file = std::fs::OpenOptions::new()
+            .read(true)
+            .write(true)
+            .open(path)?;
+        Ok(Self::from_file(file))
+    }
+
+    /// wraps a device opened for reading and writing
+    pub fn from_file(file: File) -> Self {
+        Self { file }
+    }
+}
+
+impl PartitionSink for BlockDeviceSink {
+    fn set_size(&self, size: u64) -> io::Result<()> {
+        // block devices report their size as the end of the stream
+        let capacity = (&self.file).seek(SeekFrom::End(0))?;
+        if size > capacity {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                format!(
+                    "image of {} bytes does not fit the {} byte device",
+                    size, capacity
+                ),
+            ));
+        }
+        Ok(())
+    }
+
+    fn write_at(&self, buf: &[u8], offset: u64) -> io::Result<()> {
+        write_all_at(&self.file, buf, offset)
+    }
+
+    fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<()> {
+        read_exact_at(&self.file, buf, offset)
+    }
+
+    fn flush(&self) -> io::Result<()> {
+        self.file.sync_all()
+    }
+}
+
+/// image kept in memory
+///
+/// grows to the furthest byte written, which with `set_size` is the whole
+/// partition: meant for small partitions and images that are consumed right
+/// away
+#[derive(Debug, Default)]
+pub struct MemorySink {
+    data: RwLock<Vec<u8>>,
+}
+
+impl MemorySink {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// the image, leaving the sink empty
+    pub fn take(&self) -> Vec<u8> {
+        std::mem::take(&mut *self.data.write().unwrap())
+    }
+
+    pub fn into_inner(self) -> Vec<u8> {
+        self.data.into_inner().unwrap()
+    }
+
+    /// `data[range]` after growing `data` to hold it
+    fn grow(data: &mut Vec<u8>, offset: u64, length: usize) -> io::Result<Range<usize>> {
+        let range = byte_range(offset, length)?;
+        if data.len() < range.end {
+            data.resize(range.end, 0);
+        }
+        Ok(range)
+    }
+}
+
+fn byte_range(offset: u64, length: usize) -> io::Result<Range<usize>> {
+    usize::try_from(offset)
+        .ok()
+        .and_then(|start| Some(start..start.checked_add(length)?))
+        .ok_or_else(|| io::Error::new(io::ErrorKind::InvalidInput, "offset out of memory range"))
+}
+
+impl PartitionSink for MemorySink {
+    fn set_size(&self, size: u64) -> io::Result<()> {
+        let size = usize::try_from(size)
+            .map_err(|_| io::Error::new(io::ErrorKind::InvalidInput, "image too large"))?;
+        self.data.write().unwrap().resize(size, 0);
+        Ok(())
+    }
+
+    fn write_at(&self, buf: &[u8], offset: u64) -> io::Result<()> {
+        let mut data = self.data.write().unwrap();
+        let range = Self::grow(&mut data, offset, buf.len())?;
+        data[range].copy_from_slice(buf);
+        Ok(())
+    }
+
+    fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<()> {
+        let data = self.data.read().unwrap();
+        let range = byte_range(offset, buf.len())?;
+        let Some(stored) = data.get(range) else {
+            return Err(io::Error::new(
+                io::ErrorKind::UnexpectedEof,
+                "read past the end of the image",
+            ));
+        };
+        buf.copy_from_slice(stored);
+        Ok(())
+    }
+
+    fn write_zeros(&self, offset: u64, length: u64) -> io::Result<()> {
+        let length = usize::try_from(length)
+            .map_err(|_| io::Error::new(io::ErrorKind::InvalidInput, "zero range too large"))?;
+        let mut data = self.data.write().unwrap();
+        let range = Self::grow(&mut data, offset, length)?;
+        data[range].fill(0);
+        Ok(())
+    }
+}
+
+/// android sparse image, encoded from `staging` once the image is complete
+///
+/// zero blocks become DONT_CARE chunks and repeated words FILL chunks, see
+/// [`write_sparse_image`]
+pub struct SparseImageSink<S, W> {
+    staging: S,
+    out: Mutex<W>,
+    size: AtomicU64,
+    block_size: u32,
+}
+
+impl<S: PartitionSink, W: Write + Seek + Send> SparseImageSink<S, W> {
+    /// `block_size` is the sparse block size (4096 for fastboot)
+    pub fn new(staging: S, out: W, block_size: u32) -> Self {
+        Self {
+            staging,
+            out: Mutex::new(out),
+            size: AtomicU64::new(0),
+            block_size,
+        }
+    }
+
+    pub fn into_inner(self) -> W {
+        self.out.into_inner().unwrap()
+    }
+}
+
+impl<S: PartitionSink, W: Write + Seek + Send> PartitionSink for SparseImageSink<S, W> {
+    fn set_size(&self, size: u64) -> io::Result<()> {
+        self.size.store(size, Ordering::Relaxed);
+        self.staging.set_size(size)
+    }
+
+    fn write_at(&self, buf: &[u8], offset: u64) -> io::Result<()> {
+        self.staging.write_at(buf, offset)
+    }
+
+    fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<()> {
+        self.staging.read_at(buf, offset)
+    }
+
+    fn write_zeros(&self, offset: u64, length: u64) -> io::Result<()> {
+        self.staging.write_zeros(offset, length)
+    }
+
+    fn flush(&self) -> io::Result<()> {
+        self.staging.flush()?;
+        let mut out = self.out.lock().unwrap();
+        write_sparse_image(
+            &self.staging,
+            self.size.load(Ordering::Relaxed),
+            &mut *out,
+            self.block_size,
+        )
+        .map_err(io::Error::other)
+    }
+}
+
+/// one entry of a tar archive shared by several partitions, appended from
+/// `staging` once the image is complete
+///
+/// zero blocks are stored as holes, see [`TarWriter`]. entries land in the
+/// order their partitions finish; the archive is ended with
+/// [`TarWriter::finish`] after the last one
+pub struct TarSink<S, W: Write> {
+    staging: S,
+    archive: Arc<Mutex<TarWriter<W>>>,
+    name: String,
+    size: AtomicU64,
+    block_size: u64,
+}
+
+impl<S: PartitionSink, W: Write + Send> TarSink<S, W> {
+    /// `name` is the entry name, `block_size` the granularity holes are
+    /// looked for at
+    pub fn new(
+        staging: S,
+        archive: Arc<Mutex<TarWriter<W>>>,
+        name: impl Into<String>,
+        block_size: u64,
+    ) -> Self {
+        Self {
+            staging,
+            archive,
+            name: name.into(),
+            size: AtomicU64::new(0),
+            block_size,
+        }
+    }
+}
+
+impl<S: PartitionSink, W: Write + Send> PartitionSink for TarSink<S, W> {
+    fn set_size(&self, size: u64) -> io::Result<()> {
+        self.size.store(size, Ordering::Relaxed);
+        self.staging.set_size(size)
+    }
+
+    fn write_at(&self, buf: &[u8], offset: u64) -> io::Result<()> {
+        self.staging.write_at(buf, offset)
+    }
+
+    fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<()> {
+        self.staging.read_at(buf, offset)
+    }
+
+    fn write_zeros(&self, offset: u64, length: u64) -> io::Result<()> {
+        self.staging.write_zeros(offset, length)
+    }
+
+    fn flush(&self) -> io::Result<()> {
+        self.staging.flush()?;
+        let size = self.size.load(Ordering::Relaxed);
+        let (regions, _) =
+            scan_data_regions(&self.staging, size, self.block_size).map_err(io::Error::other)?;
+        self.archive
+            .lock()
+            .unwrap()
+            .append_image(&self.name, &self.staging, size, &regions)
+            .map_err(io::Error::other)
+    }
+}
@@ -0,0 +1,414 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+use ahash::{AHashMap, AHashSet};
+use anyhow::{Context, Result, anyhow};
+use memmap2::Mmap;
+use std::fs::File;
+use std::hash::{BuildHasher, Hash, Hasher};
+use std::ops::Deref;
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex};
+
+use crate::structs::Extent;
+use crate::utils::read_exact_at;
+
+// gather buffers kept around for reuse, anything bigger is dropped on release
+const POOL_MAX_BUFFERS: usize = 8;
+const POOL_MAX_BUFFER_SIZE: usize = 64 * 1024 * 1024;
+
+/// bytes of gathered source extents kept for reuse by later operations
+pub const DEFAULT_EXTENT_CACHE_BUDGET: u64 = 64 * 1024 * 1024;
+// extent lists remembered as "seen once", so one-off reads skip the cache
+const EXTENT_CACHE_MAX_SEEN: usize = 64 * 1024;
+
+/// read-only view of a source partition image used by differential operations
+///
+/// the image is memory mapped when possible, so contiguous extents are handed
+/// out as borrowed slices of the mapping and the kernel shares those pages
+/// between every operation touching the same blocks. non-contiguous extents
+/// are gathered into a pooled buffer. when mapping fails (empty file, exotic
+/// filesystem, or the image is also the output being written) reads fall back
+/// to positional pread/seek_read.
+///
+/// either way a single handle can be shared by any number of concurrent diff
+/// operations without any of them holding a mutable borrow. scattered extent
+/// lists that keep coming back are served from a small LRU instead of being
+/// gathered again
+pub struct SourceImage {
+    file: File,
+    map: Option<Mmap>,
+    path: PathBuf,
+    size: u64,
+    pool: Mutex<Vec<Vec<u8>>>,
+    cache: Mutex<ExtentCache>,
+}
+
+/// source bytes for one operation, either borrowed from the mapping or
+/// gathered into a buffer that goes back to the pool when dropped
+pub enum SourceData<'a> {
+    Mapped(&'a [u8]),
+    Gathered {
+        buf: Vec<u8>,
+        pool: &'a Mutex<Vec<Vec<u8>>>,
+    },
+    Cached(Arc<[u8]>),
+}
+
+impl Deref for SourceData<'_> {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        match self {
+            SourceData::Mapped(slice) => slice,
+            SourceData::Gathered { buf, .. } => buf,
+            SourceData::Cached(data) => data,
+        }
+    }
+}
+
+impl Drop for SourceData<'_> {
+    fn drop(&mut self) {
+        if let SourceData::Gathered { buf, pool } = self {
+            if buf.capacity() > POOL_MAX_BUFFER_SIZE {
+                return;
+            }
+            if let Ok(mut pool) = pool.lock()
+                && pool.len() < POOL_MAX_BUFFERS
+            {
+                pool.push(std::mem::take(buf));
+            }
+        }
+    }
+}
+
+impl SourceImage {
+    pub fn open(path: &Path) -> Result<Self> {
+        Self::open_for_output(path, None)
+    }
+
+    /// opens the source of a partition extracted to `output`. when both are
+    /// the same file (--source-dir equal to --out, or a hard link) the image
+    /// is read with pread only, a mapping of a file being truncated and
+    /// rewritten faults with SIGBUS instead of returning an error
+    pub fn open_for_output(path: &Path, output: Option<&Path>) -> Result<Self> {
+        let file = File::open(path)
+            .with_context(|| format!("Failed to open source image {}", path.display()))?;
+        let size = file.metadata()?.len();
+        let rewritten = output.is_some_and(|output| is_same_file(&file, path, output));
+
+        // SAFETY: source images are treated as immutable inputs for the whole
+        // extraction. the one file this process writes that could be the
+        // source is the output, which is never mapped (see above). a file
+        // shrunk under us by another process is outside what we can guard
+        let map = if size > 0 && !rewritten {
+            unsafe { Mmap::map(&file) }.ok()
+        } else {
+            None
+        };
+
+        Ok(Self {
+            file,
+            map,
+            path: path.to_path_buf(),
+            size,
+            pool: Mutex::new(Vec::new()),
+            cache: Mutex::new(ExtentCache::new(DEFAULT_EXTENT_CACHE_BUDGET)),
+        })
+    }
+
+    /// changes the byte budget of the gathered-extent cache, 0 disables it
+    pub fn with_cache_budget(self, budget: u64) -> Self {
+        if let Ok(mut cache) = self.cache.lock() {
+            *cache = ExtentCache::new(budget);
+        }
+        self
+    }
+
+    pub fn path(&self) -> &Path {
+        &self.path
+    }
+
+    /// the image file, for positional access outside the mapping (cloning)
+    pub fn file(&self) -> &File {
+        &self.file
+    }
+
+    pub fn size(&self) -> u64 {
+        self.size
+    }
+
+    pub fn is_mapped(&self) -> bool {
+        self.map.is_some()
+    }
+
+    /// read exactly `buf.len()` bytes at `offset` without touching any cursor
+    pub fn read_at(&self, offset: u64, buf: &mut [u8]) -> Result<()> {
+        let end = self.check_range(offset, buf.len() as u64)?;
+
+        if let Some(map) = &self.map {
+            buf.copy_from_slice(&map[offset as usize..end as usize]);
+            return Ok(());
+        }
+
+        read_exact_at(&self.file, buf, offset)
+            .with_context(|| format!("Failed to read {} bytes at offset {}", buf.len(), offset))
+    }
+
+    /// returns the bytes covered by `extents`, in extent order
+    ///
+    /// when the extents are back to back in the image and the image is mapped
+    /// this is a zero-copy slice, otherwise the blocks are gathered
+    pub fn read_extents(&self, extents: &[Extent], block_size: u64) -> Result<SourceData<'_>> {
+        let mut ranges = Vec::with_capacity(extents.len());
+        let mut total = 0u64;
+
+        for (i, extent) in extents.iter().enumerate() {
+            let num_blocks = extent.num_blocks.unwrap_or(0);
+            if num_blocks == 0 {
+                continue;
+            }
+
+            let offset = extent
+                .start_block
+                .unwrap_or(0)
+                .checked_mul(block_size)
+                .ok_or_else(|| anyhow!("Offset overflow in extent {}", i))?;
+            let length = num_blocks
+                .checked_mul(block_size)
+                .ok_or_else(|| anyhow!("Length overflow in extent {}", i))?;
+
+            self.check_range(offset, length)
+                .with_context(|| format!("Invalid source extent {}", i))?;
+
+            ranges.push((offset, length));
+            total += length;
+        }
+
+        if let Some(map) = &self.map {
+            let contiguous = ranges.windows(2).all(|w| w[0].0 + w[0].1 == w[1].0);
+            if contiguous {
+                let start = ranges.first().map(|r| r.0).unwrap_or(0) as usize;
+                return Ok(SourceData::Mapped(&map[start..start + total as usize]));
+            }
+        }
+
+        // operations frequently read the very same scattered extent list (a
+        // shared deflate stream, common blocks), keep those around instead of
+        // gathering them again for every operation
+        let admit = match self.cache.lock() {
+            Ok(mut cache) => match cache.lookup(&ranges, total) {
+                CacheLookup::Hit(data) => return Ok(SourceData::Cached(data)),
+                CacheLookup::Admit => true,
+                CacheLookup::Skip => false,
+            },
+            Err(_) => false,
+        };
+
+        let mut buf = self.take_buffer(total as usize);
+        self.gather(&ranges, &mut buf)?;
+
+        if admit {
+            let data: Arc<[u8]> = Arc::from(&buf[..]);
+            if let Ok(mut cache) = self.cache.lock() {
+                cache.insert(ranges, Arc::clone(&data));
+            }
+            // the gather buffer is no longer needed, hand it back to the pool
+            drop(SourceData::Gathered {
+                buf,
+                pool: &self.pool,
+            });
+            return Ok(SourceData::Cached(data));
+        }
+
+        Ok(SourceData::Gathered {
+            buf,
+            pool: &self.pool,
+        })
+    }
+
+    fn gather(&self, ranges: &[(u64, u64)], buf: &mut [u8]) -> Result<()> {
+        let mut pos = 0usize;
+
+        for &(offset, length) in ranges {
+            let length = length as usize;
+            self.read_at(offset, &mut buf[pos..pos + length])?;
+            pos += length;
+        }
+
+        Ok(())
+    }
+
+    /// hints the kernel to start reading `extents` in the background
+    ///
+    /// only meaningful for mapped images on unix, a no-op otherwise
+    pub fn prefetch_extents(&self, extents: &[Extent], block_size: u64) {
+        #[cfg(unix)]
+        if let Some(map) = &self.map {
+            for extent in extents {
+                let offset = extent.start_block.unwrap_or(0).saturating_mul(block_size);
+                let length = extent.num_blocks.unwrap_or(0).saturating_mul(block_size);
+
+                if length == 0 || self.check_range(offset, length).is_err() {
+                    continue;
+                }
+
+                // purely advisory, failures are harmless
+                let _ =
+                    map.advise_range(memmap2::Advice::WillNeed, offset as usize, length as usize);
+            }
+        }
+
+        #[cfg(not(unix))]
+        let _ = (extents, block_size);
+    }
+
+    fn take_buffer(&self, len: usize) -> Vec<u8> {
+        let mut buf = self
+            .pool
+            .lock()
+            .ok()
+            .and_then(|mut pool| {
+                // prefer a buffer that is already large enough
+                let idx = pool.iter().position(|b| b.capacity() >= len)?;
+                Some(pool.swap_remove(idx))
+            })
+            .unwrap_or_default();
+
+        buf.clear();
+        buf.resize(len, 0);
+        buf
+    }
+
+    fn check_range(&self, offset: u64, length: u64) -> Result<u64> {
+        let end = offset
+            .checked_add(length)
+            .ok_or_else(|| anyhow!("Source read at {} overflows", offset))?;
+
+        if end > self.size {
+            return Err(anyhow!(
+                "Source read {}..{} is beyond the end of {} ({} bytes)",
+                offset,
+                end,
+                self.path.display(),
+                self.size
+            ));
+        }
+
+        Ok(end)
+    }
+}
+
+/// whether `output` names the file opened from `path`
+fn is_same_file(file: &File, path: &Path, output: &Path) -> bool {
+    #[cfg(unix)]
+    {
+        use std::os::unix::fs::MetadataExt;
+        if let (Ok(source), Ok(output)) = (file.metadata(), std::fs::metadata(output)) {
+            return source.dev() == output.dev() && source.ino() == output.ino();
+        }
+    }
+    #[cfg(not(unix))]
+    let _ = file;
+
+    // the output may not exist yet, compare where it would be created
+    let canonical = |path: &Path| -> Option<PathBuf> {
+        match path.canonicalize() {
+            Ok(path) => Some(path),
+            Err(_) => {
+                let parent = path.parent().filter(|p| !p.as_os_str().is_empty());
+                let parent = parent.unwrap_or(Path::new(".")).canonicalize().ok()?;
+                Some(parent.join(path.file_name()?))
+            }
+        }
+    };
+    match (canonical(path), canonical(output)) {
+        (Some(a), Some(b)) => a == b,
+        _ => false,
+    }
+}
+
+enum CacheLookup {
+    Hit(Arc<[u8]>),
+    Admit,
+    Skip,
+}
+
+/// byte-budgeted LRU of gathered source extents, keyed by the extent list
+///
+/// an extent list is only admitted the second time it is requested, so reads
+/// that are never repeated keep using pooled buffers and do not evict
+/// anything useful
+struct ExtentCache {
+    budget: u64,
+    used: u64,
+    tick: u64,
+    entries: AHashMap<Vec<(u64, u64)>, (Arc<[u8]>, u64)>,
+    seen: AHashSet<u64>,
+    hasher: ahash::RandomState,
+}
+
+impl ExtentCache {
+    fn new(budget: u64) -> Self {
+        Self {
+            budget,
+            used: 0,
+            tick: 0,
+            entries: AHashMap::new(),
+            seen: AHashSet::new(),
+            hasher: ahash::RandomState::new(),
+        }
+    }
+
+    fn lookup(&mut self, ranges: &[(u64, u64)], total: u64) -> CacheLookup {
+        // anything over a quarter of the budget would churn the whole cache
+        if self.budget == 0 || total > self.budget / 4 {
+            return CacheLookup::Skip;
+        }
+
+        self.tick += 1;
+        if let Some((data, last_used)) = self.entries.get_mut(ranges) {
+            *last_used = self.tick;
+            return CacheLookup::Hit(Arc::clone(data));
+        }
+
+        let mut hasher = self.hasher.build_hasher();
+        ranges.hash(&mut hasher);
+        let key = hasher.finish();
+
+        if self.seen.contains(&key) {
+            return CacheLookup::Admit;
+        }
+
+        if self.seen.len() >= EXTENT_CACHE_MAX_SEEN {
+            self.seen.clear();
+        }
+        self.seen.insert(key);
+        CacheLookup::Skip
+    }
+
+    fn insert(&mut self, ranges: Vec<(u64, u64)>, data: Arc<[u8]>) {
+        let size = data.len() as u64;
+
+        while self.used + size > self.budget {
+            let Some(oldest) = self
+                .entries
+                .iter()
+                .min_by_key(|(_, (_, last_used))| *last_used)
+                .map(|(key, _)| key.clone())
+            else {
+                break;
+            };
+            if let Some((evicted, _)) = self.entries.remove(&oldest) {
+                self.used -= evicted.len() as u64;
+            }
+        }
+
+        self.tick += 1;
+        if let Some((previous, _)) = self.entries.insert(ranges, (data, self.tick)) {
+            self.used -= previous.len() as u64;
+        }
+        self.used += size;
+    }
+}
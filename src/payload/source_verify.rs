@@ -0,0 +1,252 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+// pre-flight checks for the source images of differential partitions
+//
+// the whole image is first compared against `old_partition_info`. hashing a
+// multi-GB image is not free, so results are remembered per file identity
+// (path, size, mtime, inode) across runs. only when the image does not match
+// are the per-operation `src_sha256_hash` values checked, to tell the user
+// which block ranges are actually wrong.
+
+use anyhow::{Result, anyhow};
+use serde::{Deserialize, Serialize};
+use sha2::{Digest, Sha256};
+use std::collections::HashMap;
+use std::path::{Path, PathBuf};
+use std::sync::Mutex;
+
+use crate::cache::{self, FileIdentity};
+use crate::payload::source_image::SourceImage;
+use crate::structs::{Extent, PartitionInfo, PartitionUpdate};
+
+const HASH_INDEX_FILE: &str = "source_hashes.json";
+const HASH_CHUNK_SIZE: usize = 4 * 1024 * 1024;
+
+/// outcome of checking one source image
+#[derive(Debug)]
+pub enum SourceStatus {
+    /// matches `old_partition_info`
+    Verified { cached: bool },
+    /// the manifest carries no hash for the old partition
+    NoHash,
+    /// image is smaller than `old_partition_info.size`
+    TooSmall { expected: u64, actual: u64 },
+    /// whole-image hash differs
+    Mismatch,
+}
+
+/// a diff operation whose source blocks do not hash to `src_sha256_hash`
+#[derive(Debug, Clone)]
+pub struct MismatchedOperation {
+    pub operation_index: usize,
+    pub src_extents: Vec<Extent>,
+}
+
+// the hashed length is part of the key, the same file can be checked against
+// partitions of different sizes
+type HashKey = (FileIdentity, u64);
+
+/// one remembered hash as stored in the index file
+#[derive(Serialize, Deserialize)]
+struct HashRecord {
+    path: PathBuf,
+    size: u64,
+    mtime_ns: u128,
+    inode: u64,
+    length: u64,
+    hash: String,
+}
+
+/// persistent map from file identity to the sha256 of its leading bytes
+///
+/// safe to share between concurrent verification tasks
+pub struct SourceHashIndex {
+    entries: Mutex<HashMap<HashKey, String>>,
+    dirty: Mutex<bool>,
+}
+
+impl SourceHashIndex {
+    pub fn load() -> Self {
+        let records: Vec<HashRecord> = cache::load_json(HASH_INDEX_FILE).unwrap_or_default();
+        let entries = records
+            .into_iter()
+            .map(|record| {
+                let identity = FileIdentity {
+                    path: record.path,
+                    size: record.size,
+                    mtime_ns: record.mtime_ns,
+                    inode: record.inode,
+                };
+                ((identity, record.length), record.hash)
+            })
+            .collect();
+
+        Self {
+            entries: Mutex::new(entries),
+            dirty: Mutex::new(false),
+        }
+    }
+
+    fn get(&self, identity: &FileIdentity, length: u64) -> Option<Vec<u8>> {
+        let entries = self.entries.lock().ok()?;
+        hex::decode(entries.get(&(identity.clone(), length))?).ok()
+    }
+
+    fn insert(&self, identity: &FileIdentity, length: u64, hash: &[u8]) {
+        if let Ok(mut entries) = self.entries.lock() {
+            entries.insert((identity.clone(), length), hex::encode(hash));
+            if let Ok(mut dirty) = self.dirty.lock() {
+                *dirty = true;
+            }
+        }
+    }
+
+    /// remembers `hash` for the first `length` bytes of the file at `path`,
+    /// for images whose hash was computed elsewhere
+    pub fn record(&self, path: &Path, length: u64, hash: &[u8]) -> Result<()> {
+        self.insert(&FileIdentity::of(path)?, length, hash);
+        Ok(())
+    }
+
+    /// writes the index back if anything was added
+    pub fn save(&self) -> Result<()> {
+        let dirty = self.dirty.lock().map(|d| *d).unwrap_or(false);
+        if !dirty {
+            return Ok(());
+        }
+
+        let entries = self
+            .entries
+            .lock()
+            .map_err(|_| anyhow!("Source hash index lock poisoned"))?;
+
+        // drop entries for files that no longer exist so the index does not grow forever
+        let live: Vec<HashRecord> = entries
+            .iter()
+            .filter(|((identity, _), _)| identity.path.exists())
+            .map(|((identity, length), hash)| HashRecord {
+                path: identity.path.clone(),
+                size: identity.size,
+                mtime_ns: identity.mtime_ns,
+                inode: identity.inode,
+                length: *length,
+                hash: hash.clone(),
+            })
+            .collect();
+
+        cache::store_json(HASH_INDEX_FILE, &live)
+    }
+}
+
+/// sha256 of the first `length` bytes of the image
+pub fn hash_source_image(source: &SourceImage, length: u64) -> Result<Vec<u8>> {
+    let mut hasher = Sha256::new();
+    let mut buf = vec![0u8; HASH_CHUNK_SIZE.min(length as usize)];
+    let mut offset = 0u64;
+
+    while offset < length {
+        let n = (length - offset).min(HASH_CHUNK_SIZE as u64) as usize;
+        source.read_at(offset, &mut buf[..n])?;
+        hasher.update(&buf[..n]);
+        offset += n as u64;
+    }
+
+    Ok(hasher.finalize().to_vec())
+}
+
+/// checks a source image against `old_partition_info` of `partition`
+///
+/// blocking, run it on a blocking thread
+pub fn verify_source_image(
+    partition: &PartitionUpdate,
+    source: &SourceImage,
+    index: &SourceHashIndex,
+) -> Result<SourceStatus> {
+    match partition.old_partition_info.as_ref() {
+        Some(info) => verify_image(info, source, index),
+        None => Ok(SourceStatus::NoHash),
+    }
+}
+
+/// checks any image against the size and hash in `info`
+///
+/// blocking, run it on a blocking thread
+pub fn verify_image(
+    info: &PartitionInfo,
+    source: &SourceImage,
+    index: &SourceHashIndex,
+) -> Result<SourceStatus> {
+    let expected = match info.hash.as_deref() {
+        Some(hash) if !hash.is_empty() => hash,
+        _ => return Ok(SourceStatus::NoHash),
+    };
+
+    let length = info.size.unwrap_or(source.size());
+    if source.size() < length {
+        return Ok(SourceStatus::TooSmall {
+            expected: length,
+            actual: source.size(),
+        });
+    }
+
+    let identity = FileIdentity::of(source.path()).ok();
+
+    if let Some(identity) = &identity
+        && let Some(hash) = index.get(identity, length)
+    {
+        return Ok(if hash == expected {
+            SourceStatus::Verified { cached: true }
+        } else {
+            SourceStatus::Mismatch
+        });
+    }
+
+    let hash = hash_source_image(source, length)?;
+
+    if let Some(identity) = &identity {
+        index.insert(identity, length, &hash);
+    }
+
+    Ok(if hash == expected {
+        SourceStatus::Verified { cached: false }
+    } else {
+        SourceStatus::Mismatch
+    })
+}
+
+/// checks every operation carrying `src_sha256_hash` against its source blocks
+///
+/// blocking, run it on a blocking thread
+pub fn find_mismatched_operations(
+    partition: &PartitionUpdate,
+    source: &SourceImage,
+    block_size: u64,
+) -> Result<Vec<MismatchedOperation>> {
+    let mut mismatched = Vec::new();
+
+    for (operation_index, op) in partition.operations.iter().enumerate() {
+        let Some(expected) = op.src_sha256_hash.as_deref() else {
+            continue;
+        };
+        if expected.is_empty() || op.src_extents.is_empty() {
+            continue;
+        }
+
+        // extents beyond the end of the image count as mismatched as well
+        let matches = source
+            .read_extents(&op.src_extents, block_size)
+            .map(|data| Sha256::digest(&data[..]).as_slice() == expected)
+            .unwrap_or(false);
+
+        if !matches {
+            mismatched.push(MismatchedOperation {
+                operation_index,
+                src_extents: op.src_extents.clone(),
+            });
+        }
+    }
+
+    Ok(mismatched)
+}
@@ -0,0 +1,451 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+// applier for ZUCCHINI operations
+//
+// a zucchini ensemble patch splits the new image into elements. every element
+// is rebuilt from equivalences (byte runs copied from the old image), extra
+// data filling the gaps, and a sparse raw delta added on top of the copies.
+//
+// only raw (no-op disassembler) elements are supported. executable elements
+// (ELF, DEX, PE) additionally get their embedded references re-projected
+// through the matching disassembler, which is not implemented here. the
+// ZUCCHINI operations update_engine emits are for ELF executables, so most
+// real payloads carrying them still fail, with an explicit error rather than
+// a subtly wrong image.
+
+use anyhow::{Result, anyhow};
+
+const PATCH_MAGIC: u32 = u32::from_le_bytes(*b"Zucc");
+const MAJOR_VERSION: u16 = 1;
+const PATCH_HEADER_SIZE: usize = 24;
+const ELEMENT_HEADER_SIZE: usize = 22;
+const MAX_ELEMENTS: u32 = 1 << 20;
+
+// patch types of the ensemble header, raw and single patches hold exactly
+// one element
+const PATCH_TYPE_RAW: u32 = 0;
+const PATCH_TYPE_SINGLE: u32 = 1;
+const PATCH_TYPE_ENSEMBLE: u32 = 2;
+
+// executable type of elements without a disassembler, either the enum value
+// or its fourcc form depending on the generator version
+const EXE_TYPE_NO_OP: u32 = 0;
+const EXE_TYPE_NO_OP_FOURCC: u32 = u32::from_le_bytes(*b"NoOp");
+
+/// reads little-endian values and length-prefixed buffers out of a patch
+#[derive(Clone, Copy)]
+struct Reader<'a> {
+    data: &'a [u8],
+}
+
+impl<'a> Reader<'a> {
+    fn new(data: &'a [u8]) -> Self {
+        Self { data }
+    }
+
+    fn is_empty(&self) -> bool {
+        self.data.is_empty()
+    }
+
+    fn bytes(&mut self, len: usize) -> Result<&'a [u8]> {
+        if self.data.len() < len {
+            return Err(anyhow!("Corrupt zucchini patch: truncated"));
+        }
+        let (head, tail) = self.data.split_at(len);
+        self.data = tail;
+        Ok(head)
+    }
+
+    fn u8(&mut self) -> Result<u8> {
+        Ok(self.bytes(1)?[0])
+    }
+
+    fn u16(&mut self) -> Result<u16> {
+        Ok(u16::from_le_bytes(self.bytes(2)?.try_into()?))
+    }
+
+    fn u32(&mut self) -> Result<u32> {
+        Ok(u32::from_le_bytes(self.bytes(4)?.try_into()?))
+    }
+
+    /// u32 size followed by that many bytes
+    fn buffer(&mut self) -> Result<Reader<'a>> {
+        let len = self.u32()? as usize;
+        Ok(Reader::new(self.bytes(len)?))
+    }
+
+    /// LEB128, at most 5 bytes for a u32
+    fn var_u32(&mut self) -> Result<u32> {
+        let mut value = 0u32;
+        for i in 0..5 {
+            let byte = self.u8()?;
+            value |= ((byte & 0x7f) as u32) << (7 * i);
+            if byte & 0x80 == 0 {
+                return Ok(value);
+            }
+        }
+        Err(anyhow!("Corrupt zucchini patch: varint too long"))
+    }
+
+    /// sign is kept in the lowest bit
+    fn var_i32(&mut self) -> Result<i32> {
+        let raw = self.var_u32()?;
+        Ok(((raw >> 1) as i32) ^ -((raw & 1) as i32))
+    }
+}
+
+struct Equivalence {
+    src_offset: u32,
+    dst_offset: u32,
+    length: u32,
+}
+
+/// walks the equivalence streams of one element
+struct EquivalenceSource<'a> {
+    src_skip: Reader<'a>,
+    dst_skip: Reader<'a>,
+    copy_count: Reader<'a>,
+    previous_src: i64,
+    previous_dst: u64,
+}
+
+impl<'a> EquivalenceSource<'a> {
+    fn next(&mut self) -> Result<Option<Equivalence>> {
+        if self.src_skip.is_empty() || self.dst_skip.is_empty() || self.copy_count.is_empty() {
+            return Ok(None);
+        }
+
+        let length = self.copy_count.var_u32()?;
+
+        let src_offset = self.previous_src + self.src_skip.var_i32()? as i64;
+        let src_offset = u32::try_from(src_offset)
+            .map_err(|_| anyhow!("Corrupt zucchini patch: bad source offset"))?;
+        self.previous_src = src_offset as i64 + length as i64;
+
+        let dst_offset = self.previous_dst + self.dst_skip.var_u32()? as u64;
+        let dst_offset = u32::try_from(dst_offset)
+            .map_err(|_| anyhow!("Corrupt zucchini patch: bad destination offset"))?;
+        self.previous_dst = dst_offset as u64 + length as u64;
+
+        Ok(Some(Equivalence {
+            src_offset,
+            dst_offset,
+            length,
+        }))
+    }
+
+    fn is_done(&self) -> bool {
+        self.src_skip.is_empty() && self.dst_skip.is_empty() && self.copy_count.is_empty()
+    }
+}
+
+struct ElementPatch<'a> {
+    old_offset: u32,
+    old_length: u32,
+    new_offset: u32,
+    new_length: u32,
+    exe_type: u32,
+    src_skip: Reader<'a>,
+    dst_skip: Reader<'a>,
+    copy_count: Reader<'a>,
+    extra_data: Reader<'a>,
+    raw_delta_skip: Reader<'a>,
+    raw_delta_diff: Reader<'a>,
+    reference_delta: Reader<'a>,
+    extra_target_pools: u32,
+}
+
+impl<'a> ElementPatch<'a> {
+    fn parse(r: &mut Reader<'a>) -> Result<Self> {
+        let header = r.bytes(ELEMENT_HEADER_SIZE)?;
+        let mut h = Reader::new(header);
+
+        let old_offset = h.u32()?;
+        let old_length = h.u32()?;
+        let new_offset = h.u32()?;
+        let new_length = h.u32()?;
+        let exe_type = h.u32()?;
+        let _version = h.u16()?;
+
+        let src_skip = r.buffer()?;
+        let dst_skip = r.buffer()?;
+        let copy_count = r.buffer()?;
+        let extra_data = r.buffer()?;
+        let raw_delta_skip = r.buffer()?;
+        let raw_delta_diff = r.buffer()?;
+        let reference_delta = r.buffer()?;
+
+        let extra_target_pools = r.u32()?;
+        let mut non_empty_pools = 0;
+        for _ in 0..extra_target_pools {
+            let _pool_tag = r.u8()?;
+            if !r.buffer()?.is_empty() {
+                non_empty_pools += 1;
+            }
+        }
+
+        Ok(Self {
+            old_offset,
+            old_length,
+            new_offset,
+            new_length,
+            exe_type,
+            src_skip,
+            dst_skip,
+            copy_count,
+            extra_data,
+            raw_delta_skip,
+            raw_delta_diff,
+            reference_delta,
+            extra_target_pools: non_empty_pools,
+        })
+    }
+
+    fn equivalences(&self) -> EquivalenceSource<'a> {
+        EquivalenceSource {
+            src_skip: self.src_skip,
+            dst_skip: self.dst_skip,
+            copy_count: self.copy_count,
+            previous_src: 0,
+            previous_dst: 0,
+        }
+    }
+
+    fn is_raw(&self) -> bool {
+        matches!(self.exe_type, EXE_TYPE_NO_OP | EXE_TYPE_NO_OP_FOURCC)
+    }
+
+    /// rebuilds this element of the new image from its slice of the old one
+    fn apply(&self, old: &[u8], new: &mut [u8]) -> Result<()> {
+        if !self.is_raw() {
+            return Err(anyhow!(
+                "Zucchini element with executable type {:#x} (ELF/DEX/PE) needs reference correction, only raw elements are supported",
+                self.exe_type
+            ));
+        }
+        if !self.reference_delta.is_empty() || self.extra_target_pools > 0 {
+            return Err(anyhow!(
+                "Corrupt zucchini patch: raw element carries reference data"
+            ));
+        }
+
+        self.apply_equivalences_and_extra_data(old, new)?;
+        self.apply_raw_delta(new)
+    }
+
+    fn apply_equivalences_and_extra_data(&self, old: &[u8], new: &mut [u8]) -> Result<()> {
+        let mut equivalences = self.equivalences();
+        let mut extra = self.extra_data;
+        let mut next_dst = 0usize;
+
+        while let Some(eq) = equivalences.next()? {
+            let dst = eq.dst_offset as usize;
+            let src = eq.src_offset as usize;
+            let len = eq.length as usize;
+
+            if dst < next_dst || dst + len > new.len() || src + len > old.len() {
+                return Err(anyhow!("Corrupt zucchini patch: equivalence out of bounds"));
+            }
+
+            new[next_dst..dst].copy_from_slice(extra.bytes(dst - next_dst)?);
+            new[dst..dst + len].copy_from_slice(&old[src..src + len]);
+            next_dst = dst + len;
+        }
+
+        let tail = new.len() - next_dst;
+        new[next_dst..].copy_from_slice(extra.bytes(tail)?);
+
+        if !equivalences.is_done() || !extra.is_empty() {
+            return Err(anyhow!("Corrupt zucchini patch: trailing equivalence data"));
+        }
+
+        Ok(())
+    }
+
+    fn apply_raw_delta(&self, new: &mut [u8]) -> Result<()> {
+        let mut equivalences = self.equivalences();
+        let mut skip = self.raw_delta_skip;
+        let mut diff = self.raw_delta_diff;
+
+        let mut current = equivalences.next()?;
+        let mut base_copy_offset = 0u64;
+        let mut compensation = 0u64;
+
+        while !skip.is_empty() && !diff.is_empty() {
+            // copy offsets index the concatenation of all copied runs
+            let copy_offset = skip.var_u32()? as u64 + compensation;
+            let delta = diff.u8()? as i8;
+            // as upstream: a zero diff means nothing and offsets stay 32-bit,
+            // anything else is a malformed patch
+            if delta == 0 {
+                return Err(anyhow!("Corrupt zucchini patch: zero raw delta"));
+            }
+            if copy_offset > u32::MAX as u64 {
+                return Err(anyhow!("Corrupt zucchini patch: raw delta offset overflow"));
+            }
+            compensation = copy_offset + 1;
+
+            while let Some(eq) = &current
+                && base_copy_offset + eq.length as u64 <= copy_offset
+            {
+                base_copy_offset += eq.length as u64;
+                current = equivalences.next()?;
+            }
+
+            let eq = current
+                .as_ref()
+                .ok_or_else(|| anyhow!("Corrupt zucchini patch: raw delta past equivalences"))?;
+            let pos = eq.dst_offset as usize + (copy_offset - base_copy_offset) as usize;
+            let byte = new
+                .get_mut(pos)
+                .ok_or_else(|| anyhow!("Corrupt zucchini patch: raw delta out of bounds"))?;
+            *byte = byte.wrapping_add(delta as u8);
+        }
+
+        if !skip.is_empty() || !diff.is_empty() {
+            return Err(anyhow!("Corrupt zucchini patch: unbalanced raw delta"));
+        }
+
+        Ok(())
+    }
+}
+
+struct EnsemblePatch<'a> {
+    old_size: u32,
+    old_crc: u32,
+    new_size: u32,
+    new_crc: u32,
+    elements: Vec<ElementPatch<'a>>,
+}
+
+impl<'a> EnsemblePatch<'a> {
+    fn parse(patch: &'a [u8]) -> Result<Self> {
+        let mut r = Reader::new(patch);
+
+        if r.u32()? != PATCH_MAGIC {
+            return Err(anyhow!("Not a zucchini patch"));
+        }
+        let major = r.u16()?;
+        let _minor = r.u16()?;
+        if major != MAJOR_VERSION {
+            return Err(anyhow!("Unsupported zucchini patch version {}", major));
+        }
+
+        let old_size = r.u32()?;
+        let old_crc = r.u32()?;
+        let new_size = r.u32()?;
+        let new_crc = r.u32()?;
+        debug_assert_eq!(patch.len() - r.data.len(), PATCH_HEADER_SIZE);
+
+        // as EnsemblePatchReader: the patch type decides how many elements
+        // may follow, anything else is not a patch of this version
+        let patch_type = r.u32()?;
+        let max_elements = match patch_type {
+            PATCH_TYPE_RAW | PATCH_TYPE_SINGLE => 1,
+            PATCH_TYPE_ENSEMBLE => MAX_ELEMENTS,
+            other => return Err(anyhow!("Unknown zucchini patch type {}", other)),
+        };
+        let elements = Self::parse_elements(r, new_size, max_elements)
+            .map_err(|e| anyhow!("Failed to parse zucchini elements: {}", e))?;
+
+        Ok(Self {
+            old_size,
+            old_crc,
+            new_size,
+            new_crc,
+            elements,
+        })
+    }
+
+    fn parse_elements(
+        mut r: Reader<'a>,
+        new_size: u32,
+        max_elements: u32,
+    ) -> Result<Vec<ElementPatch<'a>>> {
+        let count = r.u32()?;
+        if count == 0 || count > max_elements {
+            return Err(anyhow!("invalid element count {}", count));
+        }
+
+        let mut elements = Vec::with_capacity(count as usize);
+        let mut dst_offset = 0u64;
+
+        for _ in 0..count {
+            let element = ElementPatch::parse(&mut r)?;
+            if element.new_offset as u64 != dst_offset {
+                return Err(anyhow!("elements do not tile the new image"));
+            }
+            dst_offset += element.new_length as u64;
+            elements.push(element);
+        }
+
+        if dst_offset != new_size as u64 || !r.is_empty() {
+            return Err(anyhow!("elements do not cover the new image"));
+        }
+
+        Ok(elements)
+    }
+}
+
+/// applies a zucchini ensemble patch to `old`, returning the new image
+pub fn apply_patch(old: &[u8], patch: &[u8]) -> Result<Vec<u8>> {
+    let ensemble = EnsemblePatch::parse(patch)?;
+
+    if old.len() as u64 != ensemble.old_size as u64 {
+        return Err(anyhow!(
+            "Zucchini source size mismatch: expected {} bytes, got {} bytes",
+            ensemble.old_size,
+            old.len()
+        ));
+    }
+    if crc32(old) != ensemble.old_crc {
+        return Err(anyhow!("Zucchini source CRC mismatch"));
+    }
+
+    let mut new = vec![0u8; ensemble.new_size as usize];
+
+    for element in &ensemble.elements {
+        let old_start = element.old_offset as usize;
+        let old_end = old_start + element.old_length as usize;
+        let new_start = element.new_offset as usize;
+        let new_end = new_start + element.new_length as usize;
+
+        let old_slice = old
+            .get(old_start..old_end)
+            .ok_or_else(|| anyhow!("Corrupt zucchini patch: element outside source"))?;
+        element.apply(old_slice, &mut new[new_start..new_end])?;
+    }
+
+    if crc32(&new) != ensemble.new_crc {
+        return Err(anyhow!("Zucchini output CRC mismatch"));
+    }
+
+    Ok(new)
+}
+
+/// CRC-32 (IEEE, reflected), as used by zucchini patch headers
+fn crc32(data: &[u8]) -> u32 {
+    static TABLE: once_cell::sync::Lazy<[u32; 256]> = once_cell::sync::Lazy::new(|| {
+        let mut table = [0u32; 256];
+        for (i, entry) in table.iter_mut().enumerate() {
+            let mut c = i as u32;
+            for _ in 0..8 {
+                c = if c & 1 != 0 {
+                    0xEDB8_8320 ^ (c >> 1)
+                } else {
+                    c >> 1
+                };
+            }
+            *entry = c;
+        }
+        table
+    });
+
+    let mut crc = !0u32;
+    for &byte in data {
+        crc = TABLE[((crc ^ byte as u32) & 0xff) as usize] ^ (crc >> 8);
+    }
+    !crc
+}
@@ -10,7 +10,9 @@ use tokio::fs::File;
 use tokio::io::AsyncRead;
 
 use crate::http::HttpReader;
-use crate::payload::payload_dumper::{AsyncPayloadRead, PayloadReader, ProgressReporter};
+use crate::payload::payload_dumper::{
+    AsyncPayloadRead, DumpOptions, PayloadReader, ProgressReporter,
+};
 use crate::readers::local_reader::LocalAsyncPayloadReader;
 use crate::structs::PartitionUpdate;
 use tokio::io::BufWriter;
@@ -211,6 +213,7 @@ impl PayloadReader for OffsetTranslatingPayloadReader {
 /// * `paths` - temporary and output file paths
 /// * `download_reporter` - reporter for download progress
 /// * `extract_reporter` - reporter for extraction progress
+/// * `source_dir` - directory containing source images for differential OTA
 pub async fn prefetch_and_dump_partition<D, E>(
     partition: &PartitionUpdate,
     config: &PartitionExtractionConfig,
@@ -220,6 +223,38 @@ pub async fn prefetch_and_dump_partition<D, E>(
     extract_reporter: &E,
     source_dir: Option<PathBuf>,
 ) -> Result<()>
+where
+    D: DownloadProgressReporter,
+    E: ProgressReporter,
+{
+    let options = DumpOptions {
+        source_dir,
+        ..Default::default()
+    };
+
+    prefetch_and_dump_partition_with_options(
+        partition,
+        config,
+        http_reader,
+        paths,
+        download_reporter,
+        extract_reporter,
+        &options,
+    )
+    .await
+}
+
+/// like `prefetch_and_dump_partition`, with every extraction setting
+/// (source cloning, cpu budget, ...) instead of just the source directory
+pub async fn prefetch_and_dump_partition_with_options<D, E>(
+    partition: &PartitionUpdate,
+    config: &PartitionExtractionConfig,
+    http_reader: &HttpReader,
+    paths: ExtractionPaths,
+    download_reporter: &D,
+    extract_reporter: &E,
+    options: &DumpOptions,
+) -> Result<()>
 where
     D: DownloadProgressReporter,
     E: ProgressReporter,
@@ -244,14 +279,14 @@ where
     let reader = OffsetTranslatingReader::new(paths.temp_path, range.min_offset).await?;
 
     // extract using standard dump_partition
-    crate::payload::payload_dumper::dump_partition(
+    crate::payload::payload_dumper::dump_partition_with_options(
         partition,
         config.data_offset,
         config.block_size,
         paths.output_path,
         &reader,
         extract_reporter,
-        source_dir,
+        options,
     )
     .await?;
 
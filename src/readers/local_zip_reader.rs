@@ -35,6 +35,16 @@ impl LocalAsyncZipPayloadReader {
             payload_offset: data_offset,
         })
     }
+
+    /// reader for a ZIP whose payload offset is already known, for example
+    /// from the manifest cache. the ZIP directory is not read again
+    pub async fn with_payload_offset(zip_path: PathBuf, payload_offset: u64) -> Result<Self> {
+        File::open(&zip_path).await?;
+        Ok(Self {
+            path: zip_path,
+            payload_offset,
+        })
+    }
 }
 
 #[async_trait]
@@ -35,6 +35,13 @@ impl RemoteAsyncBinPayloadReader {
             http_reader: Arc::new(http_reader),
         })
     }
+
+    /// reader over an already opened resource, no request is made
+    pub fn from_http_reader(http_reader: HttpReader) -> Self {
+        Self {
+            http_reader: Arc::new(http_reader),
+        }
+    }
 }
 
 #[async_trait]
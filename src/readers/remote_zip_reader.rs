@@ -38,6 +38,20 @@ impl RemoteAsyncZipPayloadReader {
             payload_size: entry.uncompressed_size,
         })
     }
+
+    /// reader for a payload whose place in the ZIP is already known, for
+    /// example from the manifest cache. no request is made
+    pub fn from_http_reader(
+        http_reader: HttpReader,
+        payload_offset: u64,
+        payload_size: u64,
+    ) -> Self {
+        Self {
+            http_reader: Arc::new(http_reader),
+            payload_offset,
+            payload_size,
+        }
+    }
 }
 
 #[async_trait]
@@ -0,0 +1,753 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+// seekable zstd images
+//
+// the zstd seekable format is a sequence of independent zstd frames followed
+// by a seek table in a skippable frame, listing the compressed and
+// decompressed size of every frame. any zstd decoder reads the file as a
+// whole, seekable readers decode only the frames covering a range.
+//
+// frames are compressed on worker threads and written in order. the output
+// of a ZSTD operation whose blob is one plain zstd frame covering exactly
+// its extent is the frame itself, those blobs are copied from the payload
+// instead of being compressed again.
+//
+// an image can be encoded once it is complete ([`write_seekable`]) or while
+// it is being extracted, through [`SeekableZstdSink`].
+
+use anyhow::{Context, Result, anyhow};
+use async_compression::Level;
+use async_compression::tokio::bufread::ZstdEncoder;
+use std::collections::BTreeMap;
+use std::fs::File;
+use std::io;
+use std::ops::Range;
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex, mpsc};
+use std::thread::JoinHandle;
+use tokio::io::AsyncReadExt;
+
+use crate::payload::sink::PartitionSink;
+use crate::structs::{PartitionUpdate, install_operation};
+use crate::utils::{read_exact_at, write_all_at};
+
+const ZSTD_MAGIC: u32 = 0xFD2F_B528;
+const SKIPPABLE_MAGIC: u32 = 0x184D_2A5E;
+const SEEKABLE_MAGIC: u32 = 0x8F92_EAB1;
+const SEEK_ENTRY_SIZE: usize = 8;
+const SEEK_FOOTER_SIZE: usize = 9;
+
+pub const DEFAULT_FRAME_SIZE: u64 = 2 * 1024 * 1024;
+pub const DEFAULT_LEVEL: i32 = 3;
+
+/// seekable image settings
+#[derive(Debug, Clone)]
+pub struct SeekableOptions {
+    /// decompressed size of the frames cut from the image
+    pub frame_size: u64,
+    pub level: i32,
+    pub workers: usize,
+}
+
+impl Default for SeekableOptions {
+    fn default() -> Self {
+        Self {
+            frame_size: DEFAULT_FRAME_SIZE,
+            level: DEFAULT_LEVEL,
+            workers: num_cpus::get(),
+        }
+    }
+}
+
+/// seekable zstd copy of an image, written while the image is extracted
+/// (see [`SeekableZstdSink`])
+#[derive(Debug, Clone)]
+pub struct SeekableOutput {
+    pub path: PathBuf,
+    pub options: SeekableOptions,
+    /// local payload file and the file offset of its data section, ZSTD
+    /// blobs are taken from it
+    pub payload: Option<(PathBuf, u64)>,
+}
+
+/// where the operation blobs of a local payload can be read
+pub struct PayloadBlobs<'a> {
+    pub file: &'a File,
+    /// file offset of the payload's data section
+    pub data_offset: u64,
+}
+
+/// what ended up in a seekable image
+#[derive(Debug, Default)]
+pub struct SeekableStats {
+    pub frames: u64,
+    /// frames taken from the payload as they were
+    pub reused_frames: u64,
+    pub size: u64,
+}
+
+#[derive(Debug, Clone, Copy)]
+enum FrameJob {
+    /// compress `length` bytes of the image at `offset`
+    Image { offset: u64, length: u64 },
+    /// take the blob of an operation, or compress its extent if the blob
+    /// turns out not to be usable
+    Blob {
+        offset: u64,
+        length: u64,
+        blob_offset: u64,
+        blob_length: u64,
+    },
+}
+
+impl FrameJob {
+    /// the part of the image the frame holds
+    fn extent(&self) -> Range<u64> {
+        match *self {
+            FrameJob::Image { offset, length } | FrameJob::Blob { offset, length, .. } => {
+                offset..offset + length
+            }
+        }
+    }
+}
+
+struct EncodedFrame {
+    data: Vec<u8>,
+    decompressed: u64,
+    reused: bool,
+}
+
+struct JobContext<'a> {
+    image: &'a dyn PartitionSink,
+    blobs: Option<&'a PayloadBlobs<'a>>,
+    level: i32,
+}
+
+/// frames written to the output so far and their seek table entries
+#[derive(Default)]
+struct FrameWriter {
+    pos: u64,
+    seek_table: Vec<u8>,
+    stats: SeekableStats,
+}
+
+impl FrameWriter {
+    fn push(&mut self, output: &File, frame: EncodedFrame) -> Result<()> {
+        write_all_at(output, &frame.data, self.pos)?;
+        self.pos += frame.data.len() as u64;
+
+        self.seek_table
+            .extend_from_slice(&(frame.data.len() as u32).to_le_bytes());
+        self.seek_table
+            .extend_from_slice(&(frame.decompressed as u32).to_le_bytes());
+        self.stats.frames += 1;
+        if frame.reused {
+            self.stats.reused_frames += 1;
+        }
+        Ok(())
+    }
+
+    /// appends the seek table after the last frame
+    fn finish(mut self, output: &File) -> Result<SeekableStats> {
+        // skippable frame: magic, size, entries, footer (frame count,
+        // descriptor without checksums, seekable magic)
+        let seek_table = &self.seek_table;
+        let mut trailer = Vec::with_capacity(8 + seek_table.len() + SEEK_FOOTER_SIZE);
+        trailer.extend_from_slice(&SKIPPABLE_MAGIC.to_le_bytes());
+        trailer.extend_from_slice(&((seek_table.len() + SEEK_FOOTER_SIZE) as u32).to_le_bytes());
+        trailer.extend_from_slice(seek_table);
+        trailer.extend_from_slice(&(self.stats.frames as u32).to_le_bytes());
+        trailer.push(0);
+        trailer.extend_from_slice(&SEEKABLE_MAGIC.to_le_bytes());
+        write_all_at(output, &trailer, self.pos)?;
+
+        self.stats.size = self.pos + trailer.len() as u64;
+        output.set_len(self.stats.size)?;
+        Ok(self.stats)
+    }
+}
+
+/// writes `image`, the extracted `partition`, to `output` as seekable zstd
+///
+/// with `blobs`, ZSTD operation blobs that form a whole frame are reused
+pub fn write_seekable(
+    partition: &PartitionUpdate,
+    image: &File,
+    output: &File,
+    block_size: u64,
+    blobs: Option<&PayloadBlobs>,
+    options: &SeekableOptions,
+) -> Result<SeekableStats> {
+    let size = image.metadata()?.len();
+    encode_image(partition, image, size, output, block_size, blobs, options)
+}
+
+/// [`write_seekable`] of the first `size` bytes of any sink
+fn encode_image(
+    partition: &PartitionUpdate,
+    image: &dyn PartitionSink,
+    size: u64,
+    output: &File,
+    block_size: u64,
+    blobs: Option<&PayloadBlobs>,
+    options: &SeekableOptions,
+) -> Result<SeekableStats> {
+    let jobs = plan_frames(partition, size, block_size, blobs.is_some(), options);
+    let ctx = JobContext {
+        image,
+        blobs,
+        level: options.level,
+    };
+
+    let mut writer = FrameWriter::default();
+    run_jobs(&ctx, &jobs, options.workers, |frame| {
+        writer.push(output, frame)
+    })?;
+    writer.finish(output)
+}
+
+/// cuts the image into frames, reusable ZSTD operations get one frame each
+fn plan_frames(
+    partition: &PartitionUpdate,
+    size: u64,
+    block_size: u64,
+    reuse: bool,
+    options: &SeekableOptions,
+) -> Vec<FrameJob> {
+    // (offset, length, blob offset, blob length) of candidate operations
+    let mut blobs: Vec<(u64, u64, u64, u64)> = Vec::new();
+    if reuse {
+        for op in &partition.operations {
+            if op.r#type() != install_operation::Type::Zstd {
+                continue;
+            }
+            let [extent] = op.dst_extents.as_slice() else {
+                continue;
+            };
+            let offset = extent.start_block.unwrap_or(0) * block_size;
+            let length = extent.num_blocks.unwrap_or(0) * block_size;
+            let blob_length = op.data_length.unwrap_or(0);
+
+            // the seek table stores 32-bit sizes
+            if length == 0
+                || offset + length > size
+                || length > u32::MAX as u64
+                || blob_length == 0
+                || blob_length > u32::MAX as u64
+            {
+                continue;
+            }
+            blobs.push((offset, length, op.data_offset.unwrap_or(0), blob_length));
+        }
+        blobs.sort_unstable();
+    }
+
+    let frame_size = options.frame_size.clamp(block_size, u32::MAX as u64);
+    let mut jobs = Vec::new();
+    let mut pos = 0u64;
+    let push_image = |jobs: &mut Vec<FrameJob>, from: u64, to: u64| {
+        let mut offset = from;
+        while offset < to {
+            let length = (to - offset).min(frame_size);
+            jobs.push(FrameJob::Image { offset, length });
+            offset += length;
+        }
+    };
+
+    for (offset, length, blob_offset, blob_length) in blobs {
+        // extents of a valid payload do not overlap, skip any that do
+        if offset < pos {
+            continue;
+        }
+        push_image(&mut jobs, pos, offset);
+        jobs.push(FrameJob::Blob {
+            offset,
+            length,
+            blob_offset,
+            blob_length,
+        });
+        pos = offset + length;
+    }
+    push_image(&mut jobs, pos, size);
+
+    jobs
+}
+
+/// encodes `jobs` on `workers` threads and hands the frames to `emit` in job
+/// order
+fn run_jobs<F>(ctx: &JobContext, jobs: &[FrameJob], workers: usize, mut emit: F) -> Result<()>
+where
+    F: FnMut(EncodedFrame) -> Result<()>,
+{
+    if jobs.is_empty() {
+        return Ok(());
+    }
+
+    let workers = workers.clamp(1, jobs.len());
+    let next = AtomicUsize::new(0);
+    let (tx, rx) = mpsc::sync_channel::<(usize, Result<EncodedFrame>)>(workers * 2);
+
+    std::thread::scope(|scope| -> Result<()> {
+        // owned by this closure so an early return unblocks the workers
+        let rx = rx;
+
+        for _ in 0..workers {
+            let (tx, next) = (tx.clone(), &next);
+            scope.spawn(move || {
+                loop {
+                    let index = next.fetch_add(1, Ordering::Relaxed);
+                    let Some(job) = jobs.get(index) else {
+                        return;
+                    };
+                    let result = encode_frame(ctx, *job);
+                    let failed = result.is_err();
+                    if tx.send((index, result)).is_err() || failed {
+                        return;
+                    }
+                }
+            });
+        }
+        drop(tx);
+
+        // frames finish out of order, emit them in order
+        let mut pending = BTreeMap::new();
+        let mut expected = 0usize;
+
+        for (index, result) in rx.iter() {
+            pending.insert(index, result?);
+            while let Some(frame) = pending.remove(&expected) {
+                emit(frame)?;
+                expected += 1;
+            }
+        }
+
+        if expected != jobs.len() {
+            return Err(anyhow!("Compression worker stopped early"));
+        }
+        Ok(())
+    })
+}
+
+fn encode_frame(ctx: &JobContext, job: FrameJob) -> Result<EncodedFrame> {
+    let (offset, length) = match job {
+        FrameJob::Image { offset, length } => (offset, length),
+        FrameJob::Blob {
+            offset,
+            length,
+            blob_offset,
+            blob_length,
+        } => {
+            if let Some(blobs) = ctx.blobs {
+                let mut blob = vec![0u8; blob_length as usize];
+                read_exact_at(blobs.file, &mut blob, blobs.data_offset + blob_offset)
+                    .with_context(|| format!("Failed to read blob at {}", blob_offset))?;
+                if single_frame_size(&blob) == Some(length) {
+                    return Ok(EncodedFrame {
+                        data: blob,
+                        decompressed: length,
+                        reused: true,
+                    });
+                }
+            }
+            (offset, length)
+        }
+    };
+
+    let mut data = vec![0u8; length as usize];
+    ctx.image
+        .read_at(&mut data, offset)
+        .with_context(|| format!("Failed to read image at {}", offset))?;
+
+    // the encoder is async but purely CPU bound over a slice
+    let compressed = futures::executor::block_on(async {
+        let mut out = Vec::with_capacity(data.len() / 2);
+        ZstdEncoder::with_quality(&data[..], Level::Precise(ctx.level))
+            .read_to_end(&mut out)
+            .await
+            .map(|_| out)
+    })?;
+
+    Ok(EncodedFrame {
+        data: compressed,
+        decompressed: length,
+        reused: false,
+    })
+}
+
+/// decompressed size of `data` when it is exactly one zstd frame that
+/// records its content size and needs no dictionary
+fn single_frame_size(data: &[u8]) -> Option<u64> {
+    if data.len() < 6 || u32::from_le_bytes(data[..4].try_into().ok()?) != ZSTD_MAGIC {
+        return None;
+    }
+
+    let descriptor = data[4];
+    let single_segment = descriptor & 0x20 != 0;
+    let has_checksum = descriptor & 0x04 != 0;
+    if descriptor & 0x03 != 0 || descriptor & 0x08 != 0 {
+        // dictionary id, or the reserved bit
+        return None;
+    }
+    let content_size_bytes = match descriptor >> 6 {
+        0 if single_segment => 1,
+        0 => return None, // content size not recorded
+        1 => 2,
+        2 => 4,
+        _ => 8,
+    };
+
+    let mut pos = 5 + usize::from(!single_segment);
+    let field = data.get(pos..pos + content_size_bytes)?;
+    let mut content_size = field
+        .iter()
+        .rev()
+        .fold(0u64, |acc, &b| (acc << 8) | u64::from(b));
+    if content_size_bytes == 2 {
+        content_size += 256;
+    }
+    pos += content_size_bytes;
+
+    // walk the block headers to find where the frame ends
+    loop {
+        let header = data.get(pos..pos + 3)?;
+        let header = u32::from(header[0]) | u32::from(header[1]) << 8 | u32::from(header[2]) << 16;
+        let last = header & 1 != 0;
+        let block_size = (header >> 3) as usize;
+        pos += 3 + match (header >> 1) & 3 {
+            0 | 2 => block_size, // raw, compressed
+            1 => 1,              // RLE
+            _ => return None,
+        };
+        if last {
+            break;
+        }
+    }
+    if has_checksum {
+        pos += 4;
+    }
+
+    (pos == data.len()).then_some(content_size)
+}
+
+/// seekable zstd copy of an image, compressed while the image is extracted
+///
+/// the image itself goes to `staging`. every write counts towards the frames
+/// it covers and a frame is compressed on a worker thread as soon as all of
+/// it is written, then appended to `output` once the frames before it are.
+/// frames nothing writes through the sink (ranges a seeded image already
+/// holds) are compressed on `flush`. a frame written again after it was
+/// compressed makes `flush` encode the whole image again from `staging`.
+///
+/// frames that complete ahead of an earlier one wait in memory for it
+pub struct SeekableZstdSink<S> {
+    shared: Arc<SinkShared<S>>,
+    queue: Mutex<Option<mpsc::Sender<usize>>>,
+    workers: Mutex<Vec<JoinHandle<()>>>,
+}
+
+struct SinkShared<S> {
+    staging: S,
+    output: File,
+    payload: Option<(File, u64)>,
+    partition: PartitionUpdate,
+    block_size: u64,
+    options: SeekableOptions,
+    coverage: Mutex<Coverage>,
+    emitted: Mutex<Emitted>,
+    /// the sink was dropped without being flushed, queued frames are skipped
+    cancelled: AtomicBool,
+}
+
+#[derive(Default)]
+struct Coverage {
+    planned: bool,
+    jobs: Vec<FrameJob>,
+    /// bytes of each frame not written yet
+    remaining: Vec<u64>,
+    size: u64,
+    /// frames no longer match the image (written after being compressed,
+    /// or before the image size was known)
+    stale: bool,
+}
+
+#[derive(Default)]
+struct Emitted {
+    /// compressed frames waiting for an earlier one
+    pending: BTreeMap<usize, EncodedFrame>,
+    next: usize,
+    writer: FrameWriter,
+    error: Option<anyhow::Error>,
+}
+
+impl<S: PartitionSink + 'static> SeekableZstdSink<S> {
+    /// `payload` is the local payload file and the file offset of its data
+    /// section, reusable ZSTD blobs are copied from it
+    pub fn new(
+        staging: S,
+        output: File,
+        partition: &PartitionUpdate,
+        block_size: u64,
+        payload: Option<(File, u64)>,
+        options: SeekableOptions,
+    ) -> Self {
+        Self {
+            shared: Arc::new(SinkShared {
+                staging,
+                output,
+                payload,
+                partition: partition.clone(),
+                block_size,
+                options,
+                coverage: Mutex::new(Coverage::default()),
+                emitted: Mutex::new(Emitted::default()),
+                cancelled: AtomicBool::new(false),
+            }),
+            queue: Mutex::new(None),
+            workers: Mutex::new(Vec::new()),
+        }
+    }
+
+    fn start_workers(&self) {
+        let (tx, rx) = mpsc::channel::<usize>();
+        let rx = Arc::new(Mutex::new(rx));
+        let mut workers = self.workers.lock().unwrap();
+        for _ in 0..self.shared.options.workers.max(1) {
+            let (shared, rx) = (Arc::clone(&self.shared), Arc::clone(&rx));
+            workers.push(std::thread::spawn(move || {
+                loop {
+                    let Ok(index) = rx.lock().unwrap().recv() else {
+                        return;
+                    };
+                    if shared.cancelled.load(Ordering::Relaxed) {
+                        return;
+                    }
+                    shared.encode(index);
+                }
+            }));
+        }
+        *self.queue.lock().unwrap() = Some(tx);
+    }
+
+    /// counts `range` as written and queues the frames it completes
+    fn cover(&self, range: Range<u64>) {
+        if range.is_empty() {
+            return;
+        }
+        let ready = {
+            let mut coverage = self.shared.coverage.lock().unwrap();
+            if !coverage.planned || range.end > coverage.size {
+                coverage.size = coverage.size.max(range.end);
+                coverage.stale = true;
+            }
+            if coverage.stale {
+                return;
+            }
+
+            let Coverage {
+                jobs, remaining, ..
+            } = &mut *coverage;
+            let first = jobs.partition_point(|job| job.extent().end <= range.start);
+            let mut ready = Vec::new();
+            let mut stale = false;
+            for (index, job) in jobs.iter().enumerate().skip(first) {
+                let extent = job.extent();
+                if extent.start >= range.end {
+                    break;
+                }
+                if remaining[index] == 0 {
+                    stale = true;
+                    break;
+                }
+                let overlap = extent.end.min(range.end) - extent.start.max(range.start);
+                remaining[index] = remaining[index].saturating_sub(overlap);
+                if remaining[index] == 0 {
+                    ready.push(index);
+                }
+            }
+            if stale {
+                coverage.stale = true;
+                return;
+            }
+            ready
+        };
+
+        if let Some(queue) = &*self.queue.lock().unwrap() {
+            for index in ready {
+                let _ = queue.send(index);
+            }
+        }
+    }
+
+    /// compresses what is left and writes the seek table
+    fn finish(&self) -> Result<()> {
+        let rest: Vec<usize> = {
+            let mut coverage = self.shared.coverage.lock().unwrap();
+            if coverage.stale {
+                Vec::new()
+            } else {
+                let rest = (0..coverage.jobs.len())
+                    .filter(|&index| coverage.remaining[index] > 0)
+                    .collect();
+                coverage.remaining.fill(0);
+                rest
+            }
+        };
+        if let Some(queue) = self.queue.lock().unwrap().take() {
+            for index in rest {
+                let _ = queue.send(index);
+            }
+        }
+        for worker in self.workers.lock().unwrap().drain(..) {
+            worker
+                .join()
+                .map_err(|_| anyhow!("Compression worker panicked"))?;
+        }
+
+        let shared = &*self.shared;
+        let coverage = shared.coverage.lock().unwrap();
+        let mut emitted = shared.emitted.lock().unwrap();
+        if let Some(e) = emitted.error.take() {
+            return Err(e);
+        }
+        let writer = std::mem::take(&mut emitted.writer);
+
+        if coverage.stale {
+            // the frames written so far are overwritten
+            let payload = shared.payload_blobs();
+            encode_image(
+                &shared.partition,
+                &shared.staging,
+                coverage.size,
+                &shared.output,
+                shared.block_size,
+                payload.as_ref(),
+                &shared.options,
+            )?;
+            return Ok(());
+        }
+
+        if emitted.next != coverage.jobs.len() {
+            return Err(anyhow!(
+                "{} of {} frames were compressed",
+                emitted.next,
+                coverage.jobs.len()
+            ));
+        }
+        writer.finish(&shared.output)?;
+        Ok(())
+    }
+}
+
+impl<S: PartitionSink> SinkShared<S> {
+    fn payload_blobs(&self) -> Option<PayloadBlobs<'_>> {
+        self.payload
+            .as_ref()
+            .map(|(file, data_offset)| PayloadBlobs {
+                file,
+                data_offset: *data_offset,
+            })
+    }
+
+    /// compresses frame `index` and writes whichever frames are next in line
+    fn encode(&self, index: usize) {
+        let job = self.coverage.lock().unwrap().jobs[index];
+        let payload = self.payload_blobs();
+        let ctx = JobContext {
+            image: &self.staging,
+            blobs: payload.as_ref(),
+            level: self.options.level,
+        };
+        let result = encode_frame(&ctx, job);
+
+        let mut emitted = self.emitted.lock().unwrap();
+        if emitted.error.is_some() {
+            return;
+        }
+        match result {
+            Ok(frame) => {
+                emitted.pending.insert(index, frame);
+                let Emitted {
+                    pending,
+                    next,
+                    writer,
+                    error,
+                } = &mut *emitted;
+                while let Some(frame) = pending.remove(next) {
+                    if let Err(e) = writer.push(&self.output, frame) {
+                        *error = Some(e);
+                        return;
+                    }
+                    *next += 1;
+                }
+            }
+            Err(e) => emitted.error = Some(e),
+        }
+    }
+}
+
+impl<S: PartitionSink + 'static> PartitionSink for SeekableZstdSink<S> {
+    fn set_size(&self, size: u64) -> io::Result<()> {
+        self.shared.staging.set_size(size)?;
+
+        let shared = &*self.shared;
+        let mut coverage = shared.coverage.lock().unwrap();
+        if coverage.planned || coverage.stale {
+            coverage.size = coverage.size.max(size);
+            coverage.stale = true;
+            return Ok(());
+        }
+        coverage.jobs = plan_frames(
+            &shared.partition,
+            size,
+            shared.block_size,
+            shared.payload.is_some(),
+            &shared.options,
+        );
+        coverage.remaining = coverage
+            .jobs
+            .iter()
+            .map(|job| job.extent().end - job.extent().start)
+            .collect();
+        coverage.size = size;
+        coverage.planned = true;
+        drop(coverage);
+
+        self.start_workers();
+        Ok(())
+    }
+
+    fn write_at(&self, buf: &[u8], offset: u64) -> io::Result<()> {
+        self.shared.staging.write_at(buf, offset)?;
+        self.cover(offset..offset + buf.len() as u64);
+        Ok(())
+    }
+
+    fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<()> {
+        self.shared.staging.read_at(buf, offset)
+    }
+
+    fn write_zeros(&self, offset: u64, length: u64) -> io::Result<()> {
+        self.shared.staging.write_zeros(offset, length)?;
+        self.cover(offset..offset + length);
+        Ok(())
+    }
+
+    fn flush(&self) -> io::Result<()> {
+        self.shared.staging.flush()?;
+        self.finish().map_err(io::Error::other)
+    }
+
+    fn as_file(&self) -> Option<&File> {
+        self.shared.staging.as_file()
+    }
+}
+
+impl<S> Drop for SeekableZstdSink<S> {
+    fn drop(&mut self) {
+        // workers finish their current frame and stop
+        self.shared.cancelled.store(true, Ordering::Relaxed);
+    }
+}
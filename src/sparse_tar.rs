@@ -0,0 +1,238 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+// tar streams of partition images
+//
+// images are written as PAX entries using the GNU sparse format 1.0: the
+// extended header carries the real name and size, the entry data starts
+// with a map of the regions that hold data (decimal numbers, one per line,
+// padded to a tar block) followed by those regions only. GNU tar and bsdtar
+// restore the holes on extraction. images without holes are written as
+// plain entries.
+
+use anyhow::{Result, anyhow};
+use sha2::{Digest, Sha256};
+use std::io::Write;
+
+use crate::payload::sink::PartitionSink;
+
+const TAR_BLOCK: usize = 512;
+const SCAN_CHUNK: usize = 1024 * 1024;
+// largest size the 11 octal digits of a ustar header can hold
+const MAX_OCTAL_SIZE: u64 = 0o77777777777;
+
+/// a range of an image holding data, everything else reads as zeros
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct DataRegion {
+    pub offset: u64,
+    pub length: u64,
+}
+
+/// finds the regions of the first `size` bytes of `file` that are not all
+/// zeros, at `block_size` granularity, and hashes the file on the way
+///
+/// returns the regions and the sha256 of the whole range
+pub fn scan_data_regions<S: PartitionSink + ?Sized>(
+    file: &S,
+    size: u64,
+    block_size: u64,
+) -> Result<(Vec<DataRegion>, Vec<u8>)> {
+    let block_size = block_size.max(TAR_BLOCK as u64) as usize;
+    let chunk_size = SCAN_CHUNK.max(block_size) / block_size * block_size;
+    let mut buf = vec![0u8; chunk_size.min(size as usize).max(1)];
+    let mut hasher = Sha256::new();
+    let mut regions: Vec<DataRegion> = Vec::new();
+    let mut offset = 0u64;
+
+    while offset < size {
+        let n = (size - offset).min(buf.len() as u64) as usize;
+        file.read_at(&mut buf[..n], offset)?;
+        hasher.update(&buf[..n]);
+
+        for (index, block) in buf[..n].chunks(block_size).enumerate() {
+            if block.iter().all(|&b| b == 0) {
+                continue;
+            }
+            let start = offset + (index * block_size) as u64;
+            let length = block.len() as u64;
+            match regions.last_mut() {
+                Some(last) if last.offset + last.length == start => last.length += length,
+                _ => regions.push(DataRegion {
+                    offset: start,
+                    length,
+                }),
+            }
+        }
+        offset += n as u64;
+    }
+
+    Ok((regions, hasher.finalize().to_vec()))
+}
+
+/// writes a tar stream to `out`, one image at a time
+pub struct TarWriter<W: Write> {
+    out: W,
+    mtime: u64,
+}
+
+impl<W: Write> TarWriter<W> {
+    pub fn new(out: W) -> Self {
+        let mtime = std::time::SystemTime::now()
+            .duration_since(std::time::UNIX_EPOCH)
+            .map(|d| d.as_secs())
+            .unwrap_or(0);
+        Self { out, mtime }
+    }
+
+    /// appends the first `size` bytes of `file` as `name`, storing only
+    /// `regions` (as found by [`scan_data_regions`])
+    pub fn append_image<S: PartitionSink + ?Sized>(
+        &mut self,
+        name: &str,
+        file: &S,
+        size: u64,
+        regions: &[DataRegion],
+    ) -> Result<()> {
+        let dense =
+            size == 0 || matches!(regions, [only] if only.offset == 0 && only.length == size);
+
+        if dense {
+            self.write_header(name, size, b'0')?;
+            self.copy_regions(file, regions)?;
+            return self.pad(size);
+        }
+
+        // a trailing hole is marked by an empty region at the end, like GNU
+        // tar does, so the file gets its full size
+        let mut map_regions = regions.to_vec();
+        if map_regions
+            .last()
+            .is_none_or(|r| r.offset + r.length < size)
+        {
+            map_regions.push(DataRegion {
+                offset: size,
+                length: 0,
+            });
+        }
+
+        let mut map = format!("{}\n", map_regions.len());
+        for region in &map_regions {
+            map.push_str(&format!("{}\n{}\n", region.offset, region.length));
+        }
+        let map_len = map.len().div_ceil(TAR_BLOCK) * TAR_BLOCK;
+        let data_len: u64 = regions.iter().map(|r| r.length).sum();
+        let stored = map_len as u64 + data_len;
+
+        let mut records = vec![
+            ("GNU.sparse.major", "1".to_string()),
+            ("GNU.sparse.minor", "0".to_string()),
+            ("GNU.sparse.name", name.to_string()),
+            ("GNU.sparse.realsize", size.to_string()),
+        ];
+        if stored > MAX_OCTAL_SIZE {
+            records.push(("size", stored.to_string()));
+        }
+        self.write_pax_header(name, &records)?;
+
+        self.write_header(&format!("GNUSparseFile.0/{}", name), stored, b'0')?;
+        let mut map = map.into_bytes();
+        map.resize(map_len, 0);
+        self.out.write_all(&map)?;
+        self.copy_regions(file, regions)?;
+        self.pad(data_len)
+    }
+
+    /// writes the end-of-archive marker and hands back the output
+    pub fn finish(mut self) -> Result<W> {
+        self.out.write_all(&[0u8; TAR_BLOCK * 2])?;
+        self.out.flush()?;
+        Ok(self.out)
+    }
+
+    fn copy_regions<S: PartitionSink + ?Sized>(
+        &mut self,
+        file: &S,
+        regions: &[DataRegion],
+    ) -> Result<()> {
+        let mut buf = vec![0u8; SCAN_CHUNK];
+        for region in regions {
+            let mut offset = region.offset;
+            let end = region.offset + region.length;
+            while offset < end {
+                let n = (end - offset).min(SCAN_CHUNK as u64) as usize;
+                file.read_at(&mut buf[..n], offset)?;
+                self.out.write_all(&buf[..n])?;
+                offset += n as u64;
+            }
+        }
+        Ok(())
+    }
+
+    /// zero fill up to the next tar block after `len` bytes of entry data
+    fn pad(&mut self, len: u64) -> Result<()> {
+        let rem = (len % TAR_BLOCK as u64) as usize;
+        if rem != 0 {
+            self.out.write_all(&[0u8; TAR_BLOCK][..TAR_BLOCK - rem])?;
+        }
+        Ok(())
+    }
+
+    fn write_pax_header(&mut self, name: &str, records: &[(&str, String)]) -> Result<()> {
+        let mut data = Vec::new();
+        for (key, value) in records {
+            data.extend_from_slice(pax_record(key, value).as_bytes());
+        }
+        self.write_header(&format!("PaxHeaders.0/{}", name), data.len() as u64, b'x')?;
+        self.out.write_all(&data)?;
+        self.pad(data.len() as u64)
+    }
+
+    fn write_header(&mut self, name: &str, size: u64, typeflag: u8) -> Result<()> {
+        if name.len() > 100 {
+            return Err(anyhow!("Tar entry name too long: {}", name));
+        }
+
+        let mut header = [0u8; TAR_BLOCK];
+        header[..name.len()].copy_from_slice(name.as_bytes());
+        write_octal(&mut header[100..108], 0o644);
+        write_octal(&mut header[108..116], 0);
+        write_octal(&mut header[116..124], 0);
+        if size <= MAX_OCTAL_SIZE {
+            write_octal(&mut header[124..136], size);
+        } else {
+            // GNU base-256 extension, the PAX size record takes precedence
+            header[124] = 0x80;
+            header[128..136].copy_from_slice(&size.to_be_bytes());
+        }
+        write_octal(&mut header[136..148], self.mtime);
+        header[156] = typeflag;
+        header[257..263].copy_from_slice(b"ustar\0");
+        header[263..265].copy_from_slice(b"00");
+
+        // the checksum is computed with its own field filled with spaces
+        header[148..156].fill(b' ');
+        let checksum: u32 = header.iter().map(|&b| u32::from(b)).sum();
+        write_octal(&mut header[148..155], u64::from(checksum));
+
+        self.out.write_all(&header)?;
+        Ok(())
+    }
+}
+
+/// zero padded octal digits followed by a NUL
+fn write_octal(field: &mut [u8], value: u64) {
+    let digits = format!("{:0width$o}", value, width = field.len() - 1);
+    field[..digits.len()].copy_from_slice(digits.as_bytes());
+    field[digits.len()] = 0;
+}
+
+/// "<length> <key>=<value>\n", the length counting its own digits
+fn pax_record(key: &str, value: &str) -> String {
+    let body = format!(" {}={}\n", key, value);
+    let mut length = body.len() + 1;
+    while length.to_string().len() + body.len() != length {
+        length = length.to_string().len() + body.len();
+    }
+    format!("{}{}", length, body)
+}
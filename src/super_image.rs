@@ -0,0 +1,555 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+// super.img (dynamic partitions) layout
+//
+// a super image starts with 4 KiB of reserved space, two copies of the LP
+// geometry and then the primary and backup LP metadata for every slot,
+// followed by the partition data at the first aligned offset. the layout is
+// planned from the manifest's dynamic_partition_metadata and every dynamic
+// partition gets one linear, aligned extent, so its operations can be
+// written straight into the super image by shifting their extents.
+//
+// the format matches liblp metadata v10.0 as produced by lpmake.
+
+use anyhow::{Context, Result, anyhow};
+use sha2::{Digest, Sha256};
+use std::fs::File;
+use std::io::{Seek, SeekFrom, Write};
+
+use crate::payload::sink::PartitionSink;
+use crate::structs::{DeltaArchiveManifest, Extent, PartitionUpdate};
+use crate::utils::write_all_at;
+
+const SECTOR_SIZE: u64 = 512;
+const RESERVED_BYTES: u64 = 4096;
+const GEOMETRY_SIZE: u64 = 4096;
+
+const GEOMETRY_MAGIC: u32 = 0x616c_4467;
+const GEOMETRY_STRUCT_SIZE: usize = 52;
+const HEADER_MAGIC: u32 = 0x414c_5030;
+const MAJOR_VERSION: u16 = 10;
+const MINOR_VERSION: u16 = 0;
+const HEADER_SIZE: usize = 128;
+
+const PARTITION_ENTRY_SIZE: usize = 52;
+const EXTENT_ENTRY_SIZE: usize = 24;
+const GROUP_ENTRY_SIZE: usize = 48;
+const BLOCK_DEVICE_ENTRY_SIZE: usize = 64;
+const NAME_SIZE: usize = 36;
+
+const ATTR_READONLY: u32 = 1;
+const TARGET_TYPE_LINEAR: u32 = 0;
+const DEFAULT_GROUP: &str = "default";
+const SUPER_DEVICE: &str = "super";
+
+pub const DEFAULT_METADATA_MAX_SIZE: u32 = 65536;
+pub const DEFAULT_ALIGNMENT: u64 = 1024 * 1024;
+
+/// knobs for [`SuperLayout::plan`], defaults match a typical lpmake call
+#[derive(Debug, Clone)]
+pub struct SuperConfig {
+    /// total size of the super device, smallest fitting size when unset
+    pub device_size: Option<u64>,
+    /// suffix of the slot the payload is written to ("_a", "_b" or empty)
+    pub slot_suffix: String,
+    pub metadata_max_size: u32,
+    /// metadata slots, 3 for virtual A/B and 2 otherwise when unset
+    pub metadata_slots: Option<u32>,
+    pub alignment: u64,
+}
+
+impl Default for SuperConfig {
+    fn default() -> Self {
+        Self {
+            device_size: None,
+            slot_suffix: "_a".to_string(),
+            metadata_max_size: DEFAULT_METADATA_MAX_SIZE,
+            metadata_slots: None,
+            alignment: DEFAULT_ALIGNMENT,
+        }
+    }
+}
+
+/// where one dynamic partition lives inside the super image
+#[derive(Debug, Clone)]
+pub struct SuperPartition {
+    /// partition name as in the payload, without slot suffix
+    pub name: String,
+    pub group: String,
+    pub offset: u64,
+    pub size: u64,
+}
+
+#[derive(Debug, Clone)]
+struct SuperGroup {
+    name: String,
+    max_size: u64,
+}
+
+/// planned super image
+#[derive(Debug, Clone)]
+pub struct SuperLayout {
+    pub device_size: u64,
+    /// first byte available for partition data
+    pub data_offset: u64,
+    pub metadata_max_size: u32,
+    pub metadata_slots: u32,
+    pub alignment: u64,
+    pub slot_suffix: String,
+    pub partitions: Vec<SuperPartition>,
+    groups: Vec<SuperGroup>,
+}
+
+impl SuperLayout {
+    /// lays out every dynamic partition of the manifest one after another
+    pub fn plan(manifest: &DeltaArchiveManifest, config: &SuperConfig) -> Result<Self> {
+        let dynamic = manifest
+            .dynamic_partition_metadata
+            .as_ref()
+            .ok_or_else(|| anyhow!("Payload has no dynamic partition metadata"))?;
+
+        if config.alignment == 0 || config.alignment % SECTOR_SIZE != 0 {
+            return Err(anyhow!("Alignment must be a multiple of {}", SECTOR_SIZE));
+        }
+        let block_size = manifest.block_size.unwrap_or(4096) as u64;
+        if config.alignment % block_size != 0 {
+            return Err(anyhow!(
+                "Alignment {} is not a multiple of the payload block size {}",
+                config.alignment,
+                block_size
+            ));
+        }
+
+        // virtual A/B keeps a third metadata slot for the merge
+        let default_slots = if dynamic.snapshot_enabled.unwrap_or(false) {
+            3
+        } else {
+            2
+        };
+        let metadata_slots = config.metadata_slots.unwrap_or(default_slots);
+
+        let metadata_end = RESERVED_BYTES
+            + 2 * GEOMETRY_SIZE
+            + 2 * metadata_slots as u64 * config.metadata_max_size as u64;
+        let data_offset = metadata_end.next_multiple_of(config.alignment);
+
+        let mut groups = Vec::new();
+        let mut partitions = Vec::new();
+        let mut next = data_offset;
+
+        for group in &dynamic.groups {
+            let max_size = group.size.unwrap_or(0);
+            let mut used = 0u64;
+
+            for name in &group.partition_names {
+                let size = manifest
+                    .partitions
+                    .iter()
+                    .find(|p| &p.partition_name == name)
+                    .and_then(|p| p.new_partition_info.as_ref())
+                    .and_then(|info| info.size)
+                    .unwrap_or(0);
+
+                if size % SECTOR_SIZE != 0 {
+                    return Err(anyhow!(
+                        "Size of {} is not a multiple of {}",
+                        name,
+                        SECTOR_SIZE
+                    ));
+                }
+
+                partitions.push(SuperPartition {
+                    name: name.clone(),
+                    group: group.name.clone(),
+                    offset: next,
+                    size,
+                });
+                used += size;
+                next = (next + size).next_multiple_of(config.alignment);
+            }
+
+            if max_size > 0 && used > max_size {
+                return Err(anyhow!(
+                    "Partitions of group {} need {} bytes, the group allows {}",
+                    group.name,
+                    used,
+                    max_size
+                ));
+            }
+
+            groups.push(SuperGroup {
+                name: group.name.clone(),
+                max_size,
+            });
+        }
+
+        let device_size = match config.device_size {
+            Some(size) if size < next => {
+                return Err(anyhow!(
+                    "Super image needs at least {} bytes, {} requested",
+                    next,
+                    size
+                ));
+            }
+            Some(size) if size % config.alignment != 0 => {
+                return Err(anyhow!(
+                    "Super image size {} is not a multiple of the alignment {}",
+                    size,
+                    config.alignment
+                ));
+            }
+            Some(size) => size,
+            None => next,
+        };
+
+        Ok(Self {
+            device_size,
+            data_offset,
+            metadata_max_size: config.metadata_max_size,
+            metadata_slots,
+            alignment: config.alignment,
+            slot_suffix: config.slot_suffix.clone(),
+            partitions,
+            groups,
+        })
+    }
+
+    pub fn partition(&self, name: &str) -> Option<&SuperPartition> {
+        self.partitions.iter().find(|p| p.name == name)
+    }
+
+    /// copy of `partition` with every destination extent moved into the
+    /// partition's place in the super image
+    pub fn relocate(
+        &self,
+        partition: &PartitionUpdate,
+        block_size: u64,
+    ) -> Result<PartitionUpdate> {
+        let placed = self
+            .partition(&partition.partition_name)
+            .ok_or_else(|| anyhow!("{} is not a dynamic partition", partition.partition_name))?;
+
+        if placed.offset % block_size != 0 {
+            return Err(anyhow!(
+                "Offset of {} in the super image is not block aligned",
+                placed.name
+            ));
+        }
+        let shift = placed.offset / block_size;
+
+        let move_extent = |e: &mut Extent| {
+            e.start_block = Some(e.start_block.unwrap_or(0) + shift);
+        };
+
+        let mut relocated = partition.clone();
+        for op in &mut relocated.operations {
+            op.dst_extents.iter_mut().for_each(move_extent);
+        }
+        for extent in [
+            &mut relocated.hash_tree_data_extent,
+            &mut relocated.hash_tree_extent,
+            &mut relocated.fec_data_extent,
+            &mut relocated.fec_extent,
+        ]
+        .into_iter()
+        .flatten()
+        {
+            move_extent(extent);
+        }
+
+        Ok(relocated)
+    }
+
+    /// LP geometry block, written twice after the reserved area
+    pub fn geometry(&self) -> Vec<u8> {
+        let mut geometry = Vec::with_capacity(GEOMETRY_SIZE as usize);
+        geometry.extend_from_slice(&GEOMETRY_MAGIC.to_le_bytes());
+        geometry.extend_from_slice(&(GEOMETRY_STRUCT_SIZE as u32).to_le_bytes());
+        geometry.extend_from_slice(&[0u8; 32]);
+        geometry.extend_from_slice(&self.metadata_max_size.to_le_bytes());
+        geometry.extend_from_slice(&self.metadata_slots.to_le_bytes());
+        geometry.extend_from_slice(&(SECTOR_SIZE as u32).to_le_bytes());
+
+        let checksum = Sha256::digest(&geometry[..GEOMETRY_STRUCT_SIZE]);
+        geometry[8..40].copy_from_slice(&checksum);
+        geometry.resize(GEOMETRY_SIZE as usize, 0);
+        geometry
+    }
+
+    /// serialized LP metadata (header and tables) describing the layout
+    pub fn metadata(&self) -> Result<Vec<u8>> {
+        let slots = self.slot_suffixes();
+
+        let mut partitions = Vec::new();
+        let mut extents = Vec::new();
+        let mut groups = Vec::new();
+        let mut block_devices = Vec::new();
+
+        push_group(&mut groups, DEFAULT_GROUP, 0)?;
+        let mut group_count = 1u32;
+
+        for (slot_index, suffix) in slots.iter().enumerate() {
+            for group in &self.groups {
+                push_group(
+                    &mut groups,
+                    &format!("{}{}", group.name, suffix),
+                    group.max_size,
+                )?;
+                let group_index = group_count;
+                group_count += 1;
+
+                // only the target slot gets space, the other one stays empty
+                for partition in self.partitions.iter().filter(|p| p.group == group.name) {
+                    let has_data = slot_index == 0 && partition.size > 0;
+                    let first_extent = (extents.len() / EXTENT_ENTRY_SIZE) as u32;
+
+                    if has_data {
+                        extents.extend_from_slice(&(partition.size / SECTOR_SIZE).to_le_bytes());
+                        extents.extend_from_slice(&TARGET_TYPE_LINEAR.to_le_bytes());
+                        extents.extend_from_slice(&(partition.offset / SECTOR_SIZE).to_le_bytes());
+                        extents.extend_from_slice(&0u32.to_le_bytes());
+                    }
+
+                    push_name(&mut partitions, &format!("{}{}", partition.name, suffix))?;
+                    partitions.extend_from_slice(&ATTR_READONLY.to_le_bytes());
+                    partitions.extend_from_slice(&first_extent.to_le_bytes());
+                    partitions.extend_from_slice(&(has_data as u32).to_le_bytes());
+                    partitions.extend_from_slice(&group_index.to_le_bytes());
+                }
+            }
+        }
+
+        block_devices.extend_from_slice(&(self.data_offset / SECTOR_SIZE).to_le_bytes());
+        block_devices.extend_from_slice(&(self.alignment as u32).to_le_bytes());
+        block_devices.extend_from_slice(&0u32.to_le_bytes());
+        block_devices.extend_from_slice(&self.device_size.to_le_bytes());
+        push_name(&mut block_devices, SUPER_DEVICE)?;
+        block_devices.extend_from_slice(&0u32.to_le_bytes());
+
+        let tables_size = partitions.len() + extents.len() + groups.len() + block_devices.len();
+        let mut header = Vec::with_capacity(HEADER_SIZE + tables_size);
+        header.extend_from_slice(&HEADER_MAGIC.to_le_bytes());
+        header.extend_from_slice(&MAJOR_VERSION.to_le_bytes());
+        header.extend_from_slice(&MINOR_VERSION.to_le_bytes());
+        header.extend_from_slice(&(HEADER_SIZE as u32).to_le_bytes());
+        header.extend_from_slice(&[0u8; 32]);
+        header.extend_from_slice(&(tables_size as u32).to_le_bytes());
+        header.extend_from_slice(&[0u8; 32]);
+
+        let mut offset = 0usize;
+        for (table, entry_size) in [
+            (&partitions, PARTITION_ENTRY_SIZE),
+            (&extents, EXTENT_ENTRY_SIZE),
+            (&groups, GROUP_ENTRY_SIZE),
+            (&block_devices, BLOCK_DEVICE_ENTRY_SIZE),
+        ] {
+            header.extend_from_slice(&(offset as u32).to_le_bytes());
+            header.extend_from_slice(&((table.len() / entry_size) as u32).to_le_bytes());
+            header.extend_from_slice(&(entry_size as u32).to_le_bytes());
+            offset += table.len();
+        }
+
+        let mut tables = Vec::with_capacity(tables_size);
+        tables.extend_from_slice(&partitions);
+        tables.extend_from_slice(&extents);
+        tables.extend_from_slice(&groups);
+        tables.extend_from_slice(&block_devices);
+
+        header[48..80].copy_from_slice(&Sha256::digest(&tables));
+        let header_checksum = Sha256::digest(&header[..HEADER_SIZE]);
+        header[12..44].copy_from_slice(&header_checksum);
+
+        header.extend_from_slice(&tables);
+        if header.len() > self.metadata_max_size as usize {
+            return Err(anyhow!(
+                "LP metadata needs {} bytes, only {} reserved",
+                header.len(),
+                self.metadata_max_size
+            ));
+        }
+
+        Ok(header)
+    }
+
+    /// sizes `file` to the device and writes geometry and metadata copies
+    pub fn write_metadata(&self, file: &File) -> Result<()> {
+        file.set_len(self.device_size)
+            .context("Failed to size super image")?;
+
+        let geometry = self.geometry();
+        write_all_at(file, &geometry, RESERVED_BYTES)?;
+        write_all_at(file, &geometry, RESERVED_BYTES + GEOMETRY_SIZE)?;
+
+        // every slot starts out with the same metadata, primary copies
+        // first and the backups right after them
+        let metadata = self.metadata()?;
+        let slot_size = self.metadata_max_size as u64;
+        let primary = RESERVED_BYTES + 2 * GEOMETRY_SIZE;
+        let backup = primary + self.metadata_slots as u64 * slot_size;
+
+        for slot in 0..self.metadata_slots as u64 {
+            write_all_at(file, &metadata, primary + slot * slot_size)?;
+            write_all_at(file, &metadata, backup + slot * slot_size)?;
+        }
+
+        Ok(())
+    }
+
+    fn slot_suffixes(&self) -> Vec<String> {
+        match self.slot_suffix.as_str() {
+            "_a" => vec!["_a".to_string(), "_b".to_string()],
+            "_b" => vec!["_b".to_string(), "_a".to_string()],
+            other => vec![other.to_string()],
+        }
+    }
+}
+
+fn push_name(table: &mut Vec<u8>, name: &str) -> Result<()> {
+    if name.len() >= NAME_SIZE {
+        return Err(anyhow!("LP name '{}' is too long", name));
+    }
+    let mut field = [0u8; NAME_SIZE];
+    field[..name.len()].copy_from_slice(name.as_bytes());
+    table.extend_from_slice(&field);
+    Ok(())
+}
+
+fn push_group(table: &mut Vec<u8>, name: &str, max_size: u64) -> Result<()> {
+    push_name(table, name)?;
+    table.extend_from_slice(&0u32.to_le_bytes());
+    table.extend_from_slice(&max_size.to_le_bytes());
+    Ok(())
+}
+
+const SPARSE_MAGIC: u32 = 0xed26_ff3a;
+const SPARSE_HEADER_SIZE: u16 = 28;
+const CHUNK_HEADER_SIZE: u16 = 12;
+const CHUNK_RAW: u16 = 0xcac1;
+const CHUNK_FILL: u16 = 0xcac2;
+const CHUNK_DONT_CARE: u16 = 0xcac3;
+// blocks read per positional read while converting
+const SPARSE_READ_BLOCKS: u64 = 256;
+// raw runs are split so they never have to be buffered whole
+const MAX_RAW_CHUNK_BLOCKS: u32 = 16384;
+
+#[derive(Clone, Copy, PartialEq, Eq)]
+enum ChunkKind {
+    Raw,
+    Fill(u32),
+    DontCare,
+}
+
+/// converts the first `size` bytes of `src` into an android sparse image
+///
+/// zero blocks become DONT_CARE chunks and blocks of one repeated word FILL
+/// chunks, so the sparse image only carries real data
+pub fn write_sparse_image<S, W>(src: &S, size: u64, dst: &mut W, block_size: u32) -> Result<()>
+where
+    S: PartitionSink + ?Sized,
+    W: Write + Seek,
+{
+    let bs = block_size as u64;
+    if bs == 0 || bs % 4 != 0 || size % bs != 0 {
+        return Err(anyhow!(
+            "Image size {} is not a multiple of the sparse block size {}",
+            size,
+            block_size
+        ));
+    }
+    let total_blocks = size / bs;
+
+    // header is rewritten once the chunk count is known
+    dst.write_all(&[0u8; SPARSE_HEADER_SIZE as usize])?;
+
+    let mut chunks = 0u32;
+    let mut kind = ChunkKind::DontCare;
+    let mut run = 0u32;
+    let mut raw = Vec::new();
+    let mut buf = vec![0u8; (SPARSE_READ_BLOCKS * bs) as usize];
+
+    let mut block = 0u64;
+    while block < total_blocks {
+        let count = SPARSE_READ_BLOCKS.min(total_blocks - block);
+        let chunk = &mut buf[..(count * bs) as usize];
+        src.read_at(chunk, block * bs)
+            .with_context(|| format!("Failed to read block {}", block))?;
+
+        for data in chunk.chunks_exact(bs as usize) {
+            let next = classify(data);
+            let full = kind == ChunkKind::Raw && run >= MAX_RAW_CHUNK_BLOCKS;
+
+            if run > 0 && (next != kind || full) {
+                write_chunk(dst, kind, run, &raw)?;
+                chunks += 1;
+                run = 0;
+                raw.clear();
+            }
+
+            kind = next;
+            run += 1;
+            if kind == ChunkKind::Raw {
+                raw.extend_from_slice(data);
+            }
+        }
+        block += count;
+    }
+
+    if run > 0 {
+        write_chunk(dst, kind, run, &raw)?;
+        chunks += 1;
+    }
+
+    let mut header = Vec::with_capacity(SPARSE_HEADER_SIZE as usize);
+    header.extend_from_slice(&SPARSE_MAGIC.to_le_bytes());
+    header.extend_from_slice(&1u16.to_le_bytes());
+    header.extend_from_slice(&0u16.to_le_bytes());
+    header.extend_from_slice(&SPARSE_HEADER_SIZE.to_le_bytes());
+    header.extend_from_slice(&CHUNK_HEADER_SIZE.to_le_bytes());
+    header.extend_from_slice(&block_size.to_le_bytes());
+    header.extend_from_slice(&(total_blocks as u32).to_le_bytes());
+    header.extend_from_slice(&chunks.to_le_bytes());
+    header.extend_from_slice(&0u32.to_le_bytes());
+
+    dst.seek(SeekFrom::Start(0))?;
+    dst.write_all(&header)?;
+    dst.flush()?;
+
+    Ok(())
+}
+
+fn classify(block: &[u8]) -> ChunkKind {
+    let word = u32::from_le_bytes([block[0], block[1], block[2], block[3]]);
+    let repeated = block
+        .chunks_exact(4)
+        .all(|w| w == word.to_le_bytes().as_slice());
+
+    match (repeated, word) {
+        (true, 0) => ChunkKind::DontCare,
+        (true, word) => ChunkKind::Fill(word),
+        (false, _) => ChunkKind::Raw,
+    }
+}
+
+fn write_chunk<W: Write>(dst: &mut W, kind: ChunkKind, blocks: u32, raw: &[u8]) -> Result<()> {
+    let fill;
+    let (chunk_type, payload): (u16, &[u8]) = match kind {
+        ChunkKind::Raw => (CHUNK_RAW, raw),
+        ChunkKind::Fill(word) => {
+            fill = word.to_le_bytes();
+            (CHUNK_FILL, &fill)
+        }
+        ChunkKind::DontCare => (CHUNK_DONT_CARE, &[]),
+    };
+
+    let mut header = [0u8; CHUNK_HEADER_SIZE as usize];
+    header[0..2].copy_from_slice(&chunk_type.to_le_bytes());
+    header[4..8].copy_from_slice(&blocks.to_le_bytes());
+    header[8..12]
+        .copy_from_slice(&((CHUNK_HEADER_SIZE as usize + payload.len()) as u32).to_le_bytes());
+
+    dst.write_all(&header)?;
+    dst.write_all(payload)?;
+    Ok(())
+}
@@ -0,0 +1,268 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2025 rhythmcache
+// https://github.com/rhythmcache/payload-dumper-rust
+
+// dm-verity hash tree
+//
+// every block of the data extent is hashed as H(salt || block), the digests
+// are concatenated and zero padded to a whole block, and the resulting level
+// is hashed again the same way until a single block remains. on disk the
+// levels are stored top level first. update_engine computes the tree at
+// install time, so payloads usually do not carry it and it has to be
+// regenerated for the image to match its expected hash.
+//
+// the leaf level (almost all of the work) is split across worker threads,
+// each hashing a contiguous run of blocks with positional reads; the much
+// smaller upper levels are reduced the same way from memory.
+
+use anyhow::{Context, Result, anyhow};
+use sha2::{Digest, Sha256};
+
+use crate::payload::sink::PartitionSink;
+use crate::structs::{Extent, PartitionUpdate};
+
+const DIGEST_SIZE: usize = 32;
+// blocks read per positional read on the leaf level
+const READ_BATCH_BLOCKS: u64 = 256;
+
+/// hash tree description of one partition, from its manifest entry
+#[derive(Debug, Clone)]
+pub struct HashTreeConfig {
+    pub block_size: u64,
+    /// first byte and length of the hashed data
+    pub data_offset: u64,
+    pub data_size: u64,
+    /// first byte and length reserved for the tree
+    pub tree_offset: u64,
+    pub tree_size: u64,
+    pub salt: Vec<u8>,
+}
+
+impl HashTreeConfig {
+    /// `None` when the partition has no hash tree
+    pub fn from_partition(partition: &PartitionUpdate, block_size: u64) -> Result<Option<Self>> {
+        let (Some(data), Some(tree)) = (
+            partition.hash_tree_data_extent.as_ref(),
+            partition.hash_tree_extent.as_ref(),
+        ) else {
+            return Ok(None);
+        };
+
+        if extent_len(tree, 1) == 0 {
+            return Ok(None);
+        }
+
+        let algorithm = partition.hash_tree_algorithm.as_deref().unwrap_or("sha256");
+        if !algorithm.eq_ignore_ascii_case("sha256") {
+            return Err(anyhow!(
+                "Unsupported hash tree algorithm '{}' for {}",
+                algorithm,
+                partition.partition_name
+            ));
+        }
+
+        Ok(Some(Self {
+            block_size,
+            data_offset: extent_start(data, block_size),
+            data_size: extent_len(data, block_size),
+            tree_offset: extent_start(tree, block_size),
+            tree_size: extent_len(tree, block_size),
+            salt: partition.hash_tree_salt.clone().unwrap_or_default(),
+        }))
+    }
+
+    /// whether any operation of the partition writes into the tree extent
+    pub fn is_written_by_payload(&self, partition: &PartitionUpdate) -> bool {
+        let tree_end = self.tree_offset + self.tree_size;
+
+        partition
+            .operations
+            .iter()
+            .flat_map(|op| op.dst_extents.iter())
+            .any(|e| {
+                let start = extent_start(e, self.block_size);
+                let end = start + extent_len(e, self.block_size);
+                start < tree_end && self.tree_offset < end
+            })
+    }
+}
+
+/// computed tree in on-disk layout, plus its root digest
+pub struct HashTree {
+    pub tree: Vec<u8>,
+    pub root: [u8; DIGEST_SIZE],
+}
+
+/// outcome of checking the tree stored in an image
+#[derive(Debug, PartialEq, Eq)]
+pub enum HashTreeStatus {
+    Valid,
+    Mismatch,
+}
+
+/// computes the hash tree of the data extent of `file`
+pub fn compute_hash_tree<S: PartitionSink + ?Sized>(
+    file: &S,
+    config: &HashTreeConfig,
+    workers: usize,
+) -> Result<HashTree> {
+    let block_size = config.block_size as usize;
+    if block_size == 0 || config.data_size % config.block_size != 0 {
+        return Err(anyhow!("Hash tree data is not block aligned"));
+    }
+
+    let salted = salted_hasher(&config.salt);
+    let data_blocks = config.data_size / config.block_size;
+
+    // leaf level straight from the image
+    let mut level = hash_blocks(data_blocks, block_size, workers, &salted, |start, buf| {
+        file.read_at(buf, config.data_offset + start * config.block_size)
+            .with_context(|| format!("Failed to read data block {}", start))
+    })?;
+    pad_to_block(&mut level, block_size);
+
+    let mut levels = vec![];
+    while level.len() > block_size {
+        let blocks = (level.len() / block_size) as u64;
+        let mut next = hash_blocks(blocks, block_size, workers, &salted, |start, buf| {
+            let from = start as usize * block_size;
+            buf.copy_from_slice(&level[from..from + buf.len()]);
+            Ok(())
+        })?;
+        pad_to_block(&mut next, block_size);
+        levels.push(std::mem::replace(&mut level, next));
+    }
+
+    let mut hasher = salted.clone();
+    hasher.update(&level);
+    let root: [u8; DIGEST_SIZE] = hasher.finalize().into();
+
+    // a single data block has no tree at all, only the root
+    if data_blocks > 1 {
+        levels.push(level);
+    }
+
+    let tree: Vec<u8> = levels.into_iter().rev().flatten().collect();
+
+    if tree.len() as u64 > config.tree_size {
+        return Err(anyhow!(
+            "Hash tree needs {} bytes but the tree extent holds {}",
+            tree.len(),
+            config.tree_size
+        ));
+    }
+
+    Ok(HashTree { tree, root })
+}
+
+/// regenerates the tree and writes it into the tree extent
+pub fn write_hash_tree<S: PartitionSink + ?Sized>(
+    file: &S,
+    config: &HashTreeConfig,
+    workers: usize,
+) -> Result<HashTree> {
+    let tree = compute_hash_tree(file, config, workers)?;
+    file.write_at(&tree.tree, config.tree_offset)
+        .context("Failed to write hash tree")?;
+    Ok(tree)
+}
+
+/// compares the tree stored in the image with a freshly computed one
+pub fn verify_hash_tree<S: PartitionSink + ?Sized>(
+    file: &S,
+    config: &HashTreeConfig,
+    workers: usize,
+) -> Result<HashTreeStatus> {
+    let tree = compute_hash_tree(file, config, workers)?;
+
+    let mut stored = vec![0u8; tree.tree.len()];
+    file.read_at(&mut stored, config.tree_offset)
+        .context("Failed to read hash tree")?;
+
+    Ok(if stored == tree.tree {
+        HashTreeStatus::Valid
+    } else {
+        HashTreeStatus::Mismatch
+    })
+}
+
+fn salted_hasher(salt: &[u8]) -> Sha256 {
+    let mut hasher = Sha256::new();
+    hasher.update(salt);
+    hasher
+}
+
+/// hashes `count` blocks across `workers` threads, returning the digests in order
+///
+/// `read(start, buf)` fills `buf` with whole blocks starting at block `start`
+fn hash_blocks<F>(
+    count: u64,
+    block_size: usize,
+    workers: usize,
+    salted: &Sha256,
+    read: F,
+) -> Result<Vec<u8>>
+where
+    F: Fn(u64, &mut [u8]) -> Result<()> + Sync,
+{
+    let mut digests = vec![0u8; count as usize * DIGEST_SIZE];
+    if count == 0 {
+        return Ok(digests);
+    }
+
+    let workers = workers.clamp(1, count as usize);
+    let per_worker = count.div_ceil(workers as u64);
+
+    std::thread::scope(|scope| -> Result<()> {
+        let handles: Vec<_> = digests
+            .chunks_mut(per_worker as usize * DIGEST_SIZE)
+            .enumerate()
+            .map(|(worker, out)| {
+                let read = &read;
+                scope.spawn(move || -> Result<()> {
+                    let first = worker as u64 * per_worker;
+                    let blocks = (out.len() / DIGEST_SIZE) as u64;
+                    let mut buf = vec![0u8; READ_BATCH_BLOCKS.min(blocks) as usize * block_size];
+
+                    let mut done = 0u64;
+                    while done < blocks {
+                        let batch = READ_BATCH_BLOCKS.min(blocks - done);
+                        let chunk = &mut buf[..batch as usize * block_size];
+                        read(first + done, chunk)?;
+
+                        for (i, block) in chunk.chunks_exact(block_size).enumerate() {
+                            let mut hasher = salted.clone();
+                            hasher.update(block);
+                            let at = (done as usize + i) * DIGEST_SIZE;
+                            out[at..at + DIGEST_SIZE].copy_from_slice(&hasher.finalize());
+                        }
+                        done += batch;
+                    }
+                    Ok(())
+                })
+            })
+            .collect();
+
+        for handle in handles {
+            handle
+                .join()
+                .map_err(|_| anyhow!("Hash tree worker panicked"))??;
+        }
+        Ok(())
+    })?;
+
+    Ok(digests)
+}
+
+fn pad_to_block(level: &mut Vec<u8>, block_size: usize) {
+    let padded = level.len().div_ceil(block_size).max(1) * block_size;
+    level.resize(padded, 0);
+}
+
+fn extent_start(extent: &Extent, block_size: u64) -> u64 {
+    extent.start_block.unwrap_or(0) * block_size
+}
+
+fn extent_len(extent: &Extent, block_size: u64) -> u64 {
+    extent.num_blocks.unwrap_or(0) * block_size
+}
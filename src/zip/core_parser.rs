@@ -5,6 +5,7 @@
 use crate::constants::*;
 use crate::zip::zip_io::ZipIO;
 use anyhow::{Result, anyhow};
+use serde::{Deserialize, Serialize};
 
 #[derive(Debug, Clone)]
 pub struct ZipEntry {
@@ -15,7 +16,7 @@ pub struct ZipEntry {
     pub compression_method: u16,
 }
 
-#[derive(Debug, Clone)]
+#[derive(Debug, Clone, Serialize, Deserialize)]
 pub struct ZipMetadataInfo {
     pub entry_name: String,
     pub header_offset: u64,
@@ -2,6 +2,7 @@
 // Copyright (c) 2025 rhythmcache
 // https://github.com/rhythmcache/payload-dumper-rust
 
+use crate::utils::run_blocking;
 use crate::zip::zip_io::ZipIO;
 use anyhow::Result;
 use async_trait::async_trait;
@@ -24,7 +25,7 @@ impl LocalZipIO {
 #[async_trait]
 impl ZipIO for LocalZipIO {
     async fn read_at(&self, offset: u64, buf: &mut [u8]) -> Result<()> {
-        tokio::task::block_in_place(|| {
+        run_blocking(|| {
             #[cfg(unix)]
             {
                 use std::os::unix::fs::FileExt;